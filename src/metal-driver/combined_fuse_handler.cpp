@@ -74,6 +74,33 @@ int CombinedFuseHandler::fuse_create(const std::string path, mode_t mode,
   return -ENOSYS;
 }
 
+int CombinedFuseHandler::fuse_fallocate(const std::string path, int mode,
+                                        off_t offset, off_t length,
+                                        struct fuse_file_info *fi) {
+  for (const auto &handler : _handlers) {
+    if (path.rfind(handler.first, 0) != 0) continue;
+
+    // path starts with handler.first
+    auto subpath = path.substr(handler.first.size());
+    return handler.second->fuse_fallocate(subpath, mode, offset, length, fi);
+  }
+
+  return -ENOENT;
+}
+
+int CombinedFuseHandler::fuse_fsync(const std::string path, int datasync,
+                                    struct fuse_file_info *fi) {
+  for (const auto &handler : _handlers) {
+    if (path.rfind(handler.first, 0) != 0) continue;
+
+    // path starts with handler.first
+    auto subpath = path.substr(handler.first.size());
+    return handler.second->fuse_fsync(subpath, datasync, fi);
+  }
+
+  return -ENOENT;
+}
+
 int CombinedFuseHandler::fuse_readlink(const std::string path, char *buf,
                                        size_t size) {
   for (const auto &handler : _handlers) {
@@ -205,6 +232,25 @@ int CombinedFuseHandler::fuse_rename(const std::string from_path,
   return -ENOENT;
 }
 
+int CombinedFuseHandler::fuse_statfs(const std::string path,
+                                     struct statvfs *stbuf) {
+  for (const auto &handler : _handlers) {
+    if (path.rfind(handler.first, 0) != 0) continue;
+
+    // path starts with handler.first
+    auto subpath = path.substr(handler.first.size());
+    if (subpath.empty()) subpath = "/";
+    return handler.second->fuse_statfs(subpath, stbuf);
+  }
+
+  // df asks about the mount point, which is backed by the files filesystem
+  auto files = _handlers.find("/files");
+  if (files != _handlers.end()) return files->second->fuse_statfs("/", stbuf);
+
+  memset(stbuf, 0, sizeof(*stbuf));
+  return 0;
+}
+
 void CombinedFuseHandler::addHandler(std::string prefix,
                                      std::unique_ptr<FuseHandler> handler) {
   _handlers.emplace(std::make_pair(prefix, std::move(handler)));
@@ -16,6 +16,10 @@ class CombinedFuseHandler : public FuseHandler {
                    off_t offset, struct fuse_file_info *fi) override;
   int fuse_create(const std::string path, mode_t mode,
                   struct fuse_file_info *fi) override;
+  int fuse_fallocate(const std::string path, int mode, off_t offset,
+                     off_t length, struct fuse_file_info *fi) override;
+  int fuse_fsync(const std::string path, int datasync,
+                 struct fuse_file_info *fi) override;
   int fuse_readlink(const std::string path, char *buf, size_t size) override;
   int fuse_open(const std::string path, struct fuse_file_info *fi) override;
   int fuse_read(const std::string path, char *buf, size_t size, off_t offset,
@@ -29,6 +33,7 @@ class CombinedFuseHandler : public FuseHandler {
   int fuse_rmdir(const std::string path) override;
   int fuse_rename(const std::string from_path,
                   const std::string to_path) override;
+  int fuse_statfs(const std::string path, struct statvfs *stbuf) override;
 
   void addHandler(std::string prefix, std::unique_ptr<FuseHandler> handler);
   std::pair<std::string, std::shared_ptr<FuseHandler>> resolveHandler(const std::string &path);
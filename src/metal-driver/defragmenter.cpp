@@ -0,0 +1,53 @@
+#include "defragmenter.hpp"
+
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+namespace metal {
+
+Defragmenter::Defragmenter(std::shared_ptr<FilesystemContext> filesystem,
+                           std::chrono::seconds interval,
+                           uint64_t bytesPerSecond, uint64_t minExtents)
+    : _filesystem(std::move(filesystem)),
+      _interval(interval),
+      _bytesPerPass(bytesPerSecond * interval.count()),
+      _minExtents(minExtents),
+      _stop(false) {
+  _thread = std::thread(&Defragmenter::run, this);
+}
+
+Defragmenter::~Defragmenter() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _stopped.notify_one();
+  _thread.join();
+}
+
+void Defragmenter::run() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_stopped.wait_for(lock, _interval, [this] { return _stop; })) {
+    lock.unlock();
+
+    uint64_t bytesMoved = 0;
+    int res = mtl_defragment(_filesystem->context(), _minExtents,
+                             _bytesPerPass, &bytesMoved);
+    if (res != MTL_SUCCESS) {
+      spdlog::warn("Defragmenter pass failed with error {}", res);
+    } else if (bytesMoved) {
+      mtl_defragment_stats stats;
+      mtl_get_defragment_stats(_filesystem->context(), &stats);
+      spdlog::info(
+          "Defragmenter moved {} bytes ({} files, {} bytes moved and {} "
+          "extents removed in total, {} files skipped)",
+          bytesMoved, stats.files_moved, stats.bytes_moved,
+          stats.extents_removed, stats.files_skipped);
+    }
+
+    lock.lock();
+  }
+}
+
+}  // namespace metal
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <metal-filesystem-pipeline/filesystem_context.hpp>
+
+namespace metal {
+
+// Runs a pass of the online defragmenter on a filesystem every interval. The
+// data moved per pass is limited to what the rate allows for the interval, so
+// that the copying doesn't starve regular I/O.
+class Defragmenter {
+ public:
+  Defragmenter(std::shared_ptr<FilesystemContext> filesystem,
+               std::chrono::seconds interval, uint64_t bytesPerSecond,
+               uint64_t minExtents);
+  virtual ~Defragmenter();
+
+ protected:
+  void run();
+
+  std::shared_ptr<FilesystemContext> _filesystem;
+  std::chrono::seconds _interval;
+  uint64_t _bytesPerPass;
+  uint64_t _minExtents;
+
+  std::mutex _mutex;
+  std::condition_variable _stopped;
+  bool _stop;
+  std::thread _thread;
+};
+
+}  // namespace metal
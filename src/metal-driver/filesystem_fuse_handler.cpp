@@ -1,8 +1,12 @@
 #include "filesystem_fuse_handler.hpp"
 
 #include <cstring>
+#include <limits>
+
+#include <linux/falloc.h>
 
 extern "C" {
+#include <metal-filesystem/directory.h>
 #include <metal-filesystem/inode.h>
 #include <metal-filesystem/metal.h>
 }
@@ -12,25 +16,82 @@ extern "C" {
 
 namespace metal {
 
+static void fillStat(const mtl_inode &inode, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+
+  (void)stbuf->st_dev;  // ignored by FUSE
+  (void)stbuf->st_ino;  // TODO: inode-ID
+  stbuf->st_mode = inode.mode;
+  stbuf->st_nlink = 2;  // number of hard links to file.
+
+  stbuf->st_uid = inode.user;   // user-ID of owner
+  stbuf->st_gid = inode.group;  // group-ID of owner
+  (void)stbuf->st_rdev;  // unused, since this field is meant for special files
+                         // which we do not have in our FS
+  stbuf->st_size = inode.length;  // length of referenced file in byte
+  (void)stbuf->st_blksize;        // ignored by FUSE
+  stbuf->st_blocks =
+      inode.length / 512 +
+      (inode.length % 512 > 0 ? 1
+                              : 0);  // number of 512B blocks belonging to file.
+  stbuf->st_atime = inode.accessed;  // time of last read or write
+  stbuf->st_mtime = inode.modified;  // time of last write
+  stbuf->st_ctime =
+      inode.created;  // time of last change to either content or inode-data
+}
+
 FilesystemFuseHandler::FilesystemFuseHandler(
     std::shared_ptr<FilesystemContext> filesystem)
     : _filesystem(filesystem) {}
 
+void FilesystemFuseHandler::rememberAttributes(const std::string &path,
+                                               const struct stat &stbuf) {
+  std::lock_guard<std::mutex> guard(_listedAttributesMutex);
+  if (_listedAttributes.size() >= MaxListedAttributes) return;
+  _listedAttributes[path] = {stbuf, std::chrono::steady_clock::now()};
+}
+
+bool FilesystemFuseHandler::takeAttributes(const std::string &path,
+                                           struct stat *stbuf) {
+  std::lock_guard<std::mutex> guard(_listedAttributesMutex);
+  auto it = _listedAttributes.find(path);
+  if (it == _listedAttributes.end()) return false;
+
+  bool fresh =
+      std::chrono::steady_clock::now() - it->second.listed < AttributeTimeout;
+  if (fresh) *stbuf = it->second.stbuf;
+  _listedAttributes.erase(it);
+  return fresh;
+}
+
+void FilesystemFuseHandler::forgetAttributes(const std::string &path) {
+  std::lock_guard<std::mutex> guard(_listedAttributesMutex);
+  _listedAttributes.erase(path);
+}
+
+void FilesystemFuseHandler::forgetAllAttributes() {
+  std::lock_guard<std::mutex> guard(_listedAttributesMutex);
+  _listedAttributes.clear();
+}
+
 int FilesystemFuseHandler::fuse_chown(const std::string path, uid_t uid,
                                       gid_t gid) {
+  forgetAttributes(path);
   return mtl_chown(_filesystem->context(), path.c_str(), uid, gid);
 }
 
 int FilesystemFuseHandler::fuse_getattr(const std::string path,
                                         struct stat *stbuf) {
-  memset(stbuf, 0, sizeof(struct stat));
-
   if (path.empty()) {
+    memset(stbuf, 0, sizeof(struct stat));
     stbuf->st_mode = S_IFDIR | 0755;
     stbuf->st_nlink = 2;
     return 0;
   }
 
+  // The entry might just have been listed
+  if (takeAttributes(path, stbuf)) return 0;
+
   mtl_inode inode;
 
   int res = mtl_get_inode(_filesystem->context(), path.c_str(), &inode);
@@ -38,26 +99,7 @@ int FilesystemFuseHandler::fuse_getattr(const std::string path,
     return -res;
   }
 
-  (void)stbuf->st_dev;  // ignored by FUSE
-  (void)stbuf->st_ino;  // TODO: inode-ID
-  stbuf->st_mode = inode.mode;
-  stbuf->st_nlink = 2;  // number of hard links to file.
-
-  stbuf->st_uid = inode.user;   // user-ID of owner
-  stbuf->st_gid = inode.group;  // group-ID of owner
-  (void)stbuf->st_rdev;  // unused, since this field is meant for special files
-                         // which we do not have in our FS
-  stbuf->st_size = inode.length;  // length of referenced file in byte
-  (void)stbuf->st_blksize;        // ignored by FUSE
-  stbuf->st_blocks =
-      inode.length / 512 +
-      (inode.length % 512 > 0 ? 1
-                              : 0);  // number of 512B blocks belonging to file.
-  stbuf->st_atime = inode.accessed;  // time of last read or write
-  stbuf->st_mtime = inode.modified;  // time of last write
-  stbuf->st_ctime =
-      inode.created;  // time of last change to either content or inode-data
-
+  fillStat(inode, stbuf);
   return 0;
 }
 
@@ -72,14 +114,28 @@ int FilesystemFuseHandler::fuse_readdir(const std::string path, void *buf,
     return -res;
   }
 
+  // Paths of the entries as they are passed to fuse_getattr
+  std::string prefix = path.empty() || path.back() != '/' ? path + "/" : path;
+
+  // Load the attributes along with the names, so that the kernel gets them
+  // with the entries and the getattr calls that follow are cheap
   char current_filename[FILENAME_MAX];
-  int readdir_status;
-  while ((readdir_status =
-              mtl_readdir(_filesystem->context(), dir, current_filename,
-                          sizeof(current_filename))) != MTL_COMPLETE) {
-    filler(buf, current_filename, NULL, 0);
+  mtl_inode inode;
+  struct stat stbuf;
+  while (mtl_readdir_plus(_filesystem->context(), dir, current_filename,
+                          sizeof(current_filename), NULL,
+                          &inode) == MTL_SUCCESS) {
+    fillStat(inode, &stbuf);
+
+    if (strcmp(current_filename, ".") != 0 &&
+        strcmp(current_filename, "..") != 0)
+      rememberAttributes(prefix + current_filename, stbuf);
+
+    filler(buf, current_filename, &stbuf, 0);
   }
 
+  mtl_closedir(_filesystem->context(), dir);
+
   return 0;
 }
 
@@ -91,11 +147,49 @@ int FilesystemFuseHandler::fuse_create(const std::string path, mode_t mode,
     return -res;
   }
 
+  res = mtl_open_file(_filesystem->context(), inode_id);
+  if (res != MTL_SUCCESS) {
+    return -res;
+  }
+
   fi->fh = inode_id;
 
   return 0;
 }
 
+int FilesystemFuseHandler::fuse_fallocate(const std::string path, int mode,
+                                          off_t offset, off_t length,
+                                          struct fuse_file_info *fi) {
+  if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+
+  forgetAttributes(path);
+
+  uint64_t inode_id = fi->fh;
+  if (inode_id == 0) {
+    int res = mtl_open(_filesystem->context(), path.c_str(), &inode_id);
+    if (res != MTL_SUCCESS) return -res;
+  }
+
+  int res = mtl_fallocate(
+      _filesystem->context(), inode_id,
+      mode & FALLOC_FL_KEEP_SIZE ? MTL_FALLOCATE_KEEP_SIZE : 0, offset, length);
+
+  if (res != MTL_SUCCESS) return -res;
+
+  return 0;
+}
+
+int FilesystemFuseHandler::fuse_fsync(const std::string path, int datasync,
+                                      struct fuse_file_info *fi) {
+  // The data goes to the storage directly, only the metadata might not have
+  // been flushed yet
+  int res = mtl_sync(_filesystem->context());
+
+  if (res != MTL_SUCCESS) return -res;
+
+  return 0;
+}
+
 int FilesystemFuseHandler::fuse_readlink(const std::string path, char *buf,
                                          size_t size) {
   return -ENOENT;
@@ -108,6 +202,10 @@ int FilesystemFuseHandler::fuse_open(const std::string path,
 
   if (res != MTL_SUCCESS) return -res;
 
+  res = mtl_open_file(_filesystem->context(), inode_id);
+
+  if (res != MTL_SUCCESS) return -res;
+
   fi->fh = inode_id;
 
   return 0;
@@ -116,12 +214,11 @@ int FilesystemFuseHandler::fuse_open(const std::string path,
 int FilesystemFuseHandler::fuse_read(const std::string path, char *buf,
                                      size_t size, off_t offset,
                                      struct fuse_file_info *fi) {
-  int res;
-
-  // TODO: It would be nice if this would work within a single transaction
-  uint64_t inode_id;
-  res = mtl_open(_filesystem->context(), path.c_str(), &inode_id);
-  if (res != MTL_SUCCESS) return -res;
+  uint64_t inode_id = fi->fh;
+  if (inode_id == 0) {
+    int res = mtl_open(_filesystem->context(), path.c_str(), &inode_id);
+    if (res != MTL_SUCCESS) return -res;
+  }
 
   return static_cast<int>(
       mtl_read(_filesystem->context(), inode_id, buf, size, offset));
@@ -129,10 +226,18 @@ int FilesystemFuseHandler::fuse_read(const std::string path, char *buf,
 
 int FilesystemFuseHandler::fuse_release(const std::string path,
                                         struct fuse_file_info *fi) {
+  forgetAttributes(path);
+
+  if (fi->fh != 0) {
+    mtl_close_file(_filesystem->context(), fi->fh);
+  }
+
   return 0;
 }
 
 int FilesystemFuseHandler::fuse_truncate(const std::string path, off_t size) {
+  forgetAttributes(path);
+
   uint64_t inode_id;
   int res = mtl_open(_filesystem->context(), path.c_str(), &inode_id);
 
@@ -148,8 +253,11 @@ int FilesystemFuseHandler::fuse_truncate(const std::string path, off_t size) {
 int FilesystemFuseHandler::fuse_write(const std::string path, const char *buf,
                                       size_t size, off_t offset,
                                       struct fuse_file_info *fi) {
+  forgetAttributes(path);
+
   if (fi->fh != 0) {
-    mtl_write(_filesystem->context(), fi->fh, buf, size, offset);
+    int res = mtl_write(_filesystem->context(), fi->fh, buf, size, offset);
+    if (res != MTL_SUCCESS) return -res;
 
     // TODO: Return the actual length that was written (to be returned from
     // mtl_write)
@@ -160,6 +268,8 @@ int FilesystemFuseHandler::fuse_write(const std::string path, const char *buf,
 }
 
 int FilesystemFuseHandler::fuse_unlink(const std::string path) {
+  forgetAttributes(path);
+
   int res = mtl_unlink(_filesystem->context(), path.c_str());
 
   if (res != MTL_SUCCESS) return -res;
@@ -176,6 +286,8 @@ int FilesystemFuseHandler::fuse_mkdir(const std::string path, mode_t mode) {
 }
 
 int FilesystemFuseHandler::fuse_rmdir(const std::string path) {
+  forgetAllAttributes();
+
   int res = mtl_rmdir(_filesystem->context(), path.c_str());
 
   if (res != MTL_SUCCESS) return -res;
@@ -185,6 +297,9 @@ int FilesystemFuseHandler::fuse_rmdir(const std::string path) {
 
 int FilesystemFuseHandler::fuse_rename(const std::string from_path,
                                        const std::string to_path) {
+  // Entries below a renamed directory move as well
+  forgetAllAttributes();
+
   int res =
       mtl_rename(_filesystem->context(), from_path.c_str(), to_path.c_str());
 
@@ -193,4 +308,27 @@ int FilesystemFuseHandler::fuse_rename(const std::string from_path,
   return 0;
 }
 
+int FilesystemFuseHandler::fuse_statfs(const std::string path,
+                                       struct statvfs *stbuf) {
+  mtl_filesystem_stats stats;
+  int res = mtl_statfs(_filesystem->context(), &stats);
+
+  if (res != MTL_SUCCESS) return -res;
+
+  memset(stbuf, 0, sizeof(struct statvfs));
+  stbuf->f_bsize = stats.block_size;
+  stbuf->f_frsize = stats.block_size;
+  stbuf->f_blocks = stats.blocks;
+  stbuf->f_bfree = stats.free_blocks;
+  stbuf->f_bavail = stats.free_blocks;
+
+  // Inodes are not preallocated, so only their number is limited
+  stbuf->f_files = std::numeric_limits<fsfilcnt_t>::max();
+  stbuf->f_ffree = stbuf->f_files - stats.inodes;
+  stbuf->f_favail = stbuf->f_ffree;
+  stbuf->f_namemax = MTL_MAX_FILENAME_LENGTH;
+
+  return 0;
+}
+
 }  // namespace metal
@@ -2,8 +2,11 @@
 
 #include "fuse_handler.hpp"
 
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #include <metal-pipeline/fpga_interface.hpp>
 
@@ -21,6 +24,10 @@ class FilesystemFuseHandler : public FuseHandler {
                    off_t offset, struct fuse_file_info *fi) override;
   int fuse_create(const std::string path, mode_t mode,
                   struct fuse_file_info *fi) override;
+  int fuse_fallocate(const std::string path, int mode, off_t offset,
+                     off_t length, struct fuse_file_info *fi) override;
+  int fuse_fsync(const std::string path, int datasync,
+                 struct fuse_file_info *fi) override;
   int fuse_readlink(const std::string path, char *buf, size_t size) override;
   int fuse_open(const std::string path, struct fuse_file_info *fi) override;
   int fuse_read(const std::string path, char *buf, size_t size, off_t offset,
@@ -34,11 +41,30 @@ class FilesystemFuseHandler : public FuseHandler {
   int fuse_rmdir(const std::string path) override;
   int fuse_rename(const std::string from_path,
                   const std::string to_path) override;
+  int fuse_statfs(const std::string path, struct statvfs *stbuf) override;
 
   std::shared_ptr<FilesystemContext> filesystem() const { return _filesystem; }
 
  protected:
+  void rememberAttributes(const std::string &path, const struct stat &stbuf);
+  bool takeAttributes(const std::string &path, struct stat *stbuf);
+  void forgetAttributes(const std::string &path);
+  void forgetAllAttributes();
+
   std::shared_ptr<FilesystemContext> _filesystem;
+
+  // The attributes of the entries returned by readdir. Without READDIRPLUS,
+  // the kernel follows up with a getattr for each of them (e.g. for ls -l),
+  // which is answered from here instead of resolving the path again. Entries
+  // are used once and only within the kernel's default attribute timeout.
+  struct ListedAttributes {
+    struct stat stbuf;
+    std::chrono::steady_clock::time_point listed;
+  };
+  static constexpr std::chrono::seconds AttributeTimeout{1};
+  static constexpr size_t MaxListedAttributes = 65536;
+  std::unordered_map<std::string, ListedAttributes> _listedAttributes;
+  std::mutex _listedAttributesMutex;
 };
 
 }  // namespace metal
@@ -5,6 +5,7 @@
 
 extern "C" {
 #include <fuse.h>
+#include <sys/statvfs.h>
 }
 
 #include <string>
@@ -16,6 +17,10 @@ class FuseHandler {
   virtual int fuse_chown(const std::string path, uid_t uid, gid_t gid) = 0;
   virtual int fuse_create(const std::string path, mode_t mode,
                           struct fuse_file_info *fi) = 0;
+  virtual int fuse_fallocate(const std::string path, int mode, off_t offset,
+                             off_t length, struct fuse_file_info *fi) = 0;
+  virtual int fuse_fsync(const std::string path, int datasync,
+                         struct fuse_file_info *fi) = 0;
   virtual int fuse_getattr(const std::string path, struct stat *stbuf) = 0;
   virtual int fuse_mkdir(const std::string path, mode_t mode) = 0;
   virtual int fuse_open(const std::string path, struct fuse_file_info *fi) = 0;
@@ -30,6 +35,7 @@ class FuseHandler {
   virtual int fuse_rename(const std::string from_path,
                           const std::string to_path) = 0;
   virtual int fuse_rmdir(const std::string path) = 0;
+  virtual int fuse_statfs(const std::string path, struct statvfs *stbuf) = 0;
   virtual int fuse_truncate(const std::string path, off_t size) = 0;
   virtual int fuse_unlink(const std::string path) = 0;
   virtual int fuse_write(const std::string path, const char *buf, size_t size,
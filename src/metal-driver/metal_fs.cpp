@@ -2,6 +2,7 @@ extern "C" {
 #include <metal-filesystem/metal.h>
 }
 
+#include <stdexcept>
 #include <thread>
 
 #include <spdlog/spdlog.h>
@@ -10,7 +11,9 @@ extern "C" {
 #include <metal-filesystem-pipeline/filesystem_context.hpp>
 #include <metal-pipeline/operator_factory.hpp>
 #include <metal-pipeline/snap_action.hpp>
+#include <metal-pipeline/snap_action_pool.hpp>
 
+#include "defragmenter.hpp"
 #include "filesystem_fuse_handler.hpp"
 #include "metal_fuse_operations.hpp"
 #include "operator_fuse_handler.hpp"
@@ -26,6 +29,20 @@ struct metal_config {
   char *operators;
   char *metadata_dir;
   int in_memory;
+  char *storage;
+  int storage_size;
+  int storage_queue_depth;
+  int group_commit;
+  int group_commit_count;
+  int metadata_map_size;
+  int metadata_max_map_size;
+  int metadata_writemap;
+  int metadata_nomeminit;
+  int metadata_inline_size;
+  int metadata_packed_size;
+  int defrag_interval;
+  int defrag_rate;
+  int defrag_min_extents;
   int verbosity;
 };
 enum {
@@ -45,6 +62,20 @@ static struct fuse_opt metal_opts[] = {
     METAL_OPT("--in-memory", in_memory, 1),
     METAL_OPT("--in-memory=true", in_memory, 1),
     METAL_OPT("--in-memory=false", in_memory, 0),
+    METAL_OPT("--storage=%s", storage, 0),
+    METAL_OPT("--storage-size=%i", storage_size, 0),
+    METAL_OPT("--storage-queue-depth=%i", storage_queue_depth, 0),
+    METAL_OPT("--group-commit=%i", group_commit, 0),
+    METAL_OPT("--group-commit-count=%i", group_commit_count, 0),
+    METAL_OPT("--metadata-map-size=%i", metadata_map_size, 0),
+    METAL_OPT("--metadata-max-map-size=%i", metadata_max_map_size, 0),
+    METAL_OPT("--metadata-writemap", metadata_writemap, 1),
+    METAL_OPT("--metadata-nomeminit", metadata_nomeminit, 1),
+    METAL_OPT("--metadata-inline-size=%i", metadata_inline_size, 0),
+    METAL_OPT("--metadata-packed-size=%i", metadata_packed_size, 0),
+    METAL_OPT("--defrag-interval=%i", defrag_interval, 0),
+    METAL_OPT("--defrag-rate=%i", defrag_rate, 0),
+    METAL_OPT("--defrag-min-extents=%i", defrag_min_extents, 0),
     METAL_OPT("-v", verbosity, 1),
     METAL_OPT("-vv", verbosity, 2),
     METAL_OPT("-vvv", verbosity, 3),
@@ -74,7 +105,21 @@ static int metal_opt_proc(void *data, const char *arg, int key,
               "    --card=CARD (0)\n"
               "    --timeout=TIMEOUT (10)\n"
               "    --metadata=METADATA_PATH\n"
-              "    --in-memory=(true|false)\n",
+              "    --in-memory=(true|false)\n"
+              "    --storage=FILE_OR_DEVICE (host storage instead of the FPGA)\n"
+              "    --storage-size=MIB (0, size of the existing file or device)\n"
+              "    --storage-queue-depth=DEPTH (32)\n"
+              "    --group-commit=INTERVAL_MS (0, flush every update)\n"
+              "    --group-commit-count=MAX_PENDING_UPDATES (256)\n"
+              "    --metadata-map-size=MIB (64, grows as needed)\n"
+              "    --metadata-max-map-size=MIB (0, no limit)\n"
+              "    --metadata-writemap\n"
+              "    --metadata-nomeminit\n"
+              "    --metadata-inline-size=BYTES (1024, 0 to disable)\n"
+              "    --metadata-packed-size=BYTES (65536, 0 to disable)\n"
+              "    --defrag-interval=SECONDS (0, no online defragmentation)\n"
+              "    --defrag-rate=MIB_PER_SECOND (64, 0 for no limit)\n"
+              "    --defrag-min-extents=EXTENTS (4)\n",
               outargs->argv[0]);
       fuse_opt_add_arg(outargs, "-h");
       fuse_main(outargs->argc, outargs->argv, &Context::fuseOperations(), NULL);
@@ -94,16 +139,82 @@ static int metal_opt_proc(void *data, const char *arg, int key,
 class InMemoryFilesystem : public FilesystemContext {
  public:
   InMemoryFilesystem(std::string metadataDir,
-                     bool deleteMetadataIfExists = false)
-      : FilesystemContext(metadataDir, deleteMetadataIfExists) {
-    mtl_initialize(&_context, metadataDir.c_str(), &in_memory_storage);
+                     bool deleteMetadataIfExists = false,
+                     const mtl_options *options = nullptr)
+      : FilesystemContext(metadataDir, deleteMetadataIfExists, options) {
+    mtl_initialize_with_options(&_context, metadataDir.c_str(),
+                                &in_memory_storage, &_options);
   }
 };
 
+class FileFilesystem : public FilesystemContext {
+ public:
+  FileFilesystem(std::string metadataDir, std::string path, uint64_t size,
+                 uint32_t queueDepth, const mtl_options *options = nullptr)
+      : FilesystemContext(metadataDir, false, options), _storage(nullptr) {
+    if (mtl_file_storage_create(&_storage, path.c_str(), size,
+                                fpga::StorageBlockSize,
+                                queueDepth) != MTL_SUCCESS ||
+        mtl_initialize_with_options(&_context, metadataDir.c_str(), _storage,
+                                    &_options) != MTL_SUCCESS) {
+      throw std::runtime_error("Could not open storage " + path);
+    }
+  }
+
+  ~FileFilesystem() override {
+    // Flushes the storage
+    mtl_deinitialize(_context);
+    mtl_file_storage_destroy(_storage);
+  }
+
+ protected:
+  mtl_storage_backend *_storage;
+};
+
+static mtl_options metadataOptions(const metal_config &conf) {
+  mtl_options options;
+  mtl_default_options(&options);
+  if (conf.metadata_map_size > 0)
+    options.map_size = (uint64_t)conf.metadata_map_size << 20;
+  if (conf.metadata_max_map_size > 0)
+    options.max_map_size = (uint64_t)conf.metadata_max_map_size << 20;
+  if (conf.metadata_writemap) options.flags |= MTL_METADATA_WRITEMAP;
+  if (conf.metadata_nomeminit) options.flags |= MTL_METADATA_NOMEMINIT;
+  if (conf.metadata_inline_size >= 0)
+    options.inline_data_size = conf.metadata_inline_size;
+  if (conf.metadata_packed_size >= 0)
+    options.packed_file_size = conf.metadata_packed_size;
+  return options;
+}
+
+static void configureFilesystem(FilesystemContext &filesystem,
+                                const metal_config &conf) {
+  if (conf.group_commit > 0) {
+    mtl_set_group_commit(filesystem.context(), conf.group_commit,
+                         conf.group_commit_count);
+  }
+}
+
+// Only the filesystem under /files keeps data for long enough to be worth
+// defragmenting
+static std::unique_ptr<Defragmenter> startDefragmenter(
+    std::shared_ptr<FilesystemContext> filesystem, const metal_config &conf) {
+  if (conf.defrag_interval <= 0) {
+    return nullptr;
+  }
+
+  return std::make_unique<Defragmenter>(
+      std::move(filesystem), std::chrono::seconds(conf.defrag_interval),
+      (uint64_t)conf.defrag_rate << 20, conf.defrag_min_extents);
+}
+
 int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   struct metal_config conf;
   memset(&conf, 0, sizeof(conf));
+  conf.metadata_inline_size = -1;
+  conf.metadata_packed_size = -1;
+  conf.defrag_rate = -1;
 
   if (fuse_opt_parse(&args, &conf, metal_opts, metal_opt_proc)) {
     return 1;
@@ -128,15 +239,48 @@ int main(int argc, char *argv[]) {
     conf.timeout = 2;
   }
 
+  if (conf.group_commit_count == 0) {
+    conf.group_commit_count = 256;
+  }
+
+  if (conf.defrag_rate < 0) {
+    conf.defrag_rate = 64;
+  }
+
+  if (conf.defrag_min_extents <= 0) {
+    conf.defrag_min_extents = 4;
+  }
+
+  auto options = metadataOptions(conf);
   auto metadataDir = std::string(conf.metadata_dir);
   auto metadataDirDRAM = metadataDir + "_tmp";
 
   std::unique_ptr<Server> server = nullptr;
+  std::unique_ptr<Defragmenter> defragmenter = nullptr;
 
-  if (!conf.in_memory) {
-    SnapAction fpga(Card{conf.card, conf.timeout});
-    auto factory =
-        std::make_shared<OperatorFactory>(OperatorFactory::fromFPGA(fpga));
+  if (conf.storage != nullptr) {
+    std::shared_ptr<FileFilesystem> fileFilesystem;
+    try {
+      fileFilesystem = std::make_shared<FileFilesystem>(
+          metadataDir, conf.storage, (uint64_t)conf.storage_size << 20,
+          conf.storage_queue_depth, &options);
+    } catch (const std::runtime_error &e) {
+      spdlog::error(e.what());
+      return 1;
+    }
+    configureFilesystem(*fileFilesystem, conf);
+    defragmenter = startDefragmenter(fileFilesystem, conf);
+    Context::addHandler(
+        "/files", std::make_unique<FilesystemFuseHandler>(fileFilesystem));
+  } else if (!conf.in_memory) {
+    std::shared_ptr<OperatorFactory> factory;
+    {
+      // Stays attached for the pipelines that run later
+      auto fpga = SnapActionPool::forCard(Card{conf.card, conf.timeout})
+                      ->borrow(conf.timeout);
+      factory =
+          std::make_shared<OperatorFactory>(OperatorFactory::fromFPGA(*fpga));
+    }
 
     std::set<std::string> operators;
     for (const auto &op : factory->operatorSpecifications()) {
@@ -157,21 +301,27 @@ int main(int argc, char *argv[]) {
     if (factory->isDRAMEnabled()) {
       auto dramFilesystem = std::make_shared<PipelineStorage>(
         Card{conf.card, conf.timeout}, fpga::AddressType::CardDRAM,
-        fpga::MapType::DRAM, metadataDirDRAM, true);
+        fpga::MapType::DRAM, metadataDirDRAM, true, nullptr, &options);
+      configureFilesystem(*dramFilesystem, conf);
       Context::addHandler(
           "/tmp", std::make_unique<FilesystemFuseHandler>(dramFilesystem));
 
       if (factory->isNVMeEnabled()) {
         auto nvmeFilesystem = std::make_shared<PipelineStorage>(
           Card{conf.card, conf.timeout}, fpga::AddressType::NVMe,
-          fpga::MapType::DRAMAndNVMe, metadataDir, false, dramFilesystem);
+          fpga::MapType::DRAMAndNVMe, metadataDir, false, dramFilesystem,
+          &options);
+        configureFilesystem(*nvmeFilesystem, conf);
+        defragmenter = startDefragmenter(nvmeFilesystem, conf);
         Context::addHandler(
             "/files", std::make_unique<FilesystemFuseHandler>(nvmeFilesystem));
       }
     }
   } else {
     auto inMemoryFilesystem =
-        std::make_shared<InMemoryFilesystem>(metadataDir, true);
+        std::make_shared<InMemoryFilesystem>(metadataDir, true, &options);
+    configureFilesystem(*inMemoryFilesystem, conf);
+    defragmenter = startDefragmenter(inMemoryFilesystem, conf);
     Context::addHandler(
         "/files", std::make_unique<FilesystemFuseHandler>(inMemoryFilesystem));
   }
@@ -187,5 +337,8 @@ int main(int argc, char *argv[]) {
     retc = fuse_main(args.argc, args.argv, &Context::fuseOperations(), nullptr);
   }
 
+  // Stop moving data before the filesystem goes away
+  defragmenter.reset();
+
   return retc;
 }
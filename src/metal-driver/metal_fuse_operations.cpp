@@ -25,6 +25,15 @@ void Context::createHandler() {
     spdlog::trace("fuse_create {}", path);
     return handler->fuse_create(std::string(path), mode, fi);
   };
+  ops.fallocate = [](const char *path, int mode, off_t offset, off_t length,
+                     struct fuse_file_info *fi) {
+    spdlog::trace("fuse_fallocate {}", path);
+    return handler->fuse_fallocate(std::string(path), mode, offset, length, fi);
+  };
+  ops.fsync = [](const char *path, int datasync, struct fuse_file_info *fi) {
+    spdlog::trace("fuse_fsync {}", path);
+    return handler->fuse_fsync(std::string(path), datasync, fi);
+  };
   ops.getattr = [](const char *path, struct stat *stbuf) {
     spdlog::trace("fuse_getattr {}", path);
     return handler->fuse_getattr(std::string(path), stbuf);
@@ -63,6 +72,10 @@ void Context::createHandler() {
     spdlog::trace("fuse_rmdir {}", path);
     return handler->fuse_rmdir(std::string(path));
   };
+  ops.statfs = [](const char *path, struct statvfs *stbuf) {
+    spdlog::trace("fuse_statfs {}", path);
+    return handler->fuse_statfs(std::string(path), stbuf);
+  };
   ops.truncate = [](const char *path, off_t size) {
     spdlog::trace("fuse_truncate {}", path);
     return handler->fuse_truncate(std::string(path), size);
@@ -65,6 +65,17 @@ int OperatorFuseHandler::fuse_create(const std::string path, mode_t mode,
   return -ENOSYS;
 }
 
+int OperatorFuseHandler::fuse_fallocate(const std::string path, int mode,
+                                        off_t offset, off_t length,
+                                        struct fuse_file_info *fi) {
+  return -ENOSYS;
+}
+
+int OperatorFuseHandler::fuse_fsync(const std::string path, int datasync,
+                                    struct fuse_file_info *fi) {
+  return -ENOSYS;
+}
+
 int OperatorFuseHandler::fuse_readlink(const std::string path, char *buf,
                                        size_t size) {
   return -ENOENT;
@@ -119,4 +130,8 @@ int OperatorFuseHandler::fuse_rename(const std::string from_path,
   return -ENOSYS;
 }
 
+int OperatorFuseHandler::fuse_statfs(const std::string path, struct statvfs *stbuf) {
+  return -ENOSYS;
+}
+
 }  // namespace metal
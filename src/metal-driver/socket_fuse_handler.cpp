@@ -39,6 +39,17 @@ int SocketFuseHandler::fuse_create(const std::string path, mode_t mode,
   return -ENOSYS;
 }
 
+int SocketFuseHandler::fuse_fallocate(const std::string path, int mode,
+                                      off_t offset, off_t length,
+                                      struct fuse_file_info *fi) {
+  return -ENOSYS;
+}
+
+int SocketFuseHandler::fuse_fsync(const std::string path, int datasync,
+                                  struct fuse_file_info *fi) {
+  return -ENOSYS;
+}
+
 int SocketFuseHandler::fuse_readlink(const std::string path, char *buf,
                                      size_t size) {
   if (path.empty()) {
@@ -86,4 +97,8 @@ int SocketFuseHandler::fuse_rename(const std::string from_path,
   return -ENOSYS;
 }
 
+int SocketFuseHandler::fuse_statfs(const std::string path, struct statvfs *stbuf) {
+  return -ENOSYS;
+}
+
 }  // namespace metal
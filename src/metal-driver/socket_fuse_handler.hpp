@@ -15,6 +15,10 @@ class SocketFuseHandler : public FuseHandler {
                    off_t offset, struct fuse_file_info *fi) override;
   int fuse_create(const std::string path, mode_t mode,
                   struct fuse_file_info *fi) override;
+  int fuse_fallocate(const std::string path, int mode, off_t offset,
+                     off_t length, struct fuse_file_info *fi) override;
+  int fuse_fsync(const std::string path, int datasync,
+                 struct fuse_file_info *fi) override;
   int fuse_readlink(const std::string path, char *buf, size_t size) override;
   int fuse_open(const std::string path, struct fuse_file_info *fi) override;
   int fuse_read(const std::string path, char *buf, size_t size, off_t offset,
@@ -28,6 +32,7 @@ class SocketFuseHandler : public FuseHandler {
   int fuse_rmdir(const std::string path) override;
   int fuse_rename(const std::string from_path,
                   const std::string to_path) override;
+  int fuse_statfs(const std::string path, struct statvfs *stbuf) override;
 
  protected:
   std::string _socket_name;
@@ -9,33 +9,43 @@ extern "C" {
 #include <string>
 #include <utility>
 
+#include <metal-filesystem-pipeline/metal_pipeline_storage.hpp>
 #include <metal-pipeline/data_sink_context.hpp>
 
 namespace metal {
 
-class PipelineStorage;
-
 class METAL_FILESYSTEM_PIPELINE_API FileDataSinkContext
     : public DefaultDataSinkContext {
  public:
+  // Unless holdOpen is false, the file stays open while the context exists,
+  // so the defragmenter doesn't move the blocks the card writes to
   explicit FileDataSinkContext(std::shared_ptr<PipelineStorage> filesystem,
                                uint64_t inode_id, uint64_t offset,
-                               uint64_t size, bool truncateOnFinalize = false);
+                               uint64_t size, bool truncateOnFinalize = false,
+                               bool holdOpen = true);
+  ~FileDataSinkContext();
+  FileDataSinkContext(const FileDataSinkContext &) = delete;
+  FileDataSinkContext &operator=(const FileDataSinkContext &) = delete;
 
   void prepareForTotalSize(uint64_t size);
+  const DataSink dataSink() const override;
 
  protected:
-  void loadExtents();
+  void loadFileLength();
   void configure(SnapAction &action, uint64_t inputSize, bool initial) override;
   void finalize(SnapAction &action, uint64_t outputSize,
                 bool endOfInput) override;
-  void mapExtents(SnapAction &action, fpga::ExtmapSlot slot, std::vector<mtl_file_extent> &extents);
 
   uint64_t _inode_id;
+  bool _holdsOpen;
   bool _truncateOnFinalize;
-  std::vector<mtl_file_extent> _extents;
   std::shared_ptr<PipelineStorage> _filesystem;
   uint64_t _cachedTotalSize;
+
+  // File offset of the first block in the current extent map
+  uint64_t _mappedOffset;
+  PipelineStorage::ResidentExtents _resident;
+  PipelineStorage::ResidentExtents _residentPagefile;
 };
 
 }  // namespace metal
@@ -2,33 +2,70 @@
 
 #include <metal-filesystem-pipeline/metal-filesystem-pipeline_api.h>
 
+#include <optional>
+
 #include <metal-filesystem/metal.h>
+#include <metal-filesystem-pipeline/metal_pipeline_storage.hpp>
 #include <metal-pipeline/data_source_context.hpp>
+#include <metal-pipeline/job_buffer_pool.hpp>
 
 namespace metal {
 
-class PipelineStorage;
-
 class METAL_FILESYSTEM_PIPELINE_API FileDataSourceContext
     : public DefaultDataSourceContext {
  public:
+  // Unless holdOpen is false, the file stays open while the context exists,
+  // so the defragmenter doesn't move the blocks the card reads from. The
+  // storage backend itself reads without, as it works for the filesystem.
   explicit FileDataSourceContext(std::shared_ptr<PipelineStorage> filesystem,
                                  uint64_t inode_id, uint64_t offset,
-                                 uint64_t size = 0);
+                                 uint64_t size = 0, bool holdOpen = true);
+  ~FileDataSourceContext();
+  FileDataSourceContext(const FileDataSourceContext &) = delete;
+  FileDataSourceContext &operator=(const FileDataSourceContext &) = delete;
+
   uint64_t reportTotalSize();
+  // Ends the input at end if that comes before the end of the file
+  void stopAt(uint64_t end);
+  const DataSource dataSource() const override;
   bool endOfInput() const override;
 
  protected:
-  uint64_t loadExtents();
   void configure(SnapAction &action, bool initial) override;
+  void restore(SnapAction &action) override;
+  void prepareNext(SnapAction &action) override;
   void finalize(SnapAction &action) override;
-  void mapExtents(SnapAction &action, fpga::ExtmapSlot slot, std::vector<mtl_file_extent> &extents);
+  // Returns the size of the chunk at offset. hostChunk receives it unless
+  // the card reads it from mapped blocks.
+  uint64_t setUpChunk(SnapAction &action, uint64_t offset,
+                      std::optional<JobBuffer> *hostChunk);
+  void mapExtents(SnapAction &action, uint64_t offset, uint64_t required);
 
   uint64_t _inode_id;
+  bool _holdsOpen;
   std::shared_ptr<PipelineStorage> _filesystem;
 
+  // Where the input ends, see stopAt
   uint64_t _fileLength;
-  std::vector<mtl_file_extent> _extents;
+
+  // The current chunk ends early at the next hole or block, whatever the
+  // card can't read in one go
+  uint64_t _chunkSize;
+  // Holds the current chunk if it doesn't lie in mapped blocks
+  std::optional<JobBuffer> _hostChunk;
+
+  // The chunk after the current one, if prepareNext set it up
+  struct NextChunk {
+    uint64_t chunkSize;
+    std::optional<JobBuffer> hostChunk;
+  };
+  std::optional<NextChunk> _next;
+
+  // File offset of the first block in the current extent map
+  fpga::ExtmapSlot _mappedSlot;
+  uint64_t _mappedOffset;
+  PipelineStorage::ResidentExtents _resident;
+  PipelineStorage::ResidentExtents _residentPagefile;
 };
 
 }  // namespace metal
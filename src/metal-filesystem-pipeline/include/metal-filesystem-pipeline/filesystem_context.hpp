@@ -11,14 +11,18 @@ namespace metal {
 
 class METAL_FILESYSTEM_PIPELINE_API FilesystemContext {
  public:
+  // Without options, the metadata store is opened with mtl_default_options
   FilesystemContext(std::string metadataDir,
-                    bool deleteMetadataIfExists = false);
+                    bool deleteMetadataIfExists = false,
+                    const mtl_options *options = nullptr);
   virtual ~FilesystemContext() = default;
 
   mtl_context *context() { return _context; }
+  const mtl_options &options() const { return _options; }
 
  protected:
   mtl_context *_context;
+  mtl_options _options;
 };
 
 }  // namespace metal
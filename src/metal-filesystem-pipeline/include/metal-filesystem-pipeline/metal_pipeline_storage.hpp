@@ -13,6 +13,8 @@
 
 namespace metal {
 
+class SnapAction;
+
 class METAL_FILESYSTEM_PIPELINE_API PipelineStorage
     : public FilesystemContext,
       public std::enable_shared_from_this<PipelineStorage> {
@@ -20,7 +22,8 @@ class METAL_FILESYSTEM_PIPELINE_API PipelineStorage
   PipelineStorage(
       Card card, fpga::AddressType type, fpga::MapType map,
       std::string metadataDir, bool deleteMetadataIfExists = false,
-      std::shared_ptr<PipelineStorage> dramPipelineStorage = nullptr);
+      std::shared_ptr<PipelineStorage> dramPipelineStorage = nullptr,
+      const mtl_options *options = nullptr);
 
   fpga::AddressType type() const { return _type; };
   fpga::MapType map() const { return _map; };
@@ -32,8 +35,30 @@ class METAL_FILESYSTEM_PIPELINE_API PipelineStorage
   inline static const std::string PagefileReadPath = "/.pagefile_read";
   inline static const std::string PagefileWritePath = "/.pagefile_write";
 
+  // What a file context last mapped into an extent map slot. As long as the
+  // slot and the generation of the file stay the same, it is still mapped.
+  struct ResidentExtents {
+    uint64_t version;     // of the slot, 0 if nothing was mapped
+    uint64_t inode_id;    // of the mapped file
+    uint64_t generation;  // of the file when its extents were looked up
+    uint64_t offset;      // file offset of the first mapped block
+    uint64_t end;         // file offset after the last mapped block
+  };
+
+  // Maps the file from the block holding offset on, for up to length bytes,
+  // into the slot. Fails if the first required bytes don't fit into the map.
+  // Nothing is looked up or sent to the card if the range is resident already.
+  void mapExtents(SnapAction &action, fpga::ExtmapSlot slot, uint64_t inode_id,
+                  uint64_t offset, uint64_t length, uint64_t required,
+                  ResidentExtents *resident);
+  void mapPagefile(SnapAction &action, fpga::ExtmapSlot slot,
+                   const std::string &pagefilePath, ResidentExtents *resident);
+
  protected:
   void createDramPagefile(const std::string &pagefilePath);
+  bool isResident(SnapAction &action, fpga::ExtmapSlot slot, uint64_t inode_id,
+                  uint64_t offset, uint64_t end,
+                  const ResidentExtents &resident);
 
   int initialize();
   int deinitialize();
@@ -16,22 +16,44 @@ namespace metal {
 
 FileDataSinkContext::FileDataSinkContext(
     std::shared_ptr<PipelineStorage> filesystem, uint64_t inode_id,
-    uint64_t offset, uint64_t size, bool truncateOnFinalize)
+    uint64_t offset, uint64_t size, bool truncateOnFinalize, bool holdOpen)
     : DefaultDataSinkContext(
           DataSink(offset, size,
                    filesystem ? filesystem->type() : fpga::AddressType::Host,
                    filesystem ? filesystem->map() : fpga::MapType::None)),
       _inode_id(inode_id),
+      _holdsOpen(false),
       _truncateOnFinalize(truncateOnFinalize),
       _filesystem(filesystem),
-      _cachedTotalSize(0) {
+      _cachedTotalSize(0),
+      _mappedOffset(0),
+      _resident(),
+      _residentPagefile() {
   if (_inode_id == 0) {
     // 'Disabled' mode
     return;
   }
 
-  loadExtents();
-  prepareForTotalSize(offset + size);
+  if (holdOpen) {
+    if (mtl_open_file(_filesystem->context(), inode_id) != MTL_SUCCESS) {
+      throw std::runtime_error("Unable to open file");
+    }
+    _holdsOpen = true;
+  }
+
+  try {
+    loadFileLength();
+    prepareForTotalSize(offset + size);
+  } catch (...) {
+    if (_holdsOpen) mtl_close_file(_filesystem->context(), inode_id);
+    throw;
+  }
+}
+
+FileDataSinkContext::~FileDataSinkContext() {
+  if (_holdsOpen) {
+    mtl_close_file(_filesystem->context(), _inode_id);
+  }
 }
 
 void FileDataSinkContext::prepareForTotalSize(uint64_t size) {
@@ -45,7 +67,14 @@ void FileDataSinkContext::prepareForTotalSize(uint64_t size) {
   if (res != MTL_SUCCESS)
     throw std::runtime_error("Unable to update file length");
 
-  loadExtents();
+  loadFileLength();
+}
+
+const DataSink FileDataSinkContext::dataSink() const {
+  // The extent map starts with the first block of the current chunk
+  auto address = _dataSink.address();
+  return DataSink(address.addr - _mappedOffset, address.size, address.type,
+                  address.map);
 }
 
 void FileDataSinkContext::configure(SnapAction &action, uint64_t inputSize,
@@ -56,46 +85,44 @@ void FileDataSinkContext::configure(SnapAction &action, uint64_t inputSize,
     prepareForTotalSize(_dataSink.address().addr + _dataSink.address().size);
   }
 
-  // TODO: There is a potential race condition when the file metadata was
-  // modified between obtaining the extent list and calling configure()
+  // Only map the extents that hold the current chunk. The file is extended
+  // without allocating blocks, so allocate the ones of the chunk now.
+  auto address = _dataSink.address();
+  if (address.size > 0 &&
+      mtl_fallocate(_filesystem->context(), _inode_id, MTL_FALLOCATE_KEEP_SIZE,
+                    address.addr, address.size) != MTL_SUCCESS) {
+    throw std::runtime_error("Unable to allocate blocks");
+  }
 
-  // Transfer extent list
-  switch (_dataSink.address().map) {
+  fpga::ExtmapSlot slot;
+  switch (address.map) {
     case fpga::MapType::DRAMAndNVMe: {
       auto dramFilesystem = _filesystem->dramPipelineStorage();
       if (dramFilesystem == nullptr) {
         throw std::runtime_error("A DRAM filesystem must be provided.");
       }
 
-      uint64_t pagefileInode;
-      if (mtl_open(dramFilesystem->context(),
-                   PipelineStorage::PagefileWritePath.c_str(),
-                   &pagefileInode) != MTL_SUCCESS) {
-        throw std::runtime_error("Pagefile does not exist.");
-      }
-
-      std::vector<mtl_file_extent> pagefileExtents(MTL_MAX_EXTENTS);
-      uint64_t extents_length, file_length;
-      if (mtl_load_extent_list(dramFilesystem->context(), pagefileInode,
-                               pagefileExtents.data(), &extents_length,
-                               &file_length) != MTL_SUCCESS) {
-        throw std::runtime_error("Unable to load pagefile extents.");
-      }
-      pagefileExtents.resize(extents_length);
-
-      mapExtents(action, fpga::ExtmapSlot::CardDRAMWrite, pagefileExtents);
-      mapExtents(action, fpga::ExtmapSlot::NVMeWrite, _extents);
+      dramFilesystem->mapPagefile(action, fpga::ExtmapSlot::CardDRAMWrite,
+                                  PipelineStorage::PagefileWritePath,
+                                  &_residentPagefile);
+      slot = fpga::ExtmapSlot::NVMeWrite;
       break;
     }
     case fpga::MapType::DRAM:
-      mapExtents(action, fpga::ExtmapSlot::CardDRAMWrite, _extents);
+      slot = fpga::ExtmapSlot::CardDRAMWrite;
       break;
     case fpga::MapType::NVMe:
-      mapExtents(action, fpga::ExtmapSlot::NVMeWrite, _extents);
+      slot = fpga::ExtmapSlot::NVMeWrite;
       break;
     case fpga::MapType::None:
-      break;
+    default:
+      _mappedOffset = address.addr - address.addr % fpga::StorageBlockSize;
+      return;
   }
+
+  _filesystem->mapExtents(action, slot, _inode_id, address.addr, address.size,
+                          address.size, &_resident);
+  _mappedOffset = _resident.offset;
 }
 
 void FileDataSinkContext::finalize(SnapAction &, uint64_t outputSize,
@@ -116,50 +143,15 @@ void FileDataSinkContext::finalize(SnapAction &, uint64_t outputSize,
   }
 }
 
-void FileDataSinkContext::loadExtents() {
-  std::vector<mtl_file_extent> extents(MTL_MAX_EXTENTS);
-  uint64_t extentsLength, fileLength;
-  if (mtl_load_extent_list(_filesystem->context(), _inode_id, extents.data(),
-                           &extentsLength, &fileLength) != MTL_SUCCESS) {
-    throw std::runtime_error("Unable to load extents");
+void FileDataSinkContext::loadFileLength() {
+  // The extents are mapped for each chunk in configure()
+  uint64_t fileLength;
+  if (mtl_load_extent_list(_filesystem->context(), _inode_id, nullptr, nullptr,
+                           &fileLength) != MTL_SUCCESS) {
+    throw std::runtime_error("Unable to load file length");
   }
 
-  extents.resize(extentsLength);
-
-  _extents = extents;
   _cachedTotalSize = fileLength;
 }
 
-void FileDataSinkContext::mapExtents(SnapAction &action, fpga::ExtmapSlot slot,
-                                     std::vector<mtl_file_extent> &extents) {
-  auto *job_struct = reinterpret_cast<uint64_t *>(action.allocateMemory(
-      sizeof(uint64_t) *
-      (8                                // words for the prefix
-       + (2 * fpga::MaxExtentsPerFile)  // two words for each extent
-       )));
-  job_struct[0] = htobe64(static_cast<uint64_t>(slot));  // slot number
-  spdlog::trace("Mapping {} extents for writing", extents.size());
-
-  for (uint64_t i = 0; i < fpga::MaxExtentsPerFile; ++i) {
-    if (i < extents.size()) {
-      job_struct[8 + 2 * i + 0] = htobe64(extents[i].offset);
-      job_struct[8 + 2 * i + 1] = htobe64(extents[i].length);
-      spdlog::trace("  Offset {}  Length {}", extents[i].offset,
-                    extents[i].length);
-    } else {
-      job_struct[8 + 2 * i + 0] = 0;
-      job_struct[8 + 2 * i + 1] = 0;
-    }
-  }
-
-  try {
-    action.executeJob(fpga::JobType::Map, reinterpret_cast<char *>(job_struct));
-  } catch (std::exception &ex) {
-    free(job_struct);
-    throw ex;
-  }
-
-  free(job_struct);
-}
-
 }  // namespace metal
@@ -1,9 +1,8 @@
 #include <unistd.h>
 
+#include <algorithm>
 #include <utility>
 
-#include <spdlog/spdlog.h>
-
 #include <metal-filesystem/metal.h>
 #include <metal-filesystem-pipeline/file_data_source_context.hpp>
 #include <metal-filesystem-pipeline/metal_pipeline_storage.hpp>
@@ -16,126 +15,197 @@ size_t FileDataSourceContext::reportTotalSize() { return _fileLength; }
 
 FileDataSourceContext::FileDataSourceContext(
     std::shared_ptr<PipelineStorage> filesystem, uint64_t inode_id,
-    uint64_t offset, uint64_t size)
+    uint64_t offset, uint64_t size, bool holdOpen)
     : DefaultDataSourceContext(
           DataSource(offset, size,
                      filesystem ? filesystem->type() : fpga::AddressType::Host,
                      filesystem ? filesystem->map() : fpga::MapType::None)),
       _inode_id(inode_id),
-      _filesystem(filesystem) {
+      _holdsOpen(false),
+      _filesystem(filesystem),
+      _fileLength(0),
+      _chunkSize(size),
+      _hostChunk(),
+      _next(),
+      _mappedSlot(fpga::ExtmapSlot::NVMeRead),
+      _mappedOffset(0),
+      _resident(),
+      _residentPagefile() {
   if (inode_id == 0) {
     // 'Disabled' mode
     return;
   }
 
-  std::vector<mtl_file_extent> extents(MTL_MAX_EXTENTS);
-  uint64_t extents_length, fileLength;
-
-  if (mtl_load_extent_list(_filesystem->context(), inode_id, extents.data(),
-                           &extents_length, &fileLength) != MTL_SUCCESS) {
-    throw std::runtime_error("Unable to load extents");
+  if (holdOpen) {
+    if (mtl_open_file(_filesystem->context(), inode_id) != MTL_SUCCESS) {
+      throw std::runtime_error("Unable to open file");
+    }
+    _holdsOpen = true;
   }
 
-  extents.resize(extents_length);
+  // The extents are mapped for each chunk in configure()
+  uint64_t fileLength;
+  if (mtl_load_extent_list(_filesystem->context(), inode_id, nullptr, nullptr,
+                           &fileLength) != MTL_SUCCESS) {
+    if (_holdsOpen) mtl_close_file(_filesystem->context(), inode_id);
+    throw std::runtime_error("Unable to load file length");
+  }
 
-  _extents = std::move(extents);
   _fileLength = fileLength;
 
   // Make sure that the size is not larger than the file
   _dataSource =
       _dataSource.withSize(std::min(offset + size, _fileLength) - offset);
+  _chunkSize = _dataSource.address().size;
+}
+
+FileDataSourceContext::~FileDataSourceContext() {
+  if (_holdsOpen) {
+    mtl_close_file(_filesystem->context(), _inode_id);
+  }
+}
+
+void FileDataSourceContext::stopAt(uint64_t end) {
+  _fileLength = std::min(_fileLength, end);
+}
+
+const DataSource FileDataSourceContext::dataSource() const {
+  if (_hostChunk) {
+    return DataSource(_hostChunk->data(), _chunkSize);
+  }
+
+  // The extent map starts with the first block of the current chunk
+  auto address = _dataSource.address();
+  return DataSource(address.addr - _mappedOffset, _chunkSize, address.type,
+                    address.map);
 }
 
 void FileDataSourceContext::configure(SnapAction &action, bool) {
-  if (_extents.empty())
-    throw std::runtime_error("Extents were not initialized");
+  if (_next) {
+    // Set up while the card ran the previous chunk
+    _chunkSize = _next->chunkSize;
+    _hostChunk.reset();
+    if (_next->hostChunk) _hostChunk.emplace(std::move(*_next->hostChunk));
+    _next.reset();
+    return;
+  }
+
+  _hostChunk.reset();
+  _chunkSize = setUpChunk(action, _dataSource.address().addr, &_hostChunk);
+}
+
+void FileDataSourceContext::prepareNext(SnapAction &action) {
+  if (_inode_id == 0) return;
 
-  // TODO: There is a potential race condition when the file metadata was
-  // modified between obtaining the extent list and calling configure()
+  // The current chunk and its buffer stay until finalize
+  NextChunk next{0, std::nullopt};
+  next.chunkSize = setUpChunk(action, _dataSource.address().addr + _chunkSize,
+                              &next.hostChunk);
+  _next.emplace(std::move(next));
+}
+
+uint64_t FileDataSourceContext::setUpChunk(
+    SnapAction &action, uint64_t offset, std::optional<JobBuffer> *hostChunk) {
+  auto address = _dataSource.address();
+  uint64_t end = std::min(offset + address.size, _fileLength);
+  uint64_t chunkSize = end > offset ? end - offset : 0;
+
+  if (chunkSize == 0 || address.map == fpga::MapType::None) {
+    mapExtents(action, offset, chunkSize);
+    return chunkSize;
+  }
+
+  // The card can only read blocks. What comes before the next block of the
+  // file, like a hole or data kept in the inode, is read here instead and
+  // handed to the card from memory. Reading holes doesn't allocate them.
+  uint64_t mappedOffset;
+  if (mtl_find_mapped(_filesystem->context(), _inode_id, offset,
+                      &mappedOffset) != MTL_SUCCESS) {
+    throw std::runtime_error("Unable to find mapped blocks");
+  }
 
-  // Transfer extent list
-  switch (_dataSource.address().map) {
+  if (mappedOffset > offset) {
+    chunkSize = std::min(chunkSize, mappedOffset - offset);
+    hostChunk->emplace(action.allocateJobBuffer(chunkSize));
+    if (mtl_read(_filesystem->context(), _inode_id, (*hostChunk)->as<char>(),
+                 chunkSize, offset) != chunkSize) {
+      throw std::runtime_error("Unable to read file");
+    }
+    return chunkSize;
+  }
+
+  // The chunk ends where the mapping does, like at the next hole
+  mapExtents(action, offset, 0);
+  return std::min(chunkSize, _resident.end - offset);
+}
+
+void FileDataSourceContext::restore(SnapAction &action) {
+  // Only pipelines that ran in between can have replaced the extent maps,
+  // the file itself is the same
+  if (_hostChunk || _resident.version == 0) return;
+  if (action.extentMapVersion(_mappedSlot) == _resident.version &&
+      (_residentPagefile.version == 0 ||
+       action.extentMapVersion(fpga::ExtmapSlot::CardDRAMRead) ==
+           _residentPagefile.version)) {
+    return;
+  }
+
+  mapExtents(action, _dataSource.address().addr, _chunkSize);
+}
+
+void FileDataSourceContext::mapExtents(SnapAction &action, uint64_t offset,
+                                       uint64_t required) {
+  // Map the file from the chunk at offset to its end, so that the following
+  // chunks find their extents mapped already. Only the extents that hold the
+  // first required bytes of the chunk have to fit into the extent map.
+  auto address = _dataSource.address();
+  uint64_t length = _fileLength > offset ? _fileLength - offset : 0;
+
+  fpga::ExtmapSlot slot;
+  switch (address.map) {
     case fpga::MapType::DRAMAndNVMe: {
       auto dramFilesystem = _filesystem->dramPipelineStorage();
       if (dramFilesystem == nullptr) {
         throw std::runtime_error("A DRAM filesystem must be provided.");
       }
 
-      uint64_t pagefileInode;
-      if (mtl_open(dramFilesystem->context(),
-                   PipelineStorage::PagefileReadPath.c_str(),
-                   &pagefileInode) != MTL_SUCCESS) {
-        throw std::runtime_error("Pagefile does not exist.");
-      }
-
-      std::vector<mtl_file_extent> pagefileExtents(MTL_MAX_EXTENTS);
-      uint64_t extents_length, file_length;
-      if (mtl_load_extent_list(dramFilesystem->context(), pagefileInode,
-                               pagefileExtents.data(), &extents_length,
-                               &file_length) != MTL_SUCCESS) {
-        throw std::runtime_error("Unable to load pagefile extents.");
-      }
-      pagefileExtents.resize(extents_length);
-
-      mapExtents(action, fpga::ExtmapSlot::CardDRAMRead, pagefileExtents);
-      mapExtents(action, fpga::ExtmapSlot::NVMeRead, _extents);
+      dramFilesystem->mapPagefile(action, fpga::ExtmapSlot::CardDRAMRead,
+                                  PipelineStorage::PagefileReadPath,
+                                  &_residentPagefile);
+      slot = fpga::ExtmapSlot::NVMeRead;
       break;
     }
     case fpga::MapType::DRAM:
-      mapExtents(action, fpga::ExtmapSlot::CardDRAMRead, _extents);
+      slot = fpga::ExtmapSlot::CardDRAMRead;
       break;
     case fpga::MapType::NVMe:
-      mapExtents(action, fpga::ExtmapSlot::NVMeRead, _extents);
+      slot = fpga::ExtmapSlot::NVMeRead;
       break;
     case fpga::MapType::None:
-      break;
+    default:
+      _mappedOffset = offset - offset % fpga::StorageBlockSize;
+      return;
   }
-}
 
-void FileDataSourceContext::mapExtents(SnapAction &action,
-                                       fpga::ExtmapSlot slot,
-                                       std::vector<mtl_file_extent> &extents) {
-  auto *job_struct = reinterpret_cast<uint64_t *>(action.allocateMemory(
-      sizeof(uint64_t) *
-      (8                                // words for the prefix
-       + (2 * fpga::MaxExtentsPerFile)  // two words for each extent
-       )));
-  job_struct[0] = htobe64(static_cast<uint64_t>(slot));  // slot number
-  spdlog::trace("Mapping {} extents for reading", extents.size());
-
-  for (uint64_t i = 0; i < fpga::MaxExtentsPerFile; ++i) {
-    if (i < extents.size()) {
-      job_struct[8 + 2 * i + 0] = htobe64(extents[i].offset);
-      job_struct[8 + 2 * i + 1] = htobe64(extents[i].length);
-      spdlog::trace("  Offset {}  Length {}", extents[i].offset,
-                    extents[i].length);
-    } else {
-      job_struct[8 + 2 * i + 0] = 0;
-      job_struct[8 + 2 * i + 1] = 0;
-    }
-  }
-
-  try {
-    action.executeJob(fpga::JobType::Map, reinterpret_cast<char *>(job_struct));
-  } catch (std::exception &ex) {
-    free(job_struct);
-    throw ex;
-  }
-
-  free(job_struct);
+  _filesystem->mapExtents(action, slot, _inode_id, offset, length, required,
+                          &_resident);
+  _mappedSlot = slot;
+  _mappedOffset = _resident.offset;
 }
 
 void FileDataSourceContext::finalize(SnapAction &action) {
   (void)action;
+  _hostChunk.reset();
+
   // Advance offset
   _dataSource =
-      DataSource(_dataSource.address().addr + _dataSource.address().size,
+      DataSource(_dataSource.address().addr + _chunkSize,
                  _dataSource.address().size, _dataSource.address().type,
                  _dataSource.address().map);
 }
 
 bool FileDataSourceContext::endOfInput() const {
-  return _dataSource.address().addr + _dataSource.address().size >= _fileLength;
+  return _dataSource.address().addr + _chunkSize >= _fileLength;
 }
 
 }  // namespace metal
@@ -7,8 +7,15 @@ namespace metal {
 
 FilesystemContext::FilesystemContext(
                                      std::string metadataDir,
-                                     bool deleteMetadataIfExists)
+                                     bool deleteMetadataIfExists,
+                                     const mtl_options *options)
     :  _context(nullptr) {
+  if (options) {
+    _options = *options;
+  } else {
+    mtl_default_options(&_options);
+  }
+
   DIR *dir = opendir(metadataDir.c_str());
   if (dir) {
     if (deleteMetadataIfExists) {
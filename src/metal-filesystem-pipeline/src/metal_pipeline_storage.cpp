@@ -11,6 +11,7 @@
 #include <metal-pipeline/data_sink.hpp>
 #include <metal-pipeline/fpga_interface.hpp>
 #include <metal-pipeline/pipeline.hpp>
+#include <metal-pipeline/snap_action.hpp>
 #include <metal-pipeline/snap_pipeline_runner.hpp>
 
 namespace metal {
@@ -18,8 +19,9 @@ namespace metal {
 PipelineStorage::PipelineStorage(
     Card card, fpga::AddressType type, fpga::MapType map,
     std::string metadataDir, bool deleteMetadataIfExists,
-    std::shared_ptr<PipelineStorage> dramPipelineStorage)
-    : FilesystemContext(metadataDir, deleteMetadataIfExists),
+    std::shared_ptr<PipelineStorage> dramPipelineStorage,
+    const mtl_options *options)
+    : FilesystemContext(metadataDir, deleteMetadataIfExists, options),
       _card(card),
       _type(type),
       _map(map),
@@ -49,8 +51,11 @@ PipelineStorage::PipelineStorage(
         auto This = reinterpret_cast<PipelineStorage *>(storage_context);
         return This->read(inode_id, offset, buffer, length);
       },
-      this};
-  mtl_initialize(&_context, metadataDir.c_str(), &_backend);
+      this,
+      nullptr,
+      nullptr};
+  mtl_initialize_with_options(&_context, metadataDir.c_str(), &_backend,
+                              &_options);
 
   // Make sure that the necessary pagefiles are in place
   if (_map == fpga::MapType::DRAMAndNVMe) {
@@ -77,13 +82,89 @@ void PipelineStorage::createDramPagefile(const std::string &pagefilePath) {
     throw std::runtime_error("Could not open pagefile.");
   }
 
-  res = mtl_truncate(_dramPipelineStorage->context(), pagefile_inode,
-                     fpga::PagefileSize);
+  // The pagefile is mapped as a whole, so it must not have holes
+  res = mtl_fallocate(_dramPipelineStorage->context(), pagefile_inode, 0, 0,
+                      fpga::PagefileSize);
   if (res != MTL_SUCCESS) {
     throw std::runtime_error("Could not resize pagefile.");
   }
 }
 
+bool PipelineStorage::isResident(SnapAction &action, fpga::ExtmapSlot slot,
+                                 uint64_t inode_id, uint64_t offset,
+                                 uint64_t end,
+                                 const ResidentExtents &resident) {
+  if (resident.version == 0 ||
+      action.extentMapVersion(slot) != resident.version ||
+      resident.inode_id != inode_id || offset < resident.offset ||
+      end > resident.end) {
+    return false;
+  }
+
+  uint64_t generation;
+  if (mtl_get_generation(_context, inode_id, &generation) != MTL_SUCCESS) {
+    return false;
+  }
+  return generation == resident.generation;
+}
+
+void PipelineStorage::mapExtents(SnapAction &action, fpga::ExtmapSlot slot,
+                                 uint64_t inode_id, uint64_t offset,
+                                 uint64_t length, uint64_t required,
+                                 ResidentExtents *resident) {
+  if (isResident(action, slot, inode_id, offset, offset + required,
+                 *resident)) {
+    return;
+  }
+
+  // Read before the lookup, so that a concurrent update can only make the
+  // generation look older than the extents are
+  uint64_t generation;
+  if (mtl_get_generation(_context, inode_id, &generation) != MTL_SUCCESS) {
+    throw std::runtime_error("Unable to read file generation");
+  }
+
+  std::vector<mtl_file_extent> extents(fpga::MaxExtentsPerFile);
+  uint64_t extents_length;
+  if (mtl_map_range(_context, inode_id, offset, length, extents.data(),
+                    extents.size(), &extents_length) != MTL_SUCCESS) {
+    throw std::runtime_error("Unable to map extents");
+  }
+
+  std::vector<SnapAction::Extent> mapped;
+  mapped.reserve(extents_length);
+  uint64_t mappedLength = 0;
+  for (uint64_t i = 0; i < extents_length; ++i) {
+    mapped.push_back(SnapAction::Extent{extents[i].offset, extents[i].length});
+    mappedLength += extents[i].length * fpga::StorageBlockSize;
+  }
+
+  // A range holding more extents than the hardware can map has to fail
+  uint64_t mappedOffset = offset - offset % fpga::StorageBlockSize;
+  if (required > 0 && mappedLength < offset + required - mappedOffset) {
+    throw std::runtime_error("Too many extents to map the requested range");
+  }
+
+  resident->version = action.mapExtents(slot, mapped);
+  resident->inode_id = inode_id;
+  resident->generation = generation;
+  resident->offset = mappedOffset;
+  resident->end = mappedOffset + mappedLength;
+}
+
+void PipelineStorage::mapPagefile(SnapAction &action, fpga::ExtmapSlot slot,
+                                  const std::string &pagefilePath,
+                                  ResidentExtents *resident) {
+  uint64_t pagefileInode;
+  if (mtl_open(_context, pagefilePath.c_str(), &pagefileInode) !=
+      MTL_SUCCESS) {
+    throw std::runtime_error("Pagefile does not exist.");
+  }
+
+  mapExtents(action, slot, pagefileInode, 0, fpga::PagefileSize,
+             fpga::PagefileSize, resident);
+}
+
 int PipelineStorage::mtl_storage_get_metadata(mtl_storage_metadata *metadata) {
   if (metadata) {
     // TODO: The number of blocks per NVMe stick can be obtained through the
@@ -97,12 +178,27 @@ int PipelineStorage::mtl_storage_get_metadata(mtl_storage_metadata *metadata) {
 
 int PipelineStorage::read(uint64_t inode_id, uint64_t offset, void *buffer,
                           uint64_t length) {
-  FileDataSourceContext source(shared_from_this(), inode_id, offset, length);
-  DefaultDataSinkContext sink(DataSink(buffer, length));
-
   try {
     SnapPipelineRunner runner(_card);
-    runner.run(source, sink);
+
+    // A chunk ends early at a hole or when its extents don't fit into the
+    // extent map, so the rest is read with the next one. The source sets
+    // that up while the card reads the current chunk.
+    FileDataSourceContext source(shared_from_this(), inode_id, offset, length,
+                                 false);
+    source.stopAt(offset + length);
+
+    uint64_t done = 0;
+    while (done < length) {
+      DefaultDataSinkContext sink(
+          DataSink(static_cast<char *>(buffer) + done, length - done));
+
+      auto chunk = runner.run(source, sink).first;
+      if (chunk == 0) {
+        throw std::runtime_error("Unable to read beyond the end of the file");
+      }
+      done += chunk;
+    }
     return MTL_SUCCESS;
   } catch (std::exception &e) {
     spdlog::error(e.what());
@@ -114,7 +210,8 @@ int PipelineStorage::read(uint64_t inode_id, uint64_t offset, void *buffer,
 int PipelineStorage::write(uint64_t inode_id, uint64_t offset,
                            const void *buffer, uint64_t length) {
   DefaultDataSourceContext source(DataSource(buffer, length));
-  FileDataSinkContext sink(shared_from_this(), inode_id, offset, length);
+  FileDataSinkContext sink(shared_from_this(), inode_id, offset, length,
+                           false, false);
 
   try {
     SnapPipelineRunner runner(_card);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <lmdb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MTL_MAX_FILENAME_LENGTH 255
+
+// Directory entries are stored in their own database, keyed by the
+// (big-endian) parent inode id followed by the entry name. This keeps the
+// entries of a directory adjacent and ordered by name.
+typedef struct mtl_directory_entry {
+  uint64_t inode_id;
+  uint8_t name_len;
+  char name[MTL_MAX_FILENAME_LENGTH + 1];  // null-terminated
+} mtl_directory_entry;
+
+int mtl_put_directory_entry(MDB_txn *txn, uint64_t dir_inode_id,
+                            const char *filename, uint64_t inode_id);
+int mtl_get_directory_entry(MDB_txn *txn, uint64_t dir_inode_id,
+                            const char *filename, uint64_t *inode_id);
+int mtl_delete_directory_entry(MDB_txn *txn, uint64_t dir_inode_id,
+                               const char *filename, uint64_t *inode_id);
+
+// Loads up to max_entries entries of a directory whose name sorts after
+// `after` (or from the beginning if `after` is NULL). Returns MTL_COMPLETE
+// if the end of the directory has been reached.
+int mtl_list_directory_entries(MDB_txn *txn, uint64_t dir_inode_id,
+                               const char *after, mtl_directory_entry *entries,
+                               uint64_t max_entries, uint64_t *entries_length);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,13 +5,34 @@
 
 #include <lmdb.h>
 
+#include <metal-filesystem/free_space.h>
 #include <metal-filesystem/storage.h>
 
-int mtl_initialize_extents(MDB_txn *txn, uint64_t blocks);
+// Also (re-)builds the free space index from the extents database
+int mtl_initialize_extents(MDB_txn *txn, mtl_free_space *free_space, uint64_t blocks);
 
-uint64_t mtl_reserve_extent(MDB_txn *txn, uint64_t size, mtl_file_extent *last_extent, uint64_t *offset, bool commit);
-int mtl_truncate_extent(MDB_txn *txn, uint64_t offset, uint64_t len);
-int mtl_free_extent(MDB_txn *txn, uint64_t offset);
+// Extends last_extent in place if possible. Blocks are marked as reserved unless
+// commit is set; reserved and committed blocks never share an extent.
+uint64_t mtl_reserve_extent(MDB_txn *txn, mtl_free_space *free_space, uint64_t inode_id, uint64_t size, mtl_file_extent *last_extent, uint64_t *offset, bool commit);
+int mtl_commit_extent(MDB_txn *txn, uint64_t offset);
+
+// Adds a file to the ones that a committed extent belongs to
+int mtl_share_extent(MDB_txn *txn, uint64_t offset);
+bool mtl_extent_is_shared(MDB_txn *txn, uint64_t offset);
+// Splits an extent that isn't shared after its first len blocks
+int mtl_split_extent(MDB_txn *txn, uint64_t offset, uint64_t len);
+
+// Keeps the first len blocks (which are committed afterwards) and frees the
+// rest. Shared extents can't be truncated.
+int mtl_truncate_extent(MDB_txn *txn, mtl_free_space *free_space, uint64_t offset, uint64_t len);
+// Only removes a file from a shared extent, which is freed with the last one
+int mtl_free_extent(MDB_txn *txn, mtl_free_space *free_space, uint64_t offset);
+
+// Gives the unused part of the file's reservation window back
+int mtl_release_reservation_window(MDB_txn *txn, mtl_free_space *free_space, uint64_t inode_id);
+
+int mtl_fragmentation_bucket(uint64_t value);
+int mtl_add_free_extent_stats(MDB_txn *txn, mtl_fragmentation_report *report);
 
 int mtl_dump_extents(MDB_txn *txn);
 
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <lmdb.h>
+
+#include <metal-filesystem/metal.h>
+#include <metal-filesystem/storage.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The extents of a file are stored in their own database, keyed by the
+// (big-endian) inode id followed by the (big-endian) logical block at which
+// the extent starts. This keeps the extents of a file adjacent and ordered by
+// their position in the file. Every change to them bumps the generation of
+// the inode.
+
+int mtl_put_file_extent(MDB_txn *txn, uint64_t inode_id, uint64_t first_block,
+                        const mtl_file_extent *extent);
+
+// Loads up to max_extents extents of a file, starting with the extent that
+// contains first_block (or the next one after it). first_blocks receives the
+// logical block at which each extent starts and may be NULL.
+int mtl_load_file_extents(MDB_txn *txn, uint64_t inode_id,
+                          uint64_t first_block, mtl_file_extent *extents,
+                          uint64_t *first_blocks, uint64_t max_extents,
+                          uint64_t *extents_length);
+int mtl_load_last_file_extent(MDB_txn *txn, uint64_t inode_id,
+                              mtl_file_extent *extent, uint64_t *first_block);
+
+// Removes everything from first_block onwards. An extent that spans
+// first_block is shortened accordingly.
+int mtl_delete_file_extents(MDB_txn *txn, uint64_t inode_id,
+                            uint64_t first_block);
+
+int mtl_add_file_extent_stats(MDB_txn *txn, mtl_fragmentation_report *report);
+
+// Finds the (up to max_files) files with the most extents that directly
+// follow the previous extent of the file, as long as there are at least
+// min_extents of them. Those are the extents that moving the file into
+// contiguous blocks would remove. mergeable receives their numbers, in
+// descending order.
+int mtl_find_fragmented_files(MDB_txn *txn, uint64_t min_extents,
+                              uint64_t *inode_ids, uint64_t *mergeable,
+                              uint64_t max_files, uint64_t *files_length);
+
+#ifdef __cplusplus
+}
+#endif
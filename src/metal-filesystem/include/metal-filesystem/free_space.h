@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <metal-filesystem/metal.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Volatile index of the free extents on the storage, ordered both by offset
+// and by length. It is built from the extents database when the file system
+// is mounted; the database remains the source of truth.
+//
+// The index is only modified from within write transactions, so it relies on
+// LMDB's single-writer lock instead of having its own.
+typedef struct mtl_free_space mtl_free_space;
+
+int mtl_free_space_create(mtl_free_space **free_space);
+void mtl_free_space_destroy(mtl_free_space *free_space);
+void mtl_free_space_clear(mtl_free_space *free_space);
+
+// Marks the index as out of sync with the extents database, e.g. after a
+// write transaction that modified it was aborted
+void mtl_free_space_invalidate(mtl_free_space *free_space);
+bool mtl_free_space_valid(mtl_free_space *free_space);
+void mtl_free_space_set_valid(mtl_free_space *free_space);
+
+int mtl_free_space_insert(mtl_free_space *free_space, uint64_t offset,
+                          uint64_t length);
+int mtl_free_space_remove(mtl_free_space *free_space, uint64_t offset);
+
+// Looks up the free extent starting at offset
+bool mtl_free_space_find(mtl_free_space *free_space, uint64_t offset,
+                         uint64_t *length);
+// Looks up the last free extent starting before offset
+bool mtl_free_space_find_before(mtl_free_space *free_space, uint64_t offset,
+                                uint64_t *found_offset, uint64_t *found_length);
+// Looks up the first free extent starting at or after offset
+bool mtl_free_space_find_after(mtl_free_space *free_space, uint64_t offset,
+                               uint64_t *found_offset, uint64_t *found_length);
+bool mtl_free_space_find_largest(mtl_free_space *free_space, uint64_t *offset,
+                                 uint64_t *length);
+// Looks up the smallest free extent that is at least length blocks long
+bool mtl_free_space_find_best_fit(mtl_free_space *free_space, uint64_t length,
+                                  uint64_t *found_offset,
+                                  uint64_t *found_length);
+
+void mtl_free_space_set_policy(mtl_free_space *free_space,
+                               mtl_allocation_policy policy);
+mtl_allocation_policy mtl_free_space_policy(mtl_free_space *free_space);
+
+// Reservation windows are free extents that are set aside for a single file.
+// They are not part of the index, but remain free extents in the database, so
+// they don't survive clearing the index.
+#define MTL_FREE_SPACE_WINDOWS 64
+
+bool mtl_free_space_find_window(mtl_free_space *free_space, uint64_t inode_id,
+                                uint64_t *offset, uint64_t *length);
+// A length of 0 removes the window of the file. The table must not be full
+// when adding a window for another file.
+void mtl_free_space_set_window(mtl_free_space *free_space, uint64_t inode_id,
+                               uint64_t offset, uint64_t length);
+bool mtl_free_space_windows_full(mtl_free_space *free_space);
+// Looks up the window that was used least recently
+bool mtl_free_space_oldest_window(mtl_free_space *free_space,
+                                  uint64_t *inode_id);
+
+void mtl_free_space_get_stats(mtl_free_space *free_space, uint64_t *extents,
+                              uint64_t *blocks);
+
+#ifdef __cplusplus
+}
+#endif
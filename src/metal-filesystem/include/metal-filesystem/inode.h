@@ -22,26 +22,37 @@ typedef struct mtl_inode {
   int modified;
   int created;
   int mode;
+  // Counts the changes to the extents of the file, see mtl_get_generation
+  uint64_t generation;
 } mtl_inode;
 
+// Legacy format: directory entries packed into the directory inode's data
 typedef struct mtl_directory_entry_head {
   uint64_t inode_id;
   uint8_t name_len;
 } mtl_directory_entry_head;
 
-int mtl_load_file(MDB_txn *txn, uint64_t inode_id, const mtl_inode **inode,
-                  const mtl_file_extent **extents, uint64_t *extents_length);
-int mtl_load_directory(MDB_txn *txn, uint64_t inode_id, const mtl_inode **inode,
-                       mtl_directory_entry_head **dir_entries,
-                       uint64_t *entries_length);
+// The extents themselves are kept in the file_extents database, see
+// file_extent.h. first_block is the logical block at which the extent starts.
 int mtl_add_extent_to_file(MDB_txn *txn, uint64_t inode_id,
-                           mtl_file_extent *new_extent, uint64_t new_length);
+                           uint64_t first_block, mtl_file_extent *new_extent,
+                           uint64_t new_length);
 int mtl_extend_last_extent_in_file(MDB_txn *txn, uint64_t inode_id,
+                                   uint64_t first_block,
                                    mtl_file_extent *new_extent,
                                    uint64_t new_length);
 int mtl_truncate_file_extents(MDB_txn *txn, uint64_t inode_id,
-                              uint64_t new_file_length, uint64_t extents_length,
-                              uint64_t *update_last_extent_length);
+                              uint64_t new_file_length, uint64_t blocks);
+// Files that are small enough and have no extents can keep their data in the
+// inode data instead. It holds the beginning of the file, the rest of the file
+// reads as zeros.
+int mtl_set_file_length(MDB_txn *txn, uint64_t inode_id, uint64_t new_length);
+int mtl_migrate_file_extents(MDB_txn *txn);
+// Called with every change to the extents of a file. Does nothing if there
+// is no such inode (yet).
+int mtl_bump_inode_generation(MDB_txn *txn, uint64_t inode_id);
+// Before generations, inodes ended after their mode
+int mtl_migrate_inode_generations(MDB_txn *txn);
 int mtl_resolve_inode_in_directory(MDB_txn *txn, uint64_t dir_inode_id,
                                    char *filename, uint64_t *file_inode_id);
 int mtl_append_inode_id_to_directory(MDB_txn *txn, uint64_t dir_inode_id,
@@ -49,6 +60,7 @@ int mtl_append_inode_id_to_directory(MDB_txn *txn, uint64_t dir_inode_id,
 int mtl_remove_entry_from_directory(MDB_txn *txn, uint64_t dir_inode_id,
                                     char *filename, uint64_t *inode_id);
 int mtl_remove_directory(MDB_txn *txn, uint64_t dir_inode_id);
+int mtl_migrate_directory_entries(MDB_txn *txn);
 
 int mtl_create_root_directory(MDB_txn *txn);
 int mtl_create_directory_in_directory(MDB_txn *txn, uint64_t dir_inode_id,
@@ -11,16 +11,58 @@ extern "C" {
 #define MTL_SUCCESS 0
 #define MTL_COMPLETE 1
 #define MTL_ERROR_NOENTRY 2
+#define MTL_ERROR_BUSY 16
 #define MTL_ERROR_EXISTS 17
 #define MTL_ERROR_NOTDIRECTORY 20
 #define MTL_ERROR_INVALID_ARGUMENT 22
+#define MTL_ERROR_NOSPACE 28
+#define MTL_ERROR_NAMETOOLONG 36
 #define MTL_ERROR_NOTEMPTY 39
+#define MTL_ERROR_NOTSUPPORTED 95
 
+// The most extents mtl_load_extent_list returns. Files can have more than
+// that, but they can't be mapped at once.
 #define MTL_MAX_EXTENTS 512
 
 typedef struct mtl_context mtl_context;
 int mtl_initialize(mtl_context **context, const char *metadata_store,
                    mtl_storage_backend *storage);
+
+// Maps the metadata store with MDB_WRITEMAP, which saves a copy per update
+// but lets stray writes through pointers into the map corrupt it
+#define MTL_METADATA_WRITEMAP 0x01
+// Don't zero out malloc'ed pages before writing them (MDB_NOMEMINIT)
+#define MTL_METADATA_NOMEMINIT 0x02
+
+typedef struct mtl_options {
+  // Size the memory map of the metadata store starts out with. It grows
+  // whenever less than a quarter of it is left, and when an update does not
+  // fit anymore (in which case the update runs again in the larger map).
+  uint64_t map_size;
+  // The map doesn't grow beyond this size. 0 for no limit.
+  uint64_t max_map_size;
+  // MTL_METADATA_* flags
+  int flags;
+  // Files up to this size keep their data in the metadata store instead of
+  // taking up a block of their own, so that they are read and written without
+  // going to storage. They move to blocks once they grow beyond it. 0 keeps
+  // all files in blocks.
+  uint64_t inline_data_size;
+  // Files up to this size (but larger than inline_data_size) share storage
+  // blocks with other small files, in runs of 1/64th of a block. It is
+  // limited to the block size. 0 gives every file blocks of its own.
+  uint64_t packed_file_size;
+} mtl_options;
+
+#define MTL_DEFAULT_MAP_SIZE (64ul << 20)
+#define MTL_DEFAULT_INLINE_DATA_SIZE 1024
+#define MTL_DEFAULT_PACKED_FILE_SIZE (64ul << 10)
+
+void mtl_default_options(mtl_options *options);
+int mtl_initialize_with_options(mtl_context **context,
+                                const char *metadata_store,
+                                mtl_storage_backend *storage,
+                                const mtl_options *options);
 int mtl_deinitialize(mtl_context *context);
 
 typedef struct mtl_inode mtl_inode;
@@ -32,6 +74,12 @@ int mtl_open(mtl_context *context, const char *filename, uint64_t *inode_id);
 int mtl_opendir(mtl_context *context, const char *filename, mtl_dir **dir);
 int mtl_readdir(mtl_context *context, mtl_dir *dir, char *buffer,
                 uint64_t size);
+// Like mtl_readdir, but also returns the inode ID and the attributes of the
+// entry (either may be NULL). The attributes of a batch of entries are read in
+// the same transaction as their names, so a listing with attributes is a
+// single pass over the directory instead of a lookup per entry.
+int mtl_readdir_plus(mtl_context *context, mtl_dir *dir, char *buffer,
+                     uint64_t size, uint64_t *inode_id, mtl_inode *inode);
 int mtl_closedir(mtl_context *context, mtl_dir *dir);
 int mtl_mkdir(mtl_context *context, const char *filename, int mode);
 int mtl_rmdir(mtl_context *context, const char *filename);
@@ -40,17 +88,205 @@ int mtl_rename(mtl_context *context, const char *from_filename,
 int mtl_chown(mtl_context *context, const char *path, int uid, int gid);
 int mtl_create(mtl_context *context, const char *filename, int mode,
                uint64_t *inode_id);
+int mtl_open_file(mtl_context *context, uint64_t inode_id);
+int mtl_close_file(mtl_context *context, uint64_t inode_id);
 int mtl_write(mtl_context *context, uint64_t inode_id, const char *buffer,
               uint64_t size, uint64_t offset);
 uint64_t mtl_read(mtl_context *context, uint64_t inode_id, char *buffer,
                   uint64_t size, uint64_t offset);
+
+typedef struct mtl_io mtl_io;
+
+// Like mtl_write and mtl_read, but for a list of buffers, and without
+// waiting for storage. The metadata is looked up and updated before they
+// return, then the requests for all extents of the range are in flight at
+// once. The buffers (but not iov itself) must stay valid until the I/O is
+// waited for with mtl_wait, from the same thread.
+int mtl_write_async(mtl_context *context, uint64_t inode_id,
+                    const struct iovec *iov, int iovcnt, uint64_t offset,
+                    mtl_io **io);
+int mtl_read_async(mtl_context *context, uint64_t inode_id,
+                   const struct iovec *iov, int iovcnt, uint64_t offset,
+                   mtl_io **io);
+// Waits for an I/O to complete and releases it. length receives the number
+// of bytes that were read or written.
+int mtl_wait(mtl_context *context, mtl_io *io, uint64_t *length);
 int mtl_truncate(mtl_context *context, uint64_t inode_id, uint64_t offset);
+
+// Like FALLOC_FL_KEEP_SIZE
+#define MTL_FALLOCATE_KEEP_SIZE 0x01
+
+// Allocates the blocks for the holes in the byte range [offset, offset + length)
+// of a file and extends its length accordingly, unless MTL_FALLOCATE_KEEP_SIZE
+// is given
+int mtl_fallocate(mtl_context *context, uint64_t inode_id, int mode,
+                  uint64_t offset, uint64_t length);
+
+// Replaces the content of the file to_inode_id with that of from_inode_id.
+// Both files share the blocks, which are only copied once either of them is
+// written to, so this doesn't depend on the size of the file.
+int mtl_clone(mtl_context *context, uint64_t from_inode_id,
+              uint64_t to_inode_id);
 int mtl_unlink(mtl_context *context, const char *filename);
 
+typedef struct mtl_dentry_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t entries;
+} mtl_dentry_cache_stats;
+
+int mtl_get_dentry_cache_stats(mtl_context *context,
+                               mtl_dentry_cache_stats *stats);
+
+// Group commit lets metadata updates return before they are flushed to disk.
+// They are synced together after at most interval_ms, or as soon as
+// max_pending of them have piled up. An interval of 0 disables group commit
+// (the default), so that every update is flushed before returning. Don't call
+// this while other calls are in progress.
+int mtl_set_group_commit(mtl_context *context, uint64_t interval_ms,
+                         uint64_t max_pending);
+
+// Returns once all metadata updates made so far have been flushed to disk
+int mtl_sync(mtl_context *context);
+
+typedef struct mtl_group_commit_stats {
+  uint64_t commits;
+  uint64_t pending;
+  uint64_t syncs;
+} mtl_group_commit_stats;
+
+int mtl_get_group_commit_stats(mtl_context *context,
+                               mtl_group_commit_stats *stats);
+
+typedef struct mtl_metadata_stats {
+  uint64_t map_size;
+  uint64_t used_size;
+  uint64_t map_resizes;
+} mtl_metadata_stats;
+
+int mtl_get_metadata_stats(mtl_context *context, mtl_metadata_stats *stats);
+
+// Maintained along with the extents and inodes, so this doesn't scan anything
+typedef struct mtl_filesystem_stats {
+  uint64_t block_size;
+  uint64_t blocks;
+  uint64_t free_blocks;
+  uint64_t used_blocks;
+  // In blocks, not counting the reservation windows set aside for files
+  uint64_t largest_free_extent;
+  // Including the ones that the file system uses internally
+  uint64_t inodes;
+} mtl_filesystem_stats;
+
+int mtl_statfs(mtl_context *context, mtl_filesystem_stats *stats);
+
+// Grows with every change to the extents of the file (not with writes to
+// blocks it has already) and keeps growing across remounts. As long as it
+// stays the same, extents that were looked up after reading it are current.
+int mtl_get_generation(mtl_context *context, uint64_t inode_id,
+                       uint64_t *generation);
+
+// Files are sparse: blocks are only allocated once they are written to (or
+// with mtl_fallocate), so extending a file with mtl_truncate leaves a hole.
+// Holes read as zeros. The extent list only contains the allocated extents.
 int mtl_load_extent_list(mtl_context *context, uint64_t inode_id,
                          mtl_file_extent *extents, uint64_t *extents_length,
                          uint64_t *file_length);
 
+// Maps the byte range [offset, offset + length) of a file to the physical
+// extents holding it, in file order. The extents are clipped to the blocks
+// covering the range, so the first one starts with the block that contains
+// offset. The mapping ends at the first hole in the range. If more than
+// max_extents extents are needed, only the first max_extents are returned.
+// Hold the file open with mtl_open_file for as long as the extents are used,
+// or the defragmenter may move its blocks elsewhere.
+int mtl_map_range(mtl_context *context, uint64_t inode_id, uint64_t offset,
+                  uint64_t length, mtl_file_extent *extents,
+                  uint64_t max_extents, uint64_t *extents_length);
+
+// Finds the first byte at or after offset that lies in a block mtl_map_range
+// can map. mapped_offset receives the file length if there is none, like in
+// a hole at the end of the file or for data kept in the inode or the pack
+// file. Everything before mapped_offset can be read with mtl_read instead.
+int mtl_find_mapped(mtl_context *context, uint64_t inode_id, uint64_t offset,
+                    uint64_t *mapped_offset);
+
+// Allocates the holes in the byte range [offset, offset + length) of a file
+// and writes zeros to them, for readers that can only read allocated blocks.
+// Small files that keep their data in the inode or share blocks with other
+// files get blocks of their own first.
+int mtl_fill_holes(mtl_context *context, uint64_t inode_id, uint64_t offset,
+                   uint64_t length);
+
+// How free extents are chosen when a file can't be extended in place
+typedef enum mtl_allocation_policy {
+  // Take the largest free extent
+  MTL_ALLOCATION_WORST_FIT,
+  // Take the smallest free extent that holds the whole request
+  MTL_ALLOCATION_BEST_FIT,
+  // Take the nearest free extent behind the end of the file
+  MTL_ALLOCATION_GOAL,
+  // Set aside a window of MTL_RESERVATION_WINDOW_BLOCKS behind every
+  // allocation that only the same file allocates from afterwards
+  MTL_ALLOCATION_RESERVATION_WINDOWS
+} mtl_allocation_policy;
+
+#define MTL_RESERVATION_WINDOW_BLOCKS 64
+
+int mtl_set_allocation_policy(mtl_context *context,
+                              mtl_allocation_policy policy);
+
+// Bucket i of the histograms counts values in [2^i, 2^(i+1)), the last bucket
+// everything above
+#define MTL_FRAGMENTATION_BUCKETS 16
+
+typedef struct mtl_fragmentation_report {
+  // Only files that have at least one extent are taken into account
+  uint64_t files;
+  uint64_t file_extents;
+  uint64_t max_file_extents;
+  uint64_t files_by_extents[MTL_FRAGMENTATION_BUCKETS];
+
+  uint64_t free_extents;
+  uint64_t free_blocks;
+  uint64_t largest_free_extent;
+  uint64_t free_extents_by_length[MTL_FRAGMENTATION_BUCKETS];
+} mtl_fragmentation_report;
+
+int mtl_get_fragmentation_report(mtl_context *context,
+                                 mtl_fragmentation_report *report);
+
+// The online defragmenter moves the blocks of a file into a single range of
+// free blocks, so that extents that follow each other in the file are merged
+// and the file takes fewer extents to map. Holes are kept. The data is copied
+// through the storage backend before the extent list is swapped in one
+// transaction.
+typedef struct mtl_defragment_stats {
+  uint64_t passes;
+  uint64_t files_moved;
+  uint64_t files_skipped;  // busy, or no free range large enough
+  uint64_t bytes_moved;
+  uint64_t extents_removed;
+} mtl_defragment_stats;
+
+// Moves a single file. Fails with MTL_ERROR_BUSY if the file is open, shares
+// blocks with other files or has been reopened while it was copied, and with
+// MTL_ERROR_NOSPACE if there is no free range large enough for it. Writes
+// hold the file open until their data is written, so a write that overlaps
+// with the move makes it fail. Extents from mtl_map_range are only safe to
+// use while the file is held open as well.
+int mtl_defragment_file(mtl_context *context, uint64_t inode_id);
+
+// A pass of the defragmenter: moves the files that lose the most extents
+// this way, as long as they lose at least min_extents, until max_bytes bytes
+// (0 for no limit) have been moved. bytes_moved (which may be NULL) receives
+// the number of bytes moved in this pass.
+int mtl_defragment(mtl_context *context, uint64_t min_extents,
+                   uint64_t max_bytes, uint64_t *bytes_moved);
+// Counters since the filesystem was initialized
+int mtl_get_defragment_stats(mtl_context *context,
+                             mtl_defragment_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/uio.h>
 
 typedef struct mtl_storage_metadata {
   uint64_t num_blocks;
@@ -14,6 +15,18 @@ typedef struct mtl_file_extent {
 
 typedef struct mtl_context mtl_context;
 
+// A read or write of a range of a file, from or into a list of buffers
+typedef struct mtl_storage_request {
+  int write;
+  uint64_t inode_id;
+  uint64_t offset;  // The file offset in bytes
+  const struct iovec *iov;
+  int iovcnt;
+
+  int result;          // Set by the backend once the request is done
+  void *backend_data;  // For the backend to keep track of the request
+} mtl_storage_request;
+
 typedef struct mtl_storage_backend {
   int (*initialize)(void *storage_context);
   int (*deinitialize)(void *storage_context);
@@ -34,6 +47,28 @@ typedef struct mtl_storage_backend {
 
   void *context;
 
+  // Optional, asynchronous requests. submit starts a request and returns
+  // right away, complete waits until it is done and returns its result. A
+  // request must stay in place until it is completed, by the thread that
+  // submitted it. Without them, requests are carried out through read and
+  // write, one buffer after the other.
+  int (*submit)(mtl_context *context, void *storage_context,
+                mtl_storage_request *request);
+  int (*complete)(mtl_context *context, void *storage_context,
+                  mtl_storage_request *request);
+
 } mtl_storage_backend;
 
 extern mtl_storage_backend in_memory_storage;
+
+#define MTL_FILE_STORAGE_DEFAULT_QUEUE_DEPTH 32
+
+// Storage on a regular file or block device. A regular file is created (or
+// extended) to hold size bytes, size 0 takes the size of the existing file or
+// device. Extents are read and written with O_DIRECT through io_uring, with
+// up to queue_depth I/Os in flight per thread. Where O_DIRECT or io_uring
+// aren't available, this falls back to buffered I/O and pread/pwrite.
+int mtl_file_storage_create(mtl_storage_backend **backend, const char *path,
+                            uint64_t size, uint64_t block_size,
+                            uint32_t queue_depth);
+void mtl_file_storage_destroy(mtl_storage_backend *backend);
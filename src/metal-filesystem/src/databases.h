@@ -0,0 +1,30 @@
+#pragma once
+
+#include <lmdb.h>
+
+// The handles of the databases in a metadata store. mtl_initialize opens them
+// once and attaches them to the environment, so that the mtl_ensure_*_db_open
+// functions don't have to look them up for every transaction. Environments
+// without attached handles (e.g. in tests) still open them on demand.
+typedef struct mtl_databases {
+  MDB_dbi inodes;
+  MDB_dbi dirents;
+  MDB_dbi file_extents;
+  MDB_dbi extents;
+  MDB_dbi meta;
+  MDB_dbi packed_blocks;
+  MDB_dbi packed_files;
+} mtl_databases;
+
+// Returns NULL if no handles have been attached to the environment of txn
+static inline const mtl_databases *mtl_databases_of(MDB_txn *txn) {
+  return (const mtl_databases *)mdb_env_get_userctx(mdb_txn_env(txn));
+}
+
+int mtl_ensure_inodes_db_open(MDB_txn *txn, MDB_dbi *inodes_db);
+int mtl_ensure_dirents_db_open(MDB_txn *txn, MDB_dbi *dirents_db);
+int mtl_ensure_file_extents_db_open(MDB_txn *txn, MDB_dbi *file_extents_db);
+int mtl_ensure_extents_db_open(MDB_txn *txn, MDB_dbi *db);
+int mtl_ensure_meta_db_open(MDB_txn *txn, MDB_dbi *db);
+int mtl_ensure_packed_blocks_db_open(MDB_txn *txn, MDB_dbi *db);
+int mtl_ensure_packed_files_db_open(MDB_txn *txn, MDB_dbi *db);
@@ -0,0 +1,206 @@
+#include "dentry_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <metal-filesystem/metal.h>
+
+typedef struct mtl_dentry {
+  struct mtl_dentry *next;
+  uint64_t hash;
+  uint64_t inode_id;
+  size_t path_length;
+  char path[];
+} mtl_dentry;
+
+typedef struct mtl_dentry_cache {
+  pthread_mutex_t lock;
+  mtl_dentry **buckets;
+  uint64_t buckets_length;  // power of two
+  uint64_t entries;
+  uint64_t max_entries;
+  uint64_t epoch;
+  uint64_t hits;
+  uint64_t misses;
+} mtl_dentry_cache;
+
+static uint64_t mtl_dentry_hash(const char *path, size_t path_length) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < path_length; ++i) {
+    hash ^= (unsigned char)path[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+int mtl_dentry_cache_create(mtl_dentry_cache **cache, uint64_t max_entries) {
+  mtl_dentry_cache *c = calloc(1, sizeof(mtl_dentry_cache));
+  if (c == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  c->buckets_length = 1;
+  while (c->buckets_length < max_entries) c->buckets_length <<= 1;
+  c->buckets = calloc(c->buckets_length, sizeof(mtl_dentry *));
+  if (c->buckets == NULL) {
+    free(c);
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  c->max_entries = max_entries;
+  pthread_mutex_init(&c->lock, NULL);
+
+  *cache = c;
+  return MTL_SUCCESS;
+}
+
+static void mtl_dentry_cache_clear(mtl_dentry_cache *cache) {
+  for (uint64_t i = 0; i < cache->buckets_length; ++i) {
+    mtl_dentry *entry = cache->buckets[i];
+    while (entry) {
+      mtl_dentry *next = entry->next;
+      free(entry);
+      entry = next;
+    }
+    cache->buckets[i] = NULL;
+  }
+  cache->entries = 0;
+}
+
+void mtl_dentry_cache_destroy(mtl_dentry_cache *cache) {
+  mtl_dentry_cache_clear(cache);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache);
+}
+
+uint64_t mtl_dentry_cache_epoch(mtl_dentry_cache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  uint64_t epoch = cache->epoch;
+  pthread_mutex_unlock(&cache->lock);
+  return epoch;
+}
+
+static mtl_dentry **mtl_dentry_cache_find(mtl_dentry_cache *cache,
+                                          const char *path, size_t path_length,
+                                          uint64_t hash) {
+  mtl_dentry **entry = &cache->buckets[hash & (cache->buckets_length - 1)];
+  while (*entry) {
+    if ((*entry)->hash == hash && (*entry)->path_length == path_length &&
+        memcmp((*entry)->path, path, path_length) == 0) {
+      break;
+    }
+    entry = &(*entry)->next;
+  }
+  return entry;
+}
+
+bool mtl_dentry_cache_lookup(mtl_dentry_cache *cache, const char *path,
+                             size_t path_length, uint64_t *inode_id) {
+  uint64_t hash = mtl_dentry_hash(path, path_length);
+
+  pthread_mutex_lock(&cache->lock);
+  mtl_dentry *entry = *mtl_dentry_cache_find(cache, path, path_length, hash);
+  if (entry) *inode_id = entry->inode_id;
+  pthread_mutex_unlock(&cache->lock);
+
+  return entry != NULL;
+}
+
+void mtl_dentry_cache_insert(mtl_dentry_cache *cache, const char *path,
+                             size_t path_length, uint64_t inode_id,
+                             uint64_t epoch) {
+  uint64_t hash = mtl_dentry_hash(path, path_length);
+
+  pthread_mutex_lock(&cache->lock);
+
+  // Something was invalidated while the caller was resolving this path
+  if (epoch != cache->epoch) {
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  mtl_dentry **slot = mtl_dentry_cache_find(cache, path, path_length, hash);
+  if (*slot) {
+    (*slot)->inode_id = inode_id;
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+
+  if (cache->entries >= cache->max_entries) {
+    // No replacement policy: start over with an empty cache
+    mtl_dentry_cache_clear(cache);
+    slot = &cache->buckets[hash & (cache->buckets_length - 1)];
+  }
+
+  mtl_dentry *entry = malloc(sizeof(mtl_dentry) + path_length);
+  if (entry) {
+    entry->next = NULL;
+    entry->hash = hash;
+    entry->inode_id = inode_id;
+    entry->path_length = path_length;
+    memcpy(entry->path, path, path_length);
+    *slot = entry;
+    ++cache->entries;
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void mtl_dentry_cache_invalidate(mtl_dentry_cache *cache, const char *path,
+                                 bool recursive) {
+  size_t path_length = strlen(path);
+  uint64_t hash = mtl_dentry_hash(path, path_length);
+
+  pthread_mutex_lock(&cache->lock);
+
+  ++cache->epoch;
+
+  mtl_dentry **slot = mtl_dentry_cache_find(cache, path, path_length, hash);
+  if (*slot) {
+    mtl_dentry *entry = *slot;
+    *slot = entry->next;
+    free(entry);
+    --cache->entries;
+  }
+
+  if (recursive) {
+    for (uint64_t i = 0; i < cache->buckets_length; ++i) {
+      mtl_dentry **entry = &cache->buckets[i];
+      while (*entry) {
+        if ((*entry)->path_length > path_length &&
+            (*entry)->path[path_length] == '/' &&
+            memcmp((*entry)->path, path, path_length) == 0) {
+          mtl_dentry *removed = *entry;
+          *entry = removed->next;
+          free(removed);
+          --cache->entries;
+        } else {
+          entry = &(*entry)->next;
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void mtl_dentry_cache_count(mtl_dentry_cache *cache, bool hit) {
+  pthread_mutex_lock(&cache->lock);
+  if (hit)
+    ++cache->hits;
+  else
+    ++cache->misses;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void mtl_dentry_cache_get_stats(mtl_dentry_cache *cache, uint64_t *hits,
+                                uint64_t *misses, uint64_t *entries) {
+  pthread_mutex_lock(&cache->lock);
+  if (hits) *hits = cache->hits;
+  if (misses) *misses = cache->misses;
+  if (entries) *entries = cache->entries;
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maps absolute paths (and their prefixes) to inode ids. Only positive
+// lookups are cached, so creating new entries never invalidates anything.
+typedef struct mtl_dentry_cache mtl_dentry_cache;
+
+int mtl_dentry_cache_create(mtl_dentry_cache **cache, uint64_t max_entries);
+void mtl_dentry_cache_destroy(mtl_dentry_cache *cache);
+
+// Lookups that race with an invalidation must not re-populate the cache: take
+// the epoch before starting the read transaction and pass it to insert
+uint64_t mtl_dentry_cache_epoch(mtl_dentry_cache *cache);
+
+bool mtl_dentry_cache_lookup(mtl_dentry_cache *cache, const char *path,
+                             size_t path_length, uint64_t *inode_id);
+void mtl_dentry_cache_insert(mtl_dentry_cache *cache, const char *path,
+                             size_t path_length, uint64_t inode_id,
+                             uint64_t epoch);
+
+// Removes the entry for path. If recursive is set, all entries below path
+// are removed as well (required when a directory is renamed).
+void mtl_dentry_cache_invalidate(mtl_dentry_cache *cache, const char *path,
+                                 bool recursive);
+
+void mtl_dentry_cache_count(mtl_dentry_cache *cache, bool hit);
+void mtl_dentry_cache_get_stats(mtl_dentry_cache *cache, uint64_t *hits,
+                                uint64_t *misses, uint64_t *entries);
@@ -0,0 +1,174 @@
+#include <metal-filesystem/directory.h>
+
+#include <endian.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <metal-filesystem/metal.h>
+
+#include "databases.h"
+
+#define DIRENTS_DB_NAME "dirents"
+
+#define DIRENT_KEY_MAX_LENGTH (sizeof(uint64_t) + MTL_MAX_FILENAME_LENGTH)
+
+int mtl_ensure_dirents_db_open(MDB_txn *txn, MDB_dbi *dirents_db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *dirents_db = databases->dirents;
+    return MDB_SUCCESS;
+  }
+
+  return mdb_dbi_open(txn, DIRENTS_DB_NAME, MDB_CREATE, dirents_db);
+}
+
+static int mtl_make_dirent_key(uint64_t dir_inode_id, const char *filename,
+                               char *key_data, MDB_val *key) {
+  uint64_t filename_length = filename ? strlen(filename) : 0;
+  if (filename_length > MTL_MAX_FILENAME_LENGTH) {
+    return MTL_ERROR_NAMETOOLONG;
+  }
+
+  // Big-endian, so that LMDB's lexicographic key order groups the entries of
+  // a directory together
+  uint64_t dir_inode_id_be = htobe64(dir_inode_id);
+  memcpy(key_data, &dir_inode_id_be, sizeof(dir_inode_id_be));
+  if (filename_length)
+    memcpy(key_data + sizeof(dir_inode_id_be), filename, filename_length);
+
+  key->mv_size = sizeof(dir_inode_id_be) + filename_length;
+  key->mv_data = key_data;
+  return MTL_SUCCESS;
+}
+
+static int mtl_dirent_key_belongs_to(const MDB_val *key, uint64_t dir_inode_id) {
+  uint64_t dir_inode_id_be = htobe64(dir_inode_id);
+  return key->mv_size >= sizeof(dir_inode_id_be) &&
+         memcmp(key->mv_data, &dir_inode_id_be, sizeof(dir_inode_id_be)) == 0;
+}
+
+int mtl_put_directory_entry(MDB_txn *txn, uint64_t dir_inode_id,
+                            const char *filename, uint64_t inode_id) {
+  MDB_dbi dirents_db;
+  mtl_ensure_dirents_db_open(txn, &dirents_db);
+
+  char key_data[DIRENT_KEY_MAX_LENGTH];
+  MDB_val dirent_key;
+  int res = mtl_make_dirent_key(dir_inode_id, filename, key_data, &dirent_key);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  MDB_val dirent_value = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
+  res = mdb_put(txn, dirents_db, &dirent_key, &dirent_value, MDB_NOOVERWRITE);
+  if (res == MDB_KEYEXIST) {
+    return MTL_ERROR_EXISTS;
+  }
+  if (res == MDB_MAP_FULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  return res == MDB_SUCCESS ? MTL_SUCCESS : MTL_ERROR_INVALID_ARGUMENT;
+}
+
+int mtl_get_directory_entry(MDB_txn *txn, uint64_t dir_inode_id,
+                            const char *filename, uint64_t *inode_id) {
+  MDB_dbi dirents_db;
+  mtl_ensure_dirents_db_open(txn, &dirents_db);
+
+  char key_data[DIRENT_KEY_MAX_LENGTH];
+  MDB_val dirent_key;
+  int res = mtl_make_dirent_key(dir_inode_id, filename, key_data, &dirent_key);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  MDB_val dirent_value;
+  if (mdb_get(txn, dirents_db, &dirent_key, &dirent_value) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  if (inode_id) memcpy(inode_id, dirent_value.mv_data, sizeof(*inode_id));
+  return MTL_SUCCESS;
+}
+
+int mtl_delete_directory_entry(MDB_txn *txn, uint64_t dir_inode_id,
+                               const char *filename, uint64_t *inode_id) {
+  MDB_dbi dirents_db;
+  mtl_ensure_dirents_db_open(txn, &dirents_db);
+
+  char key_data[DIRENT_KEY_MAX_LENGTH];
+  MDB_val dirent_key;
+  int res = mtl_make_dirent_key(dir_inode_id, filename, key_data, &dirent_key);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  if (inode_id) {
+    MDB_val dirent_value;
+    if (mdb_get(txn, dirents_db, &dirent_key, &dirent_value) != MDB_SUCCESS) {
+      return MTL_ERROR_NOENTRY;
+    }
+    memcpy(inode_id, dirent_value.mv_data, sizeof(*inode_id));
+  }
+
+  if (mdb_del(txn, dirents_db, &dirent_key, NULL) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  return MTL_SUCCESS;
+}
+
+int mtl_list_directory_entries(MDB_txn *txn, uint64_t dir_inode_id,
+                               const char *after, mtl_directory_entry *entries,
+                               uint64_t max_entries,
+                               uint64_t *entries_length) {
+  MDB_dbi dirents_db;
+  mtl_ensure_dirents_db_open(txn, &dirents_db);
+
+  *entries_length = 0;
+
+  char key_data[DIRENT_KEY_MAX_LENGTH];
+  MDB_val dirent_key;
+  int res = mtl_make_dirent_key(dir_inode_id, after, key_data, &dirent_key);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+  uint64_t after_key_length = dirent_key.mv_size;
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, dirents_db, &cursor);
+
+  MDB_val dirent_value;
+  res = mdb_cursor_get(cursor, &dirent_key, &dirent_value, MDB_SET_RANGE);
+
+  // When resuming, skip the entry that was returned last
+  if (res == MDB_SUCCESS && after != NULL &&
+      dirent_key.mv_size == after_key_length &&
+      memcmp(dirent_key.mv_data, key_data, after_key_length) == 0) {
+    res = mdb_cursor_get(cursor, &dirent_key, &dirent_value, MDB_NEXT);
+  }
+
+  while (res == MDB_SUCCESS && *entries_length < max_entries) {
+    if (!mtl_dirent_key_belongs_to(&dirent_key, dir_inode_id)) {
+      break;
+    }
+
+    mtl_directory_entry *entry = &entries[*entries_length];
+    entry->name_len = dirent_key.mv_size - sizeof(uint64_t);
+    memcpy(entry->name, (char *)dirent_key.mv_data + sizeof(uint64_t),
+           entry->name_len);
+    entry->name[entry->name_len] = '\0';
+    memcpy(&entry->inode_id, dirent_value.mv_data, sizeof(entry->inode_id));
+    ++*entries_length;
+
+    res = mdb_cursor_get(cursor, &dirent_key, &dirent_value, MDB_NEXT);
+  }
+
+  bool complete = res != MDB_SUCCESS ||
+                  !mtl_dirent_key_belongs_to(&dirent_key, dir_inode_id);
+
+  mdb_cursor_close(cursor);
+
+  return complete ? MTL_COMPLETE : MTL_SUCCESS;
+}
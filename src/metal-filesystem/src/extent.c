@@ -5,11 +5,14 @@
 #include <stddef.h>
 #include <stdio.h>
 
-#include <metal-filesystem/heap.h>
+#include <metal-filesystem/free_space.h>
 #include <metal-filesystem/metal.h>
 
 #include <metal-filesystem/extent.h>
 
+#include "databases.h"
+#include "meta.h"
+
 #define EXTENTS_DB_NAME "extents"
 
 typedef enum mtl_extent_status {
@@ -21,10 +24,19 @@ typedef enum mtl_extent_status {
 typedef struct mtl_extent {
   uint64_t length;
   mtl_extent_status status;
-  mtl_heap_node_id pq_node;
+  // Number of further files that a committed extent belongs to. This used to
+  // be an (unused) heap node of the same size, which was always zero.
+  uint64_t shares;
+  uint64_t unused;
 } mtl_extent;
 
 int mtl_ensure_extents_db_open(MDB_txn *txn, MDB_dbi *db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *db = databases->extents;
+    return MDB_SUCCESS;
+  }
+
   return mdb_dbi_open(txn, EXTENTS_DB_NAME, MDB_CREATE, db);
 }
 
@@ -56,94 +68,304 @@ int mtl_put_extent(MDB_txn *txn, uint64_t offset, mtl_extent *extent) {
   return MTL_SUCCESS;
 }
 
-int mtl_initialize_extents(MDB_txn *txn, uint64_t blocks) {
+static int mtl_load_free_space(MDB_txn *txn, mtl_free_space *free_space) {
+  MDB_dbi extents_db;
+  mtl_ensure_extents_db_open(txn, &extents_db);
+
+  mtl_free_space_clear(free_space);
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, extents_db, &cursor);
+
+  MDB_val extent_key, extent_value;
+  int res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    const mtl_extent *extent = extent_value.mv_data;
+    if (extent->status == MTL_FREE) {
+      mtl_free_space_insert(free_space, *(uint64_t *)extent_key.mv_data,
+                            extent->length);
+    }
+
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+
+  mtl_free_space_set_valid(free_space);
+  return MTL_SUCCESS;
+}
+
+static void mtl_ensure_free_space_loaded(MDB_txn *txn,
+                                         mtl_free_space *free_space) {
+  if (!mtl_free_space_valid(free_space)) {
+    mtl_load_free_space(txn, free_space);
+  }
+}
+
+// Adjusts the space counters by the number of blocks that have been freed (or
+// allocated, if negative) and takes the largest free extent from the index
+static void mtl_update_space_counters(MDB_txn *txn,
+                                      mtl_free_space *free_space,
+                                      int64_t freed) {
+  mtl_space_counters counters = {.free_blocks = 0, .largest_free_extent = 0};
+  mtl_load_space_counters(txn, &counters);
+  counters.free_blocks += freed;
+  counters.largest_free_extent = 0;
+  mtl_free_space_find_largest(free_space, NULL,
+                              &counters.largest_free_extent);
+  mtl_store_space_counters(txn, &counters);
+}
+
+int mtl_initialize_extents(MDB_txn *txn, mtl_free_space *free_space,
+                           uint64_t blocks) {
   const mtl_extent *first_extent;
   if (mtl_load_extent(txn, 0, &first_extent) == MTL_ERROR_NOENTRY) {
-    mtl_extent all_extent = {.length = blocks, .status = MTL_FREE};
-    mtl_heap_insert(txn, blocks, 0, &all_extent.pq_node);
+    mtl_extent all_extent = {
+        .length = blocks, .status = MTL_FREE};
     mtl_put_extent(txn, 0, &all_extent);
   }
 
-  return MTL_SUCCESS;
+  int res = mtl_load_free_space(txn, free_space);
+
+  // There are no reservation windows yet, so the index has all free blocks.
+  // This also sets up the counters of stores that predate them.
+  mtl_space_counters counters = {.free_blocks = 0, .largest_free_extent = 0};
+  mtl_free_space_get_stats(free_space, NULL, &counters.free_blocks);
+  mtl_free_space_find_largest(free_space, NULL,
+                              &counters.largest_free_extent);
+  mtl_store_space_counters(txn, &counters);
+
+  return res;
 }
 
-uint64_t mtl_reserve_extent(MDB_txn *txn, uint64_t size,
-                            mtl_file_extent *last_extent, uint64_t *offset,
-                            bool commit) {
+// Takes up to size blocks from the front of the file's reservation window
+static uint64_t mtl_reserve_from_window(MDB_txn *txn,
+                                        mtl_free_space *free_space,
+                                        uint64_t inode_id, uint64_t size,
+                                        mtl_file_extent *last_extent,
+                                        uint64_t *offset, bool commit) {
+  uint64_t window_offset, window_length;
+  if (!mtl_free_space_find_window(free_space, inode_id, &window_offset,
+                                  &window_length)) {
+    return 0;
+  }
+
+  uint64_t length = size < window_length ? size : window_length;
+
+  // The window is stored as a free extent, which shrinks from the front
+  MDB_dbi extents_db;
+  mtl_ensure_extents_db_open(txn, &extents_db);
+  MDB_val window_key = {.mv_size = sizeof(window_offset),
+                        .mv_data = &window_offset};
+  mdb_del(txn, extents_db, &window_key, NULL);
+
+  if (window_length > length) {
+    mtl_extent remaining_window = {.length = window_length - length,
+                                   .status = MTL_FREE};
+    mtl_put_extent(txn, window_offset + length, &remaining_window);
+  }
+  mtl_free_space_set_window(free_space, inode_id, window_offset + length,
+                            window_length - length);
+
+  if (last_extent &&
+      last_extent->offset + last_extent->length == window_offset) {
+    // Extend the last extent of the file
+    const mtl_extent *extent;
+    int res = mtl_load_extent(txn, last_extent->offset, &extent);
+    assert(res == MTL_SUCCESS);
+
+    mtl_extent updated_extent = *extent;
+    updated_extent.length += length;
+    mtl_put_extent(txn, last_extent->offset, &updated_extent);
+
+    if (offset) *offset = last_extent->offset;
+  } else {
+    mtl_extent new_extent = {.length = length,
+                             .status = commit ? MTL_COMMITTED : MTL_RESERVED};
+    mtl_put_extent(txn, window_offset, &new_extent);
+
+    if (offset) *offset = window_offset;
+  }
+
+  return length;
+}
+
+int mtl_release_reservation_window(MDB_txn *txn, mtl_free_space *free_space,
+                                   uint64_t inode_id) {
+  mtl_ensure_free_space_loaded(txn, free_space);
+
+  uint64_t window_offset;
+  if (!mtl_free_space_find_window(free_space, inode_id, &window_offset,
+                                  NULL)) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  mtl_free_space_set_window(free_space, inode_id, 0, 0);
+
+  // Merges the window with the free extents around it
+  return mtl_free_extent(txn, free_space, window_offset);
+}
+
+static void mtl_release_oldest_reservation_window(MDB_txn *txn,
+                                                  mtl_free_space *free_space) {
+  uint64_t inode_id;
+  if (mtl_free_space_oldest_window(free_space, &inode_id))
+    mtl_release_reservation_window(txn, free_space, inode_id);
+}
+
+static bool mtl_choose_free_extent(mtl_free_space *free_space, uint64_t size,
+                                   uint64_t goal, uint64_t *offset) {
+  switch (mtl_free_space_policy(free_space)) {
+    case MTL_ALLOCATION_BEST_FIT:
+      if (mtl_free_space_find_best_fit(free_space, size, offset, NULL))
+        return true;
+      break;
+    case MTL_ALLOCATION_RESERVATION_WINDOWS:
+      // Leave room for a window if possible
+      if (mtl_free_space_find_best_fit(
+              free_space, size + MTL_RESERVATION_WINDOW_BLOCKS, offset, NULL) ||
+          mtl_free_space_find_best_fit(free_space, size, offset, NULL))
+        return true;
+      break;
+    case MTL_ALLOCATION_GOAL:
+      // Wrap around at the end of the storage
+      if (mtl_free_space_find_after(free_space, goal, offset, NULL) ||
+          mtl_free_space_find_after(free_space, 0, offset, NULL))
+        return true;
+      break;
+    default:
+      break;
+  }
+
+  // Nothing fits, so take as much as possible
+  return mtl_free_space_find_largest(free_space, offset, NULL);
+}
+
+static uint64_t mtl_allocate_extent(MDB_txn *txn, mtl_free_space *free_space,
+                                    uint64_t inode_id, uint64_t size,
+                                    mtl_file_extent *last_extent,
+                                    uint64_t *offset, bool commit) {
   MDB_dbi extents_db;
   mtl_ensure_extents_db_open(txn, &extents_db);
+  mtl_ensure_free_space_loaded(txn, free_space);
+
+  // Reserved and committed blocks are kept in separate extents, and shared
+  // extents don't grow
+  mtl_file_extent *extendable_extent = NULL;
+  if (last_extent) {
+    const mtl_extent *extent;
+    if (mtl_load_extent(txn, last_extent->offset, &extent) == MTL_SUCCESS &&
+        extent->status == (commit ? MTL_COMMITTED : MTL_RESERVED) &&
+        extent->shares == 0)
+      extendable_extent = last_extent;
+  }
+
+  bool use_windows = mtl_free_space_policy(free_space) ==
+                     MTL_ALLOCATION_RESERVATION_WINDOWS;
+  if (use_windows) {
+    uint64_t reserved = mtl_reserve_from_window(
+        txn, free_space, inode_id, size, extendable_extent, offset, commit);
+    if (reserved) return reserved;
+
+    // Make room for the window that we might create
+    if (mtl_free_space_windows_full(free_space))
+      mtl_release_oldest_reservation_window(txn, free_space);
+  }
 
   int res;
 
   uint64_t extent_offset;
-  const mtl_extent *extent = NULL;
+  mtl_extent updated_extent;
+  bool found_extent = false;
   uint64_t original_extent_length = 0;
-  uint64_t append_extent_length = 0;
+  uint64_t extent_length = 0;
 
   // If the last allocated extent is provided, check if we can extend it
-  if (last_extent) {
-    const mtl_extent *next_extent;
+  if (extendable_extent) {
     uint64_t next_extent_offset = last_extent->offset + last_extent->length;
-    res = mtl_load_extent(txn, next_extent_offset, &next_extent);
-
-    if (res == MTL_SUCCESS) {  // If the last extent ends at the very end, we
-                               // can't extend it
-      uint64_t next_extent_length = next_extent->length;
-
-      if (next_extent->status == MTL_FREE) {
-        // Delete the next_extent and add its length to last_extent
-        res = mtl_heap_delete(txn, next_extent->pq_node);
-        assert(res == MTL_SUCCESS);
-
-        MDB_val next_extent_key = {.mv_size = sizeof(next_extent_offset),
-                                   .mv_data = &next_extent_offset};
-        res = mdb_del(txn, extents_db, &next_extent_key, NULL);
-        assert(res == MDB_SUCCESS);
-
-        // Load last_extent
-        extent_offset = last_extent->offset;
-        res = mtl_load_extent(txn, extent_offset, &extent);
-        assert(res == MTL_SUCCESS);
-
-        append_extent_length = next_extent_length;
-        original_extent_length = extent->length;
-      }
+    uint64_t next_extent_length;
+
+    if (mtl_free_space_find(free_space, next_extent_offset,
+                            &next_extent_length)) {
+      // Delete the next_extent and add its length to last_extent
+      mtl_free_space_remove(free_space, next_extent_offset);
+
+      MDB_val next_extent_key = {.mv_size = sizeof(next_extent_offset),
+                                 .mv_data = &next_extent_offset};
+      res = mdb_del(txn, extents_db, &next_extent_key, NULL);
+      assert(res == MDB_SUCCESS);
+
+      // Load last_extent
+      extent_offset = last_extent->offset;
+      const mtl_extent *extent;
+      res = mtl_load_extent(txn, extent_offset, &extent);
+      assert(res == MTL_SUCCESS);
+
+      updated_extent = *extent;
+      original_extent_length = extent->length;
+      extent_length = extent->length + next_extent_length;
+      found_extent = true;
     }
   }
 
-  if (extent == NULL) {
-    // Pop from heap
-    if (mtl_heap_extract_max(txn, &extent_offset) == MTL_ERROR_NOENTRY) {
-      return 0;
+  if (!found_extent) {
+    uint64_t goal = last_extent ? last_extent->offset + last_extent->length : 0;
+    if (!mtl_choose_free_extent(free_space, size, goal, &extent_offset)) {
+      // Release the reservation windows of other files before giving up
+      uint64_t window_inode_id;
+      while (mtl_free_space_oldest_window(free_space, &window_inode_id))
+        mtl_release_reservation_window(txn, free_space, window_inode_id);
+
+      if (!mtl_choose_free_extent(free_space, size, goal, &extent_offset))
+        return 0;
     }
+    mtl_free_space_remove(free_space, extent_offset);
 
     // Load extent
+    const mtl_extent *extent;
     res = mtl_load_extent(txn, extent_offset, &extent);
     assert(res == MTL_SUCCESS);
-  }
 
-  mtl_extent updated_extent = *extent;
-  uint64_t extent_length = extent->length + append_extent_length;
+    updated_extent = *extent;
+    extent_length = extent->length;
+  }
 
   // Split up if necessary
   uint64_t total_needed_size = original_extent_length + size;
   if (extent_length > total_needed_size) {
     uint64_t remaining_extent_offset = extent_offset + total_needed_size;
     uint64_t remaining_extent_length = extent_length - total_needed_size;
-    mtl_extent remaining_extent = {.length = remaining_extent_length,
-                                   .status = MTL_FREE};
 
-    // Insert remaining extent into heap
-    mtl_heap_insert(txn, remaining_extent_length, remaining_extent_offset,
-                    &remaining_extent.pq_node);
+    if (use_windows) {
+      // Set aside the blocks behind the allocation for the same file
+      uint64_t window_length =
+          remaining_extent_length < MTL_RESERVATION_WINDOW_BLOCKS
+              ? remaining_extent_length
+              : MTL_RESERVATION_WINDOW_BLOCKS;
+      mtl_extent window = {.length = window_length,
+                           .status = MTL_FREE};
+      mtl_put_extent(txn, remaining_extent_offset, &window);
+      mtl_free_space_set_window(free_space, inode_id, remaining_extent_offset,
+                                window_length);
+
+      remaining_extent_offset += window_length;
+      remaining_extent_length -= window_length;
+    }
+
+    if (remaining_extent_length) {
+      mtl_extent remaining_extent = {.length = remaining_extent_length,
+                                     .status = MTL_FREE};
 
-    mtl_put_extent(txn, remaining_extent_offset, &remaining_extent);
+      mtl_free_space_insert(free_space, remaining_extent_offset,
+                            remaining_extent_length);
+      mtl_put_extent(txn, remaining_extent_offset, &remaining_extent);
+    }
 
     // Update length of existing extent
-    updated_extent.length = total_needed_size;
     extent_length = total_needed_size;
   }
 
+  updated_extent.length = extent_length;
   updated_extent.status = commit ? MTL_COMMITTED : MTL_RESERVED;
   mtl_put_extent(txn, extent_offset, &updated_extent);
 
@@ -154,14 +376,81 @@ uint64_t mtl_reserve_extent(MDB_txn *txn, uint64_t size,
   return extent_length - original_extent_length;
 }
 
-int mtl_truncate_extent(MDB_txn *txn, uint64_t offset, uint64_t len) {
+uint64_t mtl_reserve_extent(MDB_txn *txn, mtl_free_space *free_space,
+                            uint64_t inode_id, uint64_t size,
+                            mtl_file_extent *last_extent, uint64_t *offset,
+                            bool commit) {
+  uint64_t reserved = mtl_allocate_extent(txn, free_space, inode_id, size,
+                                          last_extent, offset, commit);
+  if (reserved) mtl_update_space_counters(txn, free_space, -(int64_t)reserved);
+  return reserved;
+}
+
+int mtl_commit_extent(MDB_txn *txn, uint64_t offset) {
+  const mtl_extent *extent = NULL;
+  if (mtl_load_extent(txn, offset, &extent) != MTL_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  if (extent->status == MTL_COMMITTED) {
+    return MTL_SUCCESS;
+  }
+
+  mtl_extent updated_extent = *extent;
+  updated_extent.status = MTL_COMMITTED;
+  return mtl_put_extent(txn, offset, &updated_extent);
+}
+
+int mtl_share_extent(MDB_txn *txn, uint64_t offset) {
+  const mtl_extent *extent = NULL;
+  if (mtl_load_extent(txn, offset, &extent) != MTL_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  if (extent->status != MTL_COMMITTED) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  mtl_extent updated_extent = *extent;
+  ++updated_extent.shares;
+  return mtl_put_extent(txn, offset, &updated_extent);
+}
+
+bool mtl_extent_is_shared(MDB_txn *txn, uint64_t offset) {
+  const mtl_extent *extent = NULL;
+  return mtl_load_extent(txn, offset, &extent) == MTL_SUCCESS &&
+         extent->shares > 0;
+}
+
+int mtl_split_extent(MDB_txn *txn, uint64_t offset, uint64_t len) {
+  const mtl_extent *extent = NULL;
+  if (mtl_load_extent(txn, offset, &extent) != MTL_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  if (extent->shares > 0 || len == 0 || len >= extent->length) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  mtl_extent second = *extent;
+  second.length -= len;
+
+  mtl_extent first = *extent;
+  first.length = len;
+  mtl_put_extent(txn, offset, &first);
+  return mtl_put_extent(txn, offset + len, &second);
+}
+
+int mtl_truncate_extent(MDB_txn *txn, mtl_free_space *free_space,
+                        uint64_t offset, uint64_t len) {
   if (len == 0) {
-    return mtl_free_extent(txn, offset);
+    return mtl_free_extent(txn, free_space, offset);
   }
 
   // Find extent by offset
   const mtl_extent *extent = NULL;
   mtl_load_extent(txn, offset, &extent);
+  uint64_t extent_length = extent->length;
 
   {
     // Update the existing extent
@@ -171,101 +460,118 @@ int mtl_truncate_extent(MDB_txn *txn, uint64_t offset, uint64_t len) {
     mtl_put_extent(txn, offset, &updated_extent);
   }
 
-  if (extent->length > len) {
+  if (extent_length > len) {
     // Temporarily add an extent for the remaining space
-    mtl_extent extent_to_be_freed = {.length = extent->length - len,
-                                     .status = MTL_RESERVED,
-                                     .pq_node = INVALID_NODE};
+    mtl_extent extent_to_be_freed = {.length = extent_length - len,
+                                     .status = MTL_RESERVED};
     mtl_put_extent(txn, offset + len, &extent_to_be_freed);
 
     // Delete it afterwards
-    return mtl_free_extent(txn, offset + len);
+    return mtl_free_extent(txn, free_space, offset + len);
   }
 
   return MTL_SUCCESS;
 }
 
-int mtl_free_extent(MDB_txn *txn, uint64_t offset) {
+int mtl_free_extent(MDB_txn *txn, mtl_free_space *free_space,
+                    uint64_t offset) {
   MDB_dbi extents_db;
   mtl_ensure_extents_db_open(txn, &extents_db);
-
-  int res;
+  mtl_ensure_free_space_loaded(txn, free_space);
 
   // Find extent by offset
   const mtl_extent *extent = NULL;
-  mtl_load_extent(txn, offset, &extent);
+  if (mtl_load_extent(txn, offset, &extent) != MTL_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  if (extent->shares > 0) {
+    // Other files still use the blocks
+    mtl_extent updated_extent = *extent;
+    --updated_extent.shares;
+    return mtl_put_extent(txn, offset, &updated_extent);
+  }
+
   uint64_t extent_offset = offset;
   uint64_t extent_size = extent->length;
-  mtl_heap_node_id pq_node = INVALID_NODE;
+  // Reservation windows are free already and only merged here
+  uint64_t freed = extent->status == MTL_FREE ? 0 : extent->length;
 
-  MDB_cursor *cursor;
-  mdb_cursor_open(txn, extents_db, &cursor);
+  // Check if the following extent is also free
+  uint64_t next_extent_offset = offset + extent_size;
+  uint64_t next_extent_length;
+  if (mtl_free_space_find(free_space, next_extent_offset,
+                          &next_extent_length)) {
+    extent_size += next_extent_length;
+    mtl_free_space_remove(free_space, next_extent_offset);
+
+    MDB_val next_extent_key = {.mv_size = sizeof(next_extent_offset),
+                               .mv_data = &next_extent_offset};
+    mdb_del(txn, extents_db, &next_extent_key, NULL);
+  }
 
-  MDB_val extent_key = {.mv_size = sizeof(offset), .mv_data = &offset};
+  // Check if we can merge with the previous extent
+  uint64_t previous_extent_offset, previous_extent_length;
+  if (mtl_free_space_find_before(free_space, offset, &previous_extent_offset,
+                                 &previous_extent_length) &&
+      previous_extent_offset + previous_extent_length == offset) {
+    extent_offset = previous_extent_offset;
+    extent_size += previous_extent_length;
+    mtl_free_space_remove(free_space, previous_extent_offset);
+
+    // Remove this extent
+    MDB_val extent_key = {.mv_size = sizeof(offset), .mv_data = &offset};
+    mdb_del(txn, extents_db, &extent_key, NULL);
+  }
 
-  // Check if the following extent is also free
-  {
-    MDB_val next_extent_key;
-    MDB_val next_extent_value;
-    mdb_cursor_get(cursor, &extent_key, &next_extent_value, MDB_SET);
-    res =
-        mdb_cursor_get(cursor, &next_extent_key, &next_extent_value, MDB_NEXT);
+  // Create new extent
+  mtl_free_space_insert(free_space, extent_offset, extent_size);
 
-    mtl_extent *next_extent =
-        res == MDB_NOTFOUND ? NULL : next_extent_value.mv_data;
+  mtl_extent updated_extent = {
+      .status = MTL_FREE, .length = extent_size};
+  mtl_put_extent(txn, extent_offset, &updated_extent);
 
-    if (next_extent && next_extent->status == MTL_FREE) {
-      extent_size += next_extent->length;
-      // Remove from heap
-      mtl_heap_delete(txn, next_extent->pq_node);
+  mtl_update_space_counters(txn, free_space, freed);
+  return MTL_SUCCESS;
+}
 
-      // Remove from extents
-      mdb_cursor_del(cursor, 0);
-    }
+int mtl_fragmentation_bucket(uint64_t value) {
+  int bucket = 0;
+  while (value > 1 && bucket < MTL_FRAGMENTATION_BUCKETS - 1) {
+    value >>= 1;
+    ++bucket;
   }
+  return bucket;
+}
 
-  // Check if we can merge with the previous extent
-  {
-    MDB_val previous_extent_key;
-    MDB_val previous_extent_value;
-    mdb_cursor_get(cursor, &extent_key, &previous_extent_value, MDB_SET);
-    res = mdb_cursor_get(cursor, &previous_extent_key, &previous_extent_value,
-                         MDB_NEXT);
-
-    uint64_t previous_extent_offset =
-        res == MDB_NOTFOUND ? 0 : *(uint64_t *)previous_extent_key.mv_data;
-    mtl_extent *previous_extent =
-        res == MDB_NOTFOUND ? NULL : previous_extent_value.mv_data;
-
-    if (previous_extent && previous_extent->status == MTL_FREE) {
-      extent_offset = previous_extent_offset;
-      extent_size += previous_extent->length;
-      pq_node = previous_extent->pq_node;
-
-      // Remove this extent
-      mdb_del(txn, extents_db, &extent_key, NULL);
-    }
+int mtl_add_free_extent_stats(MDB_txn *txn,
+                              mtl_fragmentation_report *report) {
+  MDB_dbi extents_db;
+  if (mtl_ensure_extents_db_open(txn, &extents_db) != MDB_SUCCESS) {
+    return MTL_SUCCESS;
   }
 
-  mdb_cursor_close(cursor);
-
-  // Insert resulting extent into heap
-  if (memcmp(&pq_node, &INVALID_NODE, sizeof(mtl_heap_node_id)) != 0) {
-    mtl_heap_increase_key(txn, pq_node, extent_size, &pq_node);
-  } else {
-    mtl_heap_insert(txn, extent_size, extent_offset, &pq_node);
-  }
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, extents_db, &cursor);
 
-  // Create new extent
-  mtl_extent updated_extent = {
-      .status = MTL_FREE, .length = extent_size, .pq_node = pq_node};
+  // Reservation windows are counted as separate free extents
+  MDB_val extent_key, extent_value;
+  int res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    const mtl_extent *extent = extent_value.mv_data;
+    if (extent->status == MTL_FREE) {
+      ++report->free_extents;
+      report->free_blocks += extent->length;
+      if (extent->length > report->largest_free_extent)
+        report->largest_free_extent = extent->length;
+      ++report->free_extents_by_length[mtl_fragmentation_bucket(
+          extent->length)];
+    }
 
-  MDB_val updated_extent_key = {.mv_size = sizeof(extent_offset),
-                                .mv_data = &extent_offset};
-  MDB_val updated_extent_value = {.mv_size = sizeof(updated_extent),
-                                  .mv_data = &updated_extent};
-  mdb_put(txn, extents_db, &updated_extent_key, &updated_extent_value, 0);
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_NEXT);
+  }
 
+  mdb_cursor_close(cursor);
   return MTL_SUCCESS;
 }
 
@@ -0,0 +1,329 @@
+#include <metal-filesystem/file_extent.h>
+
+#include <endian.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <metal-filesystem/extent.h>
+#include <metal-filesystem/inode.h>
+#include <metal-filesystem/metal.h>
+
+#include "databases.h"
+
+#define FILE_EXTENTS_DB_NAME "file_extents"
+
+typedef struct mtl_file_extent_key {
+  uint64_t inode_id_be;
+  uint64_t first_block_be;
+} mtl_file_extent_key;
+
+int mtl_ensure_file_extents_db_open(MDB_txn *txn, MDB_dbi *file_extents_db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *file_extents_db = databases->file_extents;
+    return MDB_SUCCESS;
+  }
+
+  return mdb_dbi_open(txn, FILE_EXTENTS_DB_NAME, MDB_CREATE, file_extents_db);
+}
+
+static void mtl_make_file_extent_key(uint64_t inode_id, uint64_t first_block,
+                                     mtl_file_extent_key *key_data,
+                                     MDB_val *key) {
+  // Big-endian, so that LMDB's lexicographic key order matches the logical
+  // order of the extents
+  key_data->inode_id_be = htobe64(inode_id);
+  key_data->first_block_be = htobe64(first_block);
+  key->mv_size = sizeof(*key_data);
+  key->mv_data = key_data;
+}
+
+static bool mtl_file_extent_key_belongs_to(const MDB_val *key,
+                                           uint64_t inode_id,
+                                           uint64_t *first_block) {
+  mtl_file_extent_key key_data;
+  if (key->mv_size != sizeof(key_data)) return false;
+
+  memcpy(&key_data, key->mv_data, sizeof(key_data));
+  if (be64toh(key_data.inode_id_be) != inode_id) return false;
+
+  if (first_block) *first_block = be64toh(key_data.first_block_be);
+  return true;
+}
+
+int mtl_put_file_extent(MDB_txn *txn, uint64_t inode_id, uint64_t first_block,
+                        const mtl_file_extent *extent) {
+  MDB_dbi file_extents_db;
+  mtl_ensure_file_extents_db_open(txn, &file_extents_db);
+
+  mtl_file_extent_key key_data;
+  MDB_val extent_key;
+  mtl_make_file_extent_key(inode_id, first_block, &key_data, &extent_key);
+
+  MDB_val extent_value = {.mv_size = sizeof(*extent),
+                          .mv_data = (void *)extent};
+  if (mdb_put(txn, file_extents_db, &extent_key, &extent_value, 0) !=
+      MDB_SUCCESS) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  return mtl_bump_inode_generation(txn, inode_id);
+}
+
+// Positions the cursor at the extent containing block (or the next one)
+static int mtl_seek_file_extent(MDB_cursor *cursor, uint64_t inode_id,
+                                uint64_t block, MDB_val *extent_key,
+                                MDB_val *extent_value) {
+  mtl_file_extent_key key_data;
+  mtl_make_file_extent_key(inode_id, block, &key_data, extent_key);
+
+  int res = mdb_cursor_get(cursor, extent_key, extent_value, MDB_SET_RANGE);
+
+  uint64_t first_block;
+  if (res == MDB_SUCCESS &&
+      mtl_file_extent_key_belongs_to(extent_key, inode_id, &first_block) &&
+      first_block == block) {
+    return MDB_SUCCESS;
+  }
+
+  // The previous extent might span block
+  MDB_val previous_key, previous_value;
+  int previous_res =
+      mdb_cursor_get(cursor, &previous_key, &previous_value,
+                     res == MDB_SUCCESS ? MDB_PREV : MDB_LAST);
+  if (previous_res == MDB_SUCCESS &&
+      mtl_file_extent_key_belongs_to(&previous_key, inode_id, &first_block)) {
+    mtl_file_extent previous_extent;
+    memcpy(&previous_extent, previous_value.mv_data, sizeof(previous_extent));
+    if (first_block + previous_extent.length > block) {
+      *extent_key = previous_key;
+      *extent_value = previous_value;
+      return MDB_SUCCESS;
+    }
+  }
+
+  // Go back to where we were
+  if (previous_res == MDB_SUCCESS && res == MDB_SUCCESS) {
+    return mdb_cursor_get(cursor, extent_key, extent_value, MDB_NEXT);
+  }
+
+  return res;
+}
+
+int mtl_load_file_extents(MDB_txn *txn, uint64_t inode_id,
+                          uint64_t first_block, mtl_file_extent *extents,
+                          uint64_t *first_blocks, uint64_t max_extents,
+                          uint64_t *extents_length) {
+  *extents_length = 0;
+
+  // The database doesn't exist until the first extent has been added
+  MDB_dbi file_extents_db;
+  if (mtl_ensure_file_extents_db_open(txn, &file_extents_db) != MDB_SUCCESS) {
+    return MTL_SUCCESS;
+  }
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, file_extents_db, &cursor);
+
+  MDB_val extent_key, extent_value;
+  int res = mtl_seek_file_extent(cursor, inode_id, first_block, &extent_key,
+                                 &extent_value);
+
+  uint64_t extent_first_block;
+  while (res == MDB_SUCCESS && *extents_length < max_extents &&
+         mtl_file_extent_key_belongs_to(&extent_key, inode_id,
+                                        &extent_first_block)) {
+    memcpy(&extents[*extents_length], extent_value.mv_data,
+           sizeof(mtl_file_extent));
+    if (first_blocks) first_blocks[*extents_length] = extent_first_block;
+    ++*extents_length;
+
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+  return MTL_SUCCESS;
+}
+
+int mtl_load_last_file_extent(MDB_txn *txn, uint64_t inode_id,
+                              mtl_file_extent *extent, uint64_t *first_block) {
+  MDB_dbi file_extents_db;
+  if (mtl_ensure_file_extents_db_open(txn, &file_extents_db) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, file_extents_db, &cursor);
+
+  // Seek behind the last possible extent of the file and step back
+  MDB_val extent_key, extent_value;
+  mtl_file_extent_key key_data;
+  mtl_make_file_extent_key(inode_id, UINT64_MAX, &key_data, &extent_key);
+
+  int res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_SET_RANGE);
+  if (res == MDB_SUCCESS &&
+      !mtl_file_extent_key_belongs_to(&extent_key, inode_id, NULL)) {
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_PREV);
+  } else if (res == MDB_NOTFOUND) {
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_LAST);
+  }
+
+  if (res != MDB_SUCCESS ||
+      !mtl_file_extent_key_belongs_to(&extent_key, inode_id, first_block)) {
+    mdb_cursor_close(cursor);
+    return MTL_ERROR_NOENTRY;
+  }
+
+  memcpy(extent, extent_value.mv_data, sizeof(*extent));
+
+  mdb_cursor_close(cursor);
+  return MTL_SUCCESS;
+}
+
+int mtl_delete_file_extents(MDB_txn *txn, uint64_t inode_id,
+                            uint64_t first_block) {
+  MDB_dbi file_extents_db;
+  mtl_ensure_file_extents_db_open(txn, &file_extents_db);
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, file_extents_db, &cursor);
+
+  MDB_val extent_key, extent_value;
+  int res = mtl_seek_file_extent(cursor, inode_id, first_block, &extent_key,
+                                 &extent_value);
+
+  uint64_t extent_first_block;
+  bool changed = false;
+  while (res == MDB_SUCCESS &&
+         mtl_file_extent_key_belongs_to(&extent_key, inode_id,
+                                        &extent_first_block)) {
+    if (extent_first_block < first_block) {
+      // Keep the part before first_block
+      mtl_file_extent extent;
+      memcpy(&extent, extent_value.mv_data, sizeof(extent));
+      extent.length = first_block - extent_first_block;
+
+      MDB_val updated_value = {.mv_size = sizeof(extent), .mv_data = &extent};
+      mdb_cursor_put(cursor, &extent_key, &updated_value, MDB_CURRENT);
+    } else {
+      mdb_cursor_del(cursor, 0);
+    }
+    changed = true;
+
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+  return changed ? mtl_bump_inode_generation(txn, inode_id) : MTL_SUCCESS;
+}
+
+static void mtl_add_file_to_stats(mtl_fragmentation_report *report,
+                                  uint64_t extents) {
+  ++report->files;
+  report->file_extents += extents;
+  if (extents > report->max_file_extents) report->max_file_extents = extents;
+  ++report->files_by_extents[mtl_fragmentation_bucket(extents)];
+}
+
+int mtl_add_file_extent_stats(MDB_txn *txn, mtl_fragmentation_report *report) {
+  MDB_dbi file_extents_db;
+  if (mtl_ensure_file_extents_db_open(txn, &file_extents_db) != MDB_SUCCESS) {
+    return MTL_SUCCESS;
+  }
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, file_extents_db, &cursor);
+
+  // The extents of a file are adjacent
+  uint64_t inode_id = 0, extents = 0;
+  MDB_val extent_key, extent_value;
+  int res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    mtl_file_extent_key key_data;
+    memcpy(&key_data, extent_key.mv_data, sizeof(key_data));
+
+    if (extents && be64toh(key_data.inode_id_be) != inode_id) {
+      mtl_add_file_to_stats(report, extents);
+      extents = 0;
+    }
+
+    inode_id = be64toh(key_data.inode_id_be);
+    ++extents;
+
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_NEXT);
+  }
+
+  if (extents) mtl_add_file_to_stats(report, extents);
+
+  mdb_cursor_close(cursor);
+  return MTL_SUCCESS;
+}
+
+// Keeps the files with the most mergeable extents, in descending order
+static void mtl_add_fragmented_file(uint64_t inode_id, uint64_t extents,
+                                    uint64_t *inode_ids, uint64_t *mergeable,
+                                    uint64_t max_files,
+                                    uint64_t *files_length) {
+  uint64_t i = *files_length;
+  if (i == max_files) {
+    if (max_files == 0 || mergeable[i - 1] >= extents) return;
+    --i;
+  } else {
+    ++*files_length;
+  }
+
+  for (; i > 0 && mergeable[i - 1] < extents; --i) {
+    inode_ids[i] = inode_ids[i - 1];
+    mergeable[i] = mergeable[i - 1];
+  }
+  inode_ids[i] = inode_id;
+  mergeable[i] = extents;
+}
+
+int mtl_find_fragmented_files(MDB_txn *txn, uint64_t min_extents,
+                              uint64_t *inode_ids, uint64_t *mergeable,
+                              uint64_t max_files, uint64_t *files_length) {
+  *files_length = 0;
+
+  MDB_dbi file_extents_db;
+  if (mtl_ensure_file_extents_db_open(txn, &file_extents_db) != MDB_SUCCESS) {
+    return MTL_SUCCESS;
+  }
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, file_extents_db, &cursor);
+
+  uint64_t inode_id = 0, extents = 0, end_block = 0;
+  bool any = false;
+  MDB_val extent_key, extent_value;
+  int res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    mtl_file_extent_key key_data;
+    memcpy(&key_data, extent_key.mv_data, sizeof(key_data));
+    mtl_file_extent extent;
+    memcpy(&extent, extent_value.mv_data, sizeof(extent));
+
+    uint64_t first_block = be64toh(key_data.first_block_be);
+    if (!any || be64toh(key_data.inode_id_be) != inode_id) {
+      if (any && extents && extents >= min_extents)
+        mtl_add_fragmented_file(inode_id, extents, inode_ids, mergeable,
+                                max_files, files_length);
+      inode_id = be64toh(key_data.inode_id_be);
+      extents = 0;
+      any = true;
+    } else if (first_block == end_block) {
+      // Holes stay, so only extents without one before them go away
+      ++extents;
+    }
+    end_block = first_block + extent.length;
+
+    res = mdb_cursor_get(cursor, &extent_key, &extent_value, MDB_NEXT);
+  }
+
+  if (any && extents && extents >= min_extents)
+    mtl_add_fragmented_file(inode_id, extents, inode_ids, mergeable,
+                            max_files, files_length);
+
+  mdb_cursor_close(cursor);
+  return MTL_SUCCESS;
+}
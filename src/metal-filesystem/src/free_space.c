@@ -0,0 +1,351 @@
+#include <metal-filesystem/free_space.h>
+
+#include <stdlib.h>
+
+#include <metal-filesystem/metal.h>
+
+// Every free extent is a node in two treaps: one ordered by offset and one
+// ordered by (length, offset)
+#define BY_OFFSET 0
+#define BY_LENGTH 1
+
+typedef struct mtl_free_space_node {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t priority;
+  struct mtl_free_space_node *children[2][2];  // [tree][left/right]
+} mtl_free_space_node;
+
+typedef struct mtl_free_space_window {
+  uint64_t inode_id;
+  uint64_t offset;
+  uint64_t length;  // 0 if the slot is unused
+  uint64_t last_used;
+} mtl_free_space_window;
+
+typedef struct mtl_free_space {
+  mtl_free_space_node *roots[2];
+  uint64_t extents;
+  uint64_t blocks;
+  uint32_t random_state;
+  bool valid;
+
+  mtl_allocation_policy policy;
+  mtl_free_space_window windows[MTL_FREE_SPACE_WINDOWS];
+  uint64_t window_clock;
+} mtl_free_space;
+
+static uint32_t mtl_free_space_random(mtl_free_space *free_space) {
+  // xorshift32
+  uint32_t x = free_space->random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  free_space->random_state = x;
+  return x;
+}
+
+static int mtl_free_space_compare(int tree, const mtl_free_space_node *a,
+                                  const mtl_free_space_node *b) {
+  if (tree == BY_LENGTH && a->length != b->length)
+    return a->length < b->length ? -1 : 1;
+  if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+  return 0;
+}
+
+static mtl_free_space_node *mtl_free_space_rotate(mtl_free_space_node *root,
+                                                  int tree, int dir) {
+  mtl_free_space_node *pivot = root->children[tree][dir];
+  root->children[tree][dir] = pivot->children[tree][!dir];
+  pivot->children[tree][!dir] = root;
+  return pivot;
+}
+
+static mtl_free_space_node *mtl_free_space_insert_node(
+    mtl_free_space_node *root, mtl_free_space_node *node, int tree) {
+  if (root == NULL) return node;
+
+  int dir = mtl_free_space_compare(tree, node, root) > 0;
+  root->children[tree][dir] =
+      mtl_free_space_insert_node(root->children[tree][dir], node, tree);
+
+  if (root->children[tree][dir]->priority > root->priority)
+    root = mtl_free_space_rotate(root, tree, dir);
+
+  return root;
+}
+
+static mtl_free_space_node *mtl_free_space_remove_node(
+    mtl_free_space_node *root, mtl_free_space_node *node, int tree) {
+  if (root == NULL) return NULL;
+
+  if (root == node) {
+    mtl_free_space_node *left = root->children[tree][0];
+    mtl_free_space_node *right = root->children[tree][1];
+    if (left == NULL) return right;
+    if (right == NULL) return left;
+
+    // Rotate the child with the higher priority up and continue below it
+    int dir = right->priority > left->priority;
+    root = mtl_free_space_rotate(root, tree, dir);
+    root->children[tree][!dir] =
+        mtl_free_space_remove_node(root->children[tree][!dir], node, tree);
+    return root;
+  }
+
+  int dir = mtl_free_space_compare(tree, node, root) > 0;
+  root->children[tree][dir] =
+      mtl_free_space_remove_node(root->children[tree][dir], node, tree);
+  return root;
+}
+
+static void mtl_free_space_free_nodes(mtl_free_space_node *node) {
+  if (node == NULL) return;
+  mtl_free_space_free_nodes(node->children[BY_OFFSET][0]);
+  mtl_free_space_free_nodes(node->children[BY_OFFSET][1]);
+  free(node);
+}
+
+int mtl_free_space_create(mtl_free_space **free_space) {
+  mtl_free_space *f = calloc(1, sizeof(mtl_free_space));
+  if (f == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  f->random_state = 2463534242u;
+
+  *free_space = f;
+  return MTL_SUCCESS;
+}
+
+void mtl_free_space_destroy(mtl_free_space *free_space) {
+  mtl_free_space_clear(free_space);
+  free(free_space);
+}
+
+void mtl_free_space_clear(mtl_free_space *free_space) {
+  mtl_free_space_free_nodes(free_space->roots[BY_OFFSET]);
+  free_space->roots[BY_OFFSET] = NULL;
+  free_space->roots[BY_LENGTH] = NULL;
+  free_space->extents = 0;
+  free_space->blocks = 0;
+  free_space->valid = false;
+
+  for (int i = 0; i < MTL_FREE_SPACE_WINDOWS; ++i)
+    free_space->windows[i].length = 0;
+}
+
+void mtl_free_space_invalidate(mtl_free_space *free_space) {
+  free_space->valid = false;
+}
+
+bool mtl_free_space_valid(mtl_free_space *free_space) {
+  return free_space->valid;
+}
+
+void mtl_free_space_set_valid(mtl_free_space *free_space) {
+  free_space->valid = true;
+}
+
+static mtl_free_space_node *mtl_free_space_find_node(
+    mtl_free_space *free_space, uint64_t offset) {
+  mtl_free_space_node *node = free_space->roots[BY_OFFSET];
+  while (node && node->offset != offset)
+    node = node->children[BY_OFFSET][offset > node->offset];
+  return node;
+}
+
+int mtl_free_space_insert(mtl_free_space *free_space, uint64_t offset,
+                          uint64_t length) {
+  mtl_free_space_node *node = calloc(1, sizeof(mtl_free_space_node));
+  if (node == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  node->offset = offset;
+  node->length = length;
+  node->priority = mtl_free_space_random(free_space);
+
+  for (int tree = 0; tree < 2; ++tree)
+    free_space->roots[tree] =
+        mtl_free_space_insert_node(free_space->roots[tree], node, tree);
+
+  ++free_space->extents;
+  free_space->blocks += length;
+  return MTL_SUCCESS;
+}
+
+int mtl_free_space_remove(mtl_free_space *free_space, uint64_t offset) {
+  mtl_free_space_node *node = mtl_free_space_find_node(free_space, offset);
+  if (node == NULL) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  for (int tree = 0; tree < 2; ++tree)
+    free_space->roots[tree] =
+        mtl_free_space_remove_node(free_space->roots[tree], node, tree);
+
+  --free_space->extents;
+  free_space->blocks -= node->length;
+  free(node);
+  return MTL_SUCCESS;
+}
+
+bool mtl_free_space_find(mtl_free_space *free_space, uint64_t offset,
+                         uint64_t *length) {
+  mtl_free_space_node *node = mtl_free_space_find_node(free_space, offset);
+  if (node && length) *length = node->length;
+  return node != NULL;
+}
+
+bool mtl_free_space_find_before(mtl_free_space *free_space, uint64_t offset,
+                                uint64_t *found_offset,
+                                uint64_t *found_length) {
+  mtl_free_space_node *result = NULL;
+  mtl_free_space_node *node = free_space->roots[BY_OFFSET];
+  while (node) {
+    if (node->offset < offset) {
+      result = node;
+      node = node->children[BY_OFFSET][1];
+    } else {
+      node = node->children[BY_OFFSET][0];
+    }
+  }
+
+  if (result == NULL) return false;
+
+  if (found_offset) *found_offset = result->offset;
+  if (found_length) *found_length = result->length;
+  return true;
+}
+
+bool mtl_free_space_find_after(mtl_free_space *free_space, uint64_t offset,
+                               uint64_t *found_offset,
+                               uint64_t *found_length) {
+  mtl_free_space_node *result = NULL;
+  mtl_free_space_node *node = free_space->roots[BY_OFFSET];
+  while (node) {
+    if (node->offset >= offset) {
+      result = node;
+      node = node->children[BY_OFFSET][0];
+    } else {
+      node = node->children[BY_OFFSET][1];
+    }
+  }
+
+  if (result == NULL) return false;
+
+  if (found_offset) *found_offset = result->offset;
+  if (found_length) *found_length = result->length;
+  return true;
+}
+
+bool mtl_free_space_find_largest(mtl_free_space *free_space, uint64_t *offset,
+                                 uint64_t *length) {
+  mtl_free_space_node *node = free_space->roots[BY_LENGTH];
+  if (node == NULL) return false;
+
+  while (node->children[BY_LENGTH][1]) node = node->children[BY_LENGTH][1];
+
+  if (offset) *offset = node->offset;
+  if (length) *length = node->length;
+  return true;
+}
+
+void mtl_free_space_get_stats(mtl_free_space *free_space, uint64_t *extents,
+                              uint64_t *blocks) {
+  if (extents) *extents = free_space->extents;
+  if (blocks) *blocks = free_space->blocks;
+}
+
+bool mtl_free_space_find_best_fit(mtl_free_space *free_space, uint64_t length,
+                                  uint64_t *found_offset,
+                                  uint64_t *found_length) {
+  // Ties are broken by offset, so this prefers the front of the storage
+  mtl_free_space_node *result = NULL;
+  mtl_free_space_node *node = free_space->roots[BY_LENGTH];
+  while (node) {
+    if (node->length >= length) {
+      result = node;
+      node = node->children[BY_LENGTH][0];
+    } else {
+      node = node->children[BY_LENGTH][1];
+    }
+  }
+
+  if (result == NULL) return false;
+
+  if (found_offset) *found_offset = result->offset;
+  if (found_length) *found_length = result->length;
+  return true;
+}
+
+void mtl_free_space_set_policy(mtl_free_space *free_space,
+                               mtl_allocation_policy policy) {
+  free_space->policy = policy;
+}
+
+mtl_allocation_policy mtl_free_space_policy(mtl_free_space *free_space) {
+  return free_space->policy;
+}
+
+static mtl_free_space_window *mtl_free_space_window_slot(
+    mtl_free_space *free_space, uint64_t inode_id) {
+  for (int i = 0; i < MTL_FREE_SPACE_WINDOWS; ++i) {
+    mtl_free_space_window *window = &free_space->windows[i];
+    if (window->length && window->inode_id == inode_id) return window;
+  }
+  return NULL;
+}
+
+bool mtl_free_space_find_window(mtl_free_space *free_space, uint64_t inode_id,
+                                uint64_t *offset, uint64_t *length) {
+  mtl_free_space_window *window =
+      mtl_free_space_window_slot(free_space, inode_id);
+  if (window == NULL) return false;
+
+  if (offset) *offset = window->offset;
+  if (length) *length = window->length;
+  return true;
+}
+
+void mtl_free_space_set_window(mtl_free_space *free_space, uint64_t inode_id,
+                               uint64_t offset, uint64_t length) {
+  mtl_free_space_window *window =
+      mtl_free_space_window_slot(free_space, inode_id);
+  if (window == NULL) {
+    if (length == 0) return;
+
+    for (int i = 0; i < MTL_FREE_SPACE_WINDOWS && window == NULL; ++i)
+      if (free_space->windows[i].length == 0) window = &free_space->windows[i];
+
+    if (window == NULL) return;
+  }
+
+  window->inode_id = inode_id;
+  window->offset = offset;
+  window->length = length;
+  window->last_used = ++free_space->window_clock;
+}
+
+bool mtl_free_space_windows_full(mtl_free_space *free_space) {
+  for (int i = 0; i < MTL_FREE_SPACE_WINDOWS; ++i)
+    if (free_space->windows[i].length == 0) return false;
+  return true;
+}
+
+bool mtl_free_space_oldest_window(mtl_free_space *free_space,
+                                  uint64_t *inode_id) {
+  mtl_free_space_window *oldest = NULL;
+  for (int i = 0; i < MTL_FREE_SPACE_WINDOWS; ++i) {
+    mtl_free_space_window *window = &free_space->windows[i];
+    if (window->length &&
+        (oldest == NULL || window->last_used < oldest->last_used))
+      oldest = window;
+  }
+
+  if (oldest == NULL) return false;
+
+  *inode_id = oldest->inode_id;
+  return true;
+}
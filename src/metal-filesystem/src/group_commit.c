@@ -0,0 +1,168 @@
+#include "group_commit.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <metal-filesystem/metal.h>
+
+#define MTL_GROUP_COMMIT_FLAGS (MDB_NOSYNC | MDB_NOMETASYNC)
+
+typedef struct mtl_group_commit {
+  MDB_env *env;
+  pthread_rwlock_t *map_lock;
+  uint64_t interval_ms;
+  uint64_t max_pending;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t flusher;
+  bool stopping;
+
+  uint64_t pending;
+  struct timespec first_pending;  // time of the oldest unsynced commit
+
+  uint64_t commits;
+  uint64_t syncs;
+} mtl_group_commit;
+
+static int mtl_group_commit_sync_env(mtl_group_commit *group_commit) {
+  // The map must not be resized while it is being synced
+  pthread_rwlock_rdlock(group_commit->map_lock);
+  int res = mdb_env_sync(group_commit->env, 1);
+  pthread_rwlock_unlock(group_commit->map_lock);
+  return res;
+}
+
+// Has to be called with the lock held, which is released during the sync
+static int mtl_group_commit_flush(mtl_group_commit *group_commit) {
+  group_commit->pending = 0;
+  pthread_mutex_unlock(&group_commit->lock);
+
+  // Syncs everything that has been committed so far, not only the pending
+  // commits we have counted
+  int res = mtl_group_commit_sync_env(group_commit);
+
+  pthread_mutex_lock(&group_commit->lock);
+  ++group_commit->syncs;
+  return res;
+}
+
+static void *mtl_group_commit_run(void *arg) {
+  mtl_group_commit *group_commit = arg;
+
+  pthread_mutex_lock(&group_commit->lock);
+  while (!group_commit->stopping) {
+    if (group_commit->pending == 0) {
+      pthread_cond_wait(&group_commit->wake, &group_commit->lock);
+      continue;
+    }
+
+    if (group_commit->pending < group_commit->max_pending) {
+      // Give further commits the chance to join this flush
+      struct timespec deadline = group_commit->first_pending;
+      deadline.tv_sec += group_commit->interval_ms / 1000;
+      deadline.tv_nsec += (group_commit->interval_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+      }
+
+      if (pthread_cond_timedwait(&group_commit->wake, &group_commit->lock,
+                                 &deadline) != ETIMEDOUT)
+        continue;
+
+      // Someone else might have flushed in the meantime
+      if (group_commit->pending == 0) continue;
+    }
+
+    mtl_group_commit_flush(group_commit);
+  }
+  pthread_mutex_unlock(&group_commit->lock);
+
+  return NULL;
+}
+
+int mtl_group_commit_create(mtl_group_commit **group_commit, MDB_env *env,
+                            pthread_rwlock_t *map_lock, uint64_t interval_ms,
+                            uint64_t max_pending) {
+  mtl_group_commit *g = calloc(1, sizeof(mtl_group_commit));
+  if (g == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  g->env = env;
+  g->map_lock = map_lock;
+  g->interval_ms = interval_ms;
+  g->max_pending = max_pending ? max_pending : 1;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->wake, NULL);
+
+  if (mdb_env_set_flags(env, MTL_GROUP_COMMIT_FLAGS, 1) != MDB_SUCCESS) {
+    pthread_cond_destroy(&g->wake);
+    pthread_mutex_destroy(&g->lock);
+    free(g);
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (pthread_create(&g->flusher, NULL, mtl_group_commit_run, g) != 0) {
+    mdb_env_set_flags(env, MTL_GROUP_COMMIT_FLAGS, 0);
+    pthread_cond_destroy(&g->wake);
+    pthread_mutex_destroy(&g->lock);
+    free(g);
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  *group_commit = g;
+  return MTL_SUCCESS;
+}
+
+void mtl_group_commit_destroy(mtl_group_commit *group_commit) {
+  pthread_mutex_lock(&group_commit->lock);
+  group_commit->stopping = true;
+  pthread_cond_signal(&group_commit->wake);
+  pthread_mutex_unlock(&group_commit->lock);
+
+  pthread_join(group_commit->flusher, NULL);
+
+  mtl_group_commit_sync_env(group_commit);
+  mdb_env_set_flags(group_commit->env, MTL_GROUP_COMMIT_FLAGS, 0);
+
+  pthread_cond_destroy(&group_commit->wake);
+  pthread_mutex_destroy(&group_commit->lock);
+  free(group_commit);
+}
+
+void mtl_group_commit_add(mtl_group_commit *group_commit) {
+  pthread_mutex_lock(&group_commit->lock);
+
+  ++group_commit->commits;
+  if (group_commit->pending++ == 0) {
+    clock_gettime(CLOCK_REALTIME, &group_commit->first_pending);
+    pthread_cond_signal(&group_commit->wake);
+  } else if (group_commit->pending >= group_commit->max_pending) {
+    pthread_cond_signal(&group_commit->wake);
+  }
+
+  pthread_mutex_unlock(&group_commit->lock);
+}
+
+int mtl_group_commit_sync(mtl_group_commit *group_commit) {
+  pthread_mutex_lock(&group_commit->lock);
+  int res = mtl_group_commit_flush(group_commit);
+  pthread_mutex_unlock(&group_commit->lock);
+
+  return res == MDB_SUCCESS ? MTL_SUCCESS : MTL_ERROR_INVALID_ARGUMENT;
+}
+
+void mtl_group_commit_get_stats(mtl_group_commit *group_commit,
+                                uint64_t *commits, uint64_t *pending,
+                                uint64_t *syncs) {
+  pthread_mutex_lock(&group_commit->lock);
+  *commits = group_commit->commits;
+  *pending = group_commit->pending;
+  *syncs = group_commit->syncs;
+  pthread_mutex_unlock(&group_commit->lock);
+}
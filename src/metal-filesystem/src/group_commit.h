@@ -0,0 +1,28 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <lmdb.h>
+
+// Flushes the metadata store in the background instead of on every commit.
+// The environment is switched to MDB_NOSYNC | MDB_NOMETASYNC, so commits only
+// reach the page cache and are counted here. A flusher thread syncs them to
+// disk interval_ms after the first unsynced commit or as soon as max_pending
+// commits have piled up, whichever comes first. Syncs hold map_lock shared.
+typedef struct mtl_group_commit mtl_group_commit;
+
+int mtl_group_commit_create(mtl_group_commit **group_commit, MDB_env *env,
+                            pthread_rwlock_t *map_lock, uint64_t interval_ms,
+                            uint64_t max_pending);
+// Flushes what is pending and switches back to synchronous commits
+void mtl_group_commit_destroy(mtl_group_commit *group_commit);
+
+// Counts a commit towards the next flush
+void mtl_group_commit_add(mtl_group_commit *group_commit);
+// Makes every commit so far durable before returning
+int mtl_group_commit_sync(mtl_group_commit *group_commit);
+
+void mtl_group_commit_get_stats(mtl_group_commit *group_commit,
+                                uint64_t *commits, uint64_t *pending,
+                                uint64_t *syncs);
@@ -1,15 +1,26 @@
 #include <metal-filesystem/inode.h>
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
+#include <metal-filesystem/directory.h>
+#include <metal-filesystem/file_extent.h>
 #include <metal-filesystem/metal.h>
+#include "databases.h"
 #include "meta.h"
 
 #define INODES_DB_NAME "inodes"
 
 int mtl_ensure_inodes_db_open(MDB_txn *txn, MDB_dbi *inodes_db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *inodes_db = databases->inodes;
+    return MDB_SUCCESS;
+  }
+
   return mdb_dbi_open(txn, INODES_DB_NAME, MDB_CREATE, inodes_db);
 }
 
@@ -25,6 +36,10 @@ int mtl_load_inode(MDB_txn *txn, uint64_t inode_id, const mtl_inode **inode,
   if (ret == MDB_NOTFOUND) {
     return MTL_ERROR_NOENTRY;
   }
+  if (ret != MDB_SUCCESS) {
+    // Like after the map ran full in txn
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
 
   if (inode != NULL) *inode = (mtl_inode *)inode_value.mv_data;
   if (data != NULL) *data = inode_value.mv_data + sizeof(mtl_inode);
@@ -34,75 +49,25 @@ int mtl_load_inode(MDB_txn *txn, uint64_t inode_id, const mtl_inode **inode,
   return MTL_SUCCESS;
 }
 
-mtl_directory_entry_head *mtl_load_next_directory_entry(
-    const void *dir_data, uint64_t dir_data_length,
-    mtl_directory_entry_head *entry, char **filename) {
-  mtl_directory_entry_head *result;
-
-  if (entry == NULL) {
-    result = (mtl_directory_entry_head *)dir_data;
-  } else {
-    result = (mtl_directory_entry_head *)((void *)entry +
-                                          sizeof(mtl_directory_entry_head) +
-                                          entry->name_len);
-  }
-
-  if ((void *)result + sizeof(mtl_directory_entry_head) >
-      dir_data + dir_data_length) {
-    return NULL;
-  }
-
-  *filename = (char *)((void *)result + sizeof(mtl_directory_entry_head));
-
-  return result;
-}
-
-int mtl_load_directory(MDB_txn *txn, uint64_t inode_id, const mtl_inode **inode,
-                       mtl_directory_entry_head **dir_entries,
-                       uint64_t *entries_length) {
-  return mtl_load_inode(txn, inode_id, inode, (const void **)dir_entries,
-                        entries_length);
-}
-
-int mtl_load_file(MDB_txn *txn, uint64_t inode_id, const mtl_inode **inode,
-                  const mtl_file_extent **extents, uint64_t *extents_length) {
-  uint64_t data_length = 0;
-  int res = mtl_load_inode(txn, inode_id, inode, (const void **)extents,
-                           &data_length);
-  if (extents_length != NULL)
-    *extents_length = data_length / sizeof(mtl_file_extent);
-
-  return res;
-}
-
 int mtl_resolve_inode_in_directory(MDB_txn *txn, uint64_t dir_inode_id,
                                    char *filename, uint64_t *file_inode_id) {
-  // TODO: Check if len(filename) < FILENAME_MAX = 2^8 = 256
-  uint64_t filename_length = strlen(filename);
+  int res = mtl_get_directory_entry(txn, dir_inode_id, filename, file_inode_id);
+  if (res != MTL_ERROR_NOENTRY) {
+    return res;
+  }
 
+  // Only look at the directory inode if the lookup failed, to distinguish
+  // between a missing entry and a path component that is not a directory
   const mtl_inode *dir_inode = NULL;
-  const void *dir_data = NULL;
-  mtl_load_inode(txn, dir_inode_id, &dir_inode, &dir_data, NULL);
+  res = mtl_load_inode(txn, dir_inode_id, &dir_inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
 
   if (dir_inode->type != MTL_DIRECTORY) {
     return MTL_ERROR_NOTDIRECTORY;
   }
 
-  mtl_directory_entry_head *current_entry = NULL;
-  char *current_filename = NULL;
-  while ((current_entry = mtl_load_next_directory_entry(
-              dir_data, dir_inode->length, current_entry, &current_filename)) !=
-         NULL) {
-    // File names are not null-terminated, so we *have* to use strncmp
-    if (filename_length != current_entry->name_len) continue;
-
-    if (strncmp(current_filename, filename, current_entry->name_len) == 0) {
-      // This is the entry we're looking for!
-      *file_inode_id = current_entry->inode_id;
-      return MDB_SUCCESS;
-    }
-  }
-
   return MTL_ERROR_NOENTRY;
 }
 
@@ -124,193 +89,145 @@ int mtl_put_inode(MDB_txn *txn, uint64_t inode_id, mtl_inode *inode,
   return MTL_SUCCESS;
 }
 
-int mtl_add_extent_to_file(MDB_txn *txn, uint64_t inode_id,
-                           mtl_file_extent *new_extent, uint64_t new_length) {
+int mtl_set_file_length(MDB_txn *txn, uint64_t inode_id, uint64_t new_length) {
   const mtl_inode *inode = NULL;
-  const mtl_file_extent *extents;
-  uint64_t extents_length;
-  mtl_load_file(txn, inode_id, &inode, &extents, &extents_length);
+  const void *data;
+  uint64_t data_length;
+  int res = mtl_load_inode(txn, inode_id, &inode, &data, &data_length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  // Data kept in the inode is cut off along with the file
+  if (data_length > new_length) data_length = new_length;
 
   mtl_inode updated_inode = *inode;
   updated_inode.length = new_length;
-
-  mtl_file_extent extent_data[extents_length + 1];
-  memcpy(extent_data, extents, extents_length * sizeof(mtl_file_extent));
-  memcpy(extent_data + extents_length, new_extent, sizeof(mtl_file_extent));
-  return mtl_put_inode(txn, inode_id, &updated_inode, extent_data,
-                       sizeof(extent_data));
+  return mtl_put_inode(txn, inode_id, &updated_inode, data, data_length);
 }
 
-int mtl_extend_last_extent_in_file(MDB_txn *txn, uint64_t inode_id,
-                                   mtl_file_extent *new_extent,
-                                   uint64_t new_length) {
+int mtl_bump_inode_generation(MDB_txn *txn, uint64_t inode_id) {
   const mtl_inode *inode = NULL;
-  const mtl_file_extent *extents;
-  uint64_t extents_length;
-  mtl_load_file(txn, inode_id, &inode, &extents, &extents_length);
+  const void *data;
+  uint64_t data_length;
+  int res = mtl_load_inode(txn, inode_id, &inode, &data, &data_length);
+  if (res == MTL_ERROR_NOENTRY) {
+    return MTL_SUCCESS;
+  } else if (res != MTL_SUCCESS) {
+    return res;
+  }
 
   mtl_inode updated_inode = *inode;
-  updated_inode.length = new_length;
-
-  mtl_file_extent extent_data[extents_length];
-  memcpy(extent_data, extents, extents_length * sizeof(mtl_file_extent));
-  memcpy(extent_data + extents_length - 1, new_extent, sizeof(mtl_file_extent));
-  return mtl_put_inode(txn, inode_id, &updated_inode, extent_data,
-                       sizeof(extent_data));
+  ++updated_inode.generation;
+  return mtl_put_inode(txn, inode_id, &updated_inode, data, data_length);
 }
 
-int mtl_truncate_file_extents(MDB_txn *txn, uint64_t inode_id,
-                              uint64_t new_file_length, uint64_t extents_length,
-                              uint64_t *update_last_extent_length) {
-  const mtl_inode *inode = NULL;
-  const mtl_file_extent *extents;
-  mtl_load_file(txn, inode_id, &inode, &extents, NULL);
+int mtl_add_extent_to_file(MDB_txn *txn, uint64_t inode_id,
+                           uint64_t first_block, mtl_file_extent *new_extent,
+                           uint64_t new_length) {
+  int res = mtl_put_file_extent(txn, inode_id, first_block, new_extent);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
 
-  mtl_inode updated_inode = *inode;
-  updated_inode.length = new_file_length;
+  return mtl_set_file_length(txn, inode_id, new_length);
+}
+
+int mtl_extend_last_extent_in_file(MDB_txn *txn, uint64_t inode_id,
+                                   uint64_t first_block,
+                                   mtl_file_extent *new_extent,
+                                   uint64_t new_length) {
+  // The key stays the same, so this just replaces the extent
+  return mtl_add_extent_to_file(txn, inode_id, first_block, new_extent,
+                                new_length);
+}
 
-  mtl_file_extent extent_data[extents_length];
-  memcpy(extent_data, extents, extents_length * sizeof(mtl_file_extent));
-  if (update_last_extent_length) {
-    extent_data[extents_length - 1].length = *update_last_extent_length;
+int mtl_truncate_file_extents(MDB_txn *txn, uint64_t inode_id,
+                              uint64_t new_file_length, uint64_t blocks) {
+  int res = mtl_delete_file_extents(txn, inode_id, blocks);
+  if (res != MTL_SUCCESS) {
+    return res;
   }
 
-  return mtl_put_inode(txn, inode_id, &updated_inode, extent_data,
-                       sizeof(extent_data));
+  return mtl_set_file_length(txn, inode_id, new_file_length);
+}
+
+static int mtl_update_directory_length(MDB_txn *txn, uint64_t dir_inode_id,
+                                       const mtl_inode *dir_inode,
+                                       int64_t delta) {
+  // The length of a directory is the number of entries it contains
+  mtl_inode new_dir_inode = *dir_inode;
+  new_dir_inode.length += delta;
+  return mtl_put_inode(txn, dir_inode_id, &new_dir_inode, NULL, 0);
 }
 
 int mtl_append_inode_id_to_directory(MDB_txn *txn, uint64_t dir_inode_id,
                                      char *filename, uint64_t inode_id) {
-  // TODO: Check if len(filename) < FILENAME_MAX = 2^8 = 256
-  uint64_t filename_length = strlen(filename);
-
   const mtl_inode *dir_inode = NULL;
-  const void *dir_inode_data = NULL;
-  mtl_load_inode(txn, dir_inode_id, &dir_inode, &dir_inode_data, NULL);
+  int res = mtl_load_inode(txn, dir_inode_id, &dir_inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
 
   if (dir_inode->type != MTL_DIRECTORY) {
     return MTL_ERROR_NOTDIRECTORY;
   }
 
-  // Check if the entry already exists
-  mtl_directory_entry_head *current_entry = NULL;
-  char *current_filename = NULL;
-  while ((current_entry = mtl_load_next_directory_entry(
-              dir_inode_data, dir_inode->length, current_entry,
-              &current_filename)) != NULL) {
-    if (filename_length != current_entry->name_len) continue;
-
-    if (strncmp(current_filename, filename, current_entry->name_len) == 0) {
-      return MTL_ERROR_EXISTS;
-    }
+  res = mtl_put_directory_entry(txn, dir_inode_id, filename, inode_id);
+  if (res != MTL_SUCCESS) {
+    return res;
   }
 
-  uint64_t new_data_length =
-      dir_inode->length + sizeof(mtl_directory_entry_head) + filename_length;
-
-  mtl_inode new_dir_inode = *dir_inode;
-  new_dir_inode.length = new_data_length;
-
-  char new_dir_inode_data[new_data_length];
-
-  // Copy existing data and append the new entry to the end of the data section
-  memcpy(new_dir_inode_data, dir_inode_data, dir_inode->length);
-
-  mtl_directory_entry_head *new_entry_head =
-      (mtl_directory_entry_head *)(new_dir_inode_data + dir_inode->length);
-  new_entry_head->inode_id = inode_id;
-  new_entry_head->name_len = strlen(filename);
-
-  memcpy(
-      new_dir_inode_data + dir_inode->length + sizeof(mtl_directory_entry_head),
-      filename, filename_length);
-
-  return mtl_put_inode(txn, dir_inode_id, &new_dir_inode, new_dir_inode_data,
-                       new_data_length);
+  return mtl_update_directory_length(txn, dir_inode_id, dir_inode, 1);
 }
 
 int mtl_remove_entry_from_directory(MDB_txn *txn, uint64_t dir_inode_id,
                                     char *filename, uint64_t *inode_id) {
-  uint64_t filename_length = strlen(filename);
-
   const mtl_inode *dir_inode = NULL;
-  const void *dir_inode_data = NULL;
-  mtl_load_inode(txn, dir_inode_id, &dir_inode, &dir_inode_data, NULL);
+  int res = mtl_load_inode(txn, dir_inode_id, &dir_inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
 
   if (dir_inode->type != MTL_DIRECTORY) {
     return MTL_ERROR_NOTDIRECTORY;
   }
 
-  uint64_t new_data_length =
-      dir_inode->length - (sizeof(mtl_directory_entry_head) + filename_length);
-
-  mtl_inode new_dir_inode = *dir_inode;
-  new_dir_inode.length = new_data_length;
-  char new_dir_inode_data[new_data_length];
-
-  uint64_t current_inode_data_offset = 0;
-
-  // Find the entry
-  mtl_directory_entry_head *current_entry = NULL;
-  char *current_filename = NULL;
-  while ((current_entry = mtl_load_next_directory_entry(
-              dir_inode_data, dir_inode->length, current_entry,
-              &current_filename)) != NULL) {
-    if (filename_length == current_entry->name_len &&
-        strncmp(current_filename, filename, current_entry->name_len) == 0) {
-      if (inode_id) *inode_id = current_entry->inode_id;
-
-      continue;  // Skip this entry
-    }
-
-    if (current_inode_data_offset + current_entry->name_len +
-            sizeof(mtl_directory_entry_head) >
-        new_data_length) {
-      // If we're attempting to write too much data, this means we didn't find
-      // (skip) the specified entry
-      return MTL_ERROR_NOENTRY;
-    }
-
-    memcpy(new_dir_inode_data + current_inode_data_offset, current_entry,
-           sizeof(mtl_directory_entry_head));
-    current_inode_data_offset += sizeof(mtl_directory_entry_head);
-    memcpy(new_dir_inode_data + current_inode_data_offset, current_filename,
-           current_entry->name_len);
-    current_inode_data_offset += current_entry->name_len;
+  res = mtl_delete_directory_entry(txn, dir_inode_id, filename, inode_id);
+  if (res != MTL_SUCCESS) {
+    return res;
   }
 
-  return mtl_put_inode(txn, dir_inode_id, &new_dir_inode, new_dir_inode_data,
-                       new_data_length);
+  return mtl_update_directory_length(txn, dir_inode_id, dir_inode, -1);
 }
 
 int mtl_remove_directory(MDB_txn *txn, uint64_t dir_inode_id) {
   const mtl_inode *dir_inode = NULL;
-  mtl_directory_entry_head *dir_entries = NULL;
-  mtl_load_directory(txn, dir_inode_id, &dir_inode, &dir_entries, NULL);
+  int res = mtl_load_inode(txn, dir_inode_id, &dir_inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
 
   if (dir_inode->type != MTL_DIRECTORY) {
     return MTL_ERROR_NOTDIRECTORY;
   }
 
-  // Iterate over directory entries to check if it's empty
-  mtl_directory_entry_head *current_entry = NULL;
-  char *current_filename = NULL;
-  while ((current_entry = mtl_load_next_directory_entry(
-              dir_entries, dir_inode->length, current_entry,
-              &current_filename)) != NULL) {
-    if (current_entry->name_len == 1 &&
-        strncmp(current_filename, ".", 1) == 0) {
-      continue;
+  // Look at the first few entries to check if it's empty
+  mtl_directory_entry entries[3];
+  uint64_t entries_length;
+  mtl_list_directory_entries(txn, dir_inode_id, NULL, entries,
+                             sizeof(entries) / sizeof(entries[0]),
+                             &entries_length);
+  for (uint64_t i = 0; i < entries_length; ++i) {
+    if (strcmp(entries[i].name, ".") != 0 &&
+        strcmp(entries[i].name, "..") != 0) {
+      return MTL_ERROR_NOTEMPTY;
     }
-
-    if (current_entry->name_len == 2 &&
-        strncmp(current_filename, "..", 2) == 0) {
-      continue;
-    }
-
-    return MTL_ERROR_NOTEMPTY;
   }
 
+  mtl_delete_directory_entry(txn, dir_inode_id, ".", NULL);
+  mtl_delete_directory_entry(txn, dir_inode_id, "..", NULL);
+
   return mtl_delete_inode(txn, dir_inode_id);
 }
 
@@ -331,7 +248,7 @@ int mtl_create_root_directory(MDB_txn *txn) {
 
   // Create a root inode
   mtl_inode root_inode = {.type = MTL_DIRECTORY,
-                          .length = 0,  // sizeof(dir_data),
+                          .length = 0,  // number of entries, see below
                           .user = 0,
                           .group = 0,
                           .accessed = now,
@@ -361,7 +278,7 @@ int mtl_create_directory_in_directory(MDB_txn *txn, uint64_t dir_inode_id,
   int now = time(NULL);
 
   mtl_inode dir_inode = {.type = MTL_DIRECTORY,
-                         .length = 0,  // sizeof(dir_data),
+                         .length = 0,  // number of entries, see below
                          .user = 0,
                          .group = 0,
                          .accessed = now,
@@ -419,7 +336,242 @@ int mtl_delete_inode(MDB_txn *txn, uint64_t inode_id) {
   MDB_dbi inodes_db;
   mtl_ensure_inodes_db_open(txn, &inodes_db);
 
+  // Directories don't have any extents, but this is just a single lookup
+  mtl_delete_file_extents(txn, inode_id, 0);
+
   MDB_val inode_key = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
   mdb_del(txn, inodes_db, &inode_key, NULL);
   return MTL_SUCCESS;
 }
+
+static const mtl_directory_entry_head *mtl_load_next_legacy_directory_entry(
+    const void *dir_data, uint64_t dir_data_length,
+    const mtl_directory_entry_head *entry, const char **filename) {
+  const mtl_directory_entry_head *result;
+
+  if (entry == NULL) {
+    result = (const mtl_directory_entry_head *)dir_data;
+  } else {
+    result = (const mtl_directory_entry_head *)((const char *)entry +
+                                                sizeof(mtl_directory_entry_head) +
+                                                entry->name_len);
+  }
+
+  if ((const char *)result + sizeof(mtl_directory_entry_head) >
+      (const char *)dir_data + dir_data_length) {
+    return NULL;
+  }
+
+  *filename = (const char *)result + sizeof(mtl_directory_entry_head);
+
+  return result;
+}
+
+static int mtl_migrate_directory(MDB_txn *txn, uint64_t dir_inode_id) {
+  const mtl_inode *dir_inode;
+  const void *dir_data;
+  uint64_t dir_data_length;
+  int res = mtl_load_inode(txn, dir_inode_id, &dir_inode, &dir_data,
+                           &dir_data_length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  // The inode value will be moved by the puts below, so work on a copy
+  mtl_inode new_dir_inode = *dir_inode;
+  char *entries = malloc(dir_data_length);
+  memcpy(entries, dir_data, dir_data_length);
+
+  new_dir_inode.length = 0;
+
+  const mtl_directory_entry_head *current_entry = NULL;
+  const char *current_filename = NULL;
+  while ((current_entry = mtl_load_next_legacy_directory_entry(
+              entries, dir_data_length, current_entry, &current_filename)) !=
+         NULL) {
+    char filename[MTL_MAX_FILENAME_LENGTH + 1];
+    memcpy(filename, current_filename, current_entry->name_len);
+    filename[current_entry->name_len] = '\0';
+
+    res = mtl_put_directory_entry(txn, dir_inode_id, filename,
+                                  current_entry->inode_id);
+    if (res != MTL_SUCCESS && res != MTL_ERROR_EXISTS) {
+      free(entries);
+      return res;
+    }
+
+    ++new_dir_inode.length;
+  }
+
+  free(entries);
+
+  return mtl_put_inode(txn, dir_inode_id, &new_dir_inode, NULL, 0);
+}
+
+int mtl_migrate_directory_entries(MDB_txn *txn) {
+  MDB_dbi inodes_db;
+  mtl_ensure_inodes_db_open(txn, &inodes_db);
+
+  // Collect all directories that still carry their entries inline
+  uint64_t dirs_length = 0, dirs_capacity = 64;
+  uint64_t *dirs = malloc(dirs_capacity * sizeof(uint64_t));
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, inodes_db, &cursor);
+
+  MDB_val inode_key, inode_value;
+  int res = mdb_cursor_get(cursor, &inode_key, &inode_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    const mtl_inode *inode = (const mtl_inode *)inode_value.mv_data;
+    if (inode->type == MTL_DIRECTORY &&
+        inode_value.mv_size > sizeof(mtl_inode)) {
+      if (dirs_length == dirs_capacity) {
+        dirs_capacity *= 2;
+        dirs = realloc(dirs, dirs_capacity * sizeof(uint64_t));
+      }
+      memcpy(&dirs[dirs_length++], inode_key.mv_data, sizeof(uint64_t));
+    }
+
+    res = mdb_cursor_get(cursor, &inode_key, &inode_value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+
+  res = MTL_SUCCESS;
+  for (uint64_t i = 0; i < dirs_length && res == MTL_SUCCESS; ++i) {
+    res = mtl_migrate_directory(txn, dirs[i]);
+  }
+
+  free(dirs);
+  return res;
+}
+
+static int mtl_migrate_file(MDB_txn *txn, uint64_t inode_id) {
+  const mtl_inode *inode;
+  const void *data;
+  uint64_t data_length;
+  int res = mtl_load_inode(txn, inode_id, &inode, &data, &data_length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  // The inode value will be moved by the puts below, so work on a copy
+  mtl_inode new_inode = *inode;
+  uint64_t extents_length = data_length / sizeof(mtl_file_extent);
+  mtl_file_extent *extents = malloc(data_length);
+  memcpy(extents, data, data_length);
+
+  uint64_t first_block = 0;
+  for (uint64_t i = 0; i < extents_length && res == MTL_SUCCESS; ++i) {
+    res = mtl_put_file_extent(txn, inode_id, first_block, &extents[i]);
+    first_block += extents[i].length;
+  }
+
+  free(extents);
+
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  return mtl_put_inode(txn, inode_id, &new_inode, NULL, 0);
+}
+
+int mtl_migrate_file_extents(MDB_txn *txn) {
+  MDB_dbi inodes_db;
+  mtl_ensure_inodes_db_open(txn, &inodes_db);
+
+  // Collect all files that still carry their extents inline
+  uint64_t files_length = 0, files_capacity = 64;
+  uint64_t *files = malloc(files_capacity * sizeof(uint64_t));
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, inodes_db, &cursor);
+
+  MDB_val inode_key, inode_value;
+  int res = mdb_cursor_get(cursor, &inode_key, &inode_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    const mtl_inode *inode = (const mtl_inode *)inode_value.mv_data;
+    if (inode->type == MTL_FILE && inode_value.mv_size > sizeof(mtl_inode)) {
+      if (files_length == files_capacity) {
+        files_capacity *= 2;
+        files = realloc(files, files_capacity * sizeof(uint64_t));
+      }
+      memcpy(&files[files_length++], inode_key.mv_data, sizeof(uint64_t));
+    }
+
+    res = mdb_cursor_get(cursor, &inode_key, &inode_value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+
+  res = MTL_SUCCESS;
+  for (uint64_t i = 0; i < files_length && res == MTL_SUCCESS; ++i) {
+    res = mtl_migrate_file(txn, files[i]);
+  }
+
+  free(files);
+  return res;
+}
+
+int mtl_migrate_inode_generations(MDB_txn *txn) {
+  MDB_dbi inodes_db;
+  mtl_ensure_inodes_db_open(txn, &inodes_db);
+
+  // The generation goes between the inode and its data
+  const uint64_t legacy_size = offsetof(mtl_inode, generation);
+
+  // Collect all inodes first, as they grow while they are migrated
+  uint64_t inodes_length = 0, inodes_capacity = 64;
+  uint64_t *inodes = malloc(inodes_capacity * sizeof(uint64_t));
+  if (inodes == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, inodes_db, &cursor);
+
+  MDB_val inode_key, inode_value;
+  int res = mdb_cursor_get(cursor, &inode_key, &inode_value, MDB_FIRST);
+  while (res == MDB_SUCCESS) {
+    if (inodes_length == inodes_capacity) {
+      inodes_capacity *= 2;
+      inodes = realloc(inodes, inodes_capacity * sizeof(uint64_t));
+    }
+    memcpy(&inodes[inodes_length++], inode_key.mv_data, sizeof(uint64_t));
+
+    res = mdb_cursor_get(cursor, &inode_key, &inode_value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+
+  res = MTL_SUCCESS;
+  for (uint64_t i = 0; i < inodes_length && res == MTL_SUCCESS; ++i) {
+    inode_key.mv_size = sizeof(uint64_t);
+    inode_key.mv_data = &inodes[i];
+    if (mdb_get(txn, inodes_db, &inode_key, &inode_value) != MDB_SUCCESS ||
+        inode_value.mv_size < legacy_size) {
+      continue;
+    }
+
+    uint64_t data_length = inode_value.mv_size - legacy_size;
+    char *inode_data = malloc(sizeof(mtl_inode) + data_length);
+    if (inode_data == NULL) {
+      res = MTL_ERROR_NOSPACE;
+      break;
+    }
+
+    memcpy(inode_data, inode_value.mv_data, legacy_size);
+    memset(inode_data + legacy_size, 0, sizeof(mtl_inode) - legacy_size);
+    memcpy(inode_data + sizeof(mtl_inode), inode_value.mv_data + legacy_size,
+           data_length);
+
+    MDB_val new_value = {.mv_size = sizeof(mtl_inode) + data_length,
+                         .mv_data = inode_data};
+    if (mdb_put(txn, inodes_db, &inode_key, &new_value, 0) != MDB_SUCCESS)
+      res = MTL_ERROR_NOSPACE;
+    free(inode_data);
+  }
+
+  free(inodes);
+  return res;
+}
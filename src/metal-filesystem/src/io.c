@@ -0,0 +1,175 @@
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <metal-filesystem/metal.h>
+
+uint64_t mtl_iov_length(const struct iovec *iov, int iovcnt) {
+  uint64_t length = 0;
+  for (int i = 0; i < iovcnt; ++i) length += iov[i].iov_len;
+  return length;
+}
+
+// Finds the buffer that contains byte from, and the position in it
+static int mtl_iov_find(const struct iovec *iov, int iovcnt, uint64_t *from) {
+  int i = 0;
+  while (i < iovcnt && *from >= iov[i].iov_len) {
+    *from -= iov[i].iov_len;
+    ++i;
+  }
+  return i;
+}
+
+void mtl_iov_copy_to(const struct iovec *iov, int iovcnt, uint64_t from,
+                     const void *src, uint64_t length) {
+  for (int i = mtl_iov_find(iov, iovcnt, &from); i < iovcnt && length > 0;
+       ++i) {
+    uint64_t chunk = iov[i].iov_len - from;
+    if (chunk > length) chunk = length;
+
+    char *dst = (char *)iov[i].iov_base + from;
+    if (src) {
+      memcpy(dst, src, chunk);
+      src = (const char *)src + chunk;
+    } else {
+      memset(dst, 0, chunk);
+    }
+
+    length -= chunk;
+    from = 0;
+  }
+}
+
+void mtl_iov_copy_from(void *dst, const struct iovec *iov, int iovcnt,
+                       uint64_t from, uint64_t length) {
+  for (int i = mtl_iov_find(iov, iovcnt, &from); i < iovcnt && length > 0;
+       ++i) {
+    uint64_t chunk = iov[i].iov_len - from;
+    if (chunk > length) chunk = length;
+
+    memcpy(dst, (const char *)iov[i].iov_base + from, chunk);
+    dst = (char *)dst + chunk;
+    length -= chunk;
+    from = 0;
+  }
+}
+
+void mtl_io_init(mtl_io *io) { memset(io, 0, sizeof(*io)); }
+
+int mtl_io_reserve(mtl_io *io, uint64_t requests) {
+  // Submitted requests must stay in place, so this happens only once
+  if (io->requests || requests == 0) {
+    return requests == 0 ? MTL_SUCCESS : MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  io->requests = calloc(requests, sizeof(mtl_io_request));
+  if (io->requests == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  io->requests_capacity = requests;
+  return MTL_SUCCESS;
+}
+
+// Points the request at the bytes [from, from + length) of the buffers
+static int mtl_io_slice(mtl_io_request *request, const struct iovec *iov,
+                        int iovcnt, uint64_t from, uint64_t length) {
+  int first = mtl_iov_find(iov, iovcnt, &from);
+  if (first == iovcnt) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (iov[first].iov_len - from >= length) {
+    request->single.iov_base = (char *)iov[first].iov_base + from;
+    request->single.iov_len = length;
+    request->request.iov = &request->single;
+    request->request.iovcnt = 1;
+    return MTL_SUCCESS;
+  }
+
+  int last = first;
+  uint64_t covered = iov[first].iov_len - from;
+  while (covered < length && ++last < iovcnt) covered += iov[last].iov_len;
+  if (covered < length) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  int count = last - first + 1;
+  request->iov = malloc(count * sizeof(struct iovec));
+  if (request->iov == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  memcpy(request->iov, &iov[first], count * sizeof(struct iovec));
+  request->iov[0].iov_base = (char *)request->iov[0].iov_base + from;
+  request->iov[0].iov_len -= from;
+  request->iov[count - 1].iov_len -= covered - length;
+  request->request.iov = request->iov;
+  request->request.iovcnt = count;
+  return MTL_SUCCESS;
+}
+
+int mtl_io_submit(mtl_context *context, mtl_storage_backend *storage,
+                  mtl_io *io, int write, uint64_t inode_id, uint64_t offset,
+                  const struct iovec *iov, int iovcnt, uint64_t from,
+                  uint64_t length) {
+  if (io->requests_length == io->requests_capacity) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  mtl_io_request *request = &io->requests[io->requests_length];
+  memset(request, 0, sizeof(*request));
+  request->request.write = write;
+  request->request.inode_id = inode_id;
+  request->request.offset = offset;
+
+  int res = mtl_io_slice(request, iov, iovcnt, from, length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  if (storage->submit) {
+    res = storage->submit(context, storage->context, &request->request);
+    if (res != MTL_SUCCESS) {
+      free(request->iov);
+      return res;
+    }
+  } else {
+    // Backends without an asynchronous interface are done right away
+    const struct iovec *buffers = request->request.iov;
+    res = MTL_SUCCESS;
+    for (int i = 0; i < request->request.iovcnt && res == MTL_SUCCESS; ++i) {
+      res = write ? storage->write(context, storage->context, inode_id,
+                                   offset, buffers[i].iov_base,
+                                   buffers[i].iov_len)
+                  : storage->read(context, storage->context, inode_id, offset,
+                                  buffers[i].iov_base, buffers[i].iov_len);
+      offset += buffers[i].iov_len;
+    }
+    request->request.result = res;
+  }
+
+  ++io->requests_length;
+  return MTL_SUCCESS;
+}
+
+int mtl_io_wait(mtl_context *context, mtl_storage_backend *storage,
+                mtl_io *io) {
+  for (uint64_t i = 0; i < io->requests_length; ++i) {
+    mtl_io_request *request = &io->requests[i];
+
+    int res = storage->complete
+                  ? storage->complete(context, storage->context,
+                                      &request->request)
+                  : request->request.result;
+    if (res != MTL_SUCCESS && io->result == MTL_SUCCESS) io->result = res;
+
+    free(request->iov);
+  }
+
+  free(io->requests);
+  io->requests = NULL;
+  io->requests_capacity = io->requests_length = 0;
+  return io->result;
+}
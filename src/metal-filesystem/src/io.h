@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <metal-filesystem/storage.h>
+
+// A storage request with the part of the caller's buffers it covers
+typedef struct mtl_io_request {
+  mtl_storage_request request;
+  struct iovec single;  // if the part is within a single buffer
+  struct iovec *iov;    // allocated otherwise
+} mtl_io_request;
+
+// The storage requests of an mtl_read_async or mtl_write_async call
+typedef struct mtl_io {
+  mtl_io_request *requests;
+  uint64_t requests_capacity;
+  uint64_t requests_length;  // the ones that have been submitted
+
+  uint64_t length;  // bytes read or written once the requests are done
+  int result;       // the first error
+
+  // A write to a file without a handle holds it open until its requests are
+  // done, so that the defragmenter doesn't move its blocks in the meantime
+  bool holds_file;
+  uint64_t inode_id;
+} mtl_io;
+
+uint64_t mtl_iov_length(const struct iovec *iov, int iovcnt);
+
+// Copies length bytes from src into the buffers of iov, starting at byte
+// from. src NULL writes zeros.
+void mtl_iov_copy_to(const struct iovec *iov, int iovcnt, uint64_t from,
+                     const void *src, uint64_t length);
+// Copies length bytes from the buffers of iov, starting at byte from
+void mtl_iov_copy_from(void *dst, const struct iovec *iov, int iovcnt,
+                       uint64_t from, uint64_t length);
+
+void mtl_io_init(mtl_io *io);
+int mtl_io_reserve(mtl_io *io, uint64_t requests);
+
+// Submits a request for the bytes [from, from + length) of the buffers in
+// iov, which go to or come from the file at offset
+int mtl_io_submit(mtl_context *context, mtl_storage_backend *storage,
+                  mtl_io *io, int write, uint64_t inode_id, uint64_t offset,
+                  const struct iovec *iov, int iovcnt, uint64_t from,
+                  uint64_t length);
+
+// Waits for all requests of io and releases them
+int mtl_io_wait(mtl_context *context, mtl_storage_backend *storage,
+                mtl_io *io);
@@ -1,12 +1,25 @@
+#include <string.h>
+
 #include <metal-filesystem/metal.h>
 
+#include "databases.h"
 #include "meta.h"
 
 #define META_DB_NAME "meta"
 
 const char next_inode_id_key[] = "next_inode";
+const char format_version_key[] = "format_version";
+const char pack_inode_key[] = "pack_inode";
+const char relocation_inode_key[] = "relocation_inode";
+const char space_counters_key[] = "space_counters";
 
 int mtl_ensure_meta_db_open(MDB_txn *txn, MDB_dbi *db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *db = databases->meta;
+    return MDB_SUCCESS;
+  }
+
   return mdb_dbi_open(txn, META_DB_NAME, MDB_CREATE, db);
 }
 
@@ -36,3 +49,111 @@ uint64_t mtl_next_inode_id(MDB_txn *txn) {
                  .mv_data = (void *)&next_inode_id_key};
   return mtl_next_id(txn, &key);
 }
+
+uint64_t mtl_load_format_version(MDB_txn *txn) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(format_version_key),
+                 .mv_data = (void *)&format_version_key};
+  MDB_val value;
+  if (mdb_get(txn, meta_db, &key, &value) == MDB_NOTFOUND) {
+    return MTL_FORMAT_VERSION_INITIAL;
+  }
+
+  return *((uint64_t *)value.mv_data);
+}
+
+int mtl_store_format_version(MDB_txn *txn, uint64_t version) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(format_version_key),
+                 .mv_data = (void *)&format_version_key};
+  MDB_val value = {.mv_size = sizeof(version), .mv_data = &version};
+  mdb_put(txn, meta_db, &key, &value, 0);
+
+  return MTL_SUCCESS;
+}
+
+int mtl_load_pack_inode_id(MDB_txn *txn, uint64_t *inode_id) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(pack_inode_key),
+                 .mv_data = (void *)&pack_inode_key};
+  MDB_val value;
+  if (mdb_get(txn, meta_db, &key, &value) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  *inode_id = *((uint64_t *)value.mv_data);
+  return MTL_SUCCESS;
+}
+
+int mtl_store_pack_inode_id(MDB_txn *txn, uint64_t inode_id) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(pack_inode_key),
+                 .mv_data = (void *)&pack_inode_key};
+  MDB_val value = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
+  mdb_put(txn, meta_db, &key, &value, 0);
+
+  return MTL_SUCCESS;
+}
+
+int mtl_load_relocation_inode_id(MDB_txn *txn, uint64_t *inode_id) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(relocation_inode_key),
+                 .mv_data = (void *)&relocation_inode_key};
+  MDB_val value;
+  if (mdb_get(txn, meta_db, &key, &value) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  *inode_id = *((uint64_t *)value.mv_data);
+  return MTL_SUCCESS;
+}
+
+int mtl_store_relocation_inode_id(MDB_txn *txn, uint64_t inode_id) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(relocation_inode_key),
+                 .mv_data = (void *)&relocation_inode_key};
+  MDB_val value = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
+  mdb_put(txn, meta_db, &key, &value, 0);
+
+  return MTL_SUCCESS;
+}
+
+int mtl_load_space_counters(MDB_txn *txn, mtl_space_counters *counters) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(space_counters_key),
+                 .mv_data = (void *)&space_counters_key};
+  MDB_val value;
+  if (mdb_get(txn, meta_db, &key, &value) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  memcpy(counters, value.mv_data, sizeof(*counters));
+  return MTL_SUCCESS;
+}
+
+int mtl_store_space_counters(MDB_txn *txn,
+                             const mtl_space_counters *counters) {
+  MDB_dbi meta_db;
+  mtl_ensure_meta_db_open(txn, &meta_db);
+
+  MDB_val key = {.mv_size = sizeof(space_counters_key),
+                 .mv_data = (void *)&space_counters_key};
+  MDB_val value = {.mv_size = sizeof(*counters), .mv_data = (void *)counters};
+  mdb_put(txn, meta_db, &key, &value, 0);
+
+  return MTL_SUCCESS;
+}
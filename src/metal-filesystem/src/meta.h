@@ -4,7 +4,47 @@
 
 #include <lmdb.h>
 
+// Metadata stores without a format version predate versioning
+#define MTL_FORMAT_VERSION_INITIAL 1
+// Directory entries moved from the inode data to the dirents database
+#define MTL_FORMAT_VERSION_DIRENTS 2
+// File extents moved from the inode data to the file_extents database
+#define MTL_FORMAT_VERSION_FILE_EXTENTS 3
+// Small files may keep their data in the inode data
+#define MTL_FORMAT_VERSION_INLINE_DATA 4
+// Small files may share blocks of the pack file
+#define MTL_FORMAT_VERSION_PACKED_FILES 5
+// Files may share extents, which count their further files
+#define MTL_FORMAT_VERSION_SHARED_EXTENTS 6
+// Inodes count the changes to their extents
+#define MTL_FORMAT_VERSION_INODE_GENERATIONS 7
+
+#define MTL_FORMAT_VERSION MTL_FORMAT_VERSION_INODE_GENERATIONS
+
 uint64_t mtl_next_inode_id(MDB_txn *txn);
 uint64_t mtl_next_heap_node_id(MDB_txn *txn);
 
+uint64_t mtl_load_format_version(MDB_txn *txn);
+int mtl_store_format_version(MDB_txn *txn, uint64_t version);
+
+// The pack file holds the blocks shared by small files, see packed.h
+int mtl_load_pack_inode_id(MDB_txn *txn, uint64_t *inode_id);
+int mtl_store_pack_inode_id(MDB_txn *txn, uint64_t inode_id);
+
+// The relocation file holds the blocks that the defragmenter copies a file
+// to, until they replace the blocks of the file
+int mtl_load_relocation_inode_id(MDB_txn *txn, uint64_t *inode_id);
+int mtl_store_relocation_inode_id(MDB_txn *txn, uint64_t inode_id);
+
+// Kept up to date as extents are reserved and freed, so that statfs doesn't
+// have to scan the extents database. Both are in blocks.
+typedef struct mtl_space_counters {
+  uint64_t free_blocks;
+  // Reservation windows don't count, they are set aside for their file
+  uint64_t largest_free_extent;
+} mtl_space_counters;
+
+int mtl_load_space_counters(MDB_txn *txn, mtl_space_counters *counters);
+int mtl_store_space_counters(MDB_txn *txn, const mtl_space_counters *counters);
+
 int mtl_reset_meta_db();
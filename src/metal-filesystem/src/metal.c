@@ -3,36 +3,141 @@
 #include <assert.h>
 #include <libgen.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include <lmdb.h>
 
+#include <metal-filesystem/directory.h>
 #include <metal-filesystem/extent.h>
+#include <metal-filesystem/file_extent.h>
+#include <metal-filesystem/free_space.h>
 #include <metal-filesystem/heap.h>
 #include <metal-filesystem/inode.h>
 #include <metal-filesystem/metal.h>
 
+#include "databases.h"
+#include "dentry_cache.h"
+#include "group_commit.h"
+#include "io.h"
 #include "meta.h"
+#include "open_files.h"
+#include "packed.h"
+#include "readers.h"
+
+#define MTL_DENTRY_CACHE_SIZE 65536
+
+// Directory entries are fetched in batches, each in a short read transaction,
+// so an open directory handle does not pin a transaction
+#define MTL_DIR_BATCH_SIZE 64
+
+// Number of file extents that are loaded at once when walking a file
+#define MTL_EXTENT_BATCH_SIZE 64
+
+// Sequential writers preallocate as much as their file already has, within
+// these bounds
+#define MTL_MIN_PREALLOCATION (1ul << 20)
+#define MTL_MAX_PREALLOCATION (64ul << 20)
+
+// Cloning splits extents into pieces of at most this size, which bounds the
+// amount of data copied when a shared extent is written to
+#define MTL_MAX_SHARED_EXTENT (4ul << 20)
+
+// mtl_fill_holes writes at most this many zeros at once
+#define MTL_ZERO_BUFFER_SIZE (64ul << 10)
+
+// A defragmenter pass picks at most this many files, and copies their data in
+// pieces of this size
+#define MTL_DEFRAGMENT_CANDIDATES 16
+#define MTL_DEFRAGMENT_COPY_SIZE (1ul << 20)
+
+// The memory map of the metadata store is doubled once less than
+// 1 / MTL_MAP_HEADROOM of it is left
+#define MTL_MAP_HEADROOM 4
+
+// A write transaction that ran out of map space returns this internally once
+// the map has been grown, and the operation runs again. As the map doubles
+// every time, an operation gives up after MTL_MAP_RETRIES attempts.
+#define MTL_RETRY (-1)
+#define MTL_MAP_RETRIES 16
 
 typedef struct mtl_dir {
-  uint64_t length;
-  mtl_directory_entry_head *first;
-  mtl_directory_entry_head *next;
+  uint64_t inode_id;
+  bool complete;
+  uint64_t batch_length;
+  uint64_t batch_position;
+  mtl_directory_entry batch[MTL_DIR_BATCH_SIZE];
+
+  // Only loaded for mtl_readdir_plus. Entries that have disappeared in the
+  // meantime are left with type 0.
+  bool has_attributes;
+  mtl_inode attributes[MTL_DIR_BATCH_SIZE];
 } mtl_dir;
 
 typedef struct mtl_context {
   MDB_env *env;
+  mtl_databases databases;
+  mtl_readers *readers;
   mtl_storage_metadata metadata;
   mtl_storage_backend *storage;
+  mtl_dentry_cache *dentries;
+  mtl_open_files *open_files;
+  mtl_free_space *free_space;
+  mtl_group_commit *group_commit;  // NULL unless group commit is enabled
+
+  // Transactions hold this shared, so that the map can only be resized while
+  // none of them is in progress
+  pthread_rwlock_t map_lock;
+  uint64_t max_map_size;
+  uint64_t map_resizes;
+
+  // Files up to this size keep their data in the inode
+  uint64_t inline_data_size;
+  // Files up to this size share blocks with each other (see packed.h)
+  uint64_t packed_file_size;
+  // Where the next search for free sectors in the pack file starts
+  uint64_t pack_hint;
+
+  // Only one file is defragmented at a time, as they all go through the
+  // relocation file
+  pthread_mutex_t defragment_lock;
+  mtl_defragment_stats defragment_stats;
 } mtl_context;
 
+void mtl_default_options(mtl_options *options) {
+  options->map_size = MTL_DEFAULT_MAP_SIZE;
+  options->max_map_size = 0;
+  options->flags = 0;
+  options->inline_data_size = MTL_DEFAULT_INLINE_DATA_SIZE;
+  options->packed_file_size = MTL_DEFAULT_PACKED_FILE_SIZE;
+}
+
 int mtl_initialize(mtl_context **context, const char *metadata_store,
                    mtl_storage_backend *storage) {
+  mtl_options options;
+  mtl_default_options(&options);
+  return mtl_initialize_with_options(context, metadata_store, storage,
+                                     &options);
+}
+
+int mtl_initialize_with_options(mtl_context **context,
+                                const char *metadata_store,
+                                mtl_storage_backend *storage,
+                                const mtl_options *options) {
   mtl_context *ctx = (mtl_context *)malloc(sizeof(mtl_context));
   ctx->storage = storage;
+  ctx->group_commit = NULL;
+  ctx->max_map_size = options->max_map_size;
+  ctx->map_resizes = 0;
+  ctx->inline_data_size = options->inline_data_size;
+  ctx->pack_hint = 0;
+  memset(&ctx->defragment_stats, 0, sizeof(ctx->defragment_stats));
 
   int res = ctx->storage->initialize(ctx->storage->context);
   if (res != MTL_SUCCESS) {
@@ -40,8 +145,17 @@ int mtl_initialize(mtl_context **context, const char *metadata_store,
   }
 
   mdb_env_create(&ctx->env);
-  mdb_env_set_maxdbs(ctx->env, 4);  // inodes, extents, heap, meta
-  res = mdb_env_open(ctx->env, metadata_store, 0, 0644);
+  // inodes, dirents, file_extents, extents, heap, meta, packed_blocks,
+  // packed_files
+  mdb_env_set_maxdbs(ctx->env, 8);
+  // An existing store is mapped with at least its current size
+  mdb_env_set_mapsize(ctx->env, options->map_size);
+
+  // Read transactions are kept across calls, not bound to their thread
+  unsigned int env_flags = MDB_NOTLS;
+  if (options->flags & MTL_METADATA_WRITEMAP) env_flags |= MDB_WRITEMAP;
+  if (options->flags & MTL_METADATA_NOMEMINIT) env_flags |= MDB_NOMEMINIT;
+  res = mdb_env_open(ctx->env, metadata_store, env_flags, 0644);
 
   if (res == MDB_INVALID) {
     return MTL_ERROR_INVALID_ARGUMENT;
@@ -50,18 +164,76 @@ int mtl_initialize(mtl_context **context, const char *metadata_store,
   MDB_txn *txn;
   mdb_txn_begin(ctx->env, NULL, 0, &txn);
 
+  uint64_t format_version = mtl_load_format_version(txn);
+
+  if (format_version < MTL_FORMAT_VERSION_INODE_GENERATIONS) {
+    // Comes first, as the other migrations read the inodes
+    res = mtl_migrate_inode_generations(txn);
+    if (res != MTL_SUCCESS) {
+      mdb_txn_abort(txn);
+      return res;
+    }
+  }
+
+  if (format_version < MTL_FORMAT_VERSION_DIRENTS) {
+    // Move directory entries out of the directory inodes (if there are any)
+    res = mtl_migrate_directory_entries(txn);
+    if (res != MTL_SUCCESS) {
+      mdb_txn_abort(txn);
+      return res;
+    }
+  }
+
+  if (format_version < MTL_FORMAT_VERSION_FILE_EXTENTS) {
+    // Same for the extents of files
+    res = mtl_migrate_file_extents(txn);
+    if (res != MTL_SUCCESS) {
+      mdb_txn_abort(txn);
+      return res;
+    }
+  }
+
+  if (format_version < MTL_FORMAT_VERSION) {
+    mtl_store_format_version(txn, MTL_FORMAT_VERSION);
+  }
+
   mtl_create_root_directory(txn);
 
   // Query storage metadata
   storage->get_metadata(ctx->storage->context, &ctx->metadata);
 
-  // Create a single extent spanning the entire storage (if necessary)
-  mtl_initialize_extents(txn, ctx->metadata.num_blocks);
+  // A packed file has to fit into a single block
+  ctx->packed_file_size = options->packed_file_size;
+  if (ctx->packed_file_size > ctx->metadata.block_size)
+    ctx->packed_file_size = ctx->metadata.block_size;
+  if (ctx->metadata.block_size < MTL_PACKED_SECTORS) ctx->packed_file_size = 0;
+
+  // Create a single extent spanning the entire storage (if necessary) and
+  // index the free extents
+  mtl_free_space_create(&ctx->free_space);
+  mtl_initialize_extents(txn, ctx->free_space, ctx->metadata.num_blocks);
 
   // mtl_dump_extents(txn);
 
+  // All databases exist now, so their handles can be kept
+  mtl_ensure_inodes_db_open(txn, &ctx->databases.inodes);
+  mtl_ensure_dirents_db_open(txn, &ctx->databases.dirents);
+  mtl_ensure_file_extents_db_open(txn, &ctx->databases.file_extents);
+  mtl_ensure_extents_db_open(txn, &ctx->databases.extents);
+  mtl_ensure_meta_db_open(txn, &ctx->databases.meta);
+  mtl_ensure_packed_blocks_db_open(txn, &ctx->databases.packed_blocks);
+  mtl_ensure_packed_files_db_open(txn, &ctx->databases.packed_files);
+
   mdb_txn_commit(txn);
 
+  mdb_env_set_userctx(ctx->env, &ctx->databases);
+  mtl_readers_create(&ctx->readers, ctx->env);
+  pthread_rwlock_init(&ctx->map_lock, NULL);
+
+  mtl_dentry_cache_create(&ctx->dentries, MTL_DENTRY_CACHE_SIZE);
+  mtl_open_files_create(&ctx->open_files);
+  pthread_mutex_init(&ctx->defragment_lock, NULL);
+
   *context = ctx;
 
   return MTL_SUCCESS;
@@ -70,74 +242,255 @@ int mtl_initialize(mtl_context **context, const char *metadata_store,
 int mtl_deinitialize(mtl_context *context) {
   context->storage->deinitialize(context->storage->context);
 
+  if (context->group_commit) {
+    mtl_group_commit_destroy(context->group_commit);
+  }
+
+  mtl_readers_destroy(context->readers);
   mdb_env_close(context->env);
+  pthread_rwlock_destroy(&context->map_lock);
+
+  mtl_dentry_cache_destroy(context->dentries);
+  mtl_open_files_destroy(context->open_files);
+  mtl_free_space_destroy(context->free_space);
+  pthread_mutex_destroy(&context->defragment_lock);
 
   free(context);
 
   return MTL_SUCCESS;
 }
 
-int mtl_resolve_inode(MDB_txn *txn, const char *path, uint64_t *inode_id) {
-  int res;
-  char *dirc, *basec;
-  char *dir, *base;
+// Returns the number of bytes in use and the size of the map
+static void mtl_map_usage(mtl_context *context, uint64_t *used,
+                          uint64_t *map_size) {
+  MDB_envinfo info;
+  MDB_stat stat;
+  mdb_env_info(context->env, &info);
+  mdb_env_stat(context->env, &stat);
+  *used = (info.me_last_pgno + 1) * stat.ms_psize;
+  *map_size = info.me_mapsize;
+}
 
-  dirc = strdup(path);
-  basec = strdup(path);
+// Doubles the map if less than 1 / MTL_MAP_HEADROOM of it is left, or
+// regardless of that if force is set. Unless force is set, this gives up
+// instead of waiting for the transactions in progress.
+static int mtl_grow_map(mtl_context *context, bool force) {
+  uint64_t used, map_size;
+  mtl_map_usage(context, &used, &map_size);
+  if (!force && map_size - used >= map_size / MTL_MAP_HEADROOM)
+    return MTL_SUCCESS;
 
-  dir = dirname(dirc);
-  base = basename(basec);
+  if (force) {
+    pthread_rwlock_wrlock(&context->map_lock);
+  } else if (pthread_rwlock_trywrlock(&context->map_lock) != 0) {
+    return MTL_SUCCESS;
+  }
 
-  uint64_t dir_inode_id;
-  if (strcmp(dir, "/") == 0) {
-    // Perform a lookup in the root directory file
-    dir_inode_id = 0;
-  } else {
-    res = mtl_resolve_inode(txn, dir, &dir_inode_id);
-    if (res != MTL_SUCCESS) {
-      free(dirc), free(basec);
-      return res;
+  // Someone else might have grown the map in the meantime
+  uint64_t current_map_size;
+  mtl_map_usage(context, &used, &current_map_size);
+  int res = MTL_SUCCESS;
+  if (current_map_size == map_size) {
+    uint64_t new_map_size = 2 * map_size;
+    if (context->max_map_size && new_map_size > context->max_map_size)
+      new_map_size = context->max_map_size;
+
+    if (new_map_size <= map_size ||
+        mdb_env_set_mapsize(context->env, new_map_size) != MDB_SUCCESS) {
+      res = MTL_ERROR_NOSPACE;
+    } else {
+      ++context->map_resizes;
     }
   }
 
-  if (strcmp(base, "/") == 0) {
-    *inode_id = 0;
-    res = MTL_SUCCESS;
-  } else {
-    res = mtl_resolve_inode_in_directory(txn, dir_inode_id, base, inode_id);
-  }
+  pthread_rwlock_unlock(&context->map_lock);
+  return res;
+}
+
+static void mtl_begin_read(mtl_context *context, MDB_txn **txn) {
+  pthread_rwlock_rdlock(&context->map_lock);
+  mtl_readers_begin(context->readers, txn);
+}
 
-  free(dirc), free(basec);
+static void mtl_end_read(mtl_context *context, MDB_txn *txn) {
+  mtl_readers_end(context->readers, txn);
+  pthread_rwlock_unlock(&context->map_lock);
+}
+
+static int mtl_begin(mtl_context *context, MDB_txn **txn) {
+  pthread_rwlock_rdlock(&context->map_lock);
+  int res = mdb_txn_begin(context->env, NULL, 0, txn);
+  if (res != MDB_SUCCESS) pthread_rwlock_unlock(&context->map_lock);
   return res;
 }
 
-int mtl_resolve_parent_dir_inode(MDB_txn *txn, const char *path,
-                                 uint64_t *inode_id) {
-  int res;
-  char *dirc, *dir;
+// Grows the map for a transaction that ran out of space in it. Returns
+// MTL_RETRY, or MTL_ERROR_NOSPACE if the map can't grow any further.
+static int mtl_grow_map_for_retry(mtl_context *context) {
+  return mtl_grow_map(context, true) == MTL_SUCCESS ? MTL_RETRY
+                                                    : MTL_ERROR_NOSPACE;
+}
+
+// Aborts a write transaction and returns res. If a write in it ran out of map
+// space, the map is grown and this returns MTL_RETRY instead.
+static int mtl_abort(mtl_context *context, MDB_txn *txn, int res) {
+  // After such a write, LMDB refuses even reads from the transaction
+  uint8_t probe = 0;
+  MDB_val key = {.mv_size = sizeof(probe), .mv_data = &probe}, value;
+  bool map_full =
+      mdb_get(txn, context->databases.meta, &key, &value) == MDB_BAD_TXN;
+
+  mdb_txn_abort(txn);
+  pthread_rwlock_unlock(&context->map_lock);
+
+  return map_full ? mtl_grow_map_for_retry(context) : res;
+}
+
+// Commits a write transaction. With group commit, it is made durable later.
+// If the map is full, the transaction is lost and the map is grown, so this
+// returns MTL_RETRY for the operation to run again.
+static int mtl_commit(mtl_context *context, MDB_txn *txn) {
+  int res = mdb_txn_commit(txn);
+  pthread_rwlock_unlock(&context->map_lock);
+
+  if (res == MDB_MAP_FULL || res == MDB_BAD_TXN) {
+    // LMDB reports a put that ran out of space on commit as MDB_BAD_TXN
+    return mtl_grow_map_for_retry(context);
+  }
+  if (res != MDB_SUCCESS) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (context->group_commit) {
+    mtl_group_commit_add(context->group_commit);
+  }
+  mtl_grow_map(context, false);
+  return MTL_SUCCESS;
+}
 
-  dirc = strdup(path);
-  dir = dirname(dirc);
+// Whether an operation that returned res runs again because its transaction
+// ran out of map space. After MTL_MAP_RETRIES attempts, res becomes
+// MTL_ERROR_NOSPACE.
+static bool mtl_retry(int *res, int *attempts) {
+  if (*res != MTL_RETRY) return false;
+  if (++*attempts < MTL_MAP_RETRIES) return true;
+  *res = MTL_ERROR_NOSPACE;
+  return false;
+}
 
-  if (strcmp(dir, "/") == 0) {
+// Resolves the first path_length characters of path. Starts at the longest
+// prefix that is present in the dentry cache and caches every component that
+// had to be looked up in the metadata store. dentry_epoch has to be taken
+// before txn was started.
+static int mtl_resolve_path(mtl_context *context, MDB_txn *txn,
+                            uint64_t dentry_epoch, const char *path,
+                            size_t path_length, uint64_t *inode_id) {
+  while (path_length > 0 && path[path_length - 1] == '/') --path_length;
+
+  if (path_length == 0) {
+    // The root directory
     *inode_id = 0;
-    res = MTL_SUCCESS;
-  } else {
-    res = mtl_resolve_inode(txn, dir, inode_id);
+    return MTL_SUCCESS;
   }
 
-  free(dirc);
-  return res;
+  uint64_t current_inode_id = 0;
+  bool hit = mtl_dentry_cache_lookup(context->dentries, path, path_length,
+                                     &current_inode_id);
+  mtl_dentry_cache_count(context->dentries, hit);
+  if (hit) {
+    *inode_id = current_inode_id;
+    return MTL_SUCCESS;
+  }
+
+  // Find the longest cached parent directory
+  size_t resolved_length = path_length;
+  for (;;) {
+    while (resolved_length > 0 && path[resolved_length - 1] != '/')
+      --resolved_length;
+    while (resolved_length > 0 && path[resolved_length - 1] == '/')
+      --resolved_length;
+
+    if (resolved_length == 0) {
+      current_inode_id = 0;
+      break;
+    }
+
+    if (mtl_dentry_cache_lookup(context->dentries, path, resolved_length,
+                                &current_inode_id)) {
+      break;
+    }
+  }
+
+  // Walk down the remaining path components
+  size_t position = resolved_length;
+  while (position < path_length) {
+    while (position < path_length && path[position] == '/') ++position;
+
+    size_t component_start = position;
+    while (position < path_length && path[position] != '/') ++position;
+
+    size_t component_length = position - component_start;
+    if (component_length > MTL_MAX_FILENAME_LENGTH) {
+      return MTL_ERROR_NAMETOOLONG;
+    }
+
+    char component[MTL_MAX_FILENAME_LENGTH + 1];
+    memcpy(component, path + component_start, component_length);
+    component[component_length] = '\0';
+
+    int res = mtl_resolve_inode_in_directory(txn, current_inode_id, component,
+                                             &current_inode_id);
+    if (res != MTL_SUCCESS) {
+      return res;
+    }
+
+    mtl_dentry_cache_insert(context->dentries, path, position,
+                            current_inode_id, dentry_epoch);
+  }
+
+  *inode_id = current_inode_id;
+  return MTL_SUCCESS;
+}
+
+int mtl_resolve_inode(mtl_context *context, MDB_txn *txn, uint64_t dentry_epoch,
+                      const char *path, uint64_t *inode_id) {
+  return mtl_resolve_path(context, txn, dentry_epoch, path, strlen(path),
+                          inode_id);
+}
+
+int mtl_resolve_parent_dir_inode(mtl_context *context, MDB_txn *txn,
+                                 uint64_t dentry_epoch, const char *path,
+                                 uint64_t *inode_id) {
+  size_t path_length = strlen(path);
+
+  // Strip trailing slashes and the last path component
+  while (path_length > 0 && path[path_length - 1] == '/') --path_length;
+  while (path_length > 0 && path[path_length - 1] != '/') --path_length;
+
+  return mtl_resolve_path(context, txn, dentry_epoch, path, path_length,
+                          inode_id);
+}
+
+// The length of an open file might not have been persisted yet
+static uint64_t mtl_current_length(mtl_context *context, uint64_t inode_id,
+                                   uint64_t length) {
+  uint64_t dirty_length;
+  if (mtl_open_files_dirty_length(context->open_files, inode_id,
+                                  &dirty_length) &&
+      dirty_length > length)
+    return dirty_length;
+  return length;
 }
 
 int mtl_get_inode(mtl_context *context, const char *path, mtl_inode *inode) {
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, MDB_RDONLY, &txn);
+  mtl_begin_read(context, &txn);
 
   uint64_t inode_id;
-  int res = mtl_resolve_inode(txn, path, &inode_id);
+  int res = mtl_resolve_inode(context, txn, dentry_epoch, path, &inode_id);
   if (res != MTL_SUCCESS) {  // early exit because inode resolving failed
-    mdb_txn_abort(txn);
+    mtl_end_read(context, txn);
     return res;
   }
 
@@ -152,75 +505,172 @@ int mtl_get_inode(mtl_context *context, const char *path, mtl_inode *inode) {
                              // invalid memory after aborting the DB transaction
   }
 
-  mdb_txn_abort(txn);
+  if (res == MTL_SUCCESS && inode->type == MTL_FILE) {
+    inode->length = mtl_current_length(context, inode_id, inode->length);
+  }
+
+  mtl_end_read(context, txn);
   return res;
 }
 
 int mtl_open(mtl_context *context, const char *filename, uint64_t *inode_id) {
+  uint64_t id;
+
+  // Don't start a transaction if the path is cached
+  if (mtl_dentry_cache_lookup(context->dentries, filename, strlen(filename),
+                              &id)) {
+    mtl_dentry_cache_count(context->dentries, true);
+    if (inode_id) *inode_id = id;
+    return MTL_SUCCESS;
+  }
+
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, MDB_RDONLY, &txn);
+  mtl_begin_read(context, &txn);
 
-  uint64_t id;
-  int res = mtl_resolve_inode(txn, filename, &id);
+  int res = mtl_resolve_inode(context, txn, dentry_epoch, filename, &id);
 
-  mdb_txn_abort(txn);
+  mtl_end_read(context, txn);
 
-  if (inode_id) *inode_id = id;
+  if (res == MTL_SUCCESS && inode_id) *inode_id = id;
 
   return res;
 }
 
 int mtl_opendir(mtl_context *context, const char *filename, mtl_dir **dir) {
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, MDB_RDONLY, &txn);
+  mtl_begin_read(context, &txn);
 
   uint64_t inode_id;
-  int res = mtl_resolve_inode(txn, filename, &inode_id);
+  int res = mtl_resolve_inode(context, txn, dentry_epoch, filename, &inode_id);
+  if (res != MTL_SUCCESS) {
+    mtl_end_read(context, txn);
+    return res;
+  }
 
   const mtl_inode *dir_inode;
-  mtl_directory_entry_head *dir_entries;
-  res = mtl_load_directory(txn, inode_id, &dir_inode, &dir_entries, NULL);
+  res = mtl_load_inode(txn, inode_id, &dir_inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    mtl_end_read(context, txn);
+    return res;
+  }
 
-  char *dir_data = malloc(sizeof(mtl_dir) + dir_inode->length);
+  if (dir_inode->type != MTL_DIRECTORY) {
+    mtl_end_read(context, txn);
+    return MTL_ERROR_NOTDIRECTORY;
+  }
 
-  *dir = (mtl_dir *)dir_data;
-  (*dir)->length = dir_inode->length;
-  (*dir)->next = (mtl_directory_entry_head *)(dir_data + sizeof(mtl_dir));
-  (*dir)->first = (*dir)->next;
+  *dir = (mtl_dir *)malloc(sizeof(mtl_dir));
+  (*dir)->inode_id = inode_id;
+  (*dir)->batch_position = 0;
+  (*dir)->has_attributes = false;
 
-  memcpy(dir_data + sizeof(mtl_dir), dir_entries, dir_inode->length);
+  // Load the first batch right away
+  res = mtl_list_directory_entries(txn, inode_id, NULL, (*dir)->batch,
+                                   MTL_DIR_BATCH_SIZE, &(*dir)->batch_length);
+  (*dir)->complete = res == MTL_COMPLETE;
 
-  // we can abort because we only read
-  mdb_txn_abort(txn);
+  // Hand the transaction back, we only read
+  mtl_end_read(context, txn);
 
-  return res;
+  return MTL_SUCCESS;
 }
 
-int mtl_readdir(mtl_context *context, mtl_dir *dir, char *buffer,
-                uint64_t size) {
-  (void)context;
-  if (dir->next != NULL) {
-    strncpy(buffer, (char *)dir->next + sizeof(mtl_directory_entry_head),
-            size < dir->next->name_len ? size : dir->next->name_len);
+// Loads the attributes of the rest of the current batch
+static void mtl_load_dir_attributes(mtl_context *context, MDB_txn *txn,
+                                    mtl_dir *dir) {
+  for (uint64_t i = dir->batch_position; i < dir->batch_length; ++i) {
+    uint64_t inode_id = dir->batch[i].inode_id;
+    const mtl_inode *inode;
+    if (mtl_load_inode(txn, inode_id, &inode, NULL, NULL) != MTL_SUCCESS) {
+      memset(&dir->attributes[i], 0, sizeof(mtl_inode));
+      continue;
+    }
 
-    // Null-terminate
-    if (size > dir->next->name_len) buffer[dir->next->name_len] = '\0';
+    dir->attributes[i] = *inode;
+    if (inode->type == MTL_FILE) {
+      dir->attributes[i].length =
+          mtl_current_length(context, inode_id, inode->length);
+    }
+  }
+  dir->has_attributes = true;
+}
 
-    mtl_directory_entry_head *next =
-        (mtl_directory_entry_head *)((char *)dir->next +
-                                     sizeof(mtl_directory_entry_head) +
-                                     dir->next->name_len);
+// Returns the next entry of dir, or NULL once all of them have been returned
+static const mtl_directory_entry *mtl_next_dir_entry(mtl_context *context,
+                                                     mtl_dir *dir,
+                                                     bool with_attributes) {
+  if (dir->batch_position == dir->batch_length) {
+    if (dir->complete || dir->batch_length == 0) {
+      return NULL;
+    }
 
-    if ((char *)next + sizeof(mtl_directory_entry_head) >
-        (char *)dir->first + dir->length) {
-      next = NULL;
+    // Continue after the last entry of the previous batch
+    char after[MTL_MAX_FILENAME_LENGTH + 1];
+    strcpy(after, dir->batch[dir->batch_length - 1].name);
+
+    MDB_txn *txn;
+    mtl_begin_read(context, &txn);
+    int res = mtl_list_directory_entries(txn, dir->inode_id, after, dir->batch,
+                                         MTL_DIR_BATCH_SIZE,
+                                         &dir->batch_length);
+    dir->complete = res == MTL_COMPLETE;
+    dir->batch_position = 0;
+    dir->has_attributes = false;
+
+    // The attributes are read in the same transaction as the names
+    if (with_attributes) mtl_load_dir_attributes(context, txn, dir);
+    mtl_end_read(context, txn);
+
+    if (dir->batch_length == 0) {
+      return NULL;
     }
-    dir->next = next;
+  } else if (with_attributes && !dir->has_attributes) {
+    // The batch has been loaded without them (e.g. by mtl_opendir)
+    MDB_txn *txn;
+    mtl_begin_read(context, &txn);
+    mtl_load_dir_attributes(context, txn, dir);
+    mtl_end_read(context, txn);
+  }
 
-    return MTL_SUCCESS;
+  return &dir->batch[dir->batch_position++];
+}
+
+static void mtl_copy_dir_entry_name(const mtl_directory_entry *entry,
+                                    char *buffer, uint64_t size) {
+  strncpy(buffer, entry->name, size < entry->name_len ? size : entry->name_len);
+
+  // Null-terminate
+  if (size > entry->name_len) buffer[entry->name_len] = '\0';
+}
+
+int mtl_readdir(mtl_context *context, mtl_dir *dir, char *buffer,
+                uint64_t size) {
+  const mtl_directory_entry *entry = mtl_next_dir_entry(context, dir, false);
+  if (entry == NULL) {
+    return MTL_COMPLETE;
   }
 
-  return MTL_COMPLETE;
+  mtl_copy_dir_entry_name(entry, buffer, size);
+  return MTL_SUCCESS;
+}
+
+int mtl_readdir_plus(mtl_context *context, mtl_dir *dir, char *buffer,
+                     uint64_t size, uint64_t *inode_id, mtl_inode *inode) {
+  const mtl_directory_entry *entry;
+  do {
+    entry = mtl_next_dir_entry(context, dir, true);
+    if (entry == NULL) {
+      return MTL_COMPLETE;
+    }
+    // Skip entries that have been removed after their names were listed
+  } while (dir->attributes[dir->batch_position - 1].type == 0);
+
+  mtl_copy_dir_entry_name(entry, buffer, size);
+  if (inode_id) *inode_id = entry->inode_id;
+  if (inode) *inode = dir->attributes[dir->batch_position - 1];
+  return MTL_SUCCESS;
 }
 
 int mtl_closedir(mtl_context *context, mtl_dir *dir) {
@@ -229,17 +679,18 @@ int mtl_closedir(mtl_context *context, mtl_dir *dir) {
   return MTL_SUCCESS;
 }
 
-int mtl_mkdir(mtl_context *context, const char *filename, int mode) {
+static int mtl_try_mkdir(mtl_context *context, const char *filename, int mode) {
   int res;
 
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
+  mtl_begin(context, &txn);
 
   uint64_t parent_dir_inode_id;
-  res = mtl_resolve_parent_dir_inode(txn, filename, &parent_dir_inode_id);
+  res = mtl_resolve_parent_dir_inode(context, txn, dentry_epoch, filename,
+                                     &parent_dir_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
-    return res;
+    return mtl_abort(context, txn, res);
   }
 
   char *basec, *base;
@@ -250,27 +701,36 @@ int mtl_mkdir(mtl_context *context, const char *filename, int mode) {
   res = mtl_create_directory_in_directory(txn, parent_dir_inode_id, base, mode,
                                           &new_dir_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    res = mtl_abort(context, txn, res);
     free(basec);
     return res;
   }
 
-  mdb_txn_commit(txn);
+  res = mtl_commit(context, txn);
   free(basec);
-  return MTL_SUCCESS;
+  return res;
 }
 
-int mtl_rmdir(mtl_context *context, const char *filename) {
+int mtl_mkdir(mtl_context *context, const char *filename, int mode) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_mkdir(context, filename, mode);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+static int mtl_try_rmdir(mtl_context *context, const char *filename) {
   int res;
 
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
+  mtl_begin(context, &txn);
 
   uint64_t parent_dir_inode_id;
-  res = mtl_resolve_parent_dir_inode(txn, filename, &parent_dir_inode_id);
+  res = mtl_resolve_parent_dir_inode(context, txn, dentry_epoch, filename,
+                                     &parent_dir_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
-    return res;
+    return mtl_abort(context, txn, res);
   }
 
   char *basec, *base;
@@ -281,7 +741,7 @@ int mtl_rmdir(mtl_context *context, const char *filename) {
   res = mtl_remove_entry_from_directory(txn, parent_dir_inode_id, base,
                                         &inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    res = mtl_abort(context, txn, res);
     free(basec);
     return res;
   }
@@ -290,24 +750,38 @@ int mtl_rmdir(mtl_context *context, const char *filename) {
 
   res = mtl_remove_directory(txn, inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    return mtl_abort(context, txn, res);
+  }
+
+  res = mtl_commit(context, txn);
+  if (res != MTL_SUCCESS) {
     return res;
   }
 
-  mdb_txn_commit(txn);
+  mtl_dentry_cache_invalidate(context->dentries, filename, true);
   return MTL_SUCCESS;
 }
 
-int mtl_chown(mtl_context *context, const char *path, int uid, int gid) {
+int mtl_rmdir(mtl_context *context, const char *filename) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_rmdir(context, filename);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+static int mtl_try_chown(mtl_context *context, const char *path, int uid,
+                         int gid) {
   int res;
 
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  res = mdb_txn_begin(context->env, NULL, 0, &txn);
+  res = mtl_begin(context, &txn);
 
   uint64_t inode_id;
-  res = mtl_resolve_inode(txn, path, &inode_id);
+  res = mtl_resolve_inode(context, txn, dentry_epoch, path, &inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    mtl_abort(context, txn, res);
     return -res;
   }
 
@@ -317,7 +791,7 @@ int mtl_chown(mtl_context *context, const char *path, int uid, int gid) {
   uint64_t data_length;
   res = mtl_load_inode(txn, inode_id, &old_inode, &data, &data_length);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    mtl_abort(context, txn, res);
     return -res;
   }
 
@@ -328,31 +802,41 @@ int mtl_chown(mtl_context *context, const char *path, int uid, int gid) {
     new_inode.group = gid;
   }
   res = mtl_put_inode(txn, inode_id, &new_inode, data, data_length);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
 
-  mdb_txn_commit(txn);
+  return mtl_commit(context, txn);
+}
+
+int mtl_chown(mtl_context *context, const char *path, int uid, int gid) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_chown(context, path, uid, gid);
+  } while (mtl_retry(&res, &attempts));
   return res;
 }
 
-int mtl_rename(mtl_context *context, const char *from_filename,
-               const char *to_filename) {
+static int mtl_try_rename(mtl_context *context, const char *from_filename,
+                          const char *to_filename) {
   int res;
 
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
+  mtl_begin(context, &txn);
 
   uint64_t from_parent_dir_inode_id;
-  res = mtl_resolve_parent_dir_inode(txn, from_filename,
+  res = mtl_resolve_parent_dir_inode(context, txn, dentry_epoch, from_filename,
                                      &from_parent_dir_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
-    return res;
+    return mtl_abort(context, txn, res);
   }
 
   uint64_t to_parent_dir_inode_id;
-  res = mtl_resolve_parent_dir_inode(txn, to_filename, &to_parent_dir_inode_id);
+  res = mtl_resolve_parent_dir_inode(context, txn, dentry_epoch, to_filename,
+                                     &to_parent_dir_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
-    return res;
+    return mtl_abort(context, txn, res);
   }
 
   char *from_basec, *from_base, *to_basec, *to_base;
@@ -365,7 +849,7 @@ int mtl_rename(mtl_context *context, const char *from_filename,
   res = mtl_remove_entry_from_directory(txn, from_parent_dir_inode_id,
                                         from_base, &inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    res = mtl_abort(context, txn, res);
     free(from_basec);
     free(to_basec);
     return res;
@@ -373,7 +857,7 @@ int mtl_rename(mtl_context *context, const char *from_filename,
   res = mtl_append_inode_id_to_directory(txn, to_parent_dir_inode_id, to_base,
                                          inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    res = mtl_abort(context, txn, res);
     free(from_basec);
     free(to_basec);
     return res;
@@ -382,22 +866,38 @@ int mtl_rename(mtl_context *context, const char *from_filename,
   free(from_basec);
   free(to_basec);
 
-  mdb_txn_commit(txn);
+  res = mtl_commit(context, txn);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  // Everything below a renamed directory has moved as well
+  mtl_dentry_cache_invalidate(context->dentries, from_filename, true);
   return MTL_SUCCESS;
 }
 
-int mtl_create(mtl_context *context, const char *filename, int mode,
-               uint64_t *inode_id) {
+int mtl_rename(mtl_context *context, const char *from_filename,
+               const char *to_filename) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_rename(context, from_filename, to_filename);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+static int mtl_try_create(mtl_context *context, const char *filename, int mode,
+                          uint64_t *inode_id) {
   int res;
 
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
+  mtl_begin(context, &txn);
 
   uint64_t parent_dir_inode_id;
-  res = mtl_resolve_parent_dir_inode(txn, filename, &parent_dir_inode_id);
+  res = mtl_resolve_parent_dir_inode(context, txn, dentry_epoch, filename,
+                                     &parent_dir_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
-    return res;
+    return mtl_abort(context, txn, res);
   }
 
   char *basec, *base;
@@ -408,223 +908,2278 @@ int mtl_create(mtl_context *context, const char *filename, int mode,
   res = mtl_create_file_in_directory(txn, parent_dir_inode_id, base, mode,
                                      &file_inode_id);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    res = mtl_abort(context, txn, res);
     free(basec);
     return res;
   }
 
-  mdb_txn_commit(txn);
+  res = mtl_commit(context, txn);
   free(basec);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
 
   if (inode_id) *inode_id = file_inode_id;
 
   return MTL_SUCCESS;
 }
 
-int mtl_expand_inode(mtl_context *context, MDB_txn *txn, uint64_t inode_id,
-                     const mtl_file_extent *extents, uint64_t extents_length,
-                     uint64_t size) {
-  // Check how long we intend to write
-  uint64_t write_end_bytes = size;
-  uint64_t write_end_blocks = write_end_bytes / context->metadata.block_size;
-  if (write_end_bytes % context->metadata.block_size) ++write_end_blocks;
-
-  uint64_t current_inode_length_blocks = 0;
-  mtl_file_extent last_extent = {
-      .offset = 0, .length = 0};  // Used to append data if possible
-  {
-    for (uint64_t extent = 0; extent < extents_length; ++extent)
-      current_inode_length_blocks += extents[extent].length;
+int mtl_create(mtl_context *context, const char *filename, int mode,
+               uint64_t *inode_id) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_create(context, filename, mode, inode_id);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
 
-    if (extents_length > 0) last_extent = extents[extents_length - 1];
+// Allocates the blocks [first_block, end_block) of a file, which has none of
+// them yet. previous is the extent right in front of first_block (or NULL) and
+// is extended in place if possible. The blocks in front of required_end_block
+// have to be allocated, the others are only allocated as long as there is
+// space left. filled tells whether all of them have been allocated.
+static int mtl_fill_hole(mtl_context *context, MDB_txn *txn, uint64_t inode_id,
+                         uint64_t first_block, uint64_t end_block,
+                         uint64_t required_end_block,
+                         const mtl_file_extent *previous,
+                         uint64_t previous_first_block, bool commit,
+                         uint64_t new_length, bool *filled) {
+  mtl_file_extent last_extent = {.offset = 0, .length = 0};
+  uint64_t last_extent_first_block = 0;
+  if (previous) {
+    last_extent = *previous;
+    last_extent_first_block = previous_first_block;
   }
 
-  while (current_inode_length_blocks < write_end_blocks) {
+  uint64_t block = first_block;
+  while (block < end_block) {
     // Allocate a new occupied extent with the requested length
     mtl_file_extent new_extent;
     new_extent.length = mtl_reserve_extent(
-        txn, write_end_blocks - current_inode_length_blocks,
-        last_extent.length ? &last_extent : NULL, &new_extent.offset, true);
-    current_inode_length_blocks += new_extent.length;
-    assert(new_extent
-               .length);  // TODO: We don't handle "no space left on device" yet
-
-    uint64_t new_length =
-        write_end_bytes >
-                current_inode_length_blocks * context->metadata.block_size
-            ? current_inode_length_blocks * context->metadata.block_size
-            : write_end_bytes;
+        txn, context->free_space, inode_id, end_block - block,
+        last_extent.length ? &last_extent : NULL, &new_extent.offset, commit);
+    if (new_extent.length == 0) {
+      *filled = false;
+      return block < required_end_block ? MTL_ERROR_NOSPACE : MTL_SUCCESS;
+    }
+    uint64_t new_extent_first_block = block;
+    block += new_extent.length;
 
     // If the new_extent offset matches the last_extent offset, we've extended
     // that last_extent
     if (last_extent.length && last_extent.offset == new_extent.offset) {
       last_extent.length += new_extent.length;
-      mtl_extend_last_extent_in_file(txn, inode_id, &last_extent, new_length);
+      mtl_extend_last_extent_in_file(txn, inode_id, last_extent_first_block,
+                                     &last_extent, new_length);
     } else {
       // Otherwise, assign the new extent to the file
-      mtl_add_extent_to_file(txn, inode_id, &new_extent, new_length);
+      mtl_add_extent_to_file(txn, inode_id, new_extent_first_block,
+                             &new_extent, new_length);
       last_extent = new_extent;
+      last_extent_first_block = new_extent_first_block;
     }
   }
 
+  *filled = true;
   return MTL_SUCCESS;
 }
 
-int mtl_write(mtl_context *context, uint64_t inode_id, const char *buffer,
-              uint64_t size, uint64_t offset) {
-  MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
-
-  const mtl_inode *inode;
-  const mtl_file_extent *extents;
-  uint64_t extents_length;
-  mtl_load_file(txn, inode_id, &inode, &extents, &extents_length);
+// Makes sure that the file has blocks for the bytes from offset up to at least
+// reserve_size and extends its length to size. Only the holes in this range
+// are allocated. Blocks behind the end of the allocated part of the file are
+// marked as reserved unless commit is set, blocks in holes in front of it are
+// always committed. Blocks beyond size are only allocated as long as there is
+// space left. allocated_from (which may be NULL) receives the end of the
+// allocated part of the file before.
+int mtl_expand_inode(mtl_context *context, MDB_txn *txn, uint64_t inode_id,
+                     uint64_t offset, uint64_t size, uint64_t reserve_size,
+                     bool commit, uint64_t *allocated_from) {
+  // Check how long we intend to write
+  uint64_t first_block = offset / context->metadata.block_size;
+  uint64_t write_end_blocks = size / context->metadata.block_size;
+  if (size % context->metadata.block_size) ++write_end_blocks;
 
-  int res = mtl_expand_inode(context, txn, inode_id, extents, extents_length,
-                             offset + size);
+  uint64_t reserve_end_blocks = reserve_size / context->metadata.block_size;
+  if (reserve_size % context->metadata.block_size) ++reserve_end_blocks;
+  if (reserve_end_blocks < write_end_blocks)
+    reserve_end_blocks = write_end_blocks;
 
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
     return res;
   }
+  uint64_t new_length = inode->length < size ? size : inode->length;
+
+  uint64_t last_extent_first_block = 0;
+  mtl_file_extent last_extent = {.offset = 0, .length = 0};
+  mtl_load_last_file_extent(txn, inode_id, &last_extent,
+                            &last_extent_first_block);
+  uint64_t allocated_end = last_extent_first_block + last_extent.length;
+  if (allocated_from) *allocated_from = allocated_end;
+
+  uint64_t block = first_block;
+  while (block < reserve_end_blocks) {
+    // Skip the extents covering block. Starting one block earlier also yields
+    // the extent in front of a hole at block, which we might extend.
+    mtl_file_extent extents[MTL_EXTENT_BATCH_SIZE];
+    uint64_t first_blocks[MTL_EXTENT_BATCH_SIZE];
+    uint64_t extents_length;
+    mtl_load_file_extents(txn, inode_id, block ? block - 1 : 0, extents,
+                          first_blocks, MTL_EXTENT_BATCH_SIZE,
+                          &extents_length);
+
+    const mtl_file_extent *previous = NULL;
+    uint64_t previous_first_block = 0;
+    uint64_t hole_end = reserve_end_blocks;
+    uint64_t i = 0;
+    for (; i < extents_length; ++i) {
+      uint64_t extent_end = first_blocks[i] + extents[i].length;
+      if (first_blocks[i] > block) {
+        if (first_blocks[i] < hole_end) hole_end = first_blocks[i];
+        break;
+      }
 
-  mdb_txn_commit(txn);
+      if (extent_end >= block) {
+        previous = &extents[i];
+        previous_first_block = first_blocks[i];
+        block = extent_end;
+      }
+    }
 
-  // Copy the actual data to storage
-  context->storage->write(context, context->storage->context, inode_id, offset,
-                          buffer, size);
+    if (i == MTL_EXTENT_BATCH_SIZE) {
+      // There might be more extents covering block
+      continue;
+    }
+
+    if (block >= reserve_end_blocks) break;
+
+    bool filled;
+    res = mtl_fill_hole(context, txn, inode_id, block, hole_end,
+                        write_end_blocks, previous, previous_first_block,
+                        block < allocated_end || commit, new_length, &filled);
+    if (res != MTL_SUCCESS) {
+      return res;
+    }
+    if (!filled) break;
+
+    block = hole_end;
+  }
+
+  // The allocated blocks might have been large enough already
+  mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (inode->length < size) {
+    mtl_set_file_length(txn, inode_id, size);
+  }
 
   return MTL_SUCCESS;
 }
 
-uint64_t mtl_read(mtl_context *context, uint64_t inode_id, char *buffer,
-                  uint64_t size, uint64_t offset) {
-  MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, MDB_RDONLY, &txn);
+// Data that can only be written to storage once the transaction that made
+// room for it has been committed
+typedef struct mtl_pending_write {
+  uint64_t inode_id;
+  uint64_t offset;
+  char *data;  // NULL if there is nothing to write
+  uint64_t length;
+} mtl_pending_write;
 
-  uint64_t read_len = size;
+static void mtl_finish_write(mtl_context *context,
+                             mtl_pending_write *pending) {
+  if (pending->data == NULL) return;
 
-  // Prepare the storage and check how much we can read
-  const mtl_inode *inode;
-  const mtl_file_extent *extents;
-  uint64_t extents_length;
-  mtl_load_file(txn, inode_id, &inode, &extents, &extents_length);
+  context->storage->write(context, context->storage->context,
+                          pending->inode_id, pending->offset, pending->data,
+                          pending->length);
+  free(pending->data);
+  pending->data = NULL;
+}
 
-  if (inode->length < offset) {
-    read_len = 0;
-  } else if (inode->length < offset + size) {
-    read_len -= (offset + size) - inode->length;
+// Copies of shared blocks, which go to the blocks replacing them
+typedef struct mtl_pending_writes {
+  mtl_pending_write *writes;
+  uint64_t length;
+} mtl_pending_writes;
+
+static int mtl_add_pending_write(mtl_pending_writes *pending,
+                                 const mtl_pending_write *write) {
+  mtl_pending_write *writes =
+      realloc(pending->writes, (pending->length + 1) * sizeof(*writes));
+  if (writes == NULL) {
+    return MTL_ERROR_NOSPACE;
   }
 
-  mdb_txn_abort(txn);
+  writes[pending->length++] = *write;
+  pending->writes = writes;
+  return MTL_SUCCESS;
+}
 
-  if (read_len > 0)
-    // Copy the actual data from storage
-    context->storage->read(context, context->storage->context, inode_id, offset,
-                           buffer, read_len);
+static void mtl_finish_writes(mtl_context *context,
+                              mtl_pending_writes *pending) {
+  for (uint64_t i = 0; i < pending->length; ++i)
+    mtl_finish_write(context, &pending->writes[i]);
 
-  return read_len;
+  free(pending->writes);
+  pending->writes = NULL;
+  pending->length = 0;
 }
 
-int mtl_truncate(mtl_context *context, uint64_t inode_id, uint64_t offset) {
-  MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
+// For when the transaction has been aborted
+static void mtl_drop_writes(mtl_pending_writes *pending) {
+  for (uint64_t i = 0; i < pending->length; ++i) free(pending->writes[i].data);
 
-  const mtl_inode *inode;
-  const mtl_file_extent *extents;
-  uint64_t extents_length;
-  mtl_load_file(txn, inode_id, &inode, &extents, &extents_length);
+  free(pending->writes);
+  pending->writes = NULL;
+  pending->length = 0;
+}
+
+// Gives a file blocks of its own for the first keep blocks of a shared extent
+// starting at first_block, and drops its share of the extent. Unless copy is
+// false (because the caller overwrites them anyway), the data of these blocks
+// is read right away and goes to the new blocks through pending.
+static int mtl_unshare_extent(mtl_context *context, MDB_txn *txn,
+                              uint64_t inode_id, uint64_t first_block,
+                              const mtl_file_extent *extent, uint64_t keep,
+                              bool copy, mtl_pending_writes *pending) {
+  uint64_t block_size = context->metadata.block_size;
+  mtl_pending_write write = {.inode_id = inode_id,
+                             .offset = first_block * block_size,
+                             .data = NULL,
+                             .length = keep * block_size};
+  if (copy) {
+    write.data = malloc(write.length);
+    if (write.data == NULL) {
+      return MTL_ERROR_NOSPACE;
+    }
 
-  if (offset >= inode->length) {
-    int res = mtl_expand_inode(context, txn, inode_id, extents, extents_length,
-                               offset);
+    // The storage still maps the file as of the last commit
+    int res = context->storage->read(context, context->storage->context,
+                                     inode_id, write.offset, write.data,
+                                     write.length);
     if (res != MTL_SUCCESS) {
-      mdb_txn_abort(txn);
+      free(write.data);
       return res;
     }
-  } else {
-    // Figure out how many extents we can keep
-    uint64_t previous_extent_end = 0;
+  }
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+
+  // The first new extent takes the place of the shared one in the file
+  bool filled = false;
+  if (res == MTL_SUCCESS)
+    res = mtl_fill_hole(context, txn, inode_id, first_block,
+                        first_block + keep, first_block + keep, NULL, 0, true,
+                        inode->length, &filled);
+  if (res == MTL_SUCCESS)
+    res = mtl_free_extent(txn, context->free_space, extent->offset);
+  if (res == MTL_SUCCESS && copy) res = mtl_add_pending_write(pending, &write);
+
+  if (res != MTL_SUCCESS) free(write.data);
+  return res;
+}
+
+// Unshares the extents of a file overlapping the byte range [offset, end).
+// If overwrite is set, the caller writes the range, so the extents that lie
+// within it are not copied.
+static int mtl_unshare_range(mtl_context *context, MDB_txn *txn,
+                             uint64_t inode_id, uint64_t offset, uint64_t end,
+                             bool overwrite, mtl_pending_writes *pending) {
+  uint64_t block_size = context->metadata.block_size;
+  uint64_t block = offset / block_size;
+  uint64_t end_block = end / block_size;
+  if (end % block_size) ++end_block;
+
+  mtl_file_extent extents[MTL_EXTENT_BATCH_SIZE];
+  uint64_t first_blocks[MTL_EXTENT_BATCH_SIZE];
+  uint64_t extents_length;
+  do {
+    mtl_load_file_extents(txn, inode_id, block, extents, first_blocks,
+                          MTL_EXTENT_BATCH_SIZE, &extents_length);
+
+    for (uint64_t i = 0; i < extents_length && first_blocks[i] < end_block;
+         ++i) {
+      if (!mtl_extent_is_shared(txn, extents[i].offset)) continue;
+
+      uint64_t extent_end = first_blocks[i] + extents[i].length;
+      bool overwritten = overwrite &&
+                         first_blocks[i] * block_size >= offset &&
+                         extent_end * block_size <= end;
+      int res = mtl_unshare_extent(context, txn, inode_id, first_blocks[i],
+                                   &extents[i], extents[i].length,
+                                   !overwritten, pending);
+      if (res != MTL_SUCCESS) {
+        return res;
+      }
+    }
+
+    if (extents_length)
+      block = first_blocks[extents_length - 1] +
+              extents[extents_length - 1].length;
+  } while (extents_length == MTL_EXTENT_BATCH_SIZE && block < end_block);
+
+  return MTL_SUCCESS;
+}
+
+// Frees the blocks behind the end of the file at length and commits the
+// preallocated blocks in front of it, starting at preallocated_from. A shared
+// extent at the end of the file is copied through unshared.
+static int mtl_trim_file(mtl_context *context, MDB_txn *txn,
+                         uint64_t inode_id, uint64_t length,
+                         uint64_t preallocated_from,
+                         mtl_pending_writes *unshared) {
+  // Figure out how many blocks we can keep
+  uint64_t blocks = length / context->metadata.block_size;
+  if (length % context->metadata.block_size) ++blocks;
+
+  mtl_file_extent extents[MTL_EXTENT_BATCH_SIZE];
+  uint64_t first_blocks[MTL_EXTENT_BATCH_SIZE];
+  uint64_t extents_length;
+  uint64_t next_block = preallocated_from < blocks ? preallocated_from : blocks;
+  do {
+    mtl_load_file_extents(txn, inode_id, next_block, extents, first_blocks,
+                          MTL_EXTENT_BATCH_SIZE, &extents_length);
+
     for (uint64_t i = 0; i < extents_length; ++i) {
-      uint64_t extent_end = previous_extent_end +
-                            (extents[i].length * context->metadata.block_size);
-
-      if (previous_extent_end > offset) {
-        // The current extent has to be freed
-
-        mtl_free_extent(txn, extents[i].offset);
-      } else if (extent_end > offset) {
-        // This is the first extent that has to be modified or dropped
-        // Update the inode in the process
-
-        uint64_t new_extent_length_bytes = offset - previous_extent_end;
-        uint64_t new_extent_length_blocks =
-            new_extent_length_bytes / context->metadata.block_size;
-        if (new_extent_length_bytes % context->metadata.block_size)
-          ++new_extent_length_blocks;
-
-        if (new_extent_length_blocks) {
-          // We have to modify the extent
-          mtl_truncate_extent(txn, extents[i].offset, new_extent_length_blocks);
-          mtl_truncate_file_extents(txn, inode_id, offset, i + 1,
-                                    &new_extent_length_blocks);
+      if (first_blocks[i] + extents[i].length <= blocks) {
+        // The extent has been written to completely
+        mtl_commit_extent(txn, extents[i].offset);
+      } else if (first_blocks[i] < blocks) {
+        // We have to modify the extent. Other files keep all of a shared
+        // one, so the file gets a copy of the part it keeps.
+        if (mtl_extent_is_shared(txn, extents[i].offset)) {
+          int res = mtl_unshare_extent(context, txn, inode_id, first_blocks[i],
+                                       &extents[i], blocks - first_blocks[i],
+                                       true, unshared);
+          if (res != MTL_SUCCESS) {
+            return res;
+          }
         } else {
-          // We can drop the extent
-          mtl_free_extent(txn, extents[i].offset);
-          mtl_truncate_file_extents(txn, inode_id, offset, i, NULL);
+          mtl_truncate_extent(txn, context->free_space, extents[i].offset,
+                              blocks - first_blocks[i]);
         }
       } else {
-        // This extent is still valid -- keep unmodified
+        // We can drop the extent
+        mtl_free_extent(txn, context->free_space, extents[i].offset);
+      }
+    }
+
+    if (extents_length)
+      next_block = first_blocks[extents_length - 1] +
+                   extents[extents_length - 1].length;
+  } while (extents_length == MTL_EXTENT_BATCH_SIZE);
+
+  return mtl_truncate_file_extents(txn, inode_id, length, blocks);
+}
+
+// Loads all extents of a file and the logical blocks they start at into newly
+// allocated arrays. The blocks [shared_first_block, shared_end_block) cover
+// the extents that the file shares with others.
+static int mtl_load_all_file_extents(MDB_txn *txn, uint64_t inode_id,
+                                     mtl_file_extent **extents,
+                                     uint64_t **first_blocks,
+                                     uint64_t *extents_length,
+                                     uint64_t *shared_first_block,
+                                     uint64_t *shared_end_block) {
+  uint64_t capacity = 0;
+  *extents = NULL;
+  *first_blocks = NULL;
+  *extents_length = 0;
+  *shared_first_block = *shared_end_block = 0;
+
+  mtl_file_extent batch[MTL_EXTENT_BATCH_SIZE];
+  uint64_t batch_first_blocks[MTL_EXTENT_BATCH_SIZE];
+  uint64_t batch_length;
+  uint64_t next_block = 0;
+  do {
+    mtl_load_file_extents(txn, inode_id, next_block, batch, batch_first_blocks,
+                          MTL_EXTENT_BATCH_SIZE, &batch_length);
+    if (batch_length == 0) break;
+
+    if (*extents_length + batch_length > capacity) {
+      capacity = capacity ? capacity * 2 : MTL_EXTENT_BATCH_SIZE;
+      mtl_file_extent *new_extents =
+          realloc(*extents, capacity * sizeof(mtl_file_extent));
+      uint64_t *new_first_blocks =
+          new_extents ? realloc(*first_blocks, capacity * sizeof(uint64_t))
+                      : NULL;
+      if (new_first_blocks == NULL) {
+        free(new_extents ? new_extents : *extents);
+        free(*first_blocks);
+        *extents = NULL;
+        *first_blocks = NULL;
+        return MTL_ERROR_INVALID_ARGUMENT;
       }
+      *extents = new_extents;
+      *first_blocks = new_first_blocks;
+    }
+
+    memcpy(*extents + *extents_length, batch,
+           batch_length * sizeof(mtl_file_extent));
+    memcpy(*first_blocks + *extents_length, batch_first_blocks,
+           batch_length * sizeof(uint64_t));
+    *extents_length += batch_length;
+
+    for (uint64_t i = 0; i < batch_length; ++i) {
+      if (!mtl_extent_is_shared(txn, batch[i].offset)) continue;
+
+      if (*shared_end_block == 0) *shared_first_block = batch_first_blocks[i];
+      *shared_end_block = batch_first_blocks[i] + batch[i].length;
+    }
+
+    next_block = batch_first_blocks[batch_length - 1] +
+                 batch[batch_length - 1].length;
+  } while (batch_length == MTL_EXTENT_BATCH_SIZE);
 
-      previous_extent_end = extent_end;
+  return MTL_SUCCESS;
+}
+
+// Loads the length of a file and refreshes its snapshot if the file is open
+static int mtl_load_file_length(mtl_context *context, uint64_t inode_id,
+                                uint64_t *length) {
+  uint64_t version;
+  bool is_open =
+      mtl_open_files_version(context->open_files, inode_id, &version);
+
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res == MTL_SUCCESS) {
+    *length = inode->length;
+    if (is_open) {
+      mtl_file_extent *extents;
+      uint64_t *first_blocks;
+      uint64_t extents_length, shared_first_block, shared_end_block;
+      if (mtl_load_all_file_extents(txn, inode_id, &extents, &first_blocks,
+                                    &extents_length, &shared_first_block,
+                                    &shared_end_block) == MTL_SUCCESS) {
+        mtl_open_files_store(context->open_files, inode_id, version,
+                             inode->length, extents, first_blocks,
+                             extents_length, shared_first_block,
+                             shared_end_block);
+        free(extents);
+        free(first_blocks);
+      }
+      *length = mtl_current_length(context, inode_id, *length);
     }
   }
 
-  mdb_txn_commit(txn);
+  mtl_end_read(context, txn);
+  return res;
+}
+
+int mtl_open_file(mtl_context *context, uint64_t inode_id) {
+  int res = mtl_open_files_acquire(context->open_files, inode_id);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  // Take the initial snapshot
+  uint64_t length;
+  res = mtl_load_file_length(context, inode_id, &length);
+  if (res != MTL_SUCCESS) {
+    mtl_open_files_release(context->open_files, inode_id);
+  }
+
+  return res;
+}
+
+// Persists the length of an open file if it has only been changed in memory.
+// If trim is set, this also gives back the preallocated blocks that have not
+// been written to.
+static int mtl_try_settle_file(mtl_context *context, uint64_t inode_id,
+                               bool trim) {
+  uint64_t dirty_length;
+  bool is_dirty = mtl_open_files_dirty_length(context->open_files, inode_id,
+                                              &dirty_length);
+  uint64_t preallocated_from =
+      trim ? mtl_open_files_take_preallocated(context->open_files, inode_id)
+           : UINT64_MAX;
+  if (!is_dirty && preallocated_from == UINT64_MAX) {
+    return MTL_SUCCESS;
+  }
+
+  uint64_t version;
+  mtl_open_files_version(context->open_files, inode_id, &version);
+
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    // The file might have been unlinked
+    return mtl_abort(context, txn, res);
+  }
+
+  uint64_t length = inode->length;
+  if (is_dirty && dirty_length > length) {
+    length = dirty_length;
+    mtl_set_file_length(txn, inode_id, length);
+  }
+
+  mtl_pending_writes unshared = {.writes = NULL, .length = 0};
+  int commit_res = MTL_SUCCESS;
+  if (preallocated_from != UINT64_MAX) {
+    commit_res = mtl_trim_file(context, txn, inode_id, length,
+                               preallocated_from, &unshared);
+  }
+
+  mtl_file_extent *extents = NULL;
+  uint64_t *first_blocks = NULL;
+  uint64_t extents_length = 0, shared_first_block, shared_end_block;
+  res = mtl_load_all_file_extents(txn, inode_id, &extents, &first_blocks,
+                                  &extents_length, &shared_first_block,
+                                  &shared_end_block);
+
+  if (commit_res == MTL_SUCCESS) {
+    commit_res = mtl_commit(context, txn);
+  } else {
+    commit_res = mtl_abort(context, txn, commit_res);
+  }
+  if (commit_res != MTL_SUCCESS) {
+    // Nothing has changed, so the length stays dirty and the preallocated
+    // blocks are given back next time
+    mtl_free_space_invalidate(context->free_space);
+    if (preallocated_from != UINT64_MAX)
+      mtl_open_files_set_preallocated(context->open_files, inode_id,
+                                      preallocated_from);
+    mtl_drop_writes(&unshared);
+    free(extents);
+    free(first_blocks);
+    return commit_res;
+  }
+
+  if (res == MTL_SUCCESS) {
+    mtl_open_files_store(context->open_files, inode_id, version, length,
+                         extents, first_blocks, extents_length,
+                         shared_first_block, shared_end_block);
+    free(extents);
+    free(first_blocks);
+  } else {
+    mtl_open_files_invalidate(context->open_files, inode_id);
+  }
+
+  mtl_finish_writes(context, &unshared);
+  return MTL_SUCCESS;
+}
+
+static int mtl_settle_file(mtl_context *context, uint64_t inode_id,
+                           bool trim) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_settle_file(context, inode_id, trim);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+int mtl_close_file(mtl_context *context, uint64_t inode_id) {
+  // Only the last handle gives back the preallocated blocks, others might
+  // still be writing to them
+  mtl_settle_file(
+      context, inode_id,
+      mtl_open_files_references(context->open_files, inode_id) == 1);
+
+  mtl_open_files_release(context->open_files, inode_id);
+  return MTL_SUCCESS;
+}
+
+// Sequential writers get geometrically growing preallocations
+static uint64_t mtl_preallocation_size(uint64_t length) {
+  if (length < MTL_MIN_PREALLOCATION) return MTL_MIN_PREALLOCATION;
+  if (length > MTL_MAX_PREALLOCATION) return MTL_MAX_PREALLOCATION;
+  return length;
+}
+
+static bool mtl_has_file_extents(MDB_txn *txn, uint64_t inode_id) {
+  mtl_file_extent extent;
+  return mtl_load_last_file_extent(txn, inode_id, &extent, NULL) ==
+         MTL_SUCCESS;
+}
+
+typedef enum mtl_data_placement {
+  MTL_PLACE_IN_BLOCKS,
+  MTL_PLACE_INLINE,
+  MTL_PLACE_PACKED
+} mtl_data_placement;
+
+// Decides where the data of a file goes when it is written up to end
+static mtl_data_placement mtl_place_data(mtl_context *context, MDB_txn *txn,
+                                         uint64_t inode_id,
+                                         const mtl_inode *inode,
+                                         uint64_t end) {
+  if (inode->type != MTL_FILE ||
+      (end > context->inline_data_size && end > context->packed_file_size) ||
+      mtl_has_file_extents(txn, inode_id)) {
+    return MTL_PLACE_IN_BLOCKS;
+  }
+
+  // Packed files don't move back to the inode
+  bool is_packed = mtl_load_packed_file(txn, inode_id, NULL) == MTL_SUCCESS;
+  if (!is_packed && end <= context->inline_data_size) return MTL_PLACE_INLINE;
+  if (end <= context->packed_file_size) return MTL_PLACE_PACKED;
+  return MTL_PLACE_IN_BLOCKS;
+}
+
+// Writes to the data a file keeps in its inode. length receives the new
+// length of the file.
+static int mtl_write_inline(MDB_txn *txn, uint64_t inode_id,
+                            const char *buffer, uint64_t size, uint64_t offset,
+                            uint64_t *length) {
+  const mtl_inode *inode;
+  const void *data;
+  uint64_t data_length;
+  int res = mtl_load_inode(txn, inode_id, &inode, &data, &data_length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  uint64_t new_data_length =
+      offset + size > data_length ? offset + size : data_length;
+  char *new_data = malloc(new_data_length);
+  if (new_data == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  memcpy(new_data, data, data_length);
+  if (offset > data_length)
+    memset(new_data + data_length, 0, offset - data_length);
+  memcpy(new_data + offset, buffer, size);
+
+  mtl_inode updated_inode = *inode;
+  if (updated_inode.length < offset + size) updated_inode.length = offset + size;
+  *length = updated_inode.length;
+
+  res = mtl_put_inode(txn, inode_id, &updated_inode, new_data,
+                      new_data_length);
+  free(new_data);
+  return res;
+}
+
+// The byte offset in the pack file at which a packed file keeps its data
+static uint64_t mtl_packed_position(mtl_context *context,
+                                    const mtl_packed_file *file) {
+  uint64_t block_size = context->metadata.block_size;
+  return file->block * block_size +
+         file->first_sector * (block_size / MTL_PACKED_SECTORS);
+}
+
+// Reads the first length bytes of a packed file from the pack file
+static int mtl_read_packed(mtl_context *context, MDB_txn *txn,
+                           const mtl_packed_file *file, char *buffer,
+                           uint64_t length) {
+  uint64_t pack_inode_id;
+  int res = mtl_load_pack_inode_id(txn, &pack_inode_id);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  return context->storage->read(context, context->storage->context,
+                                pack_inode_id,
+                                mtl_packed_position(context, file), buffer,
+                                length);
+}
+
+// Finds room for a number of sectors in the pack file. If there is none, the
+// pack file grows by a block.
+static int mtl_pack(mtl_context *context, MDB_txn *txn, uint32_t sectors,
+                    mtl_packed_file *file) {
+  file->sectors = sectors;
+  int res = mtl_pack_sectors(txn, sectors, &context->pack_hint, &file->block,
+                             &file->first_sector);
+  if (res != MTL_ERROR_NOSPACE) {
+    return res;
+  }
+
+  uint64_t pack_inode_id;
+  const mtl_inode *pack_inode;
+  res = mtl_create_pack_inode(txn, &pack_inode_id);
+  if (res == MTL_SUCCESS)
+    res = mtl_load_inode(txn, pack_inode_id, &pack_inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  uint64_t block_size = context->metadata.block_size;
+  uint64_t block = pack_inode->length / block_size;
+  res = mtl_expand_inode(context, txn, pack_inode_id, block * block_size,
+                         (block + 1) * block_size, (block + 1) * block_size,
+                         true, NULL);
+  if (res == MTL_SUCCESS) res = mtl_add_packed_block(txn, block);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  context->pack_hint = block;
+  return mtl_pack_sectors(txn, sectors, &context->pack_hint, &file->block,
+                          &file->first_sector);
+}
+
+// Writes to a file that shares blocks with other small files. Data kept in
+// the inode so far moves to the pack file, and files that outgrow their
+// sectors move to a larger run of them. pending receives what has to be
+// written to the pack file once txn has been committed, length the new length
+// of the file.
+static int mtl_write_packed(mtl_context *context, MDB_txn *txn,
+                            uint64_t inode_id, const char *buffer,
+                            uint64_t size, uint64_t offset, uint64_t *length,
+                            mtl_pending_write *pending) {
+  pending->data = NULL;
+
+  const mtl_inode *inode;
+  const void *inline_data;
+  uint64_t inline_length;
+  int res =
+      mtl_load_inode(txn, inode_id, &inode, &inline_data, &inline_length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  mtl_inode updated_inode = *inode;
+  if (updated_inode.length < offset + size) updated_inode.length = offset + size;
+  *length = updated_inode.length;
+
+  mtl_packed_file packed;
+  bool is_packed = mtl_load_packed_file(txn, inode_id, &packed) == MTL_SUCCESS;
+  uint64_t data_length = is_packed ? packed.data_length : inline_length;
+  uint64_t new_data_length =
+      offset + size > data_length ? offset + size : data_length;
+
+  uint64_t sector_size = context->metadata.block_size / MTL_PACKED_SECTORS;
+  uint32_t sectors = (new_data_length + sector_size - 1) / sector_size;
+  bool relocate = !is_packed || packed.sectors < sectors;
+
+  // Everything from start to end goes to the pack file. Moving the file
+  // means copying what it has written so far.
+  uint64_t start = offset < data_length ? offset : data_length;
+  if (relocate) start = 0;
+  uint64_t end = relocate ? new_data_length : offset + size;
+  char *data = malloc(end - start);
+  if (data == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (relocate && is_packed) {
+    res = mtl_read_packed(context, txn, &packed, data, data_length);
+  } else if (relocate) {
+    memcpy(data, inline_data, inline_length);
+  }
+  // The sectors might still contain data that has been cut off before
+  if (offset > data_length)
+    memset(data + (data_length - start), 0, offset - data_length);
+  memcpy(data + (offset - start), buffer, size);
+
+  if (res == MTL_SUCCESS && relocate) {
+    // Growing files get twice the sectors they had, so that appending to
+    // them doesn't move them every time
+    if (is_packed && sectors < 2 * packed.sectors) sectors = 2 * packed.sectors;
+    if (sectors > MTL_PACKED_SECTORS) sectors = MTL_PACKED_SECTORS;
+
+    mtl_packed_file new_packed;
+    res = mtl_pack(context, txn, sectors, &new_packed);
+    if (res == MTL_SUCCESS && is_packed)
+      mtl_unpack_sectors(txn, packed.block, packed.first_sector,
+                         packed.sectors, &context->pack_hint);
+    packed = new_packed;
+  }
+  packed.data_length = new_data_length;
+
+  uint64_t pack_inode_id;
+  if (res == MTL_SUCCESS) res = mtl_put_packed_file(txn, inode_id, &packed);
+  if (res == MTL_SUCCESS)
+    res = mtl_put_inode(txn, inode_id, &updated_inode, NULL, 0);
+  if (res == MTL_SUCCESS) res = mtl_load_pack_inode_id(txn, &pack_inode_id);
+  if (res != MTL_SUCCESS) {
+    free(data);
+    return res;
+  }
+
+  pending->inode_id = pack_inode_id;
+  pending->offset = mtl_packed_position(context, &packed) + start;
+  pending->data = data;
+  pending->length = end - start;
+  return MTL_SUCCESS;
+}
+
+// Moves the data of a small file (kept in its inode or in the pack file) to
+// blocks of its own. pending receives the data, which has to be written to
+// storage once txn has been committed.
+static int mtl_move_to_blocks(mtl_context *context, MDB_txn *txn,
+                              uint64_t inode_id, mtl_pending_write *pending) {
+  pending->inode_id = inode_id;
+  pending->offset = 0;
+  pending->data = NULL;
+  pending->length = 0;
+
+  const mtl_inode *inode;
+  const void *inline_data;
+  uint64_t inline_length;
+  int res =
+      mtl_load_inode(txn, inode_id, &inode, &inline_data, &inline_length);
+  if (res != MTL_SUCCESS || inode->type != MTL_FILE) {
+    return res;
+  }
+
+  mtl_packed_file packed;
+  bool is_packed = mtl_load_packed_file(txn, inode_id, &packed) == MTL_SUCCESS;
+  uint64_t data_length = is_packed ? packed.data_length : inline_length;
+  if (data_length == 0) {
+    return is_packed
+               ? mtl_delete_packed_file(txn, inode_id, &context->pack_hint)
+               : MTL_SUCCESS;
+  }
+
+  char *copy = malloc(data_length);
+  if (copy == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (is_packed) {
+    res = mtl_read_packed(context, txn, &packed, copy, data_length);
+    if (res == MTL_SUCCESS)
+      res = mtl_delete_packed_file(txn, inode_id, &context->pack_hint);
+  } else {
+    memcpy(copy, inline_data, inline_length);
+
+    mtl_inode updated_inode = *inode;
+    res = mtl_put_inode(txn, inode_id, &updated_inode, NULL, 0);
+  }
+
+  if (res == MTL_SUCCESS)
+    res = mtl_expand_inode(context, txn, inode_id, 0, data_length,
+                           data_length, true, NULL);
+  if (res != MTL_SUCCESS) {
+    free(copy);
+    return res;
+  }
+
+  pending->data = copy;
+  pending->length = data_length;
+  return MTL_SUCCESS;
+}
+
+// The metadata part of mtl_write_data for writes that don't go to the blocks
+// of an open file. Returns MTL_COMPLETE if the data has been placed in the
+// inode or the pack file already.
+static int mtl_write_metadata(mtl_context *context, uint64_t inode_id,
+                              const struct iovec *iov, int iovcnt,
+                              uint64_t size, uint64_t offset, bool allow_small,
+                              bool is_open, uint64_t version) {
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  uint64_t length = mtl_current_length(context, inode_id, inode->length);
+
+  // Small files without blocks keep their data in the inode or share
+  // blocks with other small files
+  mtl_data_placement placement =
+      allow_small
+          ? mtl_place_data(context, txn, inode_id, inode, offset + size)
+          : MTL_PLACE_IN_BLOCKS;
+  if (placement != MTL_PLACE_IN_BLOCKS) {
+    // Small writes are copied into a single buffer
+    const char *buffer = iov[0].iov_base;
+    char *gathered = NULL;
+    if (iovcnt > 1) {
+      gathered = malloc(size);
+      if (gathered == NULL) {
+        return mtl_abort(context, txn, MTL_ERROR_NOSPACE);
+      }
+      mtl_iov_copy_from(gathered, iov, iovcnt, 0, size);
+      buffer = gathered;
+    }
+
+    mtl_pending_write pending = {.data = NULL};
+    if (placement == MTL_PLACE_INLINE) {
+      res = mtl_write_inline(txn, inode_id, buffer, size, offset, &length);
+    } else {
+      res = mtl_write_packed(context, txn, inode_id, buffer, size, offset,
+                             &length, &pending);
+    }
+    free(gathered);
+
+    if (res == MTL_SUCCESS) {
+      res = mtl_commit(context, txn);
+    } else {
+      res = mtl_abort(context, txn, res);
+    }
+    if (res != MTL_SUCCESS) {
+      // The pack file might have grown
+      mtl_free_space_invalidate(context->free_space);
+      free(pending.data);
+      return res;
+    }
+
+    if (is_open)
+      mtl_open_files_store(context->open_files, inode_id, version, length,
+                           NULL, NULL, 0, 0, 0);
+    mtl_finish_write(context, &pending);
+    return MTL_COMPLETE;
+  }
+
+  // Otherwise, the data kept in the inode or in the pack file so far moves
+  // to blocks
+  mtl_pending_write moved;
+  res = mtl_move_to_blocks(context, txn, inode_id, &moved);
+
+  // Blocks shared with other files are copied first (unless they are
+  // overwritten completely)
+  mtl_pending_writes unshared = {.writes = NULL, .length = 0};
+  if (res == MTL_SUCCESS)
+    res = mtl_unshare_range(context, txn, inode_id, offset, offset + size,
+                            true, &unshared);
+
+  // Appending to an open file preallocates blocks, which are trimmed once
+  // it is closed. Writes into holes in front of the end of the file only
+  // get the blocks they need, so that no unwritten blocks end up in it.
+  bool preallocate = is_open && offset <= length && offset + size >= length;
+  uint64_t reserve_size = offset + size;
+  if (preallocate) reserve_size += mtl_preallocation_size(offset + size);
+
+  uint64_t allocated_from;
+  if (res == MTL_SUCCESS)
+    res = mtl_expand_inode(context, txn, inode_id, offset, offset + size,
+                           reserve_size, !preallocate, &allocated_from);
+
+  if (res != MTL_SUCCESS) {
+    // The free space index might already contain the reservations
+    mtl_free_space_invalidate(context->free_space);
+    res = mtl_abort(context, txn, res);
+    free(moved.data);
+    mtl_drop_writes(&unshared);
+    return res;
+  }
+
+  // Keep a copy of the new extent list to update the snapshot after commit
+  mtl_file_extent *new_extents = NULL;
+  uint64_t *first_blocks = NULL;
+  uint64_t extents_length = 0, shared_first_block, shared_end_block;
+  if (is_open) {
+    mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+    length = inode->length;
+    if (mtl_load_all_file_extents(txn, inode_id, &new_extents, &first_blocks,
+                                  &extents_length, &shared_first_block,
+                                  &shared_end_block) != MTL_SUCCESS) {
+      // Don't store an incomplete snapshot
+      is_open = false;
+    }
+  }
+
+  res = mtl_commit(context, txn);
+  if (res != MTL_SUCCESS) {
+    // The snapshot of the file is still valid
+    mtl_free_space_invalidate(context->free_space);
+    free(new_extents);
+    free(first_blocks);
+    free(moved.data);
+    mtl_drop_writes(&unshared);
+    return res;
+  }
+
+  if (preallocate) {
+    mtl_open_files_set_preallocated(context->open_files, inode_id,
+                                    allocated_from);
+  }
+
+  if (is_open) {
+    mtl_open_files_store(context->open_files, inode_id, version, length,
+                         new_extents, first_blocks, extents_length,
+                         shared_first_block, shared_end_block);
+    free(new_extents);
+    free(first_blocks);
+  }
+
+  mtl_finish_write(context, &moved);
+  mtl_finish_writes(context, &unshared);
+
+  return MTL_SUCCESS;
+}
+
+// Like mtl_write. Unless allow_small is set, the data always goes to blocks.
+// Writes the size bytes in the buffers of iov at offset. The data of files
+// in blocks is written by a storage request added to io.
+static int mtl_write_data(mtl_context *context, uint64_t inode_id,
+                          const struct iovec *iov, int iovcnt, uint64_t size,
+                          uint64_t offset, bool allow_small, mtl_io *io) {
+  io->length = size;
+
+  // Writing within the blocks of an open file does not change its metadata
+  // (except for the length, which is persisted when the file is closed)
+  if (!mtl_open_files_write(context->open_files, inode_id, offset,
+                            offset + size, context->metadata.block_size)) {
+    uint64_t version;
+    bool is_open =
+        mtl_open_files_version(context->open_files, inode_id, &version);
+
+    // Otherwise, the defragmenter could copy the file after the blocks have
+    // been looked up and before the data has been written to them
+    int res;
+    if (!is_open) {
+      res = mtl_open_files_acquire(context->open_files, inode_id);
+      if (res != MTL_SUCCESS) {
+        return res;
+      }
+      io->holds_file = true;
+      io->inode_id = inode_id;
+    }
+
+    int attempts = 0;
+    do {
+      res = mtl_write_metadata(context, inode_id, iov, iovcnt, size, offset,
+                               allow_small, is_open, version);
+    } while (mtl_retry(&res, &attempts));
+    if (res != MTL_SUCCESS) {
+      return res == MTL_COMPLETE ? MTL_SUCCESS : res;
+    }
+  }
+
+  // Copy the actual data to storage
+  int res = mtl_io_reserve(io, 1);
+  if (res == MTL_SUCCESS)
+    res = mtl_io_submit(context, context->storage, io, 1, inode_id, offset,
+                        iov, iovcnt, 0, size);
+  return res;
+}
+
+// Waits for the storage requests of io and lets go of the file it holds
+static int mtl_wait_io(mtl_context *context, mtl_io *io) {
+  int res = mtl_io_wait(context, context->storage, io);
+  if (io->holds_file) {
+    mtl_close_file(context, io->inode_id);
+    io->holds_file = false;
+  }
+  return res;
+}
+
+// Waits for the storage requests of io, once the call that made them is done
+static int mtl_finish_io(mtl_context *context, mtl_io *io, int res) {
+  int io_res = mtl_wait_io(context, io);
+  return res != MTL_SUCCESS ? res : io_res;
+}
+
+static int mtl_write_buffer(mtl_context *context, uint64_t inode_id,
+                            const char *buffer, uint64_t size,
+                            uint64_t offset, bool allow_small) {
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = size};
+  mtl_io io;
+  mtl_io_init(&io);
+  int res = mtl_write_data(context, inode_id, &iov, 1, size, offset,
+                           allow_small, &io);
+  return mtl_finish_io(context, &io, res);
+}
+
+int mtl_write(mtl_context *context, uint64_t inode_id, const char *buffer,
+              uint64_t size, uint64_t offset) {
+  return mtl_write_buffer(context, inode_id, buffer, size, offset, true);
+}
+
+int mtl_write_async(mtl_context *context, uint64_t inode_id,
+                    const struct iovec *iov, int iovcnt, uint64_t offset,
+                    mtl_io **io) {
+  *io = malloc(sizeof(mtl_io));
+  if (*io == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  mtl_io_init(*io);
+  int res = mtl_write_data(context, inode_id, iov, iovcnt,
+                           mtl_iov_length(iov, iovcnt), offset, true, *io);
+  if (res != MTL_SUCCESS) {
+    mtl_wait_io(context, *io);
+    free(*io);
+    *io = NULL;
+  }
+  return res;
+}
+
+// Loads up to max_extents extents of a file, starting with the one containing
+// first_block (or the next one after it)
+static int mtl_map_blocks(mtl_context *context, uint64_t inode_id,
+                          uint64_t first_block, mtl_file_extent *extents,
+                          uint64_t *first_blocks, uint64_t max_extents,
+                          uint64_t *extents_length) {
+  // Serve open files from their snapshot
+  if (mtl_open_files_map(context->open_files, inode_id, first_block, extents,
+                         first_blocks, max_extents, extents_length)) {
+    return MTL_SUCCESS;
+  }
+
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  int res = mtl_load_inode(txn, inode_id, NULL, NULL, NULL);
+  if (res == MTL_SUCCESS) {
+    mtl_load_file_extents(txn, inode_id, first_block, extents, first_blocks,
+                          max_extents, extents_length);
+  }
+
+  mtl_end_read(context, txn);
+  return res;
+}
+
+// Reads from a file that keeps its data in the inode or in the pack file.
+// Returns false if it doesn't, in which case length receives the length of
+// the file.
+static bool mtl_read_small_file(mtl_context *context, uint64_t inode_id,
+                                const struct iovec *iov, int iovcnt,
+                                uint64_t size, uint64_t offset,
+                                uint64_t *read_len, uint64_t *length,
+                                mtl_io *io) {
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  const mtl_inode *inode;
+  const void *data;
+  uint64_t data_length;
+  if (mtl_load_inode(txn, inode_id, &inode, &data, &data_length) !=
+      MTL_SUCCESS) {
+    mtl_end_read(context, txn);
+    *read_len = 0;
+    return true;
+  }
+
+  *length = mtl_current_length(context, inode_id, inode->length);
+
+  mtl_packed_file packed;
+  uint64_t pack_inode_id;
+  bool is_packed = inode->type == MTL_FILE && data_length == 0 &&
+                   mtl_load_packed_file(txn, inode_id, &packed) ==
+                       MTL_SUCCESS &&
+                   mtl_load_pack_inode_id(txn, &pack_inode_id) == MTL_SUCCESS;
+  if (inode->type != MTL_FILE || (data_length == 0 && !is_packed)) {
+    mtl_end_read(context, txn);
+    return false;
+  }
+
+  *read_len = 0;
+  if (offset < *length)
+    *read_len = offset + size > *length ? *length - offset : size;
+
+  // The rest of the file reads as zeros
+  if (is_packed) data_length = packed.data_length;
+  uint64_t copy_len = 0;
+  if (offset < data_length)
+    copy_len = *read_len < data_length - offset ? *read_len
+                                                : data_length - offset;
+  if (!is_packed)
+    mtl_iov_copy_to(iov, iovcnt, 0, (const char *)data + offset, copy_len);
+  mtl_iov_copy_to(iov, iovcnt, copy_len, NULL, *read_len - copy_len);
+
+  mtl_end_read(context, txn);
+
+  if (is_packed && copy_len) {
+    if (mtl_io_reserve(io, 1) != MTL_SUCCESS ||
+        mtl_io_submit(context, context->storage, io, 0, pack_inode_id,
+                      mtl_packed_position(context, &packed) + offset, iov,
+                      iovcnt, 0, copy_len) != MTL_SUCCESS)
+      *read_len = 0;
+  }
+  return true;
+}
+
+// A range of a file that is read from storage, in bytes
+typedef struct mtl_data_run {
+  uint64_t position;
+  uint64_t end;
+} mtl_data_run;
+
+// Reads up to size bytes at offset into the buffers of iov. io->length
+// receives the number of bytes that are read. Holes are filled with zeros
+// right away, the allocated ranges are read by storage requests added to io,
+// all of which are submitted before any of them is waited for.
+static int mtl_read_data(mtl_context *context, uint64_t inode_id,
+                         const struct iovec *iov, int iovcnt, uint64_t size,
+                         uint64_t offset, mtl_io *io) {
+  uint64_t read_len = size;
+
+  // Prepare the storage and check how much we can read. Files without
+  // extents might keep their data in the inode or in the pack file.
+  uint64_t length;
+  uint64_t extents_length;
+  bool has_snapshot = mtl_open_files_load(context->open_files, inode_id,
+                                          &length, NULL, 0, &extents_length);
+  if (!has_snapshot || extents_length == 0) {
+    if (mtl_read_small_file(context, inode_id, iov, iovcnt, size, offset,
+                            &read_len, &length, io)) {
+      io->length = read_len;
+      return MTL_SUCCESS;
+    }
+
+    // Take a snapshot of an open file for the next time
+    uint64_t version;
+    if (!has_snapshot &&
+        mtl_open_files_version(context->open_files, inode_id, &version) &&
+        mtl_load_file_length(context, inode_id, &length) != MTL_SUCCESS) {
+      return MTL_ERROR_NOENTRY;
+    }
+  }
+
+  if (length < offset) {
+    read_len = 0;
+  } else if (length < offset + size) {
+    read_len -= (offset + size) - length;
+  }
+
+  // Find the ranges that are read from storage. Holes read as zeros without
+  // going to storage.
+  mtl_data_run *runs = NULL;
+  uint64_t runs_length = 0;
+  uint64_t runs_capacity = 0;
+
+  uint64_t block_size = context->metadata.block_size;
+  uint64_t position = offset;
+  uint64_t end = offset + read_len;
+  while (position < end) {
+    mtl_file_extent extents[MTL_EXTENT_BATCH_SIZE];
+    uint64_t first_blocks[MTL_EXTENT_BATCH_SIZE];
+    uint64_t extents_length;
+    if (mtl_map_blocks(context, inode_id, position / block_size, extents,
+                       first_blocks, MTL_EXTENT_BATCH_SIZE,
+                       &extents_length) != MTL_SUCCESS) {
+      free(runs);
+      return MTL_ERROR_NOENTRY;
+    }
+
+    // Find the end of the allocated blocks from position on, or the end of
+    // the hole position is in
+    uint64_t data_end = position;
+    uint64_t hole_end = end;
+    for (uint64_t i = 0; i < extents_length && data_end < end; ++i) {
+      uint64_t extent_start = first_blocks[i] * block_size;
+      if (extent_start > data_end) {
+        if (data_end == position && extent_start < hole_end)
+          hole_end = extent_start;
+        break;
+      }
+      data_end = (first_blocks[i] + extents[i].length) * block_size;
+    }
+
+    if (data_end > position) {
+      if (data_end > end) data_end = end;
+      if (runs_length && runs[runs_length - 1].end == position) {
+        runs[runs_length - 1].end = data_end;
+      } else {
+        if (runs_length == runs_capacity) {
+          runs_capacity = runs_capacity ? 2 * runs_capacity : 8;
+          mtl_data_run *grown =
+              realloc(runs, runs_capacity * sizeof(mtl_data_run));
+          if (grown == NULL) {
+            free(runs);
+            return MTL_ERROR_NOSPACE;
+          }
+          runs = grown;
+        }
+        runs[runs_length++] = (mtl_data_run){position, data_end};
+      }
+      position = data_end;
+    } else {
+      mtl_iov_copy_to(iov, iovcnt, position - offset, NULL,
+                      hole_end - position);
+      position = hole_end;
+    }
+  }
+
+  // Copy the actual data from storage
+  int res = mtl_io_reserve(io, runs_length);
+  for (uint64_t i = 0; i < runs_length && res == MTL_SUCCESS; ++i) {
+    res = mtl_io_submit(context, context->storage, io, 0, inode_id,
+                        runs[i].position, iov, iovcnt,
+                        runs[i].position - offset,
+                        runs[i].end - runs[i].position);
+  }
+  free(runs);
+
+  io->length = read_len;
+  return res;
+}
+
+uint64_t mtl_read(mtl_context *context, uint64_t inode_id, char *buffer,
+                  uint64_t size, uint64_t offset) {
+  struct iovec iov = {.iov_base = buffer, .iov_len = size};
+  mtl_io io;
+  mtl_io_init(&io);
+  int res = mtl_read_data(context, inode_id, &iov, 1, size, offset, &io);
+  if (mtl_finish_io(context, &io, res) != MTL_SUCCESS) {
+    return 0;
+  }
+
+  return io.length;
+}
+
+int mtl_read_async(mtl_context *context, uint64_t inode_id,
+                   const struct iovec *iov, int iovcnt, uint64_t offset,
+                   mtl_io **io) {
+  *io = malloc(sizeof(mtl_io));
+  if (*io == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  mtl_io_init(*io);
+  int res = mtl_read_data(context, inode_id, iov, iovcnt,
+                          mtl_iov_length(iov, iovcnt), offset, *io);
+  if (res != MTL_SUCCESS) {
+    mtl_io_wait(context, context->storage, *io);
+    free(*io);
+    *io = NULL;
+  }
+  return res;
+}
+
+int mtl_wait(mtl_context *context, mtl_io *io, uint64_t *length) {
+  int res = mtl_wait_io(context, io);
+  if (length) *length = res == MTL_SUCCESS ? io->length : 0;
+  free(io);
+  return res;
+}
+
+static int mtl_try_truncate(mtl_context *context, uint64_t inode_id,
+                            uint64_t offset) {
+  // Truncating also gives back the preallocated blocks
+  uint64_t preallocated_from =
+      mtl_open_files_take_preallocated(context->open_files, inode_id);
+
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  if (offset < inode->length) {
+    // The window no longer follows the end of the file
+    mtl_release_reservation_window(txn, context->free_space, inode_id);
+  }
+
+  // Data in the pack file is cut off along with the file
+  mtl_packed_file packed;
+  if (mtl_load_packed_file(txn, inode_id, &packed) == MTL_SUCCESS &&
+      offset < packed.data_length) {
+    if (offset == 0) {
+      mtl_delete_packed_file(txn, inode_id, &context->pack_hint);
+    } else {
+      packed.data_length = offset;
+      mtl_put_packed_file(txn, inode_id, &packed);
+    }
+  }
+
+  // Release everything behind the new end of the file. Extending the file
+  // only moves its end, so the new part is a hole until it is written to.
+  // Preallocated blocks have not been written to, so they must not become
+  // part of the file either.
+  // A shared extent at the new end of the file is copied.
+  uint64_t length = mtl_current_length(context, inode_id, inode->length);
+  mtl_pending_writes unshared = {.writes = NULL, .length = 0};
+  res = mtl_trim_file(context, txn, inode_id, offset < length ? offset : length,
+                      preallocated_from, &unshared);
+  if (res == MTL_SUCCESS && offset > length)
+    res = mtl_set_file_length(txn, inode_id, offset);
+
+  if (res == MTL_SUCCESS) {
+    res = mtl_commit(context, txn);
+  } else {
+    res = mtl_abort(context, txn, res);
+  }
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+    if (preallocated_from != UINT64_MAX)
+      mtl_open_files_set_preallocated(context->open_files, inode_id,
+                                      preallocated_from);
+    mtl_drop_writes(&unshared);
+    return res;
+  }
+
+  mtl_open_files_invalidate(context->open_files, inode_id);
+  mtl_finish_writes(context, &unshared);
+
+  return MTL_SUCCESS;
+}
+
+int mtl_truncate(mtl_context *context, uint64_t inode_id, uint64_t offset) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_truncate(context, inode_id, offset);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+static int mtl_try_fallocate(mtl_context *context, uint64_t inode_id, int mode,
+                             uint64_t offset, uint64_t length) {
+  if (mode & ~MTL_FALLOCATE_KEEP_SIZE) {
+    return MTL_ERROR_NOTSUPPORTED;
+  }
+
+  uint64_t version;
+  bool is_open =
+      mtl_open_files_version(context->open_files, inode_id, &version);
+
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  if (inode->type != MTL_FILE) {
+    return mtl_abort(context, txn, MTL_ERROR_INVALID_ARGUMENT);
+  }
+
+  // Only the holes in the range are allocated. Unlike preallocated blocks,
+  // these blocks are committed and are kept until the file is truncated. Data
+  // kept in the inode or in the pack file moves to blocks as well, and blocks
+  // shared with other files are copied, so that they can be written to in
+  // place afterwards.
+  uint64_t old_length = inode->length;
+  mtl_pending_write moved;
+  mtl_pending_writes unshared = {.writes = NULL, .length = 0};
+  res = mtl_move_to_blocks(context, txn, inode_id, &moved);
+  if (res == MTL_SUCCESS)
+    res = mtl_unshare_range(context, txn, inode_id, offset, offset + length,
+                            false, &unshared);
+  if (res == MTL_SUCCESS)
+    res = mtl_expand_inode(context, txn, inode_id, offset, offset + length,
+                           offset + length, true, NULL);
+  if (res == MTL_SUCCESS && (mode & MTL_FALLOCATE_KEEP_SIZE) &&
+      offset + length > old_length)
+    res = mtl_set_file_length(txn, inode_id, old_length);
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+    res = mtl_abort(context, txn, res);
+    free(moved.data);
+    mtl_drop_writes(&unshared);
+    return res;
+  }
+
+  mtl_file_extent *new_extents = NULL;
+  uint64_t *first_blocks = NULL;
+  uint64_t extents_length = 0, shared_first_block, shared_end_block;
+  uint64_t new_length = 0;
+  if (is_open) {
+    mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+    new_length = inode->length;
+    if (mtl_load_all_file_extents(txn, inode_id, &new_extents, &first_blocks,
+                                  &extents_length, &shared_first_block,
+                                  &shared_end_block) != MTL_SUCCESS) {
+      is_open = false;
+    }
+  }
+
+  res = mtl_commit(context, txn);
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+    free(new_extents);
+    free(first_blocks);
+    free(moved.data);
+    mtl_drop_writes(&unshared);
+    return res;
+  }
+
+  if (is_open) {
+    mtl_open_files_store(context->open_files, inode_id, version, new_length,
+                         new_extents, first_blocks, extents_length,
+                         shared_first_block, shared_end_block);
+    free(new_extents);
+    free(first_blocks);
+  }
+
+  mtl_finish_write(context, &moved);
+  mtl_finish_writes(context, &unshared);
+
+  return MTL_SUCCESS;
+}
+
+int mtl_fallocate(mtl_context *context, uint64_t inode_id, int mode,
+                  uint64_t offset, uint64_t length) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_fallocate(context, inode_id, mode, offset, length);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+// Small files don't have blocks that could be shared, so their data is copied
+static int mtl_copy_small_file(mtl_context *context, uint64_t from_inode_id,
+                               uint64_t to_inode_id, uint64_t length) {
+  char *buffer = malloc(length ? length : 1);
+  if (buffer == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  uint64_t read = mtl_read(context, from_inode_id, buffer, length, 0);
+  int res = mtl_truncate(context, to_inode_id, 0);
+  if (res == MTL_SUCCESS && read)
+    res = mtl_write(context, to_inode_id, buffer, read, 0);
+  if (res == MTL_SUCCESS && read < length)
+    res = mtl_truncate(context, to_inode_id, length);
+
+  free(buffer);
+  return res;
+}
+
+// Shares the extents of one file with another one, which is empty. Extents
+// that are not shared yet are split into pieces of MTL_MAX_SHARED_EXTENT.
+static int mtl_share_file_extents(mtl_context *context, MDB_txn *txn,
+                                  uint64_t from_inode_id,
+                                  uint64_t to_inode_id) {
+  uint64_t max_blocks = MTL_MAX_SHARED_EXTENT / context->metadata.block_size;
+  if (max_blocks == 0) max_blocks = 1;
+
+  mtl_file_extent extents[MTL_EXTENT_BATCH_SIZE];
+  uint64_t first_blocks[MTL_EXTENT_BATCH_SIZE];
+  uint64_t extents_length;
+  uint64_t next_block = 0;
+  do {
+    mtl_load_file_extents(txn, from_inode_id, next_block, extents,
+                          first_blocks, MTL_EXTENT_BATCH_SIZE,
+                          &extents_length);
+
+    for (uint64_t i = 0; i < extents_length; ++i) {
+      mtl_file_extent piece = extents[i];
+      uint64_t piece_first_block = first_blocks[i];
+      uint64_t remaining = extents[i].length;
+      bool split = remaining > max_blocks &&
+                   !mtl_extent_is_shared(txn, extents[i].offset);
+
+      while (remaining) {
+        piece.length = split && remaining > max_blocks ? max_blocks : remaining;
+        if (piece.length < remaining) {
+          int res = mtl_split_extent(txn, piece.offset, piece.length);
+          if (res != MTL_SUCCESS) {
+            return res;
+          }
+        }
+        if (split) {
+          mtl_put_file_extent(txn, from_inode_id, piece_first_block, &piece);
+        }
+
+        int res = mtl_share_extent(txn, piece.offset);
+        if (res != MTL_SUCCESS) {
+          return res;
+        }
+        mtl_put_file_extent(txn, to_inode_id, piece_first_block, &piece);
+
+        piece.offset += piece.length;
+        piece_first_block += piece.length;
+        remaining -= piece.length;
+      }
+    }
+
+    if (extents_length)
+      next_block = first_blocks[extents_length - 1] +
+                   extents[extents_length - 1].length;
+  } while (extents_length == MTL_EXTENT_BATCH_SIZE);
+
+  return MTL_SUCCESS;
+}
+
+static int mtl_try_clone(mtl_context *context, uint64_t from_inode_id,
+                         uint64_t to_inode_id) {
+  if (from_inode_id == to_inode_id) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  // Only committed blocks can be shared, so the source is settled like it is
+  // when it's closed. The destination loses its blocks anyway.
+  int res = mtl_settle_file(context, from_inode_id, true);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+  mtl_open_files_take_preallocated(context->open_files, to_inode_id);
+
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  const mtl_inode *from_inode, *to_inode;
+  const void *to_inline_data;
+  uint64_t from_inline_length, to_inline_length;
+  res = mtl_load_inode(txn, from_inode_id, &from_inode, NULL,
+                       &from_inline_length);
+  if (res == MTL_SUCCESS)
+    res = mtl_load_inode(txn, to_inode_id, &to_inode, &to_inline_data,
+                         &to_inline_length);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  if (from_inode->type != MTL_FILE || to_inode->type != MTL_FILE) {
+    return mtl_abort(context, txn, MTL_ERROR_INVALID_ARGUMENT);
+  }
+
+  uint64_t length = from_inode->length;
+  mtl_packed_file packed;
+  if (from_inline_length ||
+      mtl_load_packed_file(txn, from_inode_id, &packed) == MTL_SUCCESS) {
+    mtl_abort(context, txn, MTL_SUCCESS);
+    return mtl_copy_small_file(context, from_inode_id, to_inode_id, length);
+  }
+
+  // Drop the previous content of the destination
+  mtl_release_reservation_window(txn, context->free_space, to_inode_id);
+  mtl_delete_packed_file(txn, to_inode_id, &context->pack_hint);
+  if (to_inline_length) {
+    mtl_inode updated_inode = *to_inode;
+    mtl_put_inode(txn, to_inode_id, &updated_inode, NULL, 0);
+  }
+  res = mtl_trim_file(context, txn, to_inode_id, 0, 0, NULL);
+
+  if (res == MTL_SUCCESS)
+    res = mtl_share_file_extents(context, txn, from_inode_id, to_inode_id);
+  if (res == MTL_SUCCESS) res = mtl_set_file_length(txn, to_inode_id, length);
+
+  if (res == MTL_SUCCESS) {
+    res = mtl_commit(context, txn);
+  } else {
+    res = mtl_abort(context, txn, res);
+  }
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+    return res;
+  }
+
+  // Writes to both files have to copy the shared blocks from now on
+  mtl_open_files_invalidate(context->open_files, from_inode_id);
+  mtl_open_files_invalidate(context->open_files, to_inode_id);
+
+  return MTL_SUCCESS;
+}
+
+int mtl_clone(mtl_context *context, uint64_t from_inode_id,
+              uint64_t to_inode_id) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_clone(context, from_inode_id, to_inode_id);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+static int mtl_try_unlink(mtl_context *context, const char *filename) {
+  // We don't (yet?) support hard links, so we can just remove the inode
+  int res;
+
+  uint64_t dentry_epoch = mtl_dentry_cache_epoch(context->dentries);
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  uint64_t parent_dir_inode_id;
+  res = mtl_resolve_parent_dir_inode(context, txn, dentry_epoch, filename,
+                                     &parent_dir_inode_id);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  char *basec, *base;
+  basec = strdup(filename);
+  base = basename(basec);
+
+  // Remove directory entry
+  uint64_t inode_id;
+  res = mtl_remove_entry_from_directory(txn, parent_dir_inode_id, base,
+                                        &inode_id);
+  free(basec);
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  res = mtl_load_inode(txn, inode_id, NULL, NULL, NULL);
+  if (res == MTL_ERROR_NOENTRY) {
+    return mtl_abort(context, txn, res);
+  }
+
+  // Free all extents
+  mtl_file_extent extents[MTL_EXTENT_BATCH_SIZE];
+  uint64_t first_blocks[MTL_EXTENT_BATCH_SIZE];
+  uint64_t extents_length;
+  uint64_t next_block = 0;
+  do {
+    mtl_load_file_extents(txn, inode_id, next_block, extents, first_blocks,
+                          MTL_EXTENT_BATCH_SIZE, &extents_length);
+
+    for (uint64_t i = 0; i < extents_length; ++i) {
+      mtl_free_extent(txn, context->free_space, extents[i].offset);
+    }
+
+    if (extents_length)
+      next_block = first_blocks[extents_length - 1] +
+                   extents[extents_length - 1].length;
+  } while (extents_length == MTL_EXTENT_BATCH_SIZE);
+
+  mtl_release_reservation_window(txn, context->free_space, inode_id);
+  mtl_delete_packed_file(txn, inode_id, &context->pack_hint);
+
+  // Remove inode (and its extent list)
+  mtl_delete_inode(txn, inode_id);
+
+  res = mtl_commit(context, txn);
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+    return res;
+  }
+
+  mtl_dentry_cache_invalidate(context->dentries, filename, false);
+  mtl_open_files_invalidate(context->open_files, inode_id);
 
   return MTL_SUCCESS;
 }
 
 int mtl_unlink(mtl_context *context, const char *filename) {
-  // We don't (yet?) support hard links, so we can just remove the inode
-  int res;
+  int res, attempts = 0;
+  do {
+    res = mtl_try_unlink(context, filename);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
 
+static int mtl_try_set_allocation_policy(mtl_context *context,
+                                         mtl_allocation_policy policy) {
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, 0, &txn);
+  mtl_begin(context, &txn);
 
-  char *basec, *base;
-  basec = strdup(filename);
-  base = basename(basec);
+  // Windows are only used with this policy, so don't keep them around
+  if (policy != MTL_ALLOCATION_RESERVATION_WINDOWS) {
+    uint64_t inode_id;
+    while (mtl_free_space_oldest_window(context->free_space, &inode_id))
+      mtl_release_reservation_window(txn, context->free_space, inode_id);
+  }
 
-  uint64_t parent_dir_inode_id;
-  res = mtl_resolve_parent_dir_inode(txn, filename, &parent_dir_inode_id);
+  mtl_free_space_set_policy(context->free_space, policy);
 
-  // Remove directory entry
-  uint64_t inode_id;
-  res = mtl_remove_entry_from_directory(txn, parent_dir_inode_id, base,
-                                        &inode_id);
+  int res = mtl_commit(context, txn);
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+  }
 
-  // Free all extents
-  const mtl_file_extent *extents;
-  uint64_t extents_length;
-  res = mtl_load_file(txn, inode_id, NULL, &extents, &extents_length);
+  return res;
+}
 
-  if (res == MTL_ERROR_NOENTRY) {
+int mtl_set_allocation_policy(mtl_context *context,
+                              mtl_allocation_policy policy) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_set_allocation_policy(context, policy);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+int mtl_get_fragmentation_report(mtl_context *context,
+                                 mtl_fragmentation_report *report) {
+  memset(report, 0, sizeof(*report));
+
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  mtl_add_file_extent_stats(txn, report);
+  mtl_add_free_extent_stats(txn, report);
+
+  mtl_end_read(context, txn);
+
+  return MTL_SUCCESS;
+}
+
+// Like the pack file, the relocation file has no directory entry
+static int mtl_create_relocation_inode(MDB_txn *txn, uint64_t *inode_id) {
+  if (mtl_load_relocation_inode_id(txn, inode_id) == MTL_SUCCESS) {
+    return MTL_SUCCESS;
+  }
+
+  int now = time(NULL);
+  mtl_inode relocation_inode = {.type = MTL_FILE,
+                                .length = 0,
+                                .user = 0,
+                                .group = 0,
+                                .accessed = now,
+                                .modified = now,
+                                .created = now,
+                                .mode = S_IFREG};
+
+  *inode_id = mtl_next_inode_id(txn);
+  int res = mtl_put_inode(txn, *inode_id, &relocation_inode, NULL, 0);
+  if (res != MTL_SUCCESS) {
     return res;
   }
 
+  return mtl_store_relocation_inode_id(txn, *inode_id);
+}
+
+// Returns the number of runs of extents without a hole in between, which is
+// what the extents of a file are merged into when it is relocated
+static uint64_t mtl_count_extent_runs(const mtl_file_extent *extents,
+                                      const uint64_t *first_blocks,
+                                      uint64_t extents_length,
+                                      uint64_t *blocks) {
+  uint64_t runs = 0;
+  *blocks = 0;
   for (uint64_t i = 0; i < extents_length; ++i) {
-    mtl_free_extent(txn, extents[i].offset);
+    if (i == 0 || first_blocks[i] != first_blocks[i - 1] + extents[i - 1].length)
+      ++runs;
+    *blocks += extents[i].length;
   }
+  return runs;
+}
 
-  // Remove inode
-  mtl_delete_inode(txn, inode_id);
+// Loads the extents of a file and gives the relocation file a single extent
+// large enough for all of them, starting at target. Returns MTL_COMPLETE if
+// relocating the file wouldn't merge any extents.
+static int mtl_try_reserve_relocation(mtl_context *context, uint64_t inode_id,
+                                      uint64_t *relocation_inode_id,
+                                      mtl_file_extent **extents,
+                                      uint64_t **first_blocks,
+                                      uint64_t *extents_length,
+                                      uint64_t *target) {
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
 
-  mdb_txn_commit(txn);
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res == MTL_SUCCESS && inode->type != MTL_FILE)
+    res = MTL_ERROR_INVALID_ARGUMENT;
 
-  free(basec);
+  uint64_t shared_first_block, shared_end_block;
+  if (res == MTL_SUCCESS)
+    res = mtl_load_all_file_extents(txn, inode_id, extents, first_blocks,
+                                    extents_length, &shared_first_block,
+                                    &shared_end_block);
+
+  uint64_t blocks = 0;
+  if (res == MTL_SUCCESS) {
+    if (shared_end_block) {
+      // Other files would keep the old blocks anyway
+      res = MTL_ERROR_BUSY;
+    } else if (mtl_count_extent_runs(*extents, *first_blocks, *extents_length,
+                                     &blocks) == *extents_length) {
+      res = MTL_COMPLETE;
+    }
+  }
+  if (res != MTL_SUCCESS) {
+    return mtl_abort(context, txn, res);
+  }
+
+  // The blocks of a relocation that was interrupted are given back first
+  res = mtl_create_relocation_inode(txn, relocation_inode_id);
+  if (res == MTL_SUCCESS)
+    res = mtl_trim_file(context, txn, *relocation_inode_id, 0, 0, NULL);
+
+  if (res == MTL_SUCCESS) {
+    mtl_file_extent reserved;
+    reserved.length =
+        mtl_reserve_extent(txn, context->free_space, *relocation_inode_id,
+                           blocks, NULL, &reserved.offset, true);
+    mtl_release_reservation_window(txn, context->free_space,
+                                   *relocation_inode_id);
+
+    if (reserved.length < blocks) {
+      res = MTL_ERROR_NOSPACE;
+    } else {
+      *target = reserved.offset;
+      mtl_put_file_extent(txn, *relocation_inode_id, 0, &reserved);
+      res = mtl_set_file_length(txn, *relocation_inode_id,
+                                blocks * context->metadata.block_size);
+    }
+  }
+
+  if (res == MTL_SUCCESS) {
+    res = mtl_commit(context, txn);
+  } else {
+    res = mtl_abort(context, txn, res);
+  }
+  if (res != MTL_SUCCESS) {
+    mtl_free_space_invalidate(context->free_space);
+  }
+
+  return res;
+}
+
+static int mtl_reserve_relocation(mtl_context *context, uint64_t inode_id,
+                                  uint64_t *relocation_inode_id,
+                                  mtl_file_extent **extents,
+                                  uint64_t **first_blocks,
+                                  uint64_t *extents_length, uint64_t *target) {
+  int res, attempts = 0;
+  do {
+    // The extents of the previous attempt are loaded again
+    free(*extents);
+    free(*first_blocks);
+    *extents = NULL;
+    *first_blocks = NULL;
+    res = mtl_try_reserve_relocation(context, inode_id, relocation_inode_id,
+                                     extents, first_blocks, extents_length,
+                                     target);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+// Copies the extents of a file, one after the other, to the relocation file
+static int mtl_copy_to_relocation_file(mtl_context *context, uint64_t inode_id,
+                                       uint64_t relocation_inode_id,
+                                       const mtl_file_extent *extents,
+                                       const uint64_t *first_blocks,
+                                       uint64_t extents_length) {
+  uint64_t block_size = context->metadata.block_size;
+  uint64_t chunk_blocks = MTL_DEFRAGMENT_COPY_SIZE / block_size;
+  if (chunk_blocks == 0) chunk_blocks = 1;
+
+  char *buffer = malloc(chunk_blocks * block_size);
+  if (buffer == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  int res = MTL_SUCCESS;
+  uint64_t target_block = 0;
+  for (uint64_t i = 0; i < extents_length && res == MTL_SUCCESS; ++i) {
+    for (uint64_t done = 0; done < extents[i].length && res == MTL_SUCCESS;) {
+      uint64_t blocks = extents[i].length - done;
+      if (blocks > chunk_blocks) blocks = chunk_blocks;
+
+      res = context->storage->read(context, context->storage->context,
+                                   inode_id,
+                                   (first_blocks[i] + done) * block_size,
+                                   buffer, blocks * block_size);
+      if (res == MTL_SUCCESS)
+        res = context->storage->write(
+            context, context->storage->context, relocation_inode_id,
+            (target_block + done) * block_size, buffer, blocks * block_size);
+      done += blocks;
+    }
+    target_block += extents[i].length;
+  }
+
+  free(buffer);
+  return res;
+}
+
+// Replaces the blocks of a file with the ones of the relocation file, unless
+// the file has changed since its extents were loaded (or the data has not
+// been copied). Otherwise, the relocation file's blocks are given back and
+// this fails with MTL_ERROR_BUSY.
+static int mtl_try_swap_relocation(mtl_context *context, uint64_t inode_id,
+                                   uint64_t version,
+                                   uint64_t relocation_inode_id,
+                                   const mtl_file_extent *extents,
+                                   const uint64_t *first_blocks,
+                                   uint64_t extents_length, uint64_t target,
+                                   bool copied) {
+  MDB_txn *txn;
+  mtl_begin(context, &txn);
+
+  // A handle that has been opened in the meantime changes the version
+  uint64_t current_version;
+  bool swap =
+      copied &&
+      mtl_open_files_version(context->open_files, inode_id,
+                             &current_version) &&
+      current_version == version &&
+      mtl_open_files_references(context->open_files, inode_id) == 1;
+
+  mtl_file_extent *current_extents = NULL;
+  uint64_t *current_first_blocks = NULL;
+  uint64_t current_length = 0, shared_first_block, shared_end_block;
+  int res = MTL_SUCCESS;
+  if (swap)
+    res = mtl_load_all_file_extents(txn, inode_id, &current_extents,
+                                    &current_first_blocks, &current_length,
+                                    &shared_first_block, &shared_end_block);
+  swap = swap && res == MTL_SUCCESS && current_length == extents_length &&
+         memcmp(current_extents, extents,
+                extents_length * sizeof(mtl_file_extent)) == 0 &&
+         memcmp(current_first_blocks, first_blocks,
+                extents_length * sizeof(uint64_t)) == 0;
+  free(current_extents);
+  free(current_first_blocks);
+
+  if (swap) {
+    for (uint64_t i = 0; i < extents_length; ++i)
+      mtl_free_extent(txn, context->free_space, extents[i].offset);
+    mtl_delete_file_extents(txn, inode_id, 0);
+
+    // Every run becomes a single extent of the file, which takes its part of
+    // the relocation file's blocks
+    uint64_t remaining;
+    mtl_count_extent_runs(extents, first_blocks, extents_length, &remaining);
+    uint64_t offset = target;
+    for (uint64_t i = 0; i < extents_length && res == MTL_SUCCESS;) {
+      mtl_file_extent run = {.offset = offset, .length = 0};
+      uint64_t run_first_block = first_blocks[i];
+      do {
+        run.length += extents[i].length;
+        ++i;
+      } while (i < extents_length &&
+               first_blocks[i] == first_blocks[i - 1] + extents[i - 1].length);
+
+      if (run.length < remaining)
+        res = mtl_split_extent(txn, offset, run.length);
+      if (res == MTL_SUCCESS)
+        res = mtl_put_file_extent(txn, inode_id, run_first_block, &run);
+
+      offset += run.length;
+      remaining -= run.length;
+    }
+
+    // The blocks belong to the file now
+    if (res == MTL_SUCCESS)
+      res = mtl_truncate_file_extents(txn, relocation_inode_id, 0, 0);
+  } else {
+    res = mtl_trim_file(context, txn, relocation_inode_id, 0, 0, NULL);
+  }
+
+  if (res == MTL_SUCCESS) {
+    res = mtl_commit(context, txn);
+  } else {
+    res = mtl_abort(context, txn, res);
+  }
+  if (res != MTL_SUCCESS) {
+    // The relocation file keeps the blocks until the next relocation
+    mtl_free_space_invalidate(context->free_space);
+    return res;
+  }
+
+  if (!swap) {
+    return MTL_ERROR_BUSY;
+  }
+
+  mtl_open_files_invalidate(context->open_files, inode_id);
+  return MTL_SUCCESS;
+}
+
+static int mtl_swap_relocation(mtl_context *context, uint64_t inode_id,
+                               uint64_t version, uint64_t relocation_inode_id,
+                               const mtl_file_extent *extents,
+                               const uint64_t *first_blocks,
+                               uint64_t extents_length, uint64_t target,
+                               bool copied) {
+  int res, attempts = 0;
+  do {
+    res = mtl_try_swap_relocation(context, inode_id, version,
+                                  relocation_inode_id, extents, first_blocks,
+                                  extents_length, target, copied);
+  } while (mtl_retry(&res, &attempts));
+  return res;
+}
+
+// Moves the blocks of a file into a single range of free blocks. moved and
+// removed receive the number of blocks moved and of extents removed.
+static int mtl_relocate_file(mtl_context *context, uint64_t inode_id,
+                             uint64_t *moved, uint64_t *removed) {
+  *moved = *removed = 0;
+
+  // While we hold a reference, writes without a handle can't take the fast
+  // path either and change the version, like every handle that is opened
+  int res = mtl_open_files_acquire(context->open_files, inode_id);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+  uint64_t version;
+  mtl_open_files_version(context->open_files, inode_id, &version);
+  res = mtl_open_files_references(context->open_files, inode_id) == 1
+            ? MTL_SUCCESS
+            : MTL_ERROR_BUSY;
+
+  uint64_t relocation_inode_id = 0, target = 0;
+  mtl_file_extent *extents = NULL;
+  uint64_t *first_blocks = NULL;
+  uint64_t extents_length = 0;
+  if (res == MTL_SUCCESS)
+    res = mtl_reserve_relocation(context, inode_id, &relocation_inode_id,
+                                 &extents, &first_blocks, &extents_length,
+                                 &target);
+
+  if (res == MTL_SUCCESS) {
+    res = mtl_copy_to_relocation_file(context, inode_id, relocation_inode_id,
+                                      extents, first_blocks, extents_length);
+    int swap_res = mtl_swap_relocation(context, inode_id, version,
+                                       relocation_inode_id, extents,
+                                       first_blocks, extents_length, target,
+                                       res == MTL_SUCCESS);
+    if (res == MTL_SUCCESS) res = swap_res;
+  }
+
+  if (res == MTL_SUCCESS) {
+    *removed = extents_length - mtl_count_extent_runs(extents, first_blocks,
+                                                      extents_length, moved);
+  }
+  if (res == MTL_COMPLETE) res = MTL_SUCCESS;
+
+  free(extents);
+  free(first_blocks);
+  mtl_close_file(context, inode_id);
+  return res;
+}
+
+// Relocates a file and counts it. Requires the defragment lock.
+static int mtl_defragment_locked(mtl_context *context, uint64_t inode_id,
+                                 uint64_t *bytes_moved) {
+  uint64_t moved, removed;
+  int res = mtl_relocate_file(context, inode_id, &moved, &removed);
+  moved *= context->metadata.block_size;
+
+  mtl_defragment_stats *stats = &context->defragment_stats;
+  if (res == MTL_SUCCESS && moved) {
+    ++stats->files_moved;
+    stats->bytes_moved += moved;
+    stats->extents_removed += removed;
+  } else if (res == MTL_ERROR_BUSY || res == MTL_ERROR_NOSPACE) {
+    ++stats->files_skipped;
+  }
+
+  *bytes_moved += moved;
+  return res;
+}
+
+int mtl_defragment_file(mtl_context *context, uint64_t inode_id) {
+  uint64_t moved = 0;
+  pthread_mutex_lock(&context->defragment_lock);
+  int res = mtl_defragment_locked(context, inode_id, &moved);
+  pthread_mutex_unlock(&context->defragment_lock);
+  return res;
+}
+
+int mtl_defragment(mtl_context *context, uint64_t min_extents,
+                   uint64_t max_bytes, uint64_t *bytes_moved) {
+  uint64_t inode_ids[MTL_DEFRAGMENT_CANDIDATES];
+  uint64_t mergeable[MTL_DEFRAGMENT_CANDIDATES];
+  uint64_t candidates;
+  uint64_t pack_inode_id, relocation_inode_id;
+
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+  bool has_pack = mtl_load_pack_inode_id(txn, &pack_inode_id) == MTL_SUCCESS;
+  bool has_relocation =
+      mtl_load_relocation_inode_id(txn, &relocation_inode_id) == MTL_SUCCESS;
+  mtl_find_fragmented_files(txn, min_extents ? min_extents : 1, inode_ids,
+                            mergeable, MTL_DEFRAGMENT_CANDIDATES, &candidates);
+  mtl_end_read(context, txn);
+
+  pthread_mutex_lock(&context->defragment_lock);
+  ++context->defragment_stats.passes;
+
+  // Files that are busy, full or gone in the meantime are left for later
+  uint64_t moved = 0;
+  int res = MTL_SUCCESS;
+  for (uint64_t i = 0; i < candidates && (max_bytes == 0 || moved < max_bytes);
+       ++i) {
+    // Small files map into the pack file through its extents
+    if ((has_pack && inode_ids[i] == pack_inode_id) ||
+        (has_relocation && inode_ids[i] == relocation_inode_id))
+      continue;
+
+    res = mtl_defragment_locked(context, inode_ids[i], &moved);
+    if (res == MTL_ERROR_BUSY || res == MTL_ERROR_NOSPACE ||
+        res == MTL_ERROR_NOENTRY)
+      res = MTL_SUCCESS;
+    if (res != MTL_SUCCESS) break;
+  }
+
+  pthread_mutex_unlock(&context->defragment_lock);
+
+  if (bytes_moved) *bytes_moved = moved;
+  return res;
+}
+
+int mtl_get_defragment_stats(mtl_context *context,
+                             mtl_defragment_stats *stats) {
+  pthread_mutex_lock(&context->defragment_lock);
+  *stats = context->defragment_stats;
+  pthread_mutex_unlock(&context->defragment_lock);
+  return MTL_SUCCESS;
+}
+
+int mtl_set_group_commit(mtl_context *context, uint64_t interval_ms,
+                         uint64_t max_pending) {
+  if (context->group_commit) {
+    mtl_group_commit_destroy(context->group_commit);
+    context->group_commit = NULL;
+  }
+
+  if (interval_ms == 0) {
+    return MTL_SUCCESS;
+  }
+
+  return mtl_group_commit_create(&context->group_commit, context->env,
+                                 &context->map_lock, interval_ms, max_pending);
+}
+
+int mtl_sync(mtl_context *context) {
+  if (context->group_commit) {
+    return mtl_group_commit_sync(context->group_commit);
+  }
+
+  // Commits are synchronous otherwise
+  return MTL_SUCCESS;
+}
+
+int mtl_get_group_commit_stats(mtl_context *context,
+                               mtl_group_commit_stats *stats) {
+  if (context->group_commit == NULL) {
+    stats->commits = stats->pending = stats->syncs = 0;
+    return MTL_SUCCESS;
+  }
+
+  mtl_group_commit_get_stats(context->group_commit, &stats->commits,
+                             &stats->pending, &stats->syncs);
+  return MTL_SUCCESS;
+}
+
+int mtl_get_metadata_stats(mtl_context *context, mtl_metadata_stats *stats) {
+  mtl_map_usage(context, &stats->used_size, &stats->map_size);
+  pthread_rwlock_rdlock(&context->map_lock);
+  stats->map_resizes = context->map_resizes;
+  pthread_rwlock_unlock(&context->map_lock);
+  return MTL_SUCCESS;
+}
+
+int mtl_statfs(mtl_context *context, mtl_filesystem_stats *stats) {
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  mtl_space_counters counters;
+  int res = mtl_load_space_counters(txn, &counters);
+
+  // LMDB keeps the number of entries of a database
+  MDB_stat inodes_stat;
+  if (res == MTL_SUCCESS &&
+      mdb_stat(txn, context->databases.inodes, &inodes_stat) != MDB_SUCCESS)
+    res = MTL_ERROR_INVALID_ARGUMENT;
+
+  mtl_end_read(context, txn);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  stats->block_size = context->metadata.block_size;
+  stats->blocks = context->metadata.num_blocks;
+  stats->free_blocks = counters.free_blocks;
+  stats->used_blocks = stats->blocks - counters.free_blocks;
+  stats->largest_free_extent = counters.largest_free_extent;
+  stats->inodes = inodes_stat.ms_entries;
+  return MTL_SUCCESS;
+}
+
+int mtl_get_generation(mtl_context *context, uint64_t inode_id,
+                       uint64_t *generation) {
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  if (res == MTL_SUCCESS) *generation = inode->generation;
 
+  mtl_end_read(context, txn);
+  return res;
+}
+
+int mtl_get_dentry_cache_stats(mtl_context *context,
+                               mtl_dentry_cache_stats *stats) {
+  mtl_dentry_cache_get_stats(context->dentries, &stats->hits, &stats->misses,
+                             &stats->entries);
   return MTL_SUCCESS;
 }
 
@@ -633,21 +3188,51 @@ int mtl_load_extent_list(mtl_context *context, uint64_t inode_id,
                          uint64_t *file_length) {
   int res;
 
+  // Serve open files from their snapshot
+  if (mtl_open_files_load(context->open_files, inode_id, file_length, extents,
+                          MTL_MAX_EXTENTS, extents_length)) {
+    return MTL_SUCCESS;
+  }
+
+  uint64_t version;
+  bool is_open =
+      mtl_open_files_version(context->open_files, inode_id, &version);
+
   MDB_txn *txn;
-  mdb_txn_begin(context->env, NULL, MDB_RDONLY, &txn);
+  mtl_begin_read(context, &txn);
 
-  // Load extents
   const mtl_inode *inode;
-  const mtl_file_extent *tmp_extents;
-  uint64_t tmp_extents_length;
-  res = mtl_load_file(txn, inode_id, &inode, &tmp_extents, &tmp_extents_length);
+  res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
   if (res != MTL_SUCCESS) {
-    mdb_txn_abort(txn);
+    mtl_end_read(context, txn);
     return res;
   }
 
-  if (tmp_extents_length > MTL_MAX_EXTENTS) {
-    mdb_txn_abort(txn);
+  if (extents == NULL && extents_length == NULL) {
+    // Only the file length was requested
+    if (file_length)
+      *file_length = mtl_current_length(context, inode_id, inode->length);
+    mtl_end_read(context, txn);
+    return MTL_SUCCESS;
+  }
+
+  // Load extents
+  mtl_file_extent *tmp_extents;
+  uint64_t *first_blocks;
+  uint64_t tmp_extents_length, shared_first_block, shared_end_block;
+  res = mtl_load_all_file_extents(txn, inode_id, &tmp_extents, &first_blocks,
+                                  &tmp_extents_length, &shared_first_block,
+                                  &shared_end_block);
+  if (res != MTL_SUCCESS) {
+    mtl_end_read(context, txn);
+    return res;
+  }
+
+  // Callers that only want to know the length can pass extents == NULL
+  if (extents && tmp_extents_length > MTL_MAX_EXTENTS) {
+    free(tmp_extents);
+    free(first_blocks);
+    mtl_end_read(context, txn);
     return MTL_ERROR_INVALID_ARGUMENT;
   }
 
@@ -660,9 +3245,179 @@ int mtl_load_extent_list(mtl_context *context, uint64_t inode_id,
   }
 
   if (file_length) {
-    *file_length = inode->length;
+    *file_length = mtl_current_length(context, inode_id, inode->length);
+  }
+
+  if (is_open)
+    mtl_open_files_store(context->open_files, inode_id, version, inode->length,
+                         tmp_extents, first_blocks, tmp_extents_length,
+                         shared_first_block, shared_end_block);
+
+  free(tmp_extents);
+  free(first_blocks);
+  mtl_end_read(context, txn);
+  return MTL_SUCCESS;
+}
+
+int mtl_map_range(mtl_context *context, uint64_t inode_id, uint64_t offset,
+                  uint64_t length, mtl_file_extent *extents,
+                  uint64_t max_extents, uint64_t *extents_length) {
+  uint64_t first_block = offset / context->metadata.block_size;
+  uint64_t end_block = (offset + length) / context->metadata.block_size;
+  if ((offset + length) % context->metadata.block_size) ++end_block;
+
+  *extents_length = 0;
+  if (length == 0 || max_extents == 0) {
+    return MTL_SUCCESS;
+  }
+
+  // The caller decides how many extents it takes, so this can be large
+  uint64_t *first_blocks = calloc(max_extents, sizeof(uint64_t));
+  if (first_blocks == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  int res = mtl_map_blocks(context, inode_id, first_block, extents,
+                           first_blocks, max_extents, extents_length);
+  if (res != MTL_SUCCESS) {
+    free(first_blocks);
+    return res;
+  }
+
+  // Clip the extents to the blocks covering the range, up to the first hole
+  uint64_t clipped_length = 0;
+  uint64_t next_block = first_block;
+  for (uint64_t i = 0; i < *extents_length; ++i) {
+    uint64_t extent_start = first_blocks[i];
+    uint64_t extent_end = extent_start + extents[i].length;
+    if (extent_start >= end_block || extent_start > next_block) break;
+
+    mtl_file_extent clipped = extents[i];
+    if (extent_start < first_block) {
+      clipped.offset += first_block - extent_start;
+      extent_start = first_block;
+    }
+    if (extent_end > end_block) extent_end = end_block;
+    clipped.length = extent_end - extent_start;
+
+    extents[clipped_length++] = clipped;
+    next_block = extent_end;
+  }
+
+  free(first_blocks);
+  *extents_length = clipped_length;
+  return MTL_SUCCESS;
+}
+
+int mtl_find_mapped(mtl_context *context, uint64_t inode_id, uint64_t offset,
+                    uint64_t *mapped_offset) {
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  const mtl_inode *inode;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, NULL);
+  uint64_t file_length =
+      res == MTL_SUCCESS ? mtl_current_length(context, inode_id, inode->length)
+                         : 0;
+  mtl_end_read(context, txn);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  *mapped_offset = file_length;
+  if (offset >= file_length) {
+    return MTL_SUCCESS;
+  }
+
+  uint64_t block_size = context->metadata.block_size;
+  mtl_file_extent extent;
+  uint64_t first_block;
+  uint64_t extents_length;
+  res = mtl_map_blocks(context, inode_id, offset / block_size, &extent,
+                       &first_block, 1, &extents_length);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  if (extents_length) {
+    uint64_t extent_offset = first_block * block_size;
+    if (extent_offset <= offset) {
+      *mapped_offset = offset;
+    } else if (extent_offset < file_length) {
+      *mapped_offset = extent_offset;
+    }
+  }
+
+  return MTL_SUCCESS;
+}
+
+int mtl_fill_holes(mtl_context *context, uint64_t inode_id, uint64_t offset,
+                   uint64_t length) {
+  static const char zeros[MTL_ZERO_BUFFER_SIZE];
+
+  MDB_txn *txn;
+  mtl_begin_read(context, &txn);
+
+  const mtl_inode *inode;
+  uint64_t data_length;
+  int res = mtl_load_inode(txn, inode_id, &inode, NULL, &data_length);
+  uint64_t file_length =
+      res == MTL_SUCCESS ? mtl_current_length(context, inode_id, inode->length)
+                         : 0;
+  bool is_small = res == MTL_SUCCESS && inode->type == MTL_FILE &&
+                  (data_length ||
+                   mtl_load_packed_file(txn, inode_id, NULL) == MTL_SUCCESS);
+  mtl_end_read(context, txn);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  // Data kept in the inode or in the pack file has to go to blocks first
+  if (is_small) {
+    res = mtl_fallocate(context, inode_id, MTL_FALLOCATE_KEEP_SIZE, 0, 0);
+    if (res != MTL_SUCCESS) {
+      return res;
+    }
+  }
+
+  uint64_t block_size = context->metadata.block_size;
+  uint64_t end = offset + length < file_length ? offset + length : file_length;
+  uint64_t block = offset / block_size;
+  while (block * block_size < end) {
+    mtl_file_extent extent;
+    uint64_t first_block;
+    uint64_t extents_length;
+    res = mtl_map_blocks(context, inode_id, block, &extent, &first_block, 1,
+                         &extents_length);
+    if (res != MTL_SUCCESS) {
+      return res;
+    }
+
+    if (extents_length && first_block <= block) {
+      block = first_block + extent.length;
+      continue;
+    }
+
+    // Whole blocks are filled, as far as they lie within the file
+    uint64_t hole_end = (end + block_size - 1) / block_size * block_size;
+    if (extents_length && first_block * block_size < hole_end)
+      hole_end = first_block * block_size;
+    if (hole_end > file_length) hole_end = file_length;
+
+    for (uint64_t position = block * block_size; position < hole_end;) {
+      uint64_t size = hole_end - position;
+      if (size > sizeof(zeros)) size = sizeof(zeros);
+
+      res = mtl_write_buffer(context, inode_id, zeros, size, position, false);
+      if (res != MTL_SUCCESS) {
+        return res;
+      }
+      position += size;
+    }
+
+    if (extents_length == 0) break;
+    block = first_block + extent.length;
   }
 
-  mdb_txn_abort(txn);
   return MTL_SUCCESS;
 }
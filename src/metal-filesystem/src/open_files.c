@@ -0,0 +1,332 @@
+#include "open_files.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <metal-filesystem/metal.h>
+
+#define OPEN_FILES_BUCKETS 1024
+
+typedef struct mtl_open_files_entry {
+  struct mtl_open_files_entry *next;
+  uint64_t inode_id;
+  uint64_t references;
+  uint64_t version;
+  bool valid;
+  uint64_t length;
+  mtl_file_extent *extents;
+  uint64_t *first_blocks;  // logical block at which each extent starts
+  uint64_t extents_length;
+  uint64_t extents_capacity;
+  // Blocks that might belong to other files as well
+  uint64_t shared_first_block;
+  uint64_t shared_end_block;
+  bool length_dirty;
+  uint64_t preallocated_from;
+} mtl_open_files_entry;
+
+typedef struct mtl_open_files {
+  pthread_mutex_t lock;
+  mtl_open_files_entry *buckets[OPEN_FILES_BUCKETS];
+} mtl_open_files;
+
+int mtl_open_files_create(mtl_open_files **open_files) {
+  mtl_open_files *o = calloc(1, sizeof(mtl_open_files));
+  if (o == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  pthread_mutex_init(&o->lock, NULL);
+
+  *open_files = o;
+  return MTL_SUCCESS;
+}
+
+void mtl_open_files_destroy(mtl_open_files *open_files) {
+  for (uint64_t i = 0; i < OPEN_FILES_BUCKETS; ++i) {
+    mtl_open_files_entry *file = open_files->buckets[i];
+    while (file) {
+      mtl_open_files_entry *next = file->next;
+      free(file->extents);
+      free(file->first_blocks);
+      free(file);
+      file = next;
+    }
+  }
+
+  pthread_mutex_destroy(&open_files->lock);
+  free(open_files);
+}
+
+static mtl_open_files_entry **mtl_open_files_find(mtl_open_files *open_files,
+                                           uint64_t inode_id) {
+  mtl_open_files_entry **file = &open_files->buckets[inode_id % OPEN_FILES_BUCKETS];
+  while (*file && (*file)->inode_id != inode_id) file = &(*file)->next;
+  return file;
+}
+
+int mtl_open_files_acquire(mtl_open_files *open_files, uint64_t inode_id) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry **slot = mtl_open_files_find(open_files, inode_id);
+  if (*slot == NULL) {
+    *slot = calloc(1, sizeof(mtl_open_files_entry));
+    if (*slot == NULL) {
+      pthread_mutex_unlock(&open_files->lock);
+      return MTL_ERROR_NOSPACE;
+    }
+    (*slot)->inode_id = inode_id;
+    (*slot)->preallocated_from = UINT64_MAX;
+  }
+  ++(*slot)->references;
+
+  pthread_mutex_unlock(&open_files->lock);
+  return MTL_SUCCESS;
+}
+
+void mtl_open_files_release(mtl_open_files *open_files, uint64_t inode_id) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry **slot = mtl_open_files_find(open_files, inode_id);
+  if (*slot && --(*slot)->references == 0) {
+    mtl_open_files_entry *file = *slot;
+    *slot = file->next;
+    free(file->extents);
+    free(file->first_blocks);
+    free(file);
+  }
+
+  pthread_mutex_unlock(&open_files->lock);
+}
+
+bool mtl_open_files_version(mtl_open_files *open_files, uint64_t inode_id,
+                            uint64_t *version) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  if (file) *version = file->version;
+
+  pthread_mutex_unlock(&open_files->lock);
+  return file != NULL;
+}
+
+bool mtl_open_files_load(mtl_open_files *open_files, uint64_t inode_id,
+                         uint64_t *length, mtl_file_extent *extents,
+                         uint64_t max_extents, uint64_t *extents_length) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  bool valid = file && file->valid &&
+               (max_extents == 0 || file->extents_length <= max_extents);
+  if (valid) {
+    if (length) *length = file->length;
+    if (extents)
+      memcpy(extents, file->extents,
+             file->extents_length * sizeof(mtl_file_extent));
+    if (extents_length) *extents_length = file->extents_length;
+  }
+
+  pthread_mutex_unlock(&open_files->lock);
+  return valid;
+}
+
+bool mtl_open_files_map(mtl_open_files *open_files, uint64_t inode_id,
+                        uint64_t first_block, mtl_file_extent *extents,
+                        uint64_t *first_blocks, uint64_t max_extents,
+                        uint64_t *extents_length) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  bool valid = file && file->valid;
+  if (valid) {
+    // Find the first extent that ends behind first_block
+    uint64_t low = 0, high = file->extents_length;
+    while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      if (file->first_blocks[mid] + file->extents[mid].length <= first_block)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+    *extents_length = 0;
+    for (uint64_t i = low;
+         i < file->extents_length && *extents_length < max_extents; ++i) {
+      extents[*extents_length] = file->extents[i];
+      if (first_blocks) first_blocks[*extents_length] = file->first_blocks[i];
+      ++*extents_length;
+    }
+  }
+
+  pthread_mutex_unlock(&open_files->lock);
+  return valid;
+}
+
+void mtl_open_files_store(mtl_open_files *open_files, uint64_t inode_id,
+                          uint64_t version, uint64_t length,
+                          const mtl_file_extent *extents,
+                          const uint64_t *first_blocks,
+                          uint64_t extents_length, uint64_t shared_first_block,
+                          uint64_t shared_end_block) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  if (file == NULL) {
+    pthread_mutex_unlock(&open_files->lock);
+    return;
+  }
+
+  ++file->version;
+  file->valid = false;
+
+  if (file->version - 1 != version) {
+    // Somebody else has modified the file in the meantime
+    pthread_mutex_unlock(&open_files->lock);
+    return;
+  }
+
+  if (extents_length > file->extents_capacity) {
+    mtl_file_extent *new_extents =
+        realloc(file->extents, extents_length * sizeof(mtl_file_extent));
+    if (new_extents == NULL) {
+      pthread_mutex_unlock(&open_files->lock);
+      return;
+    }
+    file->extents = new_extents;
+
+    uint64_t *new_first_blocks =
+        realloc(file->first_blocks, extents_length * sizeof(uint64_t));
+    if (new_first_blocks == NULL) {
+      pthread_mutex_unlock(&open_files->lock);
+      return;
+    }
+    file->first_blocks = new_first_blocks;
+
+    file->extents_capacity = extents_length;
+  }
+
+  if (extents_length) {
+    memcpy(file->extents, extents, extents_length * sizeof(mtl_file_extent));
+    memcpy(file->first_blocks, first_blocks,
+           extents_length * sizeof(uint64_t));
+  }
+  file->extents_length = extents_length;
+  file->shared_first_block = shared_first_block;
+  file->shared_end_block = shared_end_block;
+  if (file->length_dirty && file->length > length) {
+    // The length has not been persisted yet
+    length = file->length;
+  } else {
+    file->length_dirty = false;
+  }
+  file->length = length;
+  file->valid = true;
+
+  pthread_mutex_unlock(&open_files->lock);
+}
+
+void mtl_open_files_invalidate(mtl_open_files *open_files, uint64_t inode_id) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  if (file) {
+    ++file->version;
+    file->valid = false;
+    file->length_dirty = false;
+    file->preallocated_from = UINT64_MAX;
+  }
+
+  pthread_mutex_unlock(&open_files->lock);
+}
+
+bool mtl_open_files_write(mtl_open_files *open_files, uint64_t inode_id,
+                          uint64_t offset, uint64_t end, uint64_t block_size) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  bool fits = false;
+  if (file && file->valid) {
+    uint64_t block = offset / block_size;
+    uint64_t end_block = end / block_size;
+    if (end % block_size) ++end_block;
+
+    // Shared blocks have to be copied before they are written to
+    bool shared = block < file->shared_end_block &&
+                  end_block > file->shared_first_block;
+
+    // Find the first extent that ends behind the first block
+    uint64_t low = 0, high = file->extents_length;
+    while (low < high) {
+      uint64_t mid = low + (high - low) / 2;
+      if (file->first_blocks[mid] + file->extents[mid].length <= block)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+    // The range must not run into a hole
+    for (uint64_t i = low; i < file->extents_length && block < end_block &&
+                           file->first_blocks[i] <= block;
+         ++i)
+      block = file->first_blocks[i] + file->extents[i].length;
+
+    fits = !shared && block >= end_block;
+    if (fits && end > file->length) {
+      file->length = end;
+      file->length_dirty = true;
+    }
+  }
+
+  pthread_mutex_unlock(&open_files->lock);
+  return fits;
+}
+
+bool mtl_open_files_dirty_length(mtl_open_files *open_files, uint64_t inode_id,
+                                 uint64_t *length) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  bool dirty = file && file->length_dirty;
+  if (dirty) *length = file->length;
+
+  pthread_mutex_unlock(&open_files->lock);
+  return dirty;
+}
+
+void mtl_open_files_set_preallocated(mtl_open_files *open_files,
+                                     uint64_t inode_id, uint64_t first_block) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  if (file && first_block < file->preallocated_from)
+    file->preallocated_from = first_block;
+
+  pthread_mutex_unlock(&open_files->lock);
+}
+
+uint64_t mtl_open_files_take_preallocated(mtl_open_files *open_files,
+                                          uint64_t inode_id) {
+  pthread_mutex_lock(&open_files->lock);
+
+  uint64_t first_block = UINT64_MAX;
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  if (file) {
+    first_block = file->preallocated_from;
+    file->preallocated_from = UINT64_MAX;
+  }
+
+  pthread_mutex_unlock(&open_files->lock);
+  return first_block;
+}
+
+uint64_t mtl_open_files_references(mtl_open_files *open_files,
+                                   uint64_t inode_id) {
+  pthread_mutex_lock(&open_files->lock);
+
+  mtl_open_files_entry *file = *mtl_open_files_find(open_files, inode_id);
+  uint64_t references = file ? file->references : 0;
+
+  pthread_mutex_unlock(&open_files->lock);
+  return references;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <metal-filesystem/storage.h>
+
+// Keeps a snapshot of the length and extent list of every open file, so that
+// I/O through an open file does not have to go to the metadata store.
+//
+// Writes within the blocks an open file already has only change the length in
+// its snapshot. Such a dirty length is persisted when the file is closed and
+// survives the snapshot being replaced by one with a shorter length.
+//
+// Every entry carries a version that is bumped whenever the snapshot is
+// replaced or invalidated. To store a snapshot, take the version before
+// starting the transaction the snapshot is loaded from; if the version has
+// changed in the meantime, the store fails and the entry is invalidated.
+typedef struct mtl_open_files mtl_open_files;
+
+int mtl_open_files_create(mtl_open_files **open_files);
+void mtl_open_files_destroy(mtl_open_files *open_files);
+
+// Fails with MTL_ERROR_NOSPACE if there is no memory for a new entry
+int mtl_open_files_acquire(mtl_open_files *open_files, uint64_t inode_id);
+void mtl_open_files_release(mtl_open_files *open_files, uint64_t inode_id);
+
+// Returns false if the file is not open
+bool mtl_open_files_version(mtl_open_files *open_files, uint64_t inode_id,
+                            uint64_t *version);
+
+// Returns false if there is no valid snapshot. extents may be NULL if only the
+// length is of interest. Unless max_extents is 0, this also fails if the
+// snapshot has more than max_extents extents.
+bool mtl_open_files_load(mtl_open_files *open_files, uint64_t inode_id,
+                         uint64_t *length, mtl_file_extent *extents,
+                         uint64_t max_extents, uint64_t *extents_length);
+
+// Like mtl_load_file_extents: starts with the snapshot's extent containing
+// first_block. Returns false if there is no valid snapshot.
+bool mtl_open_files_map(mtl_open_files *open_files, uint64_t inode_id,
+                        uint64_t first_block, mtl_file_extent *extents,
+                        uint64_t *first_blocks, uint64_t max_extents,
+                        uint64_t *extents_length);
+
+// The blocks [shared_first_block, shared_end_block) cover all extents that
+// the file shares with others; writes to them don't take the fast path of
+// mtl_open_files_write
+void mtl_open_files_store(mtl_open_files *open_files, uint64_t inode_id,
+                          uint64_t version, uint64_t length,
+                          const mtl_file_extent *extents,
+                          const uint64_t *first_blocks,
+                          uint64_t extents_length, uint64_t shared_first_block,
+                          uint64_t shared_end_block);
+// Also drops the dirty length and the preallocation, so only use this after
+// the length has been set in the metadata store
+void mtl_open_files_invalidate(mtl_open_files *open_files, uint64_t inode_id);
+
+// Returns true if the snapshot's extents cover the byte range [offset, end)
+// without a hole or a shared block; the snapshot length is extended to end in
+// this case. Returns false if there is no valid snapshot.
+bool mtl_open_files_write(mtl_open_files *open_files, uint64_t inode_id,
+                          uint64_t offset, uint64_t end, uint64_t block_size);
+// Returns false if the length has not been changed in memory
+bool mtl_open_files_dirty_length(mtl_open_files *open_files, uint64_t inode_id,
+                                 uint64_t *length);
+
+// Remembers that the blocks from first_block onwards were preallocated
+void mtl_open_files_set_preallocated(mtl_open_files *open_files,
+                                     uint64_t inode_id, uint64_t first_block);
+// Returns and forgets the first preallocated block, or UINT64_MAX if there is
+// none
+uint64_t mtl_open_files_take_preallocated(mtl_open_files *open_files,
+                                          uint64_t inode_id);
+// Returns the number of handles to the file
+uint64_t mtl_open_files_references(mtl_open_files *open_files,
+                                   uint64_t inode_id);
@@ -0,0 +1,214 @@
+#include "packed.h"
+
+#include <endian.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <metal-filesystem/inode.h>
+#include <metal-filesystem/metal.h>
+
+#include "databases.h"
+#include "meta.h"
+
+#define PACKED_BLOCKS_DB_NAME "packed_blocks"
+#define PACKED_FILES_DB_NAME "packed_files"
+
+// Number of blocks mtl_pack_sectors looks at before giving up
+#define MTL_PACKED_SCAN_BLOCKS 64
+
+int mtl_ensure_packed_blocks_db_open(MDB_txn *txn, MDB_dbi *db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *db = databases->packed_blocks;
+    return MDB_SUCCESS;
+  }
+
+  return mdb_dbi_open(txn, PACKED_BLOCKS_DB_NAME, MDB_CREATE, db);
+}
+
+int mtl_ensure_packed_files_db_open(MDB_txn *txn, MDB_dbi *db) {
+  const mtl_databases *databases = mtl_databases_of(txn);
+  if (databases) {
+    *db = databases->packed_files;
+    return MDB_SUCCESS;
+  }
+
+  return mdb_dbi_open(txn, PACKED_FILES_DB_NAME, MDB_CREATE, db);
+}
+
+int mtl_create_pack_inode(MDB_txn *txn, uint64_t *inode_id) {
+  if (mtl_load_pack_inode_id(txn, inode_id) == MTL_SUCCESS) {
+    return MTL_SUCCESS;
+  }
+
+  int now = time(NULL);
+  mtl_inode pack_inode = {.type = MTL_FILE,
+                          .length = 0,
+                          .user = 0,
+                          .group = 0,
+                          .accessed = now,
+                          .modified = now,
+                          .created = now,
+                          .mode = S_IFREG};
+
+  *inode_id = mtl_next_inode_id(txn);
+  int res = mtl_put_inode(txn, *inode_id, &pack_inode, NULL, 0);
+  if (res != MTL_SUCCESS) {
+    return res;
+  }
+
+  return mtl_store_pack_inode_id(txn, *inode_id);
+}
+
+int mtl_load_packed_file(MDB_txn *txn, uint64_t inode_id,
+                         mtl_packed_file *file) {
+  MDB_dbi packed_files_db;
+  mtl_ensure_packed_files_db_open(txn, &packed_files_db);
+
+  MDB_val key = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
+  MDB_val value;
+  if (mdb_get(txn, packed_files_db, &key, &value) != MDB_SUCCESS) {
+    return MTL_ERROR_NOENTRY;
+  }
+
+  if (file) memcpy(file, value.mv_data, sizeof(*file));
+  return MTL_SUCCESS;
+}
+
+int mtl_put_packed_file(MDB_txn *txn, uint64_t inode_id,
+                        const mtl_packed_file *file) {
+  MDB_dbi packed_files_db;
+  mtl_ensure_packed_files_db_open(txn, &packed_files_db);
+
+  MDB_val key = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
+  MDB_val value = {.mv_size = sizeof(*file), .mv_data = (void *)file};
+  if (mdb_put(txn, packed_files_db, &key, &value, 0) != MDB_SUCCESS) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  return MTL_SUCCESS;
+}
+
+int mtl_delete_packed_file(MDB_txn *txn, uint64_t inode_id, uint64_t *hint) {
+  mtl_packed_file file;
+  if (mtl_load_packed_file(txn, inode_id, &file) != MTL_SUCCESS) {
+    return MTL_SUCCESS;
+  }
+
+  mtl_unpack_sectors(txn, file.block, file.first_sector, file.sectors, hint);
+
+  MDB_dbi packed_files_db;
+  mtl_ensure_packed_files_db_open(txn, &packed_files_db);
+
+  MDB_val key = {.mv_size = sizeof(inode_id), .mv_data = &inode_id};
+  mdb_del(txn, packed_files_db, &key, NULL);
+  return MTL_SUCCESS;
+}
+
+static uint64_t mtl_sector_mask(uint32_t first_sector, uint32_t sectors) {
+  if (sectors >= MTL_PACKED_SECTORS) return UINT64_MAX;
+  return ((UINT64_C(1) << sectors) - 1) << first_sector;
+}
+
+// Returns the first of sectors consecutive free sectors, or -1
+static int mtl_find_free_sectors(uint64_t occupied, uint32_t sectors) {
+  for (uint32_t sector = 0; sector + sectors <= MTL_PACKED_SECTORS; ++sector) {
+    uint64_t mask = mtl_sector_mask(sector, sectors);
+    if ((occupied & mask) == 0) return sector;
+
+    // Skip behind the last occupied sector in the way
+    sector = 63 - __builtin_clzll(occupied & mask);
+  }
+  return -1;
+}
+
+static void mtl_put_packed_block(MDB_txn *txn, MDB_dbi packed_blocks_db,
+                                 uint64_t block, uint64_t occupied) {
+  uint64_t block_be = htobe64(block);
+  MDB_val key = {.mv_size = sizeof(block_be), .mv_data = &block_be};
+  MDB_val value = {.mv_size = sizeof(occupied), .mv_data = &occupied};
+  mdb_put(txn, packed_blocks_db, &key, &value, 0);
+}
+
+int mtl_pack_sectors(MDB_txn *txn, uint32_t sectors, uint64_t *hint,
+                     uint64_t *block, uint32_t *first_sector) {
+  if (sectors == 0 || sectors > MTL_PACKED_SECTORS) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  MDB_dbi packed_blocks_db;
+  mtl_ensure_packed_blocks_db_open(txn, &packed_blocks_db);
+
+  MDB_cursor *cursor;
+  mdb_cursor_open(txn, packed_blocks_db, &cursor);
+
+  uint64_t hint_be = htobe64(*hint);
+  MDB_val key = {.mv_size = sizeof(hint_be), .mv_data = &hint_be};
+  MDB_val value;
+  int res = mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE);
+
+  bool wrapped = false;
+  for (int scanned = 0; scanned < MTL_PACKED_SCAN_BLOCKS; ++scanned) {
+    if (res != MDB_SUCCESS) {
+      // Continue at the beginning of the pack file
+      if (wrapped) break;
+      wrapped = true;
+      res = mdb_cursor_get(cursor, &key, &value, MDB_FIRST);
+      if (res != MDB_SUCCESS) break;
+    }
+
+    uint64_t candidate_be;
+    memcpy(&candidate_be, key.mv_data, sizeof(candidate_be));
+    uint64_t candidate = be64toh(candidate_be);
+    if (wrapped && candidate >= *hint) break;
+
+    uint64_t occupied;
+    memcpy(&occupied, value.mv_data, sizeof(occupied));
+    int sector = mtl_find_free_sectors(occupied, sectors);
+    if (sector >= 0) {
+      mdb_cursor_close(cursor);
+
+      mtl_put_packed_block(txn, packed_blocks_db, candidate,
+                           occupied | mtl_sector_mask(sector, sectors));
+      *hint = *block = candidate;
+      *first_sector = sector;
+      return MTL_SUCCESS;
+    }
+
+    res = mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+  }
+
+  mdb_cursor_close(cursor);
+  return MTL_ERROR_NOSPACE;
+}
+
+void mtl_unpack_sectors(MDB_txn *txn, uint64_t block, uint32_t first_sector,
+                        uint32_t sectors, uint64_t *hint) {
+  MDB_dbi packed_blocks_db;
+  mtl_ensure_packed_blocks_db_open(txn, &packed_blocks_db);
+
+  uint64_t block_be = htobe64(block);
+  MDB_val key = {.mv_size = sizeof(block_be), .mv_data = &block_be};
+  MDB_val value;
+  if (mdb_get(txn, packed_blocks_db, &key, &value) != MDB_SUCCESS) {
+    return;
+  }
+
+  // Empty blocks stay in the pack file, for the next small files
+  uint64_t occupied;
+  memcpy(&occupied, value.mv_data, sizeof(occupied));
+  mtl_put_packed_block(txn, packed_blocks_db, block,
+                       occupied & ~mtl_sector_mask(first_sector, sectors));
+
+  if (block < *hint) *hint = block;
+}
+
+int mtl_add_packed_block(MDB_txn *txn, uint64_t block) {
+  MDB_dbi packed_blocks_db;
+  mtl_ensure_packed_blocks_db_open(txn, &packed_blocks_db);
+
+  mtl_put_packed_block(txn, packed_blocks_db, block, 0);
+  return MTL_SUCCESS;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <lmdb.h>
+
+// Small files can share blocks with each other. Those blocks belong to a pack
+// file, a file without a directory entry, and are split into
+// MTL_PACKED_SECTORS sectors each. The packed_blocks database keeps a bitmap
+// of the occupied sectors of every block of the pack file (keyed by the
+// big-endian block number, so that it can be scanned in order) and the
+// packed_files database where each packed file keeps its data.
+#define MTL_PACKED_SECTORS 64
+
+typedef struct mtl_packed_file {
+  uint64_t block;  // within the pack file
+  uint32_t first_sector;
+  uint32_t sectors;
+  // The bytes behind this have not been written to and read as zeros
+  uint64_t data_length;
+} mtl_packed_file;
+
+// Creates the pack file unless it exists already. mtl_load_pack_inode_id
+// (see meta.h) only looks it up.
+int mtl_create_pack_inode(MDB_txn *txn, uint64_t *inode_id);
+
+int mtl_load_packed_file(MDB_txn *txn, uint64_t inode_id,
+                         mtl_packed_file *file);
+int mtl_put_packed_file(MDB_txn *txn, uint64_t inode_id,
+                        const mtl_packed_file *file);
+// Also frees the sectors of the file, if it has any
+int mtl_delete_packed_file(MDB_txn *txn, uint64_t inode_id, uint64_t *hint);
+
+// Marks sectors consecutive free sectors within a single block as occupied.
+// The search starts at the block in hint and gives up with MTL_ERROR_NOSPACE
+// after a limited number of blocks, in which case the pack file should grow.
+// hint receives the block that was used.
+int mtl_pack_sectors(MDB_txn *txn, uint32_t sectors, uint64_t *hint,
+                     uint64_t *block, uint32_t *first_sector);
+// Moves hint back to block, so that the search finds the freed sectors
+void mtl_unpack_sectors(MDB_txn *txn, uint64_t block, uint32_t first_sector,
+                        uint32_t sectors, uint64_t *hint);
+// Registers a new (empty) block of the pack file
+int mtl_add_packed_block(MDB_txn *txn, uint64_t block);
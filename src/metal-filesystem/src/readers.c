@@ -0,0 +1,131 @@
+#include "readers.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <metal-filesystem/metal.h>
+
+typedef struct mtl_reader {
+  struct mtl_reader *next;
+  struct mtl_reader *prev;
+  struct mtl_readers *readers;
+  MDB_txn *txn;
+  bool active;
+} mtl_reader;
+
+typedef struct mtl_readers {
+  MDB_env *env;
+  pthread_key_t key;
+  pthread_mutex_t lock;
+  mtl_reader *first;
+} mtl_readers;
+
+static void mtl_reader_unlink(mtl_readers *readers, mtl_reader *reader) {
+  if (reader->prev)
+    reader->prev->next = reader->next;
+  else
+    readers->first = reader->next;
+  if (reader->next) reader->next->prev = reader->prev;
+}
+
+// Called when a thread that has used the metadata store exits
+static void mtl_reader_release(void *arg) {
+  mtl_reader *reader = arg;
+
+  pthread_mutex_lock(&reader->readers->lock);
+  mtl_reader_unlink(reader->readers, reader);
+  pthread_mutex_unlock(&reader->readers->lock);
+
+  if (reader->txn) mdb_txn_abort(reader->txn);
+  free(reader);
+}
+
+int mtl_readers_create(mtl_readers **readers, MDB_env *env) {
+  mtl_readers *r = calloc(1, sizeof(mtl_readers));
+  if (r == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (pthread_key_create(&r->key, mtl_reader_release) != 0) {
+    free(r);
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  r->env = env;
+  pthread_mutex_init(&r->lock, NULL);
+
+  *readers = r;
+  return MTL_SUCCESS;
+}
+
+void mtl_readers_destroy(mtl_readers *readers) {
+  // Threads that exit from now on don't call mtl_reader_release anymore
+  pthread_key_delete(readers->key);
+
+  mtl_reader *reader = readers->first;
+  while (reader) {
+    mtl_reader *next = reader->next;
+    if (reader->txn) mdb_txn_abort(reader->txn);
+    free(reader);
+    reader = next;
+  }
+
+  pthread_mutex_destroy(&readers->lock);
+  free(readers);
+}
+
+int mtl_readers_begin(mtl_readers *readers, MDB_txn **txn) {
+  mtl_reader *reader = pthread_getspecific(readers->key);
+  if (reader == NULL) {
+    reader = calloc(1, sizeof(mtl_reader));
+    if (reader == NULL) {
+      return mdb_txn_begin(readers->env, NULL, MDB_RDONLY, txn);
+    }
+
+    reader->readers = readers;
+    pthread_mutex_lock(&readers->lock);
+    reader->next = readers->first;
+    if (readers->first) readers->first->prev = reader;
+    readers->first = reader;
+    pthread_mutex_unlock(&readers->lock);
+
+    pthread_setspecific(readers->key, reader);
+  }
+
+  if (reader->active) {
+    // Nested read, which gets a transaction of its own
+    return mdb_txn_begin(readers->env, NULL, MDB_RDONLY, txn);
+  }
+
+  int res;
+  if (reader->txn) {
+    res = mdb_txn_renew(reader->txn);
+    if (res != MDB_SUCCESS) {
+      mdb_txn_abort(reader->txn);
+      reader->txn = NULL;
+    }
+  }
+
+  if (reader->txn == NULL) {
+    res = mdb_txn_begin(readers->env, NULL, MDB_RDONLY, &reader->txn);
+    if (res != MDB_SUCCESS) {
+      reader->txn = NULL;
+      return res;
+    }
+  }
+
+  reader->active = true;
+  *txn = reader->txn;
+  return MDB_SUCCESS;
+}
+
+void mtl_readers_end(mtl_readers *readers, MDB_txn *txn) {
+  mtl_reader *reader = pthread_getspecific(readers->key);
+  if (reader && reader->txn == txn) {
+    mdb_txn_reset(txn);
+    reader->active = false;
+  } else {
+    mdb_txn_abort(txn);
+  }
+}
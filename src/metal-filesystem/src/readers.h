@@ -0,0 +1,18 @@
+#pragma once
+
+#include <lmdb.h>
+
+// Keeps a read transaction per thread that is reset after use and renewed for
+// the next one, instead of allocating and tearing down a transaction for every
+// read-only call. Requires the environment to be opened with MDB_NOTLS.
+typedef struct mtl_readers mtl_readers;
+
+int mtl_readers_create(mtl_readers **readers, MDB_env *env);
+// Aborts the transactions of all threads, so only call this when none of them
+// is in use anymore
+void mtl_readers_destroy(mtl_readers *readers);
+
+// Returns a read transaction that sees everything committed so far. It has to
+// be handed back with mtl_readers_end instead of being aborted.
+int mtl_readers_begin(mtl_readers *readers, MDB_txn **txn);
+void mtl_readers_end(mtl_readers *readers, MDB_txn *txn);
@@ -0,0 +1,651 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <metal-filesystem/metal.h>
+
+#include "uring.h"
+
+// Storage backend over a regular file or block device. The ranges that are
+// read or written are mapped to extents, which are split into I/Os of at most
+// MTL_FILE_STORAGE_MAX_IO bytes and kept in flight through a per-thread
+// io_uring, up to the queue depth. Requests that are submitted one after the
+// other share the queue depth of their thread.
+
+#define MTL_FILE_STORAGE_MAX_IO (1ul << 20)
+
+// O_DIRECT requires buffers, offsets and lengths to be aligned to at least
+// the logical block size of the device
+#define MTL_FILE_STORAGE_ALIGNMENT 4096
+
+// Number of extents that are mapped at once
+#define MAPPED_EXTENTS 16
+
+struct mtl_file_storage_op;
+
+typedef struct mtl_file_storage_ring {
+  struct mtl_file_storage_ring *next;
+  struct mtl_file_storage_ring *prev;
+  struct mtl_file_storage *storage;
+  mtl_uring *ring;  // NULL if io_uring is not available
+
+  // Requests with I/Os that haven't been queued on the ring yet
+  struct mtl_file_storage_op *waiting_first;
+  struct mtl_file_storage_op *waiting_last;
+  uint32_t in_flight;
+} mtl_file_storage_ring;
+
+typedef struct mtl_file_storage {
+  mtl_storage_backend backend;
+
+  char *path;
+  uint64_t size;
+  uint64_t block_size;
+  uint32_t queue_depth;
+
+  int fd;
+  uint64_t alignment;
+  bool direct;
+
+  // Unaligned writes read the sectors at their edges, modify and write them
+  // back, which must not interleave with each other
+  pthread_mutex_t rmw_lock;
+
+  pthread_key_t key;
+  pthread_mutex_t lock;
+  mtl_file_storage_ring *first;
+} mtl_file_storage;
+
+typedef struct mtl_file_storage_io {
+  uint64_t offset;  // on the device
+  char *buffer;
+  uint64_t length;
+
+  // Unaligned I/Os go through an aligned buffer covering whole sectors
+  char *bounce;
+  uint64_t aligned_offset;
+  uint64_t aligned_length;
+
+  uint64_t done;
+  struct mtl_file_storage_op *op;
+} mtl_file_storage_io;
+
+// A request that has been submitted
+typedef struct mtl_file_storage_op {
+  struct mtl_file_storage_op *next;  // while waiting for the ring
+  bool write;
+  mtl_file_storage_io *ios;
+  uint64_t ios_length;
+  uint64_t queued;     // I/Os that have been handed to the ring
+  uint64_t remaining;  // I/Os that aren't done yet
+  int result;
+
+  // Writes that read-modify-write sectors are gathered into one buffer
+  char *gathered;
+} mtl_file_storage_op;
+
+static void mtl_file_storage_unlink_ring(mtl_file_storage *storage,
+                                         mtl_file_storage_ring *ring) {
+  if (ring->prev)
+    ring->prev->next = ring->next;
+  else
+    storage->first = ring->next;
+  if (ring->next) ring->next->prev = ring->prev;
+}
+
+// Called when a thread that has used the storage exits
+static void mtl_file_storage_release_ring(void *arg) {
+  mtl_file_storage_ring *ring = arg;
+
+  pthread_mutex_lock(&ring->storage->lock);
+  mtl_file_storage_unlink_ring(ring->storage, ring);
+  pthread_mutex_unlock(&ring->storage->lock);
+
+  if (ring->ring) mtl_uring_destroy(ring->ring);
+  free(ring);
+}
+
+// Returns the ring of the calling thread, or NULL if it couldn't be set up
+static mtl_file_storage_ring *mtl_file_storage_ring_of_thread(
+    mtl_file_storage *storage) {
+  mtl_file_storage_ring *ring = pthread_getspecific(storage->key);
+  if (ring) return ring;
+
+  ring = calloc(1, sizeof(mtl_file_storage_ring));
+  if (ring == NULL) return NULL;
+
+  ring->storage = storage;
+  if (mtl_uring_create(&ring->ring, storage->queue_depth) != MTL_SUCCESS) {
+    // Falls back to synchronous I/O for this thread
+    ring->ring = NULL;
+  }
+
+  pthread_mutex_lock(&storage->lock);
+  ring->next = storage->first;
+  if (storage->first) storage->first->prev = ring;
+  storage->first = ring;
+  pthread_mutex_unlock(&storage->lock);
+
+  pthread_setspecific(storage->key, ring);
+  return ring;
+}
+
+static int mtl_file_storage_initialize(void *storage_context) {
+  mtl_file_storage *storage = storage_context;
+
+  storage->direct = true;
+  storage->fd = open(storage->path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+  if (storage->fd < 0 && errno == EINVAL) {
+    // The file system doesn't support O_DIRECT (e.g. tmpfs)
+    storage->direct = false;
+    storage->fd = open(storage->path, O_RDWR | O_CREAT, 0644);
+  }
+  if (storage->fd < 0) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  struct stat st;
+  if (fstat(storage->fd, &st) != 0) {
+    close(storage->fd);
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  storage->alignment = MTL_FILE_STORAGE_ALIGNMENT;
+  if (S_ISBLK(st.st_mode)) {
+    uint64_t device_size;
+    int sector_size;
+    if (ioctl(storage->fd, BLKGETSIZE64, &device_size) != 0) {
+      close(storage->fd);
+      return MTL_ERROR_INVALID_ARGUMENT;
+    }
+    if (ioctl(storage->fd, BLKSSZGET, &sector_size) == 0 &&
+        (uint64_t)sector_size > storage->alignment)
+      storage->alignment = sector_size;
+
+    if (storage->size == 0 || storage->size > device_size)
+      storage->size = device_size;
+  } else if (storage->size == 0) {
+    storage->size = st.st_size;
+  } else if ((uint64_t)st.st_size < storage->size &&
+             ftruncate(storage->fd, storage->size) != 0) {
+    close(storage->fd);
+    return MTL_ERROR_NOSPACE;
+  }
+
+  return MTL_SUCCESS;
+}
+
+static int mtl_file_storage_deinitialize(void *storage_context) {
+  mtl_file_storage *storage = storage_context;
+
+  // Threads that exit from now on don't release their rings themselves
+  pthread_mutex_lock(&storage->lock);
+  mtl_file_storage_ring *ring = storage->first;
+  storage->first = NULL;
+  pthread_mutex_unlock(&storage->lock);
+
+  while (ring) {
+    mtl_file_storage_ring *next = ring->next;
+    pthread_setspecific(storage->key, NULL);
+    if (ring->ring) mtl_uring_destroy(ring->ring);
+    free(ring);
+    ring = next;
+  }
+
+  pthread_key_delete(storage->key);
+  pthread_key_create(&storage->key, mtl_file_storage_release_ring);
+
+  fsync(storage->fd);
+  close(storage->fd);
+  storage->fd = -1;
+  return MTL_SUCCESS;
+}
+
+static int mtl_file_storage_get_metadata(void *storage_context,
+                                         mtl_storage_metadata *metadata) {
+  mtl_file_storage *storage = storage_context;
+  if (metadata) {
+    metadata->num_blocks = storage->size / storage->block_size;
+    metadata->block_size = storage->block_size;
+  }
+
+  return MTL_SUCCESS;
+}
+
+// Reads or writes a whole aligned range synchronously
+static int mtl_file_storage_pio(mtl_file_storage *storage, bool write,
+                                char *buffer, uint64_t length,
+                                uint64_t offset) {
+  while (length > 0) {
+    ssize_t res = write ? pwrite(storage->fd, buffer, length, offset)
+                        : pread(storage->fd, buffer, length, offset);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) return MTL_ERROR_INVALID_ARGUMENT;
+
+    buffer += res;
+    offset += res;
+    length -= res;
+  }
+  return MTL_SUCCESS;
+}
+
+// Sets up the bounce buffer of an unaligned I/O. Writes read the sectors at
+// the edges first, which has to happen with rmw_lock held.
+static int mtl_file_storage_prepare(mtl_file_storage *storage,
+                                    mtl_file_storage_io *io, bool write) {
+  uint64_t alignment = storage->alignment;
+  bool aligned = io->offset % alignment == 0 && io->length % alignment == 0 &&
+                 (uintptr_t)io->buffer % alignment == 0;
+  if (aligned || !storage->direct) {
+    io->bounce = NULL;
+    io->aligned_offset = io->offset;
+    io->aligned_length = io->length;
+    return MTL_SUCCESS;
+  }
+
+  io->aligned_offset = io->offset - io->offset % alignment;
+  uint64_t end = io->offset + io->length;
+  uint64_t aligned_end = (end + alignment - 1) / alignment * alignment;
+  io->aligned_length = aligned_end - io->aligned_offset;
+  if (posix_memalign((void **)&io->bounce, alignment, io->aligned_length) !=
+      0) {
+    io->bounce = NULL;
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (!write) return MTL_SUCCESS;
+
+  int res = MTL_SUCCESS;
+  if (io->offset != io->aligned_offset)
+    res = mtl_file_storage_pio(storage, false, io->bounce, alignment,
+                               io->aligned_offset);
+  if (res == MTL_SUCCESS && end != aligned_end &&
+      (aligned_end - alignment > io->aligned_offset ||
+       io->offset == io->aligned_offset))
+    res = mtl_file_storage_pio(storage, false,
+                               io->bounce + io->aligned_length - alignment,
+                               alignment, aligned_end - alignment);
+  memcpy(io->bounce + (io->offset - io->aligned_offset), io->buffer,
+         io->length);
+  return res;
+}
+
+static char *mtl_file_storage_io_buffer(mtl_file_storage_io *io) {
+  return io->bounce ? io->bounce : io->buffer;
+}
+
+// Splits the file range of a request into I/Os, at the ends of extents and
+// buffers, and after at most MTL_FILE_STORAGE_MAX_IO bytes
+static int mtl_file_storage_split(mtl_context *context,
+                                  mtl_file_storage *storage,
+                                  mtl_file_storage_op *op, uint64_t inode_id,
+                                  uint64_t offset, const struct iovec *iov,
+                                  int iovcnt) {
+  uint64_t block_size = storage->block_size;
+  uint64_t ios_capacity = 0;
+  op->ios = NULL;
+  op->ios_length = 0;
+
+  int buffer_index = 0;
+  uint64_t buffer_pos = 0;
+  uint64_t length = 0;
+  for (int i = 0; i < iovcnt; ++i) length += iov[i].iov_len;
+
+  while (length > 0) {
+    // Only map the extents covering the remaining range
+    mtl_file_extent extents[MAPPED_EXTENTS];
+    uint64_t extents_length;
+    int res = mtl_map_range(context, inode_id, offset, length, extents,
+                            MAPPED_EXTENTS, &extents_length);
+    if (res != MTL_SUCCESS) return res;
+
+    // The caller has to make sure the file is large enough
+    if (extents_length == 0) return MTL_ERROR_INVALID_ARGUMENT;
+
+    uint64_t extent_pos = offset % block_size;
+    for (uint64_t i = 0; i < extents_length && length > 0; ++i) {
+      uint64_t extent_length = extents[i].length * block_size - extent_pos;
+      if (extent_length > length) extent_length = length;
+
+      uint64_t device_offset = extents[i].offset * block_size + extent_pos;
+      for (uint64_t pos = 0; pos < extent_length;) {
+        // I/Os of the same buffer must not share a sector, or their
+        // read-modify-writes would overwrite each other
+        uint64_t end = device_offset + pos + MTL_FILE_STORAGE_MAX_IO;
+        end -= end % storage->alignment;
+        if (end - device_offset > extent_length)
+          end = device_offset + extent_length;
+        if (end - (device_offset + pos) > iov[buffer_index].iov_len - buffer_pos)
+          end = device_offset + pos + iov[buffer_index].iov_len - buffer_pos;
+
+        if (op->ios_length == ios_capacity) {
+          ios_capacity = ios_capacity ? 2 * ios_capacity : 16;
+          mtl_file_storage_io *ios =
+              realloc(op->ios, ios_capacity * sizeof(mtl_file_storage_io));
+          if (ios == NULL) return MTL_ERROR_NOSPACE;
+          op->ios = ios;
+        }
+
+        mtl_file_storage_io *io = &op->ios[op->ios_length++];
+        memset(io, 0, sizeof(*io));
+        io->op = op;
+        io->offset = device_offset + pos;
+        io->buffer = (char *)iov[buffer_index].iov_base + buffer_pos;
+        io->length = end - io->offset;
+        pos += io->length;
+
+        buffer_pos += io->length;
+        if (buffer_pos == iov[buffer_index].iov_len) {
+          ++buffer_index;
+          buffer_pos = 0;
+        }
+      }
+
+      offset += extent_length;
+      length -= extent_length;
+      extent_pos = 0;
+    }
+  }
+
+  op->remaining = op->ios_length;
+  return MTL_SUCCESS;
+}
+
+// Whether any of the I/Os only covers a part of a sector
+static bool mtl_file_storage_needs_rmw(mtl_file_storage *storage,
+                                       mtl_file_storage_op *op) {
+  if (!op->write || !storage->direct) return false;
+
+  for (uint64_t i = 0; i < op->ios_length; ++i) {
+    if (op->ios[i].offset % storage->alignment ||
+        op->ios[i].length % storage->alignment)
+      return true;
+  }
+  return false;
+}
+
+static void mtl_file_storage_done(mtl_file_storage_io *io, int res) {
+  if (res != MTL_SUCCESS && io->op->result == MTL_SUCCESS)
+    io->op->result = res;
+  --io->op->remaining;
+}
+
+static bool mtl_file_storage_queue(mtl_file_storage *storage,
+                                   mtl_file_storage_ring *ring,
+                                   mtl_file_storage_io *io) {
+  if (!mtl_uring_queue(ring->ring, storage->fd, io->op->write,
+                       mtl_file_storage_io_buffer(io) + io->done,
+                       io->aligned_length - io->done,
+                       io->aligned_offset + io->done, (uintptr_t)io))
+    return false;
+
+  ++ring->in_flight;
+  return true;
+}
+
+// Fills the ring with the I/Os of waiting requests, submits them and handles
+// the completions that are there. With wait, it waits for at least one.
+static int mtl_file_storage_pump(mtl_file_storage *storage,
+                                 mtl_file_storage_ring *ring, bool wait) {
+  while (ring->waiting_first && ring->in_flight < storage->queue_depth) {
+    mtl_file_storage_op *op = ring->waiting_first;
+    if (op->queued < op->ios_length) {
+      if (!mtl_file_storage_queue(storage, ring, &op->ios[op->queued])) break;
+      ++op->queued;
+    }
+
+    if (op->queued == op->ios_length) {
+      ring->waiting_first = op->next;
+      if (ring->waiting_first == NULL) ring->waiting_last = NULL;
+    }
+  }
+
+  if (mtl_uring_submit(ring->ring, wait && ring->in_flight ? 1 : 0) !=
+      MTL_SUCCESS) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  uint64_t user_data;
+  int32_t result;
+  while (mtl_uring_complete(ring->ring, &user_data, &result)) {
+    --ring->in_flight;
+
+    mtl_file_storage_io *io = (mtl_file_storage_io *)(uintptr_t)user_data;
+    if (result == -EINTR || result == -EAGAIN) result = 0;
+    if (result < 0) {
+      mtl_file_storage_done(io, MTL_ERROR_INVALID_ARGUMENT);
+      continue;
+    }
+
+    io->done += result;
+    if (io->done == io->aligned_length) {
+      mtl_file_storage_done(io, MTL_SUCCESS);
+    } else if (result == 0 && !io->op->write) {
+      // Behind the end of the file
+      memset(mtl_file_storage_io_buffer(io) + io->done, 0,
+             io->aligned_length - io->done);
+      mtl_file_storage_done(io, MTL_SUCCESS);
+    } else {
+      // Continue where a short read or write stopped. A slot has just become
+      // free.
+      mtl_file_storage_queue(storage, ring, io);
+    }
+  }
+
+  return MTL_SUCCESS;
+}
+
+static void mtl_file_storage_enqueue(mtl_file_storage_ring *ring,
+                                     mtl_file_storage_op *op) {
+  op->next = NULL;
+  if (ring->waiting_last)
+    ring->waiting_last->next = op;
+  else
+    ring->waiting_first = op;
+  ring->waiting_last = op;
+}
+
+// Waits until all I/Os of the request are done
+static int mtl_file_storage_drive(mtl_file_storage *storage,
+                                  mtl_file_storage_ring *ring,
+                                  mtl_file_storage_op *op) {
+  if (ring == NULL || ring->ring == NULL) {
+    for (; op->remaining; ++op->queued) {
+      mtl_file_storage_io *io = &op->ios[op->queued];
+      mtl_file_storage_done(
+          io, mtl_file_storage_pio(storage, op->write,
+                                   mtl_file_storage_io_buffer(io),
+                                   io->aligned_length, io->aligned_offset));
+    }
+    return op->result;
+  }
+
+  while (op->remaining) {
+    int res = mtl_file_storage_pump(storage, ring, true);
+    if (res != MTL_SUCCESS) return res;
+  }
+  return op->result;
+}
+
+static void mtl_file_storage_release(mtl_file_storage_op *op) {
+  for (uint64_t i = 0; i < op->ios_length; ++i) {
+    mtl_file_storage_io *io = &op->ios[i];
+    if (io->bounce && !op->write && op->result == MTL_SUCCESS)
+      memcpy(io->buffer, io->bounce + (io->offset - io->aligned_offset),
+             io->length);
+    free(io->bounce);
+  }
+  free(op->ios);
+  free(op->gathered);
+  free(op);
+}
+
+static int mtl_file_storage_submit(mtl_context *context,
+                                   void *storage_context,
+                                   mtl_storage_request *request) {
+  mtl_file_storage *storage = storage_context;
+
+  mtl_file_storage_op *op = calloc(1, sizeof(mtl_file_storage_op));
+  if (op == NULL) {
+    return MTL_ERROR_NOSPACE;
+  }
+
+  op->write = request->write;
+  int res = mtl_file_storage_split(context, storage, op, request->inode_id,
+                                   request->offset, request->iov,
+                                   request->iovcnt);
+
+  bool rmw = res == MTL_SUCCESS && mtl_file_storage_needs_rmw(storage, op);
+  if (rmw && request->iovcnt > 1) {
+    // Buffer boundaries could split sectors between I/Os
+    uint64_t length = 0;
+    for (int i = 0; i < request->iovcnt; ++i)
+      length += request->iov[i].iov_len;
+    op->gathered = malloc(length);
+    if (op->gathered == NULL) {
+      res = MTL_ERROR_NOSPACE;
+    } else {
+      char *position = op->gathered;
+      for (int i = 0; i < request->iovcnt; ++i) {
+        memcpy(position, request->iov[i].iov_base, request->iov[i].iov_len);
+        position += request->iov[i].iov_len;
+      }
+
+      struct iovec gathered = {.iov_base = op->gathered, .iov_len = length};
+      free(op->ios);
+      res = mtl_file_storage_split(context, storage, op, request->inode_id,
+                                   request->offset, &gathered, 1);
+    }
+  }
+
+  // Read-modify-writes are done before returning, so that the lock isn't
+  // held until they are completed
+  if (rmw) pthread_mutex_lock(&storage->rmw_lock);
+
+  for (uint64_t i = 0; i < op->ios_length && res == MTL_SUCCESS; ++i)
+    res = mtl_file_storage_prepare(storage, &op->ios[i], op->write);
+  if (res != MTL_SUCCESS) {
+    if (rmw) pthread_mutex_unlock(&storage->rmw_lock);
+    mtl_file_storage_release(op);
+    return res;
+  }
+
+  mtl_file_storage_ring *ring = mtl_file_storage_ring_of_thread(storage);
+  bool async = ring && ring->ring;
+  if (async && op->ios_length) {
+    mtl_file_storage_enqueue(ring, op);
+    res = mtl_file_storage_pump(storage, ring, false);
+  }
+
+  if (rmw || !async || res != MTL_SUCCESS) {
+    if (res == MTL_SUCCESS) res = mtl_file_storage_drive(storage, ring, op);
+    if (rmw) pthread_mutex_unlock(&storage->rmw_lock);
+    if (res != MTL_SUCCESS && op->result == MTL_SUCCESS) op->result = res;
+  }
+
+  request->backend_data = op;
+  return MTL_SUCCESS;
+}
+
+static int mtl_file_storage_complete(mtl_context *context,
+                                     void *storage_context,
+                                     mtl_storage_request *request) {
+  mtl_file_storage *storage = storage_context;
+  mtl_file_storage_op *op = request->backend_data;
+
+  int res = mtl_file_storage_drive(
+      storage, mtl_file_storage_ring_of_thread(storage), op);
+  request->result = res;
+
+  mtl_file_storage_release(op);
+  request->backend_data = NULL;
+  return res;
+}
+
+static int mtl_file_storage_copy(mtl_context *context,
+                                 mtl_file_storage *storage, uint64_t inode_id,
+                                 uint64_t offset, void *buffer,
+                                 uint64_t length, bool write) {
+  struct iovec iov = {.iov_base = buffer, .iov_len = length};
+  mtl_storage_request request = {.write = write,
+                                 .inode_id = inode_id,
+                                 .offset = offset,
+                                 .iov = &iov,
+                                 .iovcnt = 1};
+  int res = mtl_file_storage_submit(context, storage, &request);
+  if (res != MTL_SUCCESS) return res;
+
+  return mtl_file_storage_complete(context, storage, &request);
+}
+
+static int mtl_file_storage_write(mtl_context *context, void *storage_context,
+                                  uint64_t inode_id, uint64_t offset,
+                                  const void *buffer, uint64_t length) {
+  return mtl_file_storage_copy(context, storage_context, inode_id, offset,
+                               (void *)buffer, length, true);
+}
+
+static int mtl_file_storage_read(mtl_context *context, void *storage_context,
+                                 uint64_t inode_id, uint64_t offset,
+                                 void *buffer, uint64_t length) {
+  return mtl_file_storage_copy(context, storage_context, inode_id, offset,
+                               buffer, length, false);
+}
+
+int mtl_file_storage_create(mtl_storage_backend **backend, const char *path,
+                            uint64_t size, uint64_t block_size,
+                            uint32_t queue_depth) {
+  if (block_size == 0 || block_size % MTL_FILE_STORAGE_ALIGNMENT) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  mtl_file_storage *storage = calloc(1, sizeof(mtl_file_storage));
+  if (storage == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  storage->path = strdup(path);
+  storage->size = size;
+  storage->block_size = block_size;
+  storage->queue_depth =
+      queue_depth ? queue_depth : MTL_FILE_STORAGE_DEFAULT_QUEUE_DEPTH;
+  storage->fd = -1;
+
+  if (storage->path == NULL ||
+      pthread_key_create(&storage->key, mtl_file_storage_release_ring) != 0) {
+    free(storage->path);
+    free(storage);
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_init(&storage->lock, NULL);
+  pthread_mutex_init(&storage->rmw_lock, NULL);
+
+  storage->backend = (mtl_storage_backend){
+      &mtl_file_storage_initialize,   &mtl_file_storage_deinitialize,
+      &mtl_file_storage_get_metadata, &mtl_file_storage_write,
+      &mtl_file_storage_read,         storage,
+      &mtl_file_storage_submit,       &mtl_file_storage_complete};
+
+  *backend = &storage->backend;
+  return MTL_SUCCESS;
+}
+
+void mtl_file_storage_destroy(mtl_storage_backend *backend) {
+  mtl_file_storage *storage = backend->context;
+  if (storage->fd >= 0) mtl_file_storage_deinitialize(storage);
+
+  pthread_key_delete(storage->key);
+  pthread_mutex_destroy(&storage->rmw_lock);
+  pthread_mutex_destroy(&storage->lock);
+  free(storage->path);
+  free(storage);
+}
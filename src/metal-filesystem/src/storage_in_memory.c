@@ -12,10 +12,10 @@
 #define NUM_BLOCKS 128 * 256
 #define BLOCK_SIZE 4096
 
-void *_storage = NULL;
+// Number of extents that are mapped at once
+#define MAPPED_EXTENTS 16
 
-mtl_file_extent *_extents = NULL;
-uint64_t _extents_length;
+void *_storage = NULL;
 
 int mtl_storage_initialize(void *storage_context) {
   _storage = malloc(NUM_BLOCKS * BLOCK_SIZE);
@@ -40,6 +40,39 @@ int mtl_storage_get_metadata(void *storage_context,
   return MTL_SUCCESS;
 }
 
+static void mtl_storage_copy(mtl_context *context, uint64_t inode_id,
+                             uint64_t offset, char *buffer, uint64_t length,
+                             bool write) {
+  while (length > 0) {
+    // Only map the extents covering the remaining range
+    mtl_file_extent extents[MAPPED_EXTENTS];
+    uint64_t extents_length;
+    mtl_map_range(context, inode_id, offset, length, extents, MAPPED_EXTENTS,
+                  &extents_length);
+
+    // The caller has to make sure the file is large enough
+    assert(extents_length > 0);
+
+    // Position within the first mapped block
+    uint64_t extent_pos = offset % BLOCK_SIZE;
+    for (uint64_t i = 0; i < extents_length && length > 0; ++i) {
+      uint64_t copy_length = extents[i].length * BLOCK_SIZE - extent_pos;
+      if (copy_length > length) copy_length = length;
+
+      char *storage = _storage + extents[i].offset * BLOCK_SIZE + extent_pos;
+      if (write)
+        memcpy(storage, buffer, copy_length);
+      else
+        memcpy(buffer, storage, copy_length);
+
+      offset += copy_length;
+      buffer += copy_length;
+      length -= copy_length;
+      extent_pos = 0;
+    }
+  }
+}
+
 int mtl_storage_write(mtl_context *context, void *storage_context,
                       uint64_t inode_id, uint64_t offset, const void *buffer,
                       uint64_t length) {
@@ -47,43 +80,7 @@ int mtl_storage_write(mtl_context *context, void *storage_context,
     _storage = malloc(NUM_BLOCKS * BLOCK_SIZE);
   }
 
-  assert(offset + length < NUM_BLOCKS * BLOCK_SIZE);
-
-  // Obtain extent list
-  free(_extents);
-  _extents = malloc(MTL_MAX_EXTENTS * sizeof(mtl_file_extent));
-  mtl_load_extent_list(context, inode_id, _extents, &_extents_length, NULL);
-
-  uint64_t current_offset = offset;
-
-  uint64_t current_extent = 0;
-  uint64_t current_extent_offset = 0;
-  while (length > 0) {
-    // Determine the extent for the next byte to be written
-    while (current_extent_offset +
-               (_extents[current_extent].length * BLOCK_SIZE) <=
-           current_offset) {
-      current_extent_offset += _extents[current_extent].length * BLOCK_SIZE;
-      ++current_extent;
-
-      // The caller has to make sure the file is large enough to write
-      assert(current_extent < _extents_length);
-    }
-
-    uint64_t current_extent_write_pos = current_offset - current_extent_offset;
-    uint64_t current_extent_write_length =
-        (_extents[current_extent].length * BLOCK_SIZE) -
-        current_extent_write_pos;
-    if (current_extent_write_length > length)
-      current_extent_write_length = length;
-
-    memcpy(_storage + (_extents[current_extent].offset * BLOCK_SIZE) +
-               current_extent_write_pos,
-           buffer + (current_offset - offset), current_extent_write_length);
-
-    current_offset += current_extent_write_length;
-    length -= current_extent_write_length;
-  }
+  mtl_storage_copy(context, inode_id, offset, (char *)buffer, length, true);
 
   return MTL_SUCCESS;
 }
@@ -95,44 +92,7 @@ int mtl_storage_read(mtl_context *context, void *storage_context,
     _storage = malloc(NUM_BLOCKS * BLOCK_SIZE);
   }
 
-  assert(offset + length < NUM_BLOCKS * BLOCK_SIZE);
-
-  // Obtain extent list
-  free(_extents);
-  _extents = malloc(MTL_MAX_EXTENTS * sizeof(mtl_file_extent));
-  mtl_load_extent_list(context, inode_id, _extents, &_extents_length, NULL);
-
-  uint64_t current_offset = offset;
-
-  uint64_t current_extent = 0;
-  uint64_t current_extent_offset = 0;
-  while (length > 0) {
-    // Determine the extent for the next byte to be read
-    while (current_extent_offset +
-               (_extents[current_extent].length * BLOCK_SIZE) <=
-           current_offset) {
-      current_extent_offset += _extents[current_extent].length * BLOCK_SIZE;
-      ++current_extent;
-
-      // The caller has to make sure the file is large enough to read
-      assert(current_extent < _extents_length);
-    }
-
-    uint64_t current_extent_read_pos = current_offset - current_extent_offset;
-    uint64_t current_extent_read_length =
-        (_extents[current_extent].length * BLOCK_SIZE) -
-        current_extent_read_pos;
-    if (current_extent_read_length > length)
-      current_extent_read_length = length;
-
-    memcpy(buffer + (current_offset - offset),
-           _storage + (_extents[current_extent].offset * BLOCK_SIZE) +
-               current_extent_read_pos,
-           current_extent_read_length);
-
-    current_offset += current_extent_read_length;
-    length -= current_extent_read_length;
-  }
+  mtl_storage_copy(context, inode_id, offset, buffer, length, false);
 
   return MTL_SUCCESS;
 }
@@ -140,4 +100,5 @@ int mtl_storage_read(mtl_context *context, void *storage_context,
 mtl_storage_backend in_memory_storage = {
     &mtl_storage_initialize,   &mtl_storage_deinitialize,
     &mtl_storage_get_metadata, &mtl_storage_write,
-    &mtl_storage_read,         NULL};
+    &mtl_storage_read,         NULL,
+    NULL,                      NULL};
@@ -0,0 +1,183 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <metal-filesystem/metal.h>
+
+typedef struct mtl_uring {
+  int fd;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;  // 0 if the completion ring shares the mapping
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t *sq_array;
+  uint32_t queued;  // since the last submission
+
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+} mtl_uring;
+
+static int mtl_io_uring_setup(uint32_t entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int mtl_io_uring_enter(int fd, uint32_t to_submit,
+                              uint32_t min_complete, uint32_t flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+int mtl_uring_create(mtl_uring **ring, uint32_t entries) {
+  mtl_uring *r = calloc(1, sizeof(mtl_uring));
+  if (r == NULL) {
+    return MTL_ERROR_INVALID_ARGUMENT;
+  }
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  r->fd = mtl_io_uring_setup(entries, &params);
+  if (r->fd < 0) {
+    free(r);
+    return MTL_ERROR_NOTSUPPORTED;
+  }
+
+  r->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  size_t cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_ring_size > r->sq_ring_size)
+    r->sq_ring_size = cq_ring_size;
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    close(r->fd);
+    free(r);
+    return MTL_ERROR_NOTSUPPORTED;
+  }
+
+  if (single_mmap) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring_size = cq_ring_size;
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      munmap(r->sq_ring, r->sq_ring_size);
+      close(r->fd);
+      free(r);
+      return MTL_ERROR_NOTSUPPORTED;
+    }
+  }
+
+  r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    if (r->cq_ring_size) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+    return MTL_ERROR_NOTSUPPORTED;
+  }
+
+  char *sq = r->sq_ring;
+  r->sq_head = (uint32_t *)(sq + params.sq_off.head);
+  r->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+  r->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+  r->sq_entries = params.sq_entries;
+  r->sq_array = (uint32_t *)(sq + params.sq_off.array);
+
+  char *cq = r->cq_ring;
+  r->cq_head = (uint32_t *)(cq + params.cq_off.head);
+  r->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+  r->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  *ring = r;
+  return MTL_SUCCESS;
+}
+
+void mtl_uring_destroy(mtl_uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring_size) munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+bool mtl_uring_queue(mtl_uring *ring, int fd, bool write, void *buffer,
+                     uint32_t length, uint64_t offset, uint64_t user_data) {
+  uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = *ring->sq_tail;
+  if (tail - head >= ring->sq_entries) {
+    return false;
+  }
+
+  uint32_t index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+
+  // The kernel must see the entry before the new tail
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->queued;
+  return true;
+}
+
+int mtl_uring_submit(mtl_uring *ring, uint32_t min_complete) {
+  for (;;) {
+    int res = mtl_io_uring_enter(ring->fd, ring->queued, min_complete,
+                                 min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (res >= 0) {
+      ring->queued -= (uint32_t)res < ring->queued ? (uint32_t)res
+                                                   : ring->queued;
+      if (ring->queued == 0 || min_complete) return MTL_SUCCESS;
+      continue;
+    }
+
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return MTL_ERROR_INVALID_ARGUMENT;
+    }
+  }
+}
+
+bool mtl_uring_complete(mtl_uring *ring, uint64_t *user_data,
+                        int32_t *result) {
+  uint32_t head = *ring->cq_head;
+  uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return false;
+  }
+
+  struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+  *user_data = cqe->user_data;
+  *result = cqe->res;
+
+  // Hand the entry back to the kernel
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A minimal io_uring wrapper on top of the raw system calls, for reads and
+// writes of file descriptors. A ring must only be used by one thread at a
+// time.
+typedef struct mtl_uring mtl_uring;
+
+// Fails if the kernel doesn't support io_uring (or it is not permitted)
+int mtl_uring_create(mtl_uring **ring, uint32_t entries);
+void mtl_uring_destroy(mtl_uring *ring);
+
+// Queues a read or write of length bytes at offset. Returns false if the
+// submission queue is full.
+bool mtl_uring_queue(mtl_uring *ring, int fd, bool write, void *buffer,
+                     uint32_t length, uint64_t offset, uint64_t user_data);
+// Submits everything queued so far and waits until at least min_complete
+// completions are available
+int mtl_uring_submit(mtl_uring *ring, uint32_t min_complete);
+// Takes the next completion. result is what the read or write returned (or
+// the negated errno). Returns false if there is none.
+bool mtl_uring_complete(mtl_uring *ring, uint64_t *user_data,
+                        int32_t *result);
@@ -22,6 +22,15 @@ class METAL_PIPELINE_API DataSourceContext {
     (void)action;
     (void)initial;
   };
+  // Called right before the run. Other pipelines may have run on the action
+  // since configure, like the storage I/O of the data sink, and replaced
+  // what configure set up on the card.
+  virtual void restore(SnapAction &action) { (void)action; };
+  // Called while the card runs the current chunk, unless it is the last one.
+  // A context that knows its next chunk already can set it up here, instead
+  // of in the next configure. It must leave what the current chunk uses
+  // alone, and jobs it sends only reach the card after the current run.
+  virtual void prepareNext(SnapAction &action) { (void)action; };
   virtual void finalize(SnapAction &action) { (void)action; };
 
   virtual const DataSource dataSource() const = 0;
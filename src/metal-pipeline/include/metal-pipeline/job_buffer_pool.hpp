@@ -0,0 +1,75 @@
+#pragma once
+
+#include <metal-pipeline/metal-pipeline_api.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace metal {
+
+class JobBufferPool;
+
+// A zeroed, page-aligned buffer for job parameters. It goes back to its pool
+// when it goes out of scope.
+class METAL_PIPELINE_API JobBuffer {
+ public:
+  JobBuffer(std::shared_ptr<JobBufferPool> pool, void *data, size_t size)
+      : _pool(std::move(pool)), _data(data), _size(size) {}
+  JobBuffer(const JobBuffer &other) = delete;
+  JobBuffer(JobBuffer &&other) noexcept
+      : _pool(std::move(other._pool)), _data(other._data), _size(other._size) {
+    other._data = nullptr;
+  }
+  ~JobBuffer();
+
+  void *data() const { return _data; }
+  template <typename T>
+  T *as() const {
+    return reinterpret_cast<T *>(_data);
+  }
+  size_t size() const { return _size; }
+
+ protected:
+  std::shared_ptr<JobBufferPool> _pool;
+  void *_data;
+  size_t _size;  // usable bytes, which may be more than requested
+};
+
+// Recycles job buffers in power-of-two size classes, starting at a page, so
+// that jobs don't allocate once the pool has warmed up
+class METAL_PIPELINE_API JobBufferPool
+    : public std::enable_shared_from_this<JobBufferPool> {
+ public:
+  struct Stats {
+    uint64_t allocations;  // buffers that had to be allocated
+    uint64_t reuses;       // buffers that were taken from the pool
+    uint64_t outstanding;  // buffers that are in use
+    uint64_t cachedBytes;  // kept for reuse
+  };
+
+  static constexpr size_t MinimumSize = 4096;
+  static constexpr int SizeClasses = 16;  // up to 128 MiB
+  static constexpr size_t MaxCachedPerClass = 8;
+
+  JobBufferPool();
+  JobBufferPool(const JobBufferPool &other) = delete;
+  ~JobBufferPool();
+
+  JobBuffer acquire(size_t size);
+  Stats stats();
+
+ protected:
+  friend class JobBuffer;
+  void release(void *data, size_t size);
+
+  static int sizeClass(size_t size);
+
+  std::mutex _mutex;
+  std::array<std::vector<void *>, SizeClasses> _free;
+  Stats _stats;
+};
+
+}  // namespace metal
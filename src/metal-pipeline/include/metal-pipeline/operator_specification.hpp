@@ -18,7 +18,7 @@ class METAL_PIPELINE_API OperatorSpecification {
   uint8_t streamID() const { return _streamID; }
   bool prepareRequired() const { return _prepareRequired; }
   const std::unordered_map<std::string, OperatorOptionDefinition>
-  optionDefinitions() const {
+      &optionDefinitions() const {
     return _optionDefinitions;
   }
 
@@ -2,12 +2,14 @@
 
 #include <metal-pipeline/metal-pipeline_api.h>
 
+#include <future>
 #include <memory>
 #include <vector>
 
 #include <metal-pipeline/data_sink.hpp>
 #include <metal-pipeline/data_source.hpp>
 #include <metal-pipeline/operator_context.hpp>
+#include <metal-pipeline/snap_action.hpp>
 
 namespace metal {
 
@@ -41,12 +43,18 @@ class METAL_PIPELINE_API Pipeline {
   std::vector<OperatorContext> &operators() { return _operators; }
 
   uint64_t run(DataSource dataSource, DataSink dataSink, SnapAction &action);
+  // run in two steps: submit sets up the card and starts the run, finish
+  // waits for it and returns the output size. In between, the host is free
+  // for other work, but the card reads the source and writes the sink.
+  std::future<SnapAction::JobResult> submit(DataSource dataSource,
+                                            DataSink dataSink,
+                                            SnapAction &action);
+  uint64_t finish(std::future<SnapAction::JobResult> run, SnapAction &action);
 
-  void configureSwitch(SnapAction &action, bool set_cached);
+  void configureSwitch(SnapAction &action);
 
  protected:
   std::vector<OperatorContext> _operators;
-  bool _cachedSwitchConfiguration;
 };
 
 }  // namespace metal
@@ -36,6 +36,8 @@ class METAL_PIPELINE_API ProfilingPipelineRunner : public SnapPipelineRunner {
               DataSinkContext &dataSink, bool initialize) override;
   void postRun(SnapAction &action, DataSourceContext &dataSource,
                DataSinkContext &dataSink, bool finalize) override;
+  // The counters that postRun reads must only cover the run
+  bool overlapsNextChunk() const override { return !_profileStreamIds; }
   template <typename... Args>
   static std::string string_format(const std::string &format, Args... args);
 
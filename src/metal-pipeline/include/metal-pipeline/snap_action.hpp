@@ -2,10 +2,21 @@
 
 #include <metal-pipeline/metal-pipeline_api.h>
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <metal-pipeline/card.hpp>
 #include <metal-pipeline/fpga_interface.hpp>
+#include <metal-pipeline/job_buffer_pool.hpp>
 
 struct snap_action;
 struct snap_card;
@@ -14,6 +25,32 @@ namespace metal {
 
 class METAL_PIPELINE_API SnapAction {
  public:
+  // The direct data a job returns
+  struct JobResult {
+    uint64_t directDataOut0;
+    uint64_t directDataOut1;
+  };
+
+  // A run of storage blocks in an extent map
+  struct Extent {
+    uint64_t offset;
+    uint64_t length;
+
+    bool operator==(const Extent &other) const {
+      return offset == other.offset && length == other.length;
+    }
+  };
+
+  struct ExtentMapStats {
+    uint64_t mapJobs;
+    uint64_t skippedMapJobs;  // the slot held the same extents already
+  };
+
+  struct ConfigurationStats {
+    uint64_t configureJobs;
+    uint64_t unchangedWords;  // not sent, as the register held them already
+  };
+
   explicit SnapAction(Card card = {0, 10});
   SnapAction(const SnapAction &other) = delete;
   SnapAction(SnapAction &&other) noexcept;
@@ -24,7 +61,60 @@ class METAL_PIPELINE_API SnapAction {
                   uint64_t directData0 = 0, uint64_t directData1 = 0,
                   uint64_t *directDataOut0 = nullptr,
                   uint64_t *directDataOut1 = nullptr);
+  // Queues a job and returns right away. Jobs run on the card one after
+  // another, in the order in which they were submitted, and executeJob only
+  // starts once the queue is empty. parameters and the buffers behind source
+  // and destination have to stay valid until the job is complete. If the job
+  // fails, the future rethrows the error.
+  std::future<JobResult> submitJob(fpga::JobType jobType,
+                                   const void *parameters = nullptr,
+                                   fpga::Address source = {},
+                                   fpga::Address destination = {},
+                                   uint64_t directData0 = 0,
+                                   uint64_t directData1 = 0);
+  // Waits until all submitted jobs are complete
+  void drainJobs();
   bool isNVMeEnabled();
+  // Whether the action is still attached and responding
+  bool isHealthy();
+
+  // Maps the extents into a slot of the card's extent map, unless the slot
+  // holds exactly these already. Returns the version of the slot, which is
+  // never reused and only changes when something else is mapped into it.
+  uint64_t mapExtents(fpga::ExtmapSlot slot,
+                      const std::vector<Extent> &extents);
+  // 0 if it isn't known what the slot holds
+  uint64_t extentMapVersion(fpga::ExtmapSlot slot) const {
+    return _extentMaps[static_cast<size_t>(slot)].version;
+  }
+  ExtentMapStats extentMapStats() const { return _extentMapStats; }
+
+  // Writes configuration registers of an operator, given as 32 bit words by
+  // their word offset. Words the registers hold already are left out, and
+  // the rest is sent in as few ConfigureOperator jobs as possible. Returns
+  // whether anything had to be written. The card arms the preparation mode
+  // with every job and disarms it after every run, so with rearm at least
+  // one job is sent.
+  bool configureOperator(uint32_t streamID, bool prepare,
+                         const std::map<uint32_t, uint32_t> &registers,
+                         bool rearm = false);
+  ConfigurationStats configurationStats() const { return _configurationStats; }
+
+  static constexpr size_t SwitchPorts = 8;
+  // Routes the stream switch, given the input port for each output port.
+  // Nothing is sent if the switch is routed like this already. Returns
+  // whether a ConfigureStreams job was sent.
+  bool configureStreams(const std::array<uint32_t, SwitchPorts> &inputs);
+
+  // In seconds, for each job
+  void setTimeout(int timeout) { _timeout = timeout; }
+
+  // Takes a buffer for job parameters from the pool of this action. Prefer
+  // this over allocateMemory for buffers that are needed for every run.
+  JobBuffer allocateJobBuffer(size_t size) {
+    return _jobBuffers->acquire(size);
+  }
+  JobBufferPool::Stats jobBufferStats() { return _jobBuffers->stats(); }
 
   static void *allocateMemory(size_t size);
 
@@ -32,13 +122,56 @@ class METAL_PIPELINE_API SnapAction {
   static std::string mapTypeToString(fpga::MapType mapType);
 
  protected:
+  struct PendingJob {
+    fpga::JobType jobType;
+    const void *parameters;
+    fpga::Address source;
+    fpga::Address destination;
+    uint64_t directData0;
+    uint64_t directData1;
+    std::promise<JobResult> result;
+  };
+
+  void runJob(fpga::JobType jobType, const void *parameters,
+              fpga::Address source, fpga::Address destination,
+              uint64_t directData0, uint64_t directData1,
+              uint64_t *directDataOut0, uint64_t *directDataOut1);
+  void processJobs();
+  void stopJobs();
+
+  // What has been mapped into a slot of the extent map
+  struct ResidentExtentMap {
+    uint64_t version;
+    std::vector<Extent> extents;
+  };
+  static constexpr size_t ExtentMapSlots = 4;
+
   static std::string jobTypeToString(fpga::JobType job);
   static std::string snapReturnCodeToString(int rc);
 
   struct snap_action *_action;
   struct snap_card *_card;
 
-  int _timeout;
+  std::atomic<int> _timeout;
+  std::atomic<bool> _failed;  // a job could not be executed
+  std::shared_ptr<JobBufferPool> _jobBuffers;
+  std::array<ResidentExtentMap, ExtentMapSlots> _extentMaps;
+  ExtentMapStats _extentMapStats;
+  // The last values written to the configuration registers, by stream id
+  std::unordered_map<uint32_t, std::map<uint32_t, uint32_t>>
+      _operatorRegisters;
+  ConfigurationStats _configurationStats;
+  // What the stream switch was last routed to, if known
+  std::array<uint32_t, SwitchPorts> _switchInputs;
+  bool _switchKnown;
+
+  // Submitted jobs, which stay at the front until they are complete. The
+  // worker that runs them is started with the first one.
+  std::mutex _jobsMutex;
+  std::condition_variable _jobsChanged;
+  std::deque<PendingJob> _jobs;
+  std::thread _worker;
+  bool _stopping;
 };
 
 }  // namespace metal
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <metal-pipeline/metal-pipeline_api.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <metal-pipeline/card.hpp>
+#include <metal-pipeline/snap_action.hpp>
+
+namespace metal {
+
+// Keeps actions attached between pipeline runs, so that the card is not
+// allocated and the action not attached again for every run. A card has a
+// single action, so at most capacity actions are lent out at a time and
+// further borrowers wait until one is returned. A thread that borrows again
+// while it holds an action, like for storage I/O in the middle of a run, gets
+// the same action.
+class METAL_PIPELINE_API SnapActionPool
+    : public std::enable_shared_from_this<SnapActionPool> {
+ public:
+  // Returns the action to its pool when it goes out of scope
+  class METAL_PIPELINE_API Lease {
+   public:
+    Lease(std::shared_ptr<SnapActionPool> pool, SnapAction *action,
+          std::thread::id borrower)
+        : _pool(std::move(pool)), _action(action), _borrower(borrower) {}
+    Lease(const Lease &other) = delete;
+    Lease(Lease &&other) noexcept = default;
+    ~Lease();
+
+    SnapAction &operator*() const { return *_action; }
+    SnapAction *operator->() const { return _action; }
+
+   protected:
+    std::shared_ptr<SnapActionPool> _pool;
+    SnapAction *_action;  // owned by the pool
+    std::thread::id _borrower;
+  };
+
+  explicit SnapActionPool(Card card, size_t capacity = 1)
+      : _card(card), _capacity(capacity) {}
+  SnapActionPool(const SnapActionPool &other) = delete;
+
+  // The pool shared by everyone who runs pipelines on card. Only the card
+  // number identifies it, the timeout is passed to borrow.
+  static std::shared_ptr<SnapActionPool> forCard(Card card);
+
+  // Hands out an attached action that passed a health check, attaching a
+  // new one if there is none. Waits up to timeout seconds for an action to
+  // be returned, which its jobs then use as well. Throws if no action can be
+  // attached in time.
+  Lease borrow(int timeout);
+
+ protected:
+  struct Borrowed {
+    std::unique_ptr<SnapAction> action;
+    size_t leases;  // the action goes back once all of them are gone
+  };
+
+  void giveBack(std::thread::id borrower);
+
+  Card _card;
+  size_t _capacity;
+
+  std::mutex _mutex;
+  std::condition_variable _returned;
+  std::vector<std::unique_ptr<SnapAction>> _idle;
+  std::map<std::thread::id, Borrowed> _lent;
+};
+
+}  // namespace metal
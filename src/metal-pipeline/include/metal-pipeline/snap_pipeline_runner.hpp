@@ -8,6 +8,7 @@
 
 #include <metal-pipeline/card.hpp>
 #include <metal-pipeline/pipeline.hpp>
+#include <metal-pipeline/snap_action_pool.hpp>
 
 namespace metal {
 
@@ -18,7 +19,10 @@ class DataSinkContext;
 class METAL_PIPELINE_API SnapPipelineRunner {
  public:
   SnapPipelineRunner(Card card, std::shared_ptr<Pipeline> pipeline)
-      : _pipeline(std::move(pipeline)), _initialized(false), _card(card) {}
+      : _pipeline(std::move(pipeline)),
+        _initialized(false),
+        _card(card),
+        _actions(SnapActionPool::forCard(card)) {}
   template <typename... Ts>
   SnapPipelineRunner(Card card, Ts... userOperators)
       : SnapPipelineRunner(
@@ -47,10 +51,14 @@ class METAL_PIPELINE_API SnapPipelineRunner {
     (void)dataSink;
     (void)finalize;
   };
+  // Whether the data source may prepare its next chunk while the card runs
+  // the current one. Whatever it sends to the card runs before postRun.
+  virtual bool overlapsNextChunk() const { return true; }
 
   std::shared_ptr<Pipeline> _pipeline;
   bool _initialized;
   Card _card;
+  std::shared_ptr<SnapActionPool> _actions;
 };
 
 }  // namespace metal
@@ -0,0 +1,86 @@
+#include <metal-pipeline/job_buffer_pool.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <metal-pipeline/snap_action.hpp>
+
+namespace metal {
+
+JobBuffer::~JobBuffer() {
+  if (_data) _pool->release(_data, _size);
+}
+
+JobBufferPool::JobBufferPool() : _stats() {
+  // Reserved up front, so that releasing doesn't allocate either
+  for (auto &buffers : _free) buffers.reserve(MaxCachedPerClass);
+}
+
+JobBufferPool::~JobBufferPool() {
+  for (auto &buffers : _free)
+    for (void *data : buffers) free(data);
+}
+
+int JobBufferPool::sizeClass(size_t size) {
+  int sizeClass = 0;
+  while (sizeClass < SizeClasses && (MinimumSize << sizeClass) < size)
+    ++sizeClass;
+  return sizeClass;
+}
+
+JobBuffer JobBufferPool::acquire(size_t size) {
+  int index = sizeClass(size);
+  size_t classSize = index < SizeClasses ? MinimumSize << index : size;
+
+  void *data = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ++_stats.outstanding;
+    if (index < SizeClasses && !_free[index].empty()) {
+      data = _free[index].back();
+      _free[index].pop_back();
+      _stats.cachedBytes -= classSize;
+      ++_stats.reuses;
+    } else {
+      ++_stats.allocations;
+    }
+  }
+
+  if (data) {
+    // Fresh buffers from snap_malloc are zeroed as well
+    memset(data, 0, classSize);
+  } else {
+    data = SnapAction::allocateMemory(classSize);
+    if (data == nullptr) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      --_stats.outstanding;
+      throw std::bad_alloc();
+    }
+  }
+
+  return JobBuffer(shared_from_this(), data, classSize);
+}
+
+void JobBufferPool::release(void *data, size_t size) {
+  int index = sizeClass(size);
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    --_stats.outstanding;
+    if (index < SizeClasses && _free[index].size() < MaxCachedPerClass) {
+      _free[index].push_back(data);
+      _stats.cachedBytes += size;
+      return;
+    }
+  }
+
+  free(data);
+}
+
+JobBufferPool::Stats JobBufferPool::stats() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stats;
+}
+
+}  // namespace metal
@@ -1,6 +1,7 @@
 #include <metal-pipeline/operator_context.hpp>
 
 #include <cstring>
+#include <map>
 
 #include <spdlog/spdlog.h>
 
@@ -17,62 +18,55 @@ OperatorContext::OperatorContext(Operator op)
       _profilingResults() {}
 
 void OperatorContext::configure(SnapAction &action) {
-  // Allocate job struct memory aligned on a page boundary, hopefully 4KB is
-  // sufficient
-  auto job_config = reinterpret_cast<char *>(action.allocateMemory(4096));
-  auto *metadata = reinterpret_cast<uint32_t *>(job_config);
+  // The registers of all options, by word offset. The action only sends the
+  // ones that changed since they were last written.
+  std::map<uint32_t, uint32_t> registers;
 
   for (const auto &option : _op.options()) {
     if (!option.second.has_value()) continue;
 
     const auto &definition = _op.spec().optionDefinitions().at(option.first);
-
-    metadata[0] = htobe32(definition.offset() / sizeof(uint32_t));  // offset
-    metadata[2] = htobe32(_op.spec().streamID());
-    metadata[3] = htobe32(
-        _op.spec().prepareRequired());  // enables preparation mode for the
-                                         // operator, implying that we need a
-                                         // preparation run of the operator(s)
-    const int configuration_data_offset = 4 * sizeof(uint32_t);  // bytes
+    const uint32_t offset = definition.offset() / sizeof(uint32_t);
 
     switch (static_cast<OptionType>(option.second.value().index())) {
       case OptionType::Uint: {
-        uint32_t value = std::get<uint32_t>(option.second.value());
-        std::memcpy(job_config + configuration_data_offset, &value,
-                    sizeof(uint32_t));
-        metadata[1] = htobe32(sizeof(uint32_t) / sizeof(uint32_t));  // length
+        registers[offset] = std::get<uint32_t>(option.second.value());
         break;
       }
       case OptionType::Bool: {
-        uint32_t value = std::get<bool>(option.second.value()) ? 1 : 0;
-        std::memcpy(job_config + configuration_data_offset, &value,
-                    sizeof(uint32_t));
-        metadata[1] = htobe32(1);  // length
+        registers[offset] = std::get<bool>(option.second.value()) ? 1 : 0;
         break;
       }
       case OptionType::Buffer: {
         // *No* endianness conversions on buffers
         auto &buffer = *std::get<std::shared_ptr<std::vector<char>>>(
             option.second.value());
-        std::memcpy(job_config + configuration_data_offset, buffer.data(),
-                    buffer.size());
-        metadata[1] = htobe32(buffer.size() / sizeof(uint32_t));  // length
+        for (size_t i = 0; i < buffer.size() / sizeof(uint32_t); ++i) {
+          uint32_t word;
+          std::memcpy(&word, buffer.data() + i * sizeof(uint32_t),
+                      sizeof(uint32_t));
+          registers[offset + i] = word;
+        }
         break;
       }
       default: { break; }
     }
+  }
 
-    _is_prepared = false;
-
-    try {
-      action.executeJob(fpga::JobType::ConfigureOperator, job_config);
-    } catch (std::exception &ex) {
-      // Something went wrong...
-      spdlog::warn("Could not configure operator: {}", ex.what());
+  try {
+    // Unchanged options don't need another preparation run. But the
+    // registers may have been written by another context, and the card
+    // forgets about preparation after every run.
+    bool prepare = _op.spec().prepareRequired();
+    if (action.configureOperator(_op.spec().streamID(), prepare, registers,
+                                 prepare && !_is_prepared)) {
+      _is_prepared = false;
     }
+  } catch (std::exception &ex) {
+    // Something went wrong...
+    _is_prepared = false;
+    spdlog::warn("Could not configure operator: {}", ex.what());
   }
-
-  free(job_config);
 }
 
 void OperatorContext::finalize(SnapAction &action) { (void)action; }
@@ -15,17 +15,11 @@ namespace metal {
 
 OperatorFactory OperatorFactory::fromFPGA(SnapAction &snapAction) {
   uint64_t json_len = 0;
-  auto json = snapAction.allocateMemory(4096);
-  try {
-    snapAction.executeJob(fpga::JobType::ReadImageInfo, json, {}, {}, 0, 0,
-                          &json_len);
-  } catch (std::exception &ex) {
-    free(json);
-    throw ex;
-  }
+  auto json = snapAction.allocateJobBuffer(4096);
+  snapAction.executeJob(fpga::JobType::ReadImageInfo, json.data(), {}, {}, 0,
+                        0, &json_len);
 
-  std::string info(reinterpret_cast<const char *>(json), json_len);
-  free(json);
+  std::string info(json.as<const char>(), json_len);
 
   return OperatorFactory(info);
 }
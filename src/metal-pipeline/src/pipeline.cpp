@@ -4,6 +4,7 @@ extern "C" {
 
 #include <spdlog/spdlog.h>
 #include <algorithm>
+#include <array>
 #include <iostream>
 
 #include <metal-pipeline/fpga_interface.hpp>
@@ -14,8 +15,7 @@ extern "C" {
 
 namespace metal {
 
-Pipeline::Pipeline(std::vector<Operator> userOperators)
-    : _cachedSwitchConfiguration(false) {
+Pipeline::Pipeline(std::vector<Operator> userOperators) {
   std::vector<OperatorContext> contexts;
   contexts.reserve(userOperators.size());
 
@@ -27,11 +27,16 @@ Pipeline::Pipeline(std::vector<Operator> userOperators)
 }
 
 Pipeline::Pipeline(std::vector<OperatorContext> userOperators)
-    : _operators(std::move(userOperators)),
-      _cachedSwitchConfiguration(false) {}
+    : _operators(std::move(userOperators)) {}
 
 uint64_t Pipeline::run(DataSource dataSource, DataSink dataSink,
                        SnapAction &action) {
+  return finish(submit(dataSource, dataSink, action), action);
+}
+
+std::future<SnapAction::JobResult> Pipeline::submit(DataSource dataSource,
+                                                    DataSink dataSink,
+                                                    SnapAction &action) {
   for (auto &op : _operators) {
     op.configure(action);
   }
@@ -49,7 +54,9 @@ uint64_t Pipeline::run(DataSource dataSource, DataSink dataSink,
                        enable_mask);
   }
 
-  if (!_cachedSwitchConfiguration) configureSwitch(action, false);
+  // Only sent if the switch is routed differently, like after the storage
+  // I/O that a data sink may run on the same action
+  configureSwitch(action);
 
   enable_mask = 1;  // This time, enable the I/O subsystem
   for (auto &op : _operators) {
@@ -71,10 +78,14 @@ uint64_t Pipeline::run(DataSource dataSource, DataSink dataSink,
                 SnapAction::addressTypeToString(destinationAddress.type),
                 SnapAction::mapTypeToString(destinationAddress.map));
 
-  uint64_t output_size;
-  action.executeJob(fpga::JobType::RunOperators, nullptr, sourceAddress,
-                     destinationAddress, enable_mask, /* perfmon_enable = */ 1,
-                     &output_size);
+  return action.submitJob(fpga::JobType::RunOperators, nullptr, sourceAddress,
+                          destinationAddress, enable_mask,
+                          /* perfmon_enable = */ 1);
+}
+
+uint64_t Pipeline::finish(std::future<SnapAction::JobResult> run,
+                          SnapAction &action) {
+  uint64_t output_size = run.get().directDataOut0;
 
   spdlog::debug("Result size: {}", output_size);
 
@@ -85,15 +96,10 @@ uint64_t Pipeline::run(DataSource dataSource, DataSink dataSink,
   return output_size;
 }
 
-void Pipeline::configureSwitch(SnapAction &action, bool set_cached) {
-  _cachedSwitchConfiguration = set_cached;
-
-  auto *job_struct =
-      reinterpret_cast<uint32_t *>(action.allocateMemory(sizeof(uint32_t) * 8));
+void Pipeline::configureSwitch(SnapAction &action) {
+  std::array<uint32_t, SnapAction::SwitchPorts> inputs;
   const uint32_t disable = 0x80000000;
-  for (int i = 0; i < 8; ++i) {
-    job_struct[i] = htobe32(disable);
-  }
+  inputs.fill(disable);
 
   uint8_t previousStream = IOStreamID;
   for (const auto &op : _operators) {
@@ -101,20 +107,12 @@ void Pipeline::configureSwitch(SnapAction &action, bool set_cached) {
     // Which Master port (output) should be
     // sourced from which Slave port (input)
     auto currentStream = op.userOperator().spec().streamID();
-    job_struct[currentStream] = htobe32(previousStream);
+    inputs[currentStream] = previousStream;
     previousStream = currentStream;
   }
-  job_struct[IOStreamID] = htobe32(previousStream);
-
-  try {
-    action.executeJob(fpga::JobType::ConfigureStreams,
-                       reinterpret_cast<char *>(job_struct));
-  } catch (std::exception &ex) {
-    free(job_struct);
-    throw ex;
-  }
+  inputs[IOStreamID] = previousStream;
 
-  free(job_struct);
+  action.configureStreams(inputs);
 }
 
 }  // namespace metal
@@ -80,21 +80,13 @@ void ProfilingPipelineRunner::preRun(SnapAction &action,
     if (_profileStreamIds) {
       spdlog::debug("Selecting streams {} and {} for profiling.",
                     _profileStreamIds->first, _profileStreamIds->second);
-      auto *job_struct = reinterpret_cast<uint64_t *>(
-          action.allocateMemory(sizeof(uint64_t) * 2));
+      auto buffer = action.allocateJobBuffer(sizeof(uint64_t) * 2);
+      auto *job_struct = buffer.as<uint64_t>();
 
       job_struct[0] = htobe64(_profileStreamIds->first);
       job_struct[1] = htobe64(_profileStreamIds->second);
 
-      try {
-        action.executeJob(fpga::JobType::ConfigurePerfmon,
-                          reinterpret_cast<char *>(job_struct));
-      } catch (std::exception &ex) {
-        free(job_struct);
-        throw ex;
-      }
-
-      free(job_struct);
+      action.executeJob(fpga::JobType::ConfigurePerfmon, job_struct);
     }
   }
 
@@ -110,17 +102,11 @@ void ProfilingPipelineRunner::postRun(SnapAction &action,
                                       DataSinkContext &dataSink,
                                       bool finalize) {
   if (_profileStreamIds) {
-    auto *results64 = reinterpret_cast<uint64_t *>(
-        action.allocateMemory(sizeof(uint64_t) * 6));
+    auto buffer = action.allocateJobBuffer(sizeof(uint64_t) * 6);
+    auto *results64 = buffer.as<uint64_t>();
     auto *results32 = reinterpret_cast<uint32_t *>(results64 + 1);
 
-    try {
-      action.executeJob(fpga::JobType::ReadPerfmonCounters,
-                        reinterpret_cast<char *>(results64));
-    } catch (std::exception &ex) {
-      free(results64);
-      throw ex;
-    }
+    action.executeJob(fpga::JobType::ReadPerfmonCounters, results64);
 
     _results.globalClockCounter += be64toh(results64[0]);
 
@@ -134,8 +120,6 @@ void ProfilingPipelineRunner::postRun(SnapAction &action,
     _results.outputSlaveIdleCount += be32toh(results32[8]);
     _results.outputMasterIdleCount += be32toh(results32[9]);
 
-    free(results64);
-
     if (finalize) {
       if (dataSource.profilingEnabled()) {
         dataSource.setProfilingResults(formatProfilingResults(true, false));
@@ -15,7 +15,17 @@
 
 namespace metal {
 
-SnapAction::SnapAction(Card card) : _timeout(card.timeout) {
+SnapAction::SnapAction(Card card)
+    : _timeout(card.timeout),
+      _failed(false),
+      _jobBuffers(std::make_shared<JobBufferPool>()),
+      _extentMaps(),
+      _extentMapStats(),
+      _operatorRegisters(),
+      _configurationStats(),
+      _switchInputs(),
+      _switchKnown(false),
+      _stopping(false) {
   spdlog::trace("Allocating CXL device /dev/cxl/afu{}.0s...", card.card);
 
   char device[128];
@@ -39,12 +49,28 @@ SnapAction::SnapAction(Card card) : _timeout(card.timeout) {
 }
 
 SnapAction::SnapAction(SnapAction &&other) noexcept
-    : _action(other._action), _card(other._card), _timeout(other._timeout) {
+    : _timeout(other._timeout.load()),
+      _jobBuffers(std::move(other._jobBuffers)),
+      _extentMaps(std::move(other._extentMaps)),
+      _extentMapStats(other._extentMapStats),
+      _operatorRegisters(std::move(other._operatorRegisters)),
+      _configurationStats(other._configurationStats),
+      _switchInputs(other._switchInputs),
+      _switchKnown(other._switchKnown),
+      _stopping(false) {
+  // The worker of other runs its jobs on other, so it has to finish first
+  other.stopJobs();
+
+  _action = other._action;
+  _card = other._card;
+  _failed = other._failed.load();
   other._action = nullptr;
   other._card = nullptr;
 }
 
 SnapAction::~SnapAction() {
+  stopJobs();
+
   if (_action) {
     spdlog::trace("Detaching action...");
     snap_detach_action(_action);
@@ -63,6 +89,82 @@ void SnapAction::executeJob(fpga::JobType jobType, const void *parameters,
                             uint64_t directData0, uint64_t directData1,
                             uint64_t *directDataOut0,
                             uint64_t *directDataOut1) {
+  // Keep the order in which jobs reach the card
+  drainJobs();
+
+  runJob(jobType, parameters, source, destination, directData0, directData1,
+         directDataOut0, directDataOut1);
+}
+
+std::future<SnapAction::JobResult> SnapAction::submitJob(
+    fpga::JobType jobType, const void *parameters, fpga::Address source,
+    fpga::Address destination, uint64_t directData0, uint64_t directData1) {
+  std::lock_guard<std::mutex> lock(_jobsMutex);
+
+  _jobs.push_back(PendingJob{jobType, parameters, source, destination,
+                             directData0, directData1, {}});
+  auto result = _jobs.back().result.get_future();
+
+  if (!_worker.joinable()) {
+    _worker = std::thread(&SnapAction::processJobs, this);
+  }
+  _jobsChanged.notify_all();
+
+  return result;
+}
+
+void SnapAction::drainJobs() {
+  std::unique_lock<std::mutex> lock(_jobsMutex);
+  _jobsChanged.wait(lock, [this] { return _jobs.empty(); });
+}
+
+void SnapAction::processJobs() {
+  std::unique_lock<std::mutex> lock(_jobsMutex);
+  for (;;) {
+    _jobsChanged.wait(lock, [this] { return _stopping || !_jobs.empty(); });
+    if (_jobs.empty()) {
+      return;
+    }
+
+    // Jobs are only appended while this one runs, so the reference is stable
+    auto &job = _jobs.front();
+    lock.unlock();
+
+    try {
+      JobResult result{};
+      runJob(job.jobType, job.parameters, job.source, job.destination,
+             job.directData0, job.directData1, &result.directDataOut0,
+             &result.directDataOut1);
+      job.result.set_value(result);
+    } catch (...) {
+      job.result.set_exception(std::current_exception());
+    }
+
+    lock.lock();
+    _jobs.pop_front();
+    _jobsChanged.notify_all();
+  }
+}
+
+// Lets the worker run the remaining jobs and waits for it
+void SnapAction::stopJobs() {
+  {
+    std::lock_guard<std::mutex> lock(_jobsMutex);
+    _stopping = true;
+    _jobsChanged.notify_all();
+  }
+
+  if (_worker.joinable()) {
+    _worker.join();
+  }
+
+  _stopping = false;
+}
+
+void SnapAction::runJob(fpga::JobType jobType, const void *parameters,
+                        fpga::Address source, fpga::Address destination,
+                        uint64_t directData0, uint64_t directData1,
+                        uint64_t *directDataOut0, uint64_t *directDataOut1) {
   spdlog::debug("Starting job {}...", jobTypeToString(jobType));
 
   fpga::Job mjob{};
@@ -81,6 +183,7 @@ void SnapAction::executeJob(fpga::JobType jobType, const void *parameters,
   int rc = snap_action_sync_execute_job(_action, &cjob, _timeout);
 
   if (rc != 0) {
+    _failed = true;
     throw std::runtime_error("Error starting job: " +
                              snapReturnCodeToString(rc));
   }
@@ -99,6 +202,158 @@ bool SnapAction::isNVMeEnabled() {
   return haveNVMe != 0;
 }
 
+bool SnapAction::isHealthy() {
+  if (!_action || _failed) {
+    return false;
+  }
+
+  // A card that has been reset or lost the action reads something else here
+  uint32_t actionType = 0;
+  if (snap_mmio_read32(_card, ACTION_TYPE_REG, &actionType) != 0) {
+    return false;
+  }
+  return actionType == (uint32_t)fpga::ActionType;
+}
+
+uint64_t SnapAction::mapExtents(fpga::ExtmapSlot slot,
+                                const std::vector<Extent> &extents) {
+  // Versions are unique across actions, so that a version that was handed
+  // out by a detached action never matches
+  static std::atomic<uint64_t> nextVersion(1);
+
+  auto &resident = _extentMaps[static_cast<size_t>(slot)];
+  if (resident.version != 0 && resident.extents == extents) {
+    ++_extentMapStats.skippedMapJobs;
+    return resident.version;
+  }
+
+  auto buffer = allocateJobBuffer(
+      sizeof(uint64_t) * (8                                // words for the prefix
+                          + (2 * fpga::MaxExtentsPerFile)  // two words for each extent
+                          ));
+  auto *job_struct = buffer.as<uint64_t>();
+  job_struct[0] = htobe64(static_cast<uint64_t>(slot));  // slot number
+  spdlog::trace("Mapping {} extents into slot {}", extents.size(),
+                static_cast<uint64_t>(slot));
+
+  // The rest of the buffer is zeroed already
+  for (uint64_t i = 0; i < extents.size() && i < fpga::MaxExtentsPerFile;
+       ++i) {
+    job_struct[8 + 2 * i + 0] = htobe64(extents[i].offset);
+    job_struct[8 + 2 * i + 1] = htobe64(extents[i].length);
+    spdlog::trace("  Offset {}  Length {}", extents[i].offset,
+                  extents[i].length);
+  }
+
+  // Whatever the slot holds after a failed job is unknown
+  resident.version = 0;
+  resident.extents.clear();
+  executeJob(fpga::JobType::Map, job_struct);
+  ++_extentMapStats.mapJobs;
+
+  resident.version = nextVersion++;
+  resident.extents = extents;
+  return resident.version;
+}
+
+bool SnapAction::configureOperator(
+    uint32_t streamID, bool prepare,
+    const std::map<uint32_t, uint32_t> &registers, bool rearm) {
+  auto &written = _operatorRegisters[streamID];
+
+  auto known = [&](uint32_t offset, uint32_t *value) {
+    auto reg = registers.find(offset);
+    if (reg != registers.end()) {
+      *value = reg->second;
+      return true;
+    }
+    auto previous = written.find(offset);
+    if (previous != written.end()) {
+      *value = previous->second;
+      return true;
+    }
+    return false;
+  };
+
+  // Runs of words [begin, end) to send. Words in between two dirty ones can
+  // be written again if their value is known, which saves a job.
+  std::vector<std::pair<uint32_t, uint32_t>> runs;
+  for (const auto &reg : registers) {
+    // Writing any word again arms the preparation mode, so rearming sends the
+    // first one even if the registers hold it already
+    bool rearms = rearm && reg.first == registers.begin()->first;
+    auto previous = written.find(reg.first);
+    if (!rearms && previous != written.end() &&
+        previous->second == reg.second) {
+      ++_configurationStats.unchangedWords;
+      continue;
+    }
+
+    bool bridged = !runs.empty();
+    uint32_t value;
+    for (uint32_t offset = bridged ? runs.back().second : 0;
+         bridged && offset < reg.first; ++offset)
+      bridged = known(offset, &value);
+
+    if (bridged) {
+      runs.back().second = reg.first + 1;
+    } else {
+      runs.emplace_back(reg.first, reg.first + 1);
+    }
+  }
+
+  const size_t header_words = 4;
+  try {
+    for (const auto &run : runs) {
+      uint32_t length = run.second - run.first;
+      auto buffer =
+          allocateJobBuffer(sizeof(uint32_t) * (header_words + length));
+      auto *job_config = buffer.as<uint32_t>();
+      job_config[0] = htobe32(run.first);  // offset
+      job_config[1] = htobe32(length);
+      job_config[2] = htobe32(streamID);
+      // enables preparation mode for the operator, implying that we need a
+      // preparation run of the operator(s)
+      job_config[3] = htobe32(prepare);
+
+      // The words are sent as they are, like the options hold them
+      for (uint32_t offset = run.first; offset < run.second; ++offset)
+        known(offset, &job_config[header_words + offset - run.first]);
+
+      executeJob(fpga::JobType::ConfigureOperator, job_config);
+      ++_configurationStats.configureJobs;
+
+      for (uint32_t offset = run.first; offset < run.second; ++offset)
+        written[offset] = job_config[header_words + offset - run.first];
+    }
+  } catch (...) {
+    // What the registers hold after a failed job is unknown
+    _operatorRegisters.erase(streamID);
+    throw;
+  }
+
+  return !runs.empty();
+}
+
+bool SnapAction::configureStreams(
+    const std::array<uint32_t, SwitchPorts> &inputs) {
+  // Other pipelines may have run on this action in between
+  if (_switchKnown && _switchInputs == inputs) return false;
+
+  auto buffer = allocateJobBuffer(sizeof(uint32_t) * SwitchPorts);
+  auto *job_struct = buffer.as<uint32_t>();
+  for (size_t i = 0; i < SwitchPorts; ++i) {
+    job_struct[i] = htobe32(inputs[i]);
+  }
+
+  _switchKnown = false;
+  executeJob(fpga::JobType::ConfigureStreams, job_struct);
+
+  _switchInputs = inputs;
+  _switchKnown = true;
+  return true;
+}
+
 void *SnapAction::allocateMemory(size_t size) { return snap_malloc(size); }
 
 std::string SnapAction::jobTypeToString(fpga::JobType job) {
@@ -0,0 +1,92 @@
+#include <metal-pipeline/snap_action_pool.hpp>
+
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+namespace metal {
+
+SnapActionPool::Lease::~Lease() {
+  if (_pool) _pool->giveBack(_borrower);
+}
+
+std::shared_ptr<SnapActionPool> SnapActionPool::forCard(Card card) {
+  static std::mutex poolsMutex;
+  static std::map<int, std::shared_ptr<SnapActionPool>> pools;
+
+  // Attaching to a card that already has an action attached would block, so
+  // there is only one pool per card
+  std::lock_guard<std::mutex> lock(poolsMutex);
+  auto &pool = pools[card.card];
+  if (!pool) {
+    pool = std::make_shared<SnapActionPool>(card);
+  }
+  return pool;
+}
+
+SnapActionPool::Lease SnapActionPool::borrow(int timeout) {
+  auto borrower = std::this_thread::get_id();
+  std::unique_ptr<SnapAction> action;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // Waiting for itself would never end
+    auto nested = _lent.find(borrower);
+    if (nested != _lent.end()) {
+      ++nested->second.leases;
+      return Lease(shared_from_this(), nested->second.action.get(), borrower);
+    }
+
+    if (!_returned.wait_for(lock, std::chrono::seconds(timeout),
+                            [this] { return _lent.size() < _capacity; })) {
+      throw std::runtime_error("Timed out waiting for an action on card " +
+                               std::to_string(_card.card));
+    }
+    _lent[borrower] = Borrowed{nullptr, 1};
+
+    if (!_idle.empty()) {
+      action = std::move(_idle.back());
+      _idle.pop_back();
+    }
+  }
+
+  if (action && !action->isHealthy()) {
+    spdlog::warn("Action on card {} is not responding, attaching again...",
+                 _card.card);
+    action.reset();
+  }
+
+  if (!action) {
+    try {
+      action = std::make_unique<SnapAction>(Card{_card.card, timeout});
+    } catch (...) {
+      giveBack(borrower);
+      throw;
+    }
+  }
+  action->setTimeout(timeout);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto &borrowed = _lent[borrower];
+  borrowed.action = std::move(action);
+  return Lease(shared_from_this(), borrowed.action.get(), borrower);
+}
+
+void SnapActionPool::giveBack(std::thread::id borrower) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto borrowed = _lent.find(borrower);
+  if (--borrowed->second.leases > 0) return;
+
+  // Failed actions are detected and replaced when they are borrowed again
+  if (borrowed->second.action)
+    _idle.push_back(std::move(borrowed->second.action));
+  _lent.erase(borrowed);
+
+  _returned.notify_one();
+}
+
+}  // namespace metal
@@ -8,6 +8,7 @@ extern "C" {
 #include <cstring>
 #include <iostream>
 #include <sstream>
+#include <utility>
 
 #include <metal-pipeline/fpga_interface.hpp>
 #include <metal-pipeline/common.hpp>
@@ -31,7 +32,8 @@ std::pair<uint64_t, bool> SnapPipelineRunner::run(DataSource dataSource,
 
 std::pair<uint64_t, bool> SnapPipelineRunner::run(DataSourceContext &dataSource,
                                                   DataSinkContext &dataSink) {
-  SnapAction action = SnapAction(_card);
+  auto lease = _actions->borrow(_card.timeout);
+  SnapAction &action = *lease;
 
   auto initialize = !_initialized;
 
@@ -41,8 +43,6 @@ std::pair<uint64_t, bool> SnapPipelineRunner::run(DataSourceContext &dataSource,
     if (totalSize > 0) {
       dataSink.prepareForTotalSize(totalSize);
     }
-
-    _pipeline->configureSwitch(action, true);
   }
 
   dataSource.configure(action, initialize);
@@ -50,6 +50,7 @@ std::pair<uint64_t, bool> SnapPipelineRunner::run(DataSourceContext &dataSource,
   auto size = dataSource.dataSource().address().size;
   auto endOfInput = dataSource.endOfInput();
   dataSink.configure(action, size, initialize);
+  dataSource.restore(action);
 
   _initialized = true;
 
@@ -57,7 +58,20 @@ std::pair<uint64_t, bool> SnapPipelineRunner::run(DataSourceContext &dataSource,
 
   uint64_t outputSize = 0;
   if (size > 0) {
-    outputSize = _pipeline->run(dataSource.dataSource(), dataSink.dataSink(), action);
+    auto run = _pipeline->submit(dataSource.dataSource(), dataSink.dataSink(),
+                                 action);
+
+    if (!endOfInput && overlapsNextChunk()) {
+      try {
+        dataSource.prepareNext(action);
+      } catch (...) {
+        // The card may still be using the buffers of the contexts
+        run.wait();
+        throw;
+      }
+    }
+
+    outputSize = _pipeline->finish(std::move(run), action);
   }
 
   postRun(action, dataSource, dataSink, endOfInput);
@@ -0,0 +1,435 @@
+extern "C" {
+#include <metal-filesystem/extent.h>
+#include <metal-filesystem/free_space.h>
+#include <metal-filesystem/heap.h>
+#include <metal-filesystem/inode.h>
+#include <metal-filesystem/metal.h>
+}
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <lmdb.h>
+
+// Compares the in-memory free space index with the LMDB-backed heap that the
+// extent allocator used before, using allocation-heavy workloads, the
+// fragmentation caused by the allocation policies, the cost of streaming
+// appends with and without preallocation, of creating small files with and
+// without group commit, the rate of read-only metadata operations and listing
+// a large directory with attributes
+
+namespace {
+
+const char *MetadataStore = "benchmark_files";
+
+const uint64_t Blocks = 1 << 20;
+const int Rounds = 20;
+const int OperationsPerRound = 5000;
+const int OperationsPerTransaction = 100;
+
+MDB_env *create_env() {
+  std::string command = std::string("rm -rf ") + MetadataStore;
+  if (system(command.c_str()) != 0) return nullptr;
+  mkdir(MetadataStore, S_IRWXU);
+
+  MDB_env *env;
+  mdb_env_create(&env);
+  // inodes, dirents, file_extents, extents, heap, meta
+  mdb_env_set_maxdbs(env, 6);
+  mdb_env_set_mapsize(env, 1ul << 30);
+  mdb_env_open(env, MetadataStore, 0, 0644);
+  return env;
+}
+
+// Runs operation OperationsPerTransaction times per write transaction
+double measure(MDB_env *env, int operations,
+               const std::function<void(MDB_txn *, int)> &operation) {
+  auto start = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < operations;) {
+    MDB_txn *txn;
+    mdb_txn_begin(env, NULL, 0, &txn);
+    for (int j = 0; j < OperationsPerTransaction && i < operations; ++j, ++i)
+      operation(txn, i);
+    mdb_txn_commit(txn);
+  }
+
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / operations;
+}
+
+void report(const char *name, double reserve_us, double free_us) {
+  printf("%-28s reserve %8.3f us/op   free %8.3f us/op\n", name, reserve_us,
+         free_us);
+}
+
+// The heap operations that mtl_reserve_extent and mtl_free_extent used to
+// perform: take the largest extent and put back the remainder on reserve,
+// insert the freed extent on free
+void benchmark_heap(const std::vector<uint64_t> &sizes) {
+  MDB_env *env = create_env();
+
+  measure(env, 1, [](MDB_txn *txn, int) {
+    mtl_heap_insert(txn, Blocks, 0, NULL);
+  });
+
+  double reserve_us = 0, free_us = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> reserved(OperationsPerRound);
+  for (int round = 0; round < Rounds; ++round) {
+    reserve_us += measure(env, OperationsPerRound, [&](MDB_txn *txn, int i) {
+      uint64_t offset;
+      mtl_heap_extract_max(txn, &offset);
+      reserved[i] = {offset, sizes[i]};
+      // The key only approximates the remaining length, which doesn't matter
+      // for the cost of the operation
+      mtl_heap_insert(txn, Blocks - sizes[i], offset + sizes[i], NULL);
+    });
+    free_us += measure(env, OperationsPerRound, [&](MDB_txn *txn, int i) {
+      mtl_heap_insert(txn, reserved[i].second, reserved[i].first, NULL);
+    });
+  }
+  report("LMDB heap", reserve_us / Rounds, free_us / Rounds);
+
+  mdb_env_close(env);
+}
+
+// The same operations on the in-memory index
+void benchmark_free_space_index(const std::vector<uint64_t> &sizes) {
+  mtl_free_space *free_space;
+  mtl_free_space_create(&free_space);
+  mtl_free_space_insert(free_space, 0, Blocks);
+
+  double reserve_us = 0, free_us = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> reserved(OperationsPerRound);
+  for (int round = 0; round < Rounds; ++round) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < OperationsPerRound; ++i) {
+      uint64_t offset, length;
+      mtl_free_space_find_largest(free_space, &offset, &length);
+      mtl_free_space_remove(free_space, offset);
+      reserved[i] = {offset, sizes[i]};
+      mtl_free_space_insert(free_space, offset + sizes[i], length - sizes[i]);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int i = 0; i < OperationsPerRound; ++i)
+      mtl_free_space_insert(free_space, reserved[i].first, reserved[i].second);
+    auto end = std::chrono::steady_clock::now();
+
+    reserve_us += std::chrono::duration<double, std::micro>(middle - start)
+                      .count() / OperationsPerRound;
+    free_us += std::chrono::duration<double, std::micro>(end - middle)
+                   .count() / OperationsPerRound;
+  }
+  report("In-memory index", reserve_us / Rounds, free_us / Rounds);
+
+  mtl_free_space_destroy(free_space);
+}
+
+// The complete allocator, including the updates of the extents database and
+// coalescing of freed extents
+void benchmark_allocator(const std::vector<uint64_t> &sizes) {
+  MDB_env *env = create_env();
+
+  mtl_free_space *free_space;
+  mtl_free_space_create(&free_space);
+
+  measure(env, 1, [&](MDB_txn *txn, int) {
+    mtl_initialize_extents(txn, free_space, Blocks);
+  });
+
+  double reserve_us = 0, free_us = 0;
+  std::vector<uint64_t> offsets(OperationsPerRound);
+  for (int round = 0; round < Rounds; ++round) {
+    reserve_us += measure(env, OperationsPerRound, [&](MDB_txn *txn, int i) {
+      mtl_reserve_extent(txn, free_space, 1, sizes[i], NULL, &offsets[i],
+                         true);
+    });
+    free_us += measure(env, OperationsPerRound, [&](MDB_txn *txn, int i) {
+      mtl_free_extent(txn, free_space, offsets[i]);
+    });
+  }
+  report("Allocator (index + extents)", reserve_us / Rounds, free_us / Rounds);
+
+  mtl_free_space_destroy(free_space);
+  mdb_env_close(env);
+}
+
+// Appends to several files in turn, deleting some of them in between, and
+// reports the resulting fragmentation
+void benchmark_policy(const char *name, mtl_allocation_policy policy) {
+  std::string command = std::string("rm -rf ") + MetadataStore;
+  if (system(command.c_str()) != 0) return;
+  mkdir(MetadataStore, S_IRWXU);
+
+  mtl_context *context;
+  mtl_initialize(&context, MetadataStore, &in_memory_storage);
+  mtl_set_allocation_policy(context, policy);
+
+  const int files = 16;
+  const uint64_t block_size = 4096;
+  std::mt19937_64 random(4711);
+  std::uniform_int_distribution<uint64_t> size_distribution(1, 8);
+
+  uint64_t inodes[files];
+  uint64_t lengths[files] = {};
+  for (int i = 0; i < files; ++i) {
+    std::string filename = "/file" + std::to_string(i);
+    mtl_create(context, filename.c_str(), 0755, &inodes[i]);
+  }
+
+  for (int round = 1; round <= 100; ++round) {
+    for (int i = 0; i < files; ++i) {
+      lengths[i] += size_distribution(random) * block_size;
+      mtl_truncate(context, inodes[i], lengths[i]);
+    }
+
+    // Replace every fourth file with an empty one once in a while
+    if (round % 25 == 0) {
+      for (int i = round % 4; i < files; i += 4) {
+        std::string filename = "/file" + std::to_string(i);
+        mtl_unlink(context, filename.c_str());
+        mtl_create(context, filename.c_str(), 0755, &inodes[i]);
+        lengths[i] = 0;
+      }
+    }
+  }
+
+  mtl_fragmentation_report report;
+  mtl_get_fragmentation_report(context, &report);
+  printf("%-28s extents per file %6.1f (max %lu)   free extents %lu\n", name,
+         (double)report.file_extents / report.files, report.max_file_extents,
+         report.free_extents);
+
+  mtl_deinitialize(context);
+}
+
+// Returns the number of write transactions that have been committed to the
+// metadata store, which must not be open
+uint64_t count_transactions() {
+  MDB_env *env;
+  mdb_env_create(&env);
+  mdb_env_set_maxdbs(env, 6);
+  mdb_env_open(env, MetadataStore, MDB_RDONLY, 0644);
+
+  // The ID of the last transaction is the number of write transactions
+  MDB_envinfo info;
+  mdb_env_info(env, &info);
+  mdb_env_close(env);
+  return info.me_last_txnid;
+}
+
+// Appends to a file in chunks of the size FUSE uses, either through an open
+// file (which preallocates blocks) or without opening it
+void benchmark_streaming(const char *name, bool open_file) {
+  std::string command = std::string("rm -rf ") + MetadataStore;
+  if (system(command.c_str()) != 0) return;
+  mkdir(MetadataStore, S_IRWXU);
+
+  mtl_context *context;
+  mtl_initialize(&context, MetadataStore, &in_memory_storage);
+
+  uint64_t inode_id;
+  mtl_create(context, "/stream", 0755, &inode_id);
+  if (open_file) mtl_open_file(context, inode_id);
+
+  const uint64_t chunk_size = 128 * 1024;
+  const uint64_t length = 96ul << 20;
+  std::vector<char> chunk(chunk_size, 'a');
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t offset = 0; offset < length; offset += chunk_size)
+    mtl_write(context, inode_id, chunk.data(), chunk_size, offset);
+  if (open_file) mtl_close_file(context, inode_id);
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  mtl_fragmentation_report report;
+  mtl_get_fragmentation_report(context, &report);
+  mtl_deinitialize(context);
+
+  printf("%-28s %8.3f us/write   extents %lu   transactions %lu\n", name,
+         elapsed.count() / (length / chunk_size), report.file_extents,
+         count_transactions());
+}
+
+// Creates and writes small files, flushing every update or in groups
+void benchmark_small_files(const char *name, uint64_t group_commit_ms) {
+  std::string command = std::string("rm -rf ") + MetadataStore;
+  if (system(command.c_str()) != 0) return;
+  mkdir(MetadataStore, S_IRWXU);
+
+  mtl_context *context;
+  mtl_initialize(&context, MetadataStore, &in_memory_storage);
+  mtl_set_group_commit(context, group_commit_ms, 256);
+
+  const int files = 2000;
+  std::vector<char> data(4096, 'a');
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < files; ++i) {
+    std::string filename = "/small" + std::to_string(i);
+    uint64_t inode_id;
+    mtl_create(context, filename.c_str(), 0755, &inode_id);
+    mtl_write(context, inode_id, data.data(), data.size(), 0);
+  }
+  mtl_sync(context);
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  mtl_group_commit_stats stats;
+  mtl_get_group_commit_stats(context, &stats);
+  mtl_deinitialize(context);
+
+  // Without group commit, every transaction is synced
+  uint64_t transactions = count_transactions();
+  printf("%-28s %8.3f us/file   transactions %lu   syncs %lu\n", name,
+         elapsed.count() / files, transactions,
+         group_commit_ms ? stats.syncs : transactions);
+}
+
+// Measures the rate of getattr, open and read calls, each of which needs a
+// read transaction on the metadata store
+void benchmark_metadata_reads() {
+  std::string command = std::string("rm -rf ") + MetadataStore;
+  if (system(command.c_str()) != 0) return;
+  mkdir(MetadataStore, S_IRWXU);
+
+  mtl_context *context;
+  mtl_initialize(&context, MetadataStore, &in_memory_storage);
+
+  const int files = 100;
+  const int operations = 100000;
+  std::vector<char> data(4096, 'a');
+  std::vector<std::string> filenames;
+  std::vector<uint64_t> inodes(files);
+  for (int i = 0; i < files; ++i) {
+    filenames.push_back("/read" + std::to_string(i));
+    mtl_create(context, filenames[i].c_str(), 0755, &inodes[i]);
+    mtl_write(context, inodes[i], data.data(), data.size(), 0);
+  }
+
+  auto rate = [](const std::function<void(int)> &operation) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < operations; ++i) operation(i);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return operations / elapsed.count();
+  };
+
+  mtl_inode inode;
+  double getattr = rate([&](int i) {
+    mtl_get_inode(context, filenames[i % files].c_str(), &inode);
+  });
+  double open = rate([&](int i) {
+    mtl_open(context, filenames[i % files].c_str(), nullptr);
+  });
+  double read = rate([&](int i) {
+    mtl_read(context, inodes[i % files], data.data(), data.size(), 0);
+  });
+
+  mtl_deinitialize(context);
+
+  printf("%-28s %10.0f ops/s\n", "getattr", getattr);
+  printf("%-28s %10.0f ops/s\n", "open", open);
+  printf("%-28s %10.0f ops/s\n", "read (4 KiB)", read);
+}
+
+// Lists a directory with the attributes of its entries, either with a lookup
+// per entry (like readdir followed by getattr) or in one pass
+void benchmark_listing() {
+  std::string command = std::string("rm -rf ") + MetadataStore;
+  if (system(command.c_str()) != 0) return;
+  mkdir(MetadataStore, S_IRWXU);
+
+  mtl_context *context;
+  mtl_initialize(&context, MetadataStore, &in_memory_storage);
+
+  const int files = 50000;
+  mtl_mkdir(context, "/dir", 0755);
+  for (int i = 0; i < files; ++i) {
+    std::string filename = "/dir/file" + std::to_string(i);
+    mtl_create(context, filename.c_str(), 0755, nullptr);
+  }
+
+  auto list = [&](bool plus) {
+    auto start = std::chrono::steady_clock::now();
+
+    mtl_dir *dir;
+    mtl_opendir(context, "/dir", &dir);
+    char filename[FILENAME_MAX];
+    mtl_inode inode;
+    int entries = 0;
+    if (plus) {
+      while (mtl_readdir_plus(context, dir, filename, sizeof(filename),
+                              nullptr, &inode) == MTL_SUCCESS)
+        ++entries;
+    } else {
+      while (mtl_readdir(context, dir, filename, sizeof(filename)) ==
+             MTL_SUCCESS) {
+        std::string path = std::string("/dir/") + filename;
+        mtl_get_inode(context, path.c_str(), &inode);
+        ++entries;
+      }
+    }
+    mtl_closedir(context, dir);
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    printf("%-28s %8.1f ms for %d entries\n",
+           plus ? "readdir_plus" : "readdir + getattr", elapsed.count(),
+           entries);
+  };
+
+  list(false);
+  list(true);
+
+  mtl_deinitialize(context);
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937_64 random(4711);
+  std::uniform_int_distribution<uint64_t> size_distribution(1, 16);
+
+  std::vector<uint64_t> sizes(OperationsPerRound);
+  for (auto &size : sizes) size = size_distribution(random);
+
+  printf("%d rounds of %d reservations and frees, %d per transaction\n",
+         Rounds, OperationsPerRound, OperationsPerTransaction);
+
+  benchmark_heap(sizes);
+  benchmark_free_space_index(sizes);
+  benchmark_allocator(sizes);
+
+  printf("\nFragmentation after interleaved appends\n");
+  benchmark_policy("Worst fit", MTL_ALLOCATION_WORST_FIT);
+  benchmark_policy("Best fit", MTL_ALLOCATION_BEST_FIT);
+  benchmark_policy("Goal", MTL_ALLOCATION_GOAL);
+  benchmark_policy("Reservation windows", MTL_ALLOCATION_RESERVATION_WINDOWS);
+
+  printf("\nStreaming appends of 128 KiB\n");
+  benchmark_streaming("Without preallocation", false);
+  benchmark_streaming("With preallocation", true);
+
+  printf("\nSmall files\n");
+  benchmark_small_files("Synchronous commits", 0);
+  benchmark_small_files("Group commit (10 ms)", 10);
+
+  printf("\nRead-only metadata operations\n");
+  benchmark_metadata_reads();
+
+  printf("\nListing a directory with attributes\n");
+  benchmark_listing();
+
+  return 0;
+}
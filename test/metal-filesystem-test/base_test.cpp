@@ -36,12 +36,18 @@ void BaseTest::SetUp() {
   mkdir("test_files/metadata_store", S_IRWXU);
 }
 
-void BaseTest::TearDown() { mdb_env_close(env); }
+void BaseTest::TearDown() {
+  mdb_env_close(env);
+  mtl_free_space_destroy(free_space);
+}
 
 void BaseTest::test_initialize_env() {
   mdb_env_create(&env);
-  mdb_env_set_maxdbs(env, 4);  // inodes, extents, heap, meta
+  // inodes, dirents, file_extents, extents, heap, meta
+  mdb_env_set_maxdbs(env, 6);
   mdb_env_open(env, "test_files/metadata_store", 0, 0644);
+
+  mtl_free_space_create(&free_space);
 }
 
 MDB_txn *BaseTest::test_create_txn() {
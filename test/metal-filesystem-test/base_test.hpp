@@ -3,6 +3,7 @@
 #include <gtest/gtest.h>
 #include <lmdb.h>
 
+#include <metal-filesystem/free_space.h>
 #include <metal-filesystem/metal.h>
 
 class BaseTest : public ::testing::Test {
@@ -15,6 +16,7 @@ class BaseTest : public ::testing::Test {
   void test_commit_txn(MDB_txn *txn);
 
   MDB_env *env;
+  mtl_free_space *free_space;
 };
 
 class MetalTest : public BaseTest {
@@ -0,0 +1,96 @@
+extern "C" {
+#include <metal-filesystem/directory.h>
+#include <metal-filesystem/inode.h>
+#include <metal-filesystem/metal.h>
+}
+
+#include <cstring>
+
+#include "base_test.hpp"
+
+namespace {
+
+TEST_F(BaseTest, FindsAnAddedDirectoryEntry) {
+  test_initialize_env();
+
+  MDB_txn *txn = test_create_txn();
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_directory_entry(txn, 1, "foo", 2));
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_directory_entry(txn, 3, "foo", 4));
+
+  uint64_t inode_id;
+  EXPECT_EQ(MTL_SUCCESS, mtl_get_directory_entry(txn, 1, "foo", &inode_id));
+  EXPECT_EQ(2u, inode_id);
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_get_directory_entry(txn, 1, "fo", NULL));
+  EXPECT_EQ(MTL_ERROR_EXISTS, mtl_put_directory_entry(txn, 1, "foo", 5));
+  test_commit_txn(txn);
+}
+
+TEST_F(BaseTest, ListsOnlyEntriesOfTheSameDirectory) {
+  test_initialize_env();
+
+  MDB_txn *txn = test_create_txn();
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_directory_entry(txn, 1, "b", 10));
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_directory_entry(txn, 1, "a", 11));
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_directory_entry(txn, 1, "c", 12));
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_directory_entry(txn, 256, "a", 13));
+
+  mtl_directory_entry entries[2];
+  uint64_t entries_length;
+  EXPECT_EQ(MTL_SUCCESS,
+            mtl_list_directory_entries(txn, 1, NULL, entries, 2, &entries_length));
+  ASSERT_EQ(2u, entries_length);
+  EXPECT_STREQ("a", entries[0].name);
+  EXPECT_STREQ("b", entries[1].name);
+
+  EXPECT_EQ(MTL_COMPLETE,
+            mtl_list_directory_entries(txn, 1, "b", entries, 2, &entries_length));
+  ASSERT_EQ(1u, entries_length);
+  EXPECT_STREQ("c", entries[0].name);
+  EXPECT_EQ(12u, entries[0].inode_id);
+  test_commit_txn(txn);
+}
+
+TEST_F(BaseTest, MigratesPackedDirectoryEntries) {
+  test_initialize_env();
+
+  // Build a directory in the packed format used before the dirents database
+  char dir_data[2 * sizeof(mtl_directory_entry_head) + 4];
+  mtl_directory_entry_head *head = (mtl_directory_entry_head *)dir_data;
+  head->inode_id = 0;
+  head->name_len = 1;
+  memcpy(dir_data + sizeof(mtl_directory_entry_head), ".", 1);
+  head = (mtl_directory_entry_head *)(dir_data +
+                                      sizeof(mtl_directory_entry_head) + 1);
+  head->inode_id = 1;
+  head->name_len = 3;
+  memcpy(dir_data + 2 * sizeof(mtl_directory_entry_head) + 1, "foo", 3);
+
+  mtl_inode dir_inode = {};
+  dir_inode.type = MTL_DIRECTORY;
+  dir_inode.length = sizeof(dir_data);
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_put_inode(txn, 0, &dir_inode, dir_data, sizeof(dir_data)));
+    ASSERT_EQ(MTL_SUCCESS, mtl_migrate_directory_entries(txn));
+    test_commit_txn(txn);
+  }
+  {
+    MDB_txn *txn = test_create_txn();
+    uint64_t inode_id;
+    EXPECT_EQ(MTL_SUCCESS,
+              mtl_resolve_inode_in_directory(txn, 0, (char *)"foo", &inode_id));
+    EXPECT_EQ(1u, inode_id);
+
+    const mtl_inode *migrated_inode;
+    uint64_t data_length;
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_load_inode(txn, 0, &migrated_inode, NULL, &data_length));
+    EXPECT_EQ(2u, migrated_inode->length);
+    EXPECT_EQ(0u, data_length);
+    test_commit_txn(txn);
+  }
+}
+
+}  // namespace
@@ -14,12 +14,13 @@ TEST_F(BaseTest, AllocatesAnExtent) {
 
   {
     MDB_txn *txn = test_create_txn();
-    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, 8));
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 8));
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(4u, mtl_reserve_extent(txn, length, NULL, &offset, true));
+    EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, length, NULL, &offset,
+                                     true));
     EXPECT_EQ(0u, offset);
     test_commit_txn(txn);
   }
@@ -32,18 +33,20 @@ TEST_F(BaseTest, AllocatesTwoExtents) {
 
   {
     MDB_txn *txn = test_create_txn();
-    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, 8));
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 8));
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(4u, mtl_reserve_extent(txn, length, NULL, &offset, true));
+    EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, length, NULL, &offset,
+                                     true));
     EXPECT_EQ(0u, offset);
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(4u, mtl_reserve_extent(txn, length, NULL, &offset, true));
+    EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, length, NULL, &offset,
+                                     true));
     EXPECT_EQ(4u, offset);
     test_commit_txn(txn);
   }
@@ -56,18 +59,19 @@ TEST_F(BaseTest, FreesAnExtent) {
 
   {
     MDB_txn *txn = test_create_txn();
-    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, 8));
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 8));
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(4u, mtl_reserve_extent(txn, length, NULL, &offset, true));
+    EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, length, NULL, &offset,
+                                     true));
     EXPECT_EQ(0u, offset);
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, offset));
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offset));
     test_commit_txn(txn);
   }
 }
@@ -79,26 +83,216 @@ TEST_F(BaseTest, MakesFreedSpaceAvailableForReuse) {
 
   {
     MDB_txn *txn = test_create_txn();
-    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, 8));
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 8));
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(4u, mtl_reserve_extent(txn, length, NULL, &offset, true));
+    EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, length, NULL, &offset,
+                                     true));
     EXPECT_EQ(0u, offset);
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, offset));
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offset));
     test_commit_txn(txn);
   }
   {
     MDB_txn *txn = test_create_txn();
-    EXPECT_EQ(8u, mtl_reserve_extent(txn, 8, NULL, &offset, true));
+    EXPECT_EQ(8u,
+              mtl_reserve_extent(txn, free_space, 1, 8, NULL, &offset, true));
     EXPECT_EQ(0u, offset);
     test_commit_txn(txn);
   }
 }
 
+TEST_F(BaseTest, MergesFreedExtentsWithTheirNeighbours) {
+  test_initialize_env();
+
+  uint64_t offsets[3];
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 12));
+    for (int i = 0; i < 3; ++i)
+      EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, 4, NULL,
+                                       &offsets[i], true));
+    test_commit_txn(txn);
+  }
+  {
+    // Free the middle extent last, so that it has to be merged both ways
+    MDB_txn *txn = test_create_txn();
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[0]));
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[2]));
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[1]));
+    test_commit_txn(txn);
+  }
+
+  uint64_t extents, blocks;
+  mtl_free_space_get_stats(free_space, &extents, &blocks);
+  EXPECT_EQ(1u, extents);
+  EXPECT_EQ(12u, blocks);
+
+  {
+    MDB_txn *txn = test_create_txn();
+    uint64_t offset;
+    EXPECT_EQ(12u, mtl_reserve_extent(txn, free_space, 1, 12, NULL, &offset,
+                                      true));
+    EXPECT_EQ(0u, offset);
+    test_commit_txn(txn);
+  }
+}
+
+TEST_F(BaseTest, RebuildsTheFreeSpaceIndexFromTheDatabase) {
+  test_initialize_env();
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 8));
+    uint64_t offset;
+    EXPECT_EQ(3u,
+              mtl_reserve_extent(txn, free_space, 1, 3, NULL, &offset, true));
+    test_commit_txn(txn);
+  }
+
+  // Pretend the file system is mounted again
+  mtl_free_space_destroy(free_space);
+  mtl_free_space_create(&free_space);
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 8));
+    test_commit_txn(txn);
+  }
+
+  uint64_t extents, blocks;
+  mtl_free_space_get_stats(free_space, &extents, &blocks);
+  EXPECT_EQ(1u, extents);
+  EXPECT_EQ(5u, blocks);
+
+  // An invalidated index is rebuilt on the next allocation
+  mtl_free_space_invalidate(free_space);
+  {
+    MDB_txn *txn = test_create_txn();
+    uint64_t offset;
+    EXPECT_EQ(5u,
+              mtl_reserve_extent(txn, free_space, 1, 8, NULL, &offset, true));
+    EXPECT_EQ(3u, offset);
+    test_commit_txn(txn);
+  }
+}
+
+TEST_F(BaseTest, AllocatesTheBestFittingExtent) {
+  test_initialize_env();
+
+  uint64_t offsets[4];
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 16));
+    mtl_free_space_set_policy(free_space, MTL_ALLOCATION_BEST_FIT);
+    const uint64_t lengths[] = {2, 4, 1, 9};
+    for (int i = 0; i < 4; ++i)
+      EXPECT_EQ(lengths[i], mtl_reserve_extent(txn, free_space, 1, lengths[i],
+                                               NULL, &offsets[i], true));
+    test_commit_txn(txn);
+  }
+  {
+    // Leaves holes of two and one blocks
+    MDB_txn *txn = test_create_txn();
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[0]));
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[2]));
+    test_commit_txn(txn);
+  }
+  {
+    MDB_txn *txn = test_create_txn();
+    uint64_t offset;
+    EXPECT_EQ(1u,
+              mtl_reserve_extent(txn, free_space, 1, 1, NULL, &offset, true));
+    EXPECT_EQ(offsets[2], offset);
+    EXPECT_EQ(2u,
+              mtl_reserve_extent(txn, free_space, 1, 2, NULL, &offset, true));
+    EXPECT_EQ(offsets[0], offset);
+    test_commit_txn(txn);
+  }
+}
+
+TEST_F(BaseTest, AllocatesTheNearestExtentBehindTheGoal) {
+  test_initialize_env();
+
+  uint64_t offsets[4];
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(txn, free_space, 16));
+    mtl_free_space_set_policy(free_space, MTL_ALLOCATION_GOAL);
+    for (int i = 0; i < 4; ++i)
+      EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, 4, NULL,
+                                       &offsets[i], true));
+    EXPECT_EQ(0u, offsets[0]);
+    EXPECT_EQ(12u, offsets[3]);
+    test_commit_txn(txn);
+  }
+  {
+    MDB_txn *txn = test_create_txn();
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[0]));
+    EXPECT_EQ(MTL_SUCCESS, mtl_free_extent(txn, free_space, offsets[2]));
+    test_commit_txn(txn);
+  }
+  {
+    // The file ends in front of the second hole
+    MDB_txn *txn = test_create_txn();
+    mtl_file_extent last_extent = {offsets[1], 3};
+    uint64_t offset;
+    EXPECT_EQ(4u, mtl_reserve_extent(txn, free_space, 1, 4, &last_extent,
+                                     &offset, true));
+    EXPECT_EQ(offsets[2], offset);
+    test_commit_txn(txn);
+  }
+}
+
+TEST_F(BaseTest, AllocatesFromTheReservationWindowOfAFile) {
+  test_initialize_env();
+
+  mtl_file_extent a, b;
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize_extents(
+                               txn, free_space,
+                               2 * MTL_RESERVATION_WINDOW_BLOCKS + 2));
+    mtl_free_space_set_policy(free_space, MTL_ALLOCATION_RESERVATION_WINDOWS);
+    a.length = mtl_reserve_extent(txn, free_space, 1, 1, NULL, &a.offset, true);
+    b.length = mtl_reserve_extent(txn, free_space, 2, 1, NULL, &b.offset, true);
+    EXPECT_EQ(0u, a.offset);
+    EXPECT_EQ(MTL_RESERVATION_WINDOW_BLOCKS + 1u, b.offset);
+
+    // Appending to a extends its last extent within its window
+    uint64_t offset;
+    EXPECT_EQ(2u, mtl_reserve_extent(txn, free_space, 1, 2, &a, &offset,
+                                     true));
+    EXPECT_EQ(a.offset, offset);
+    test_commit_txn(txn);
+  }
+
+  uint64_t window_offset, window_length;
+  ASSERT_TRUE(mtl_free_space_find_window(free_space, 1, &window_offset,
+                                         &window_length));
+  EXPECT_EQ(3u, window_offset);
+  EXPECT_EQ(MTL_RESERVATION_WINDOW_BLOCKS - 2u, window_length);
+
+  {
+    MDB_txn *txn = test_create_txn();
+    EXPECT_EQ(MTL_SUCCESS, mtl_release_reservation_window(txn, free_space, 1));
+    EXPECT_EQ(MTL_SUCCESS, mtl_release_reservation_window(txn, free_space, 2));
+    test_commit_txn(txn);
+  }
+
+  uint64_t extents, blocks;
+  mtl_free_space_get_stats(free_space, &extents, &blocks);
+  EXPECT_EQ(2u, extents);
+  EXPECT_EQ(2 * MTL_RESERVATION_WINDOW_BLOCKS - 2u, blocks);
+}
+
 }  // namespace
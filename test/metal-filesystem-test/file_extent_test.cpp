@@ -0,0 +1,152 @@
+extern "C" {
+#include <metal-filesystem/file_extent.h>
+#include <metal-filesystem/inode.h>
+#include <metal-filesystem/metal.h>
+}
+
+#include "base_test.hpp"
+
+namespace {
+
+TEST_F(BaseTest, SeeksToTheExtentContainingABlock) {
+  test_initialize_env();
+
+  MDB_txn *txn = test_create_txn();
+  for (uint64_t i = 0; i < 1000; ++i) {
+    mtl_file_extent extent = {10 * i, 2};
+    ASSERT_EQ(MTL_SUCCESS, mtl_put_file_extent(txn, 1, 2 * i, &extent));
+  }
+  mtl_file_extent other_extent = {4711, 1};
+  ASSERT_EQ(MTL_SUCCESS, mtl_put_file_extent(txn, 2, 0, &other_extent));
+
+  mtl_file_extent extents[2];
+  uint64_t first_blocks[2];
+  uint64_t extents_length;
+  EXPECT_EQ(MTL_SUCCESS, mtl_load_file_extents(txn, 1, 1001, extents,
+                                               first_blocks, 2,
+                                               &extents_length));
+  ASSERT_EQ(2u, extents_length);
+  EXPECT_EQ(1000u, first_blocks[0]);
+  EXPECT_EQ(5000u, extents[0].offset);
+  EXPECT_EQ(1002u, first_blocks[1]);
+
+  // Doesn't run into the extents of the next file
+  EXPECT_EQ(MTL_SUCCESS, mtl_load_file_extents(txn, 1, 1999, extents,
+                                               first_blocks, 2,
+                                               &extents_length));
+  EXPECT_EQ(1u, extents_length);
+
+  mtl_file_extent last_extent;
+  uint64_t last_first_block;
+  EXPECT_EQ(MTL_SUCCESS,
+            mtl_load_last_file_extent(txn, 1, &last_extent, &last_first_block));
+  EXPECT_EQ(1998u, last_first_block);
+  EXPECT_EQ(9990u, last_extent.offset);
+  EXPECT_EQ(MTL_ERROR_NOENTRY,
+            mtl_load_last_file_extent(txn, 3, &last_extent, &last_first_block));
+  test_commit_txn(txn);
+}
+
+TEST_F(BaseTest, DeletesTheExtentsBehindABlock) {
+  test_initialize_env();
+
+  MDB_txn *txn = test_create_txn();
+  for (uint64_t i = 0; i < 3; ++i) {
+    mtl_file_extent extent = {100 * i, 4};
+    ASSERT_EQ(MTL_SUCCESS, mtl_put_file_extent(txn, 1, 4 * i, &extent));
+  }
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_delete_file_extents(txn, 1, 5));
+
+  mtl_file_extent extents[4];
+  uint64_t extents_length;
+  EXPECT_EQ(MTL_SUCCESS,
+            mtl_load_file_extents(txn, 1, 0, extents, NULL, 4, &extents_length));
+  ASSERT_EQ(2u, extents_length);
+  EXPECT_EQ(4u, extents[0].length);
+  EXPECT_EQ(100u, extents[1].offset);
+  EXPECT_EQ(1u, extents[1].length);
+  test_commit_txn(txn);
+}
+
+TEST_F(BaseTest, MigratesInlineFileExtents) {
+  test_initialize_env();
+
+  // Before the file_extents database, extents followed the inode
+  mtl_file_extent extent_data[2] = {{8, 2}, {3, 1}};
+
+  mtl_inode file_inode = {};
+  file_inode.type = MTL_FILE;
+  file_inode.length = 3 * 4096;
+
+  {
+    MDB_txn *txn = test_create_txn();
+    ASSERT_EQ(MTL_SUCCESS, mtl_put_inode(txn, 1, &file_inode, extent_data,
+                                         sizeof(extent_data)));
+    ASSERT_EQ(MTL_SUCCESS, mtl_migrate_file_extents(txn));
+    test_commit_txn(txn);
+  }
+  {
+    MDB_txn *txn = test_create_txn();
+    mtl_file_extent last_extent;
+    uint64_t last_first_block;
+    ASSERT_EQ(MTL_SUCCESS, mtl_load_last_file_extent(txn, 1, &last_extent,
+                                                     &last_first_block));
+    EXPECT_EQ(2u, last_first_block);
+    EXPECT_EQ(3u, last_extent.offset);
+
+    const mtl_inode *migrated_inode;
+    uint64_t data_length;
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_load_inode(txn, 1, &migrated_inode, NULL, &data_length));
+    EXPECT_EQ(3u * 4096, migrated_inode->length);
+    EXPECT_EQ(0u, data_length);
+    test_commit_txn(txn);
+  }
+}
+
+TEST_F(BaseTest, MigratesInodesWithoutGeneration) {
+  test_initialize_env();
+
+  // Before generations, the data of an inode followed its mode
+  const size_t legacy_size = offsetof(mtl_inode, generation);
+  mtl_inode file_inode = {};
+  file_inode.type = MTL_FILE;
+  file_inode.length = 3;
+  char legacy_data[legacy_size + 3];
+  memcpy(legacy_data, &file_inode, legacy_size);
+  memcpy(legacy_data + legacy_size, "abc", 3);
+
+  {
+    MDB_txn *txn = test_create_txn();
+    MDB_dbi inodes_db;
+    ASSERT_EQ(MDB_SUCCESS, mdb_dbi_open(txn, "inodes", MDB_CREATE, &inodes_db));
+    uint64_t inode_id = 1;
+    MDB_val key = {sizeof(inode_id), &inode_id};
+    MDB_val value = {sizeof(legacy_data), legacy_data};
+    ASSERT_EQ(MDB_SUCCESS, mdb_put(txn, inodes_db, &key, &value, 0));
+    ASSERT_EQ(MTL_SUCCESS, mtl_migrate_inode_generations(txn));
+    test_commit_txn(txn);
+  }
+  {
+    MDB_txn *txn = test_create_txn();
+    const mtl_inode *migrated_inode;
+    const void *data;
+    uint64_t data_length;
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_load_inode(txn, 1, &migrated_inode, &data, &data_length));
+    EXPECT_EQ(3u, migrated_inode->length);
+    EXPECT_EQ(0u, migrated_inode->generation);
+    ASSERT_EQ(3u, data_length);
+    EXPECT_EQ(0, memcmp("abc", data, 3));
+
+    // Changing the extents of the file counts from there on
+    mtl_file_extent extent = {8, 1};
+    ASSERT_EQ(MTL_SUCCESS, mtl_put_file_extent(txn, 1, 0, &extent));
+    ASSERT_EQ(MTL_SUCCESS, mtl_load_inode(txn, 1, &migrated_inode, NULL, NULL));
+    EXPECT_EQ(1u, migrated_inode->generation);
+    test_commit_txn(txn);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,120 @@
+extern "C" {
+#include <metal-filesystem/free_space.h>
+#include <metal-filesystem/metal.h>
+}
+
+#include <gtest/gtest.h>
+
+namespace {
+
+class FreeSpaceTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() { mtl_free_space_create(&free_space); }
+  virtual void TearDown() { mtl_free_space_destroy(free_space); }
+
+  mtl_free_space *free_space;
+};
+
+TEST_F(FreeSpaceTest, IsEmptyByDefault) {
+  uint64_t offset, length;
+  EXPECT_FALSE(mtl_free_space_find_largest(free_space, &offset, &length));
+  EXPECT_FALSE(mtl_free_space_find(free_space, 0, &length));
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_free_space_remove(free_space, 0));
+}
+
+TEST_F(FreeSpaceTest, FindsTheLargestExtent) {
+  for (uint64_t i = 0; i < 1000; ++i) {
+    // Lengths 1..10, the largest extent with the highest offset wins ties
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_free_space_insert(free_space, 100 * i, i % 10 + 1));
+  }
+
+  uint64_t offset, length;
+  ASSERT_TRUE(mtl_free_space_find_largest(free_space, &offset, &length));
+  EXPECT_EQ(99900u, offset);
+  EXPECT_EQ(10u, length);
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_free_space_remove(free_space, 99900));
+  ASSERT_TRUE(mtl_free_space_find_largest(free_space, &offset, &length));
+  EXPECT_EQ(98900u, offset);
+
+  uint64_t extents, blocks;
+  mtl_free_space_get_stats(free_space, &extents, &blocks);
+  EXPECT_EQ(999u, extents);
+  EXPECT_EQ(100u * 55 - 10, blocks);
+}
+
+TEST_F(FreeSpaceTest, FindsNeighbouringExtents) {
+  mtl_free_space_insert(free_space, 10, 5);
+  mtl_free_space_insert(free_space, 30, 5);
+
+  uint64_t offset, length;
+  ASSERT_TRUE(mtl_free_space_find(free_space, 30, &length));
+  EXPECT_EQ(5u, length);
+  EXPECT_FALSE(mtl_free_space_find(free_space, 31, &length));
+
+  ASSERT_TRUE(mtl_free_space_find_before(free_space, 30, &offset, &length));
+  EXPECT_EQ(10u, offset);
+  ASSERT_TRUE(mtl_free_space_find_before(free_space, 31, &offset, &length));
+  EXPECT_EQ(30u, offset);
+  EXPECT_FALSE(mtl_free_space_find_before(free_space, 10, &offset, &length));
+}
+
+TEST_F(FreeSpaceTest, IsInvalidUntilMarkedValid) {
+  EXPECT_FALSE(mtl_free_space_valid(free_space));
+  mtl_free_space_set_valid(free_space);
+  EXPECT_TRUE(mtl_free_space_valid(free_space));
+  mtl_free_space_invalidate(free_space);
+  EXPECT_FALSE(mtl_free_space_valid(free_space));
+}
+
+TEST_F(FreeSpaceTest, FindsTheBestFit) {
+  mtl_free_space_insert(free_space, 0, 8);
+  mtl_free_space_insert(free_space, 10, 3);
+  mtl_free_space_insert(free_space, 20, 4);
+  mtl_free_space_insert(free_space, 30, 3);
+
+  uint64_t offset, length;
+  ASSERT_TRUE(mtl_free_space_find_best_fit(free_space, 3, &offset, &length));
+  EXPECT_EQ(10u, offset);
+  ASSERT_TRUE(mtl_free_space_find_best_fit(free_space, 4, &offset, &length));
+  EXPECT_EQ(20u, offset);
+  ASSERT_TRUE(mtl_free_space_find_best_fit(free_space, 5, &offset, &length));
+  EXPECT_EQ(0u, offset);
+  EXPECT_FALSE(mtl_free_space_find_best_fit(free_space, 9, &offset, &length));
+
+  ASSERT_TRUE(mtl_free_space_find_after(free_space, 11, &offset, &length));
+  EXPECT_EQ(20u, offset);
+  ASSERT_TRUE(mtl_free_space_find_after(free_space, 20, &offset, &length));
+  EXPECT_EQ(20u, offset);
+  EXPECT_FALSE(mtl_free_space_find_after(free_space, 31, &offset, &length));
+}
+
+TEST_F(FreeSpaceTest, KeepsReservationWindowsPerFile) {
+  for (uint64_t i = 0; i < MTL_FREE_SPACE_WINDOWS; ++i) {
+    EXPECT_FALSE(mtl_free_space_windows_full(free_space));
+    mtl_free_space_set_window(free_space, i, 100 * i, 10);
+  }
+  EXPECT_TRUE(mtl_free_space_windows_full(free_space));
+
+  // Using a window makes it the most recently used one
+  mtl_free_space_set_window(free_space, 0, 5, 5);
+
+  uint64_t inode_id, offset, length;
+  ASSERT_TRUE(mtl_free_space_oldest_window(free_space, &inode_id));
+  EXPECT_EQ(1u, inode_id);
+
+  ASSERT_TRUE(mtl_free_space_find_window(free_space, 0, &offset, &length));
+  EXPECT_EQ(5u, offset);
+  EXPECT_EQ(5u, length);
+
+  mtl_free_space_set_window(free_space, 0, 10, 0);
+  EXPECT_FALSE(mtl_free_space_find_window(free_space, 0, &offset, &length));
+  EXPECT_FALSE(mtl_free_space_windows_full(free_space));
+
+  // Windows don't outlive the index
+  mtl_free_space_clear(free_space);
+  EXPECT_FALSE(mtl_free_space_oldest_window(free_space, &inode_id));
+}
+
+}  // namespace
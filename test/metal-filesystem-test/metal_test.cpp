@@ -1,7 +1,16 @@
 extern "C" {
+#include <metal-filesystem/inode.h>
 #include <metal-filesystem/metal.h>
 }
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "base_test.hpp"
 
 namespace {
@@ -70,6 +79,187 @@ TEST_F(MetalTest, ListsDirectoryContents) {
   EXPECT_EQ(MTL_SUCCESS, mtl_closedir(_context, dir));
 }
 
+TEST_F(MetalTest, ListsDirectoryContentsAcrossBatches) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+
+  const int files = 300;
+  for (int i = 0; i < files; ++i) {
+    std::string filename = "/foo/file" + std::to_string(i);
+    ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, filename.c_str(), 0755, NULL));
+  }
+
+  mtl_dir *dir;
+  ASSERT_EQ(MTL_SUCCESS, mtl_opendir(_context, "/foo", &dir));
+
+  std::set<std::string> filenames;
+  char current_filename[FILENAME_MAX];
+  while (mtl_readdir(_context, dir, current_filename,
+                     sizeof(current_filename)) == MTL_SUCCESS) {
+    filenames.insert(current_filename);
+  }
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_closedir(_context, dir));
+
+  EXPECT_EQ(files + 2u, filenames.size());
+  EXPECT_EQ(1u, filenames.count("file299"));
+}
+
+TEST_F(MetalTest, ListsDirectoryContentsWithAttributes) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo/bar", 0700));
+
+  const int files = 100;
+  std::vector<uint64_t> inodes(files);
+  for (int i = 0; i < files; ++i) {
+    std::string filename = "/foo/file" + std::to_string(i);
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_create(_context, filename.c_str(), 0644, &inodes[i]));
+    ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inodes[i], i));
+  }
+
+  mtl_dir *dir;
+  ASSERT_EQ(MTL_SUCCESS, mtl_opendir(_context, "/foo", &dir));
+
+  // Entries that are gone by the time they are read are skipped
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/foo/file0"));
+
+  int found = 0;
+  char current_filename[FILENAME_MAX];
+  uint64_t inode_id;
+  mtl_inode inode;
+  while (mtl_readdir_plus(_context, dir, current_filename,
+                          sizeof(current_filename), &inode_id,
+                          &inode) == MTL_SUCCESS) {
+    std::string filename = current_filename;
+    if (filename == "bar") {
+      EXPECT_EQ(MTL_DIRECTORY, inode.type);
+      EXPECT_EQ(0700, inode.mode & 0777);
+    } else if (filename.compare(0, 4, "file") == 0) {
+      int i = std::stoi(filename.substr(4));
+      EXPECT_NE(0, i);
+      EXPECT_EQ(inodes[i], inode_id);
+      EXPECT_EQ(MTL_FILE, inode.type);
+      EXPECT_EQ((uint64_t)i, inode.length);
+    } else {
+      EXPECT_EQ(MTL_DIRECTORY, inode.type);  // . and ..
+    }
+    ++found;
+  }
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_closedir(_context, dir));
+  EXPECT_EQ(files + 2, found);
+}
+
+TEST_F(MetalTest, FailsWhenOpeningADirectoryThatIsAFile) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo", 0755, NULL));
+
+  mtl_dir *dir;
+  EXPECT_EQ(MTL_ERROR_NOTDIRECTORY, mtl_opendir(_context, "/foo", &dir));
+  EXPECT_EQ(MTL_ERROR_NOTDIRECTORY, mtl_open(_context, "/foo/bar", NULL));
+}
+
+TEST_F(MetalTest, RemovesADirectoryAfterItsContentsAreRemoved) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo/bar", 0755, NULL));
+  EXPECT_EQ(MTL_ERROR_NOTEMPTY, mtl_rmdir(_context, "/foo"));
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/foo/bar"));
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open(_context, "/foo/bar", NULL));
+  EXPECT_EQ(MTL_SUCCESS, mtl_rmdir(_context, "/foo"));
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open(_context, "/foo", NULL));
+}
+
+TEST_F(MetalTest, RenamesAFile) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+  uint64_t inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/bar", 0755, &inode));
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_rename(_context, "/bar", "/foo/baz"));
+
+  uint64_t renamed_inode;
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open(_context, "/bar", NULL));
+  EXPECT_EQ(MTL_SUCCESS, mtl_open(_context, "/foo/baz", &renamed_inode));
+  EXPECT_EQ(inode, renamed_inode);
+}
+
+TEST_F(MetalTest, ServesRepeatedLookupsFromTheDentryCache) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+  uint64_t inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo/bar", 0755, &inode));
+
+  mtl_dentry_cache_stats before, after;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_dentry_cache_stats(_context, &before));
+
+  uint64_t opened_inode;
+  EXPECT_EQ(MTL_SUCCESS, mtl_open(_context, "/foo/bar", &opened_inode));
+  EXPECT_EQ(MTL_SUCCESS, mtl_open(_context, "/foo/bar", &opened_inode));
+  EXPECT_EQ(inode, opened_inode);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_dentry_cache_stats(_context, &after));
+  EXPECT_EQ(before.misses + 1, after.misses);
+  EXPECT_EQ(before.hits + 1, after.hits);
+}
+
+TEST_F(MetalTest, InvalidatesCachedPathsOnRename) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo/bar", 0755, NULL));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open(_context, "/foo/bar", NULL));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_rename(_context, "/foo", "/baz"));
+
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open(_context, "/foo/bar", NULL));
+  EXPECT_EQ(MTL_SUCCESS, mtl_open(_context, "/baz/bar", NULL));
+}
+
+TEST_F(MetalTest, InvalidatesCachedPathsOnUnlinkAndRmdir) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo/bar", 0755, NULL));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open(_context, "/foo/bar", NULL));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/foo/bar"));
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open(_context, "/foo/bar", NULL));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_open(_context, "/foo", NULL));
+  ASSERT_EQ(MTL_SUCCESS, mtl_rmdir(_context, "/foo"));
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open(_context, "/foo", NULL));
+}
+
+TEST_F(MetalTest, FlushesCommitsInGroups) {
+  // Only the count threshold triggers a flush
+  ASSERT_EQ(MTL_SUCCESS, mtl_set_group_commit(_context, 3600 * 1000, 4));
+
+  for (int i = 0; i < 10; ++i) {
+    std::string filename = "/file" + std::to_string(i);
+    ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, filename.c_str(), 0755, NULL));
+  }
+
+  mtl_group_commit_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_group_commit_stats(_context, &stats));
+  EXPECT_EQ(10u, stats.commits);
+  EXPECT_GT(10u, stats.syncs);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_sync(_context));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_group_commit_stats(_context, &stats));
+  EXPECT_EQ(0u, stats.pending);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_set_group_commit(_context, 0, 0));
+  EXPECT_EQ(MTL_SUCCESS, mtl_open(_context, "/file9", NULL));
+}
+
+TEST_F(MetalTest, FlushesCommitsAfterTheInterval) {
+  ASSERT_EQ(MTL_SUCCESS, mtl_set_group_commit(_context, 1, 1000));
+  ASSERT_EQ(MTL_SUCCESS, mtl_mkdir(_context, "/foo", 0755));
+
+  mtl_group_commit_stats stats;
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_EQ(MTL_SUCCESS, mtl_get_group_commit_stats(_context, &stats));
+    if (stats.syncs) break;
+    usleep(1000);
+  }
+  EXPECT_EQ(1u, stats.syncs);
+  EXPECT_EQ(0u, stats.pending);
+}
+
 TEST_F(MetalTest, WritesToAFile) {
   uint64_t inode;
   EXPECT_EQ(MTL_SUCCESS, mtl_create(_context, "/hello_world.txt", 0755, &inode));
@@ -92,6 +282,45 @@ TEST_F(MetalTest, ReadsWrittenBytes) {
   EXPECT_EQ(0, strncmp(test.c_str(), output, test.size() + 1));
 }
 
+TEST_F(MetalTest, AppendsToAFileWithinTheLastBlock) {
+  uint64_t inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/hello_world.txt", 0755, &inode));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode, "hello", 5, 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode, "world", 5, 5));
+
+  char output[256];
+  EXPECT_EQ(10u, mtl_read(_context, inode, output, sizeof(output), 0));
+  EXPECT_EQ(0, strncmp("helloworld", output, 10));
+}
+
+TEST_F(MetalTest, ReadsAndWritesThroughAnOpenFile) {
+  uint64_t inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/hello_world.txt", 0755, &inode));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, inode));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode, "hello world!", 12, 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode, "W", 1, 6));
+
+  char output[256];
+  EXPECT_EQ(12u, mtl_read(_context, inode, output, sizeof(output), 0));
+  EXPECT_EQ(0, strncmp("hello World!", output, 12));
+
+  // Modifications outside of the open file must be picked up
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode, 5));
+  EXPECT_EQ(5u, mtl_read(_context, inode, output, sizeof(output), 0));
+
+  uint64_t file_length;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, inode, NULL, NULL, &file_length));
+  EXPECT_EQ(5u, file_length);
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_close_file(_context, inode));
+}
+
+TEST_F(MetalTest, FailsWhenOpeningAFileThatDoesNotExist) {
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_open_file(_context, 4711));
+}
+
 TEST_F(MetalTest, TruncatesAFile) {
   uint64_t inode;
   EXPECT_EQ(MTL_SUCCESS, mtl_create(_context, "/hello_world.txt", 0755, &inode));
@@ -102,4 +331,1022 @@ TEST_F(MetalTest, TruncatesAFile) {
   EXPECT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode, 0));
 }
 
+TEST_F(MetalTest, SeesUpdatesInReusedReadTransactions) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/file", 0755, &inode_id));
+
+  mtl_inode inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/file", &inode));
+  EXPECT_EQ(0u, inode.length);
+
+  // The read transaction of this thread is renewed for the next read
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode_id, 4096));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/file", &inode));
+  EXPECT_EQ(4096u, inode.length);
+
+  // Other threads get transactions of their own, which go away with them
+  std::thread reader([&] {
+    mtl_inode other;
+    EXPECT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/file", &other));
+    EXPECT_EQ(4096u, other.length);
+  });
+  reader.join();
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/file"));
+  EXPECT_EQ(MTL_ERROR_NOENTRY, mtl_get_inode(_context, "/file", &inode));
+}
+
+TEST_F(MetalTest, GrowsTheMetadataMap) {
+  mtl_deinitialize(_context);
+
+  mtl_options options;
+  mtl_default_options(&options);
+  options.map_size = 256 * 1024;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_initialize_with_options(&_context, "test_files/metadata_store",
+                                        &in_memory_storage, &options));
+
+  for (int i = 0; i < 4000; ++i) {
+    std::string filename = "/file" + std::to_string(i);
+    ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, filename.c_str(), 0755, NULL));
+  }
+
+  mtl_metadata_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_metadata_stats(_context, &stats));
+  EXPECT_LT(0u, stats.map_resizes);
+  EXPECT_LT(options.map_size, stats.map_size);
+  EXPECT_LT(stats.used_size, stats.map_size);
+}
+
+TEST_F(MetalTest, GrowsTheMetadataMapForLargeUpdates) {
+  mtl_deinitialize(_context);
+
+  mtl_options options;
+  mtl_default_options(&options);
+  options.map_size = 256 * 1024;
+  options.inline_data_size = 1024 * 1024;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_initialize_with_options(&_context, "test_files/metadata_store",
+                                        &in_memory_storage, &options));
+
+  // A single update that is larger than the whole map
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/file", 0755, &inode_id));
+  std::vector<char> data(options.inline_data_size);
+  for (uint64_t i = 0; i < data.size(); ++i) data[i] = (char)(i % 251);
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, data.data(), data.size(), 0));
+
+  mtl_metadata_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_metadata_stats(_context, &stats));
+  EXPECT_LT(1u, stats.map_resizes);
+  EXPECT_LT(data.size(), stats.map_size);
+
+  std::vector<char> output(data.size());
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, inode_id, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+}
+
+TEST_F(MetalTest, FailsWhenTheMetadataMapCannotGrow) {
+  mtl_deinitialize(_context);
+
+  mtl_options options;
+  mtl_default_options(&options);
+  options.map_size = 256 * 1024;
+  options.max_map_size = options.map_size;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_initialize_with_options(&_context, "test_files/metadata_store",
+                                        &in_memory_storage, &options));
+
+  int res = MTL_SUCCESS;
+  for (int i = 0; i < 4000 && res == MTL_SUCCESS; ++i) {
+    std::string filename = "/file" + std::to_string(i);
+    res = mtl_create(_context, filename.c_str(), 0755, NULL);
+  }
+  EXPECT_EQ(MTL_ERROR_NOSPACE, res);
+
+  // Earlier updates are still there
+  EXPECT_EQ(MTL_SUCCESS, mtl_open(_context, "/file0", NULL));
+
+  mtl_metadata_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_metadata_stats(_context, &stats));
+  EXPECT_EQ(0u, stats.map_resizes);
+  EXPECT_EQ(options.map_size, stats.map_size);
+}
+
+TEST_F(MetalTest, KeepsMoreExtentsThanFitIntoAnExtentList) {
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  // Growing both files in turns gives every block its own extent
+  const uint64_t block_size = 4096;
+  const uint64_t blocks = MTL_MAX_EXTENTS + 100;
+  for (uint64_t i = 0; i < blocks; ++i) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_fallocate(_context, a, 0, i * block_size, block_size));
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_fallocate(_context, b, 0, i * block_size, block_size));
+  }
+
+  uint64_t extents_length, file_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_load_extent_list(_context, a, NULL,
+                                              &extents_length, &file_length));
+  EXPECT_EQ(blocks, extents_length);
+  EXPECT_EQ(blocks * block_size, file_length);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, a, 100 * block_size + 1));
+  ASSERT_EQ(MTL_SUCCESS, mtl_load_extent_list(_context, a, NULL,
+                                              &extents_length, &file_length));
+  EXPECT_EQ(101u, extents_length);
+  EXPECT_EQ(100 * block_size + 1, file_length);
+
+  EXPECT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/a"));
+  EXPECT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/b"));
+}
+
+TEST_F(MetalTest, MapsOnlyTheExtentsOfARange) {
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  const uint64_t block_size = 4096;
+  for (uint64_t i = 0; i < 4; ++i) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_fallocate(_context, a, 0, i * block_size, block_size));
+    ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, b, 0, 2 * i * block_size,
+                                         2 * block_size));
+  }
+
+  mtl_file_extent all_extents[MTL_MAX_EXTENTS];
+  uint64_t all_extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_load_extent_list(_context, a, all_extents,
+                                              &all_extents_length, NULL));
+  ASSERT_EQ(4u, all_extents_length);
+
+  mtl_file_extent extents[4];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, a, block_size + 10,
+                                       block_size, extents, 4,
+                                       &extents_length));
+  ASSERT_EQ(2u, extents_length);
+  EXPECT_EQ(all_extents[1].offset, extents[0].offset);
+  EXPECT_EQ(all_extents[2].offset, extents[1].offset);
+
+  // Extents of b span two blocks and have to be clipped
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, b));
+  ASSERT_EQ(MTL_SUCCESS, mtl_load_extent_list(_context, b, all_extents,
+                                              &all_extents_length, NULL));
+  ASSERT_EQ(4u, all_extents_length);
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, b, 3 * block_size, 2,
+                                       extents, 4, &extents_length));
+  ASSERT_EQ(1u, extents_length);
+  EXPECT_EQ(all_extents[1].offset + 1, extents[0].offset);
+  EXPECT_EQ(1u, extents[0].length);
+  EXPECT_EQ(MTL_SUCCESS, mtl_close_file(_context, b));
+}
+
+TEST_F(MetalTest, ReadsAndWritesAFileWithManyExtents) {
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  const uint64_t block_size = 4096;
+  const uint64_t blocks = MTL_MAX_EXTENTS + 100;
+  for (uint64_t i = 0; i < blocks; ++i) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_fallocate(_context, a, 0, i * block_size, block_size));
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_fallocate(_context, b, 0, i * block_size, block_size));
+  }
+
+  std::vector<char> input(blocks * block_size);
+  for (uint64_t i = 0; i < input.size(); ++i) input[i] = i % 251;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, a, input.data(), input.size(), 0));
+
+  std::vector<char> output(input.size());
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_EQ(input, output);
+}
+
+// Returns the number of blocks that are not free
+static uint64_t used_blocks(mtl_context *context) {
+  mtl_fragmentation_report report;
+  EXPECT_EQ(MTL_SUCCESS, mtl_get_fragmentation_report(context, &report));
+  return 32768 - report.free_blocks;
+}
+
+TEST_F(MetalTest, PreallocatesBlocksForSequentialAppends) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &inode_id));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, inode_id));
+
+  const uint64_t chunk_size = 128 * 1024;
+  std::vector<char> input(16 * chunk_size);
+  for (uint64_t i = 0; i < input.size(); ++i) input[i] = i % 251;
+  for (uint64_t offset = 0; offset < input.size(); offset += chunk_size)
+    ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode_id, &input[offset],
+                                     chunk_size, offset));
+
+  // More blocks than written to are held while the file is open
+  const uint64_t block_size = 4096;
+  EXPECT_LT(input.size() / block_size, used_blocks(_context));
+
+  mtl_inode inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/a", &inode));
+  EXPECT_EQ(input.size(), inode.length);
+
+  // Closing the file gives back the rest
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, inode_id));
+  EXPECT_EQ(input.size() / block_size, used_blocks(_context));
+
+  mtl_file_extent extents[MTL_MAX_EXTENTS];
+  uint64_t extents_length;
+  uint64_t length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_load_extent_list(_context, inode_id, extents,
+                                              &extents_length, &length));
+  EXPECT_EQ(1u, extents_length);
+  EXPECT_EQ(input.size(), length);
+
+  std::vector<char> output(input.size());
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, inode_id, output.data(), output.size(), 0));
+  EXPECT_EQ(input, output);
+}
+
+TEST_F(MetalTest, TrimsPreallocatedBlocksOnTruncate) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &inode_id));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, inode_id));
+
+  const uint64_t block_size = 4096;
+  std::vector<char> input(4 * block_size, 'a');
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, input.data(), input.size(), 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode_id, 2 * block_size));
+  EXPECT_EQ(2u, used_blocks(_context));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, inode_id));
+  EXPECT_EQ(2u, used_blocks(_context));
+}
+
+TEST_F(MetalTest, AllocatesBlocksWithFallocate) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &inode_id));
+
+  const uint64_t block_size = 4096;
+  // The first block stays a hole
+  ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, inode_id, 0, block_size,
+                                       2 * block_size));
+  EXPECT_EQ(2u, used_blocks(_context));
+
+  mtl_inode inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/a", &inode));
+  EXPECT_EQ(3 * block_size, inode.length);
+
+  // Keeping the size, the blocks are kept even when the file is closed
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, inode_id));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_fallocate(_context, inode_id, MTL_FALLOCATE_KEEP_SIZE, 0,
+                          8 * block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, inode_id));
+  EXPECT_EQ(8u, used_blocks(_context));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/a", &inode));
+  EXPECT_EQ(3 * block_size, inode.length);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode_id, 0));
+  EXPECT_EQ(0u, used_blocks(_context));
+
+  EXPECT_EQ(MTL_ERROR_NOTSUPPORTED,
+            mtl_fallocate(_context, inode_id, 0x02, 0, block_size));
+}
+
+TEST_F(MetalTest, ExtendsFilesWithoutAllocatingBlocks) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &inode_id));
+
+  // Larger than the storage
+  const uint64_t block_size = 4096;
+  const uint64_t length = 1ul << 30;
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode_id, length));
+  EXPECT_EQ(0u, used_blocks(_context));
+
+  mtl_inode inode;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_inode(_context, "/a", &inode));
+  EXPECT_EQ(length, inode.length);
+
+  std::vector<char> output(3 * block_size, 'x');
+  EXPECT_EQ(output.size(), mtl_read(_context, inode_id, output.data(),
+                                    output.size(), length / 2));
+  EXPECT_EQ(std::vector<char>(output.size(), 0), output);
+
+  // Writing into the hole only allocates the blocks written to
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, inode_id));
+  std::string data = "hello world!";
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode_id, data.c_str(),
+                                   data.size(), length / 2 + block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, inode_id));
+  EXPECT_EQ(1u, used_blocks(_context));
+
+  std::vector<char> expected(output.size(), 0);
+  std::copy(data.begin(), data.end(), expected.begin() + block_size);
+  EXPECT_EQ(output.size(), mtl_read(_context, inode_id, output.data(),
+                                    output.size(), length / 2));
+  EXPECT_EQ(expected, output);
+
+  // Holes can't be mapped
+  mtl_file_extent extents[3];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, inode_id, length / 2,
+                                       output.size(), extents, 3,
+                                       &extents_length));
+  EXPECT_EQ(0u, extents_length);
+
+  // Readers that can only read blocks find where they start
+  uint64_t mapped_offset;
+  ASSERT_EQ(MTL_SUCCESS, mtl_find_mapped(_context, inode_id, length / 2,
+                                         &mapped_offset));
+  EXPECT_EQ(length / 2 + block_size, mapped_offset);
+  ASSERT_EQ(MTL_SUCCESS, mtl_find_mapped(_context, inode_id,
+                                         length / 2 + block_size + 1,
+                                         &mapped_offset));
+  EXPECT_EQ(length / 2 + block_size + 1, mapped_offset);
+  ASSERT_EQ(MTL_SUCCESS, mtl_find_mapped(_context, inode_id,
+                                         length / 2 + 2 * block_size,
+                                         &mapped_offset));
+  EXPECT_EQ(length, mapped_offset);
+
+  // Unless they are filled first
+  ASSERT_EQ(MTL_SUCCESS, mtl_fill_holes(_context, inode_id, length / 2,
+                                        output.size()));
+  EXPECT_EQ(3u, used_blocks(_context));
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, inode_id, length / 2,
+                                       output.size(), extents, 3,
+                                       &extents_length));
+  uint64_t mapped_blocks = 0;
+  for (uint64_t i = 0; i < extents_length; ++i)
+    mapped_blocks += extents[i].length;
+  EXPECT_EQ(3u, mapped_blocks);
+
+  EXPECT_EQ(output.size(), mtl_read(_context, inode_id, output.data(),
+                                    output.size(), length / 2));
+  EXPECT_EQ(expected, output);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/a"));
+  EXPECT_EQ(0u, used_blocks(_context));
+}
+
+TEST_F(MetalTest, KeepsSmallFilesInTheInode) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &inode_id));
+
+  std::string data = "hello world!";
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, data.c_str(), data.size(), 0));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, data.c_str(), data.size(), 100));
+  EXPECT_EQ(0u, used_blocks(_context));
+
+  std::vector<char> expected(100 + data.size(), 0);
+  std::copy(data.begin(), data.end(), expected.begin());
+  std::copy(data.begin(), data.end(), expected.begin() + 100);
+
+  std::vector<char> output(1000, 'x');
+  ASSERT_EQ(expected.size(),
+            mtl_read(_context, inode_id, output.data(), output.size(), 0));
+  output.resize(expected.size());
+  EXPECT_EQ(expected, output);
+
+  // There are no blocks to map
+  uint64_t mapped_offset;
+  ASSERT_EQ(MTL_SUCCESS, mtl_find_mapped(_context, inode_id, 0, &mapped_offset));
+  EXPECT_EQ(expected.size(), mapped_offset);
+
+  // Cutting off data in the inode makes it read as zeros once extended
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode_id, 6));
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inode_id, expected.size()));
+  std::fill(expected.begin() + 6, expected.end(), 0);
+  ASSERT_EQ(expected.size(), mtl_read(_context, inode_id, output.data(),
+                                      output.size(), 0));
+  EXPECT_EQ(expected, output);
+
+  // Growing beyond what could be packed into a block moves the data to
+  // blocks of its own
+  const uint64_t block_size = 4096;
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, inode_id));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode_id, data.c_str(),
+                                   data.size(), block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, inode_id));
+  EXPECT_EQ(2u, used_blocks(_context));
+
+  expected.resize(block_size);
+  expected.insert(expected.end(), data.begin(), data.end());
+  output.resize(expected.size());
+  ASSERT_EQ(expected.size(), mtl_read(_context, inode_id, output.data(),
+                                      output.size(), 0));
+  EXPECT_EQ(expected, output);
+}
+
+TEST_F(MetalTest, MovesSmallFilesToBlocksForMapping) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &inode_id));
+
+  std::string data = "hello world!";
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, data.c_str(), data.size(), 0));
+  EXPECT_EQ(0u, used_blocks(_context));
+
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_fill_holes(_context, inode_id, 0, data.size()));
+  EXPECT_EQ(1u, used_blocks(_context));
+
+  mtl_file_extent extent;
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, inode_id, 0, data.size(),
+                                       &extent, 1, &extents_length));
+  EXPECT_EQ(1u, extents_length);
+
+  char output[32];
+  ASSERT_EQ(data.size(),
+            mtl_read(_context, inode_id, output, sizeof(output), 0));
+  EXPECT_EQ(data, std::string(output, data.size()));
+}
+
+TEST_F(MetalTest, KeepsAllFilesInBlocksOfTheirOwnIfConfigured) {
+  mtl_deinitialize(_context);
+
+  mtl_options options;
+  mtl_default_options(&options);
+  options.inline_data_size = 0;
+  options.packed_file_size = 0;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_initialize_with_options(&_context, "test_files/metadata_store",
+                                        &in_memory_storage, &options));
+
+  for (auto filename : {"/a", "/b"}) {
+    uint64_t inode_id;
+    ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, filename, 0755, &inode_id));
+    ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode_id, "a", 1, 0));
+  }
+  EXPECT_EQ(2u, used_blocks(_context));
+}
+
+static std::vector<char> read_file(mtl_context *context, uint64_t inode_id,
+                                   uint64_t size) {
+  std::vector<char> output(size + 1);
+  output.resize(mtl_read(context, inode_id, output.data(), output.size(), 0));
+  return output;
+}
+
+TEST_F(MetalTest, PacksSmallFilesIntoSharedBlocks) {
+  // 18 sectors of 64 bytes each, so three of them share a block
+  const uint64_t size = 1100;
+  std::vector<uint64_t> inodes;
+  std::vector<std::vector<char>> contents;
+  for (auto filename : {"/a", "/b", "/c"}) {
+    uint64_t inode_id;
+    ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, filename, 0755, &inode_id));
+
+    std::vector<char> data(size, filename[1]);
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, inode_id, data.data(), data.size(), 0));
+    inodes.push_back(inode_id);
+    contents.push_back(data);
+  }
+  EXPECT_EQ(1u, used_blocks(_context));
+
+  for (size_t i = 0; i < inodes.size(); ++i)
+    EXPECT_EQ(contents[i], read_file(_context, inodes[i], 2 * size));
+
+  // A file that outgrows its sectors moves to a new block
+  std::vector<char> appended(size, 'x');
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inodes[0], appended.data(),
+                                   appended.size(), size));
+  EXPECT_EQ(2u, used_blocks(_context));
+  contents[0].insert(contents[0].end(), appended.begin(), appended.end());
+  EXPECT_EQ(contents[0], read_file(_context, inodes[0], 4 * size));
+
+  // The sectors of removed files are reused
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/b"));
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/d", 0755, &inode_id));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inode_id, appended.data(),
+                                   appended.size(), 0));
+  EXPECT_EQ(2u, used_blocks(_context));
+  EXPECT_EQ(appended, read_file(_context, inode_id, 2 * size));
+  EXPECT_EQ(contents[2], read_file(_context, inodes[2], 2 * size));
+
+  // Data that has been cut off reads as zeros
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, inodes[2], 100));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, inodes[2], "c", 1, size - 1));
+  std::fill(contents[2].begin() + 100, contents[2].end(), 0);
+  contents[2].back() = 'c';
+  EXPECT_EQ(contents[2], read_file(_context, inodes[2], 2 * size));
+
+  // Mapping a packed file gives it blocks of its own
+  ASSERT_EQ(MTL_SUCCESS, mtl_fill_holes(_context, inodes[0], 0, 2 * size));
+  EXPECT_EQ(3u, used_blocks(_context));
+  mtl_file_extent extent;
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, inodes[0], 0, 2 * size,
+                                       &extent, 1, &extents_length));
+  EXPECT_EQ(1u, extents_length);
+  EXPECT_EQ(contents[0], read_file(_context, inodes[0], 4 * size));
+}
+
+// Appends a block to each file in turn and returns the average number of
+// extents per file
+static double append_interleaved(mtl_context *context,
+                                 mtl_allocation_policy policy) {
+  EXPECT_EQ(MTL_SUCCESS, mtl_set_allocation_policy(context, policy));
+
+  const int files = 4;
+  uint64_t inodes[files];
+  for (int i = 0; i < files; ++i) {
+    std::string filename = "/file" + std::to_string(i);
+    EXPECT_EQ(MTL_SUCCESS,
+              mtl_create(context, filename.c_str(), 0755, &inodes[i]));
+  }
+
+  const uint64_t block_size = 4096;
+  for (uint64_t block = 0; block < 16; ++block)
+    for (int i = 0; i < files; ++i)
+      EXPECT_EQ(MTL_SUCCESS, mtl_fallocate(context, inodes[i], 0,
+                                           block * block_size, block_size));
+
+  mtl_fragmentation_report report;
+  EXPECT_EQ(MTL_SUCCESS, mtl_get_fragmentation_report(context, &report));
+  EXPECT_EQ(4u, report.files);
+  return (double)report.file_extents / report.files;
+}
+
+TEST_F(MetalTest, InterleavesAppendsWithWorstFitAllocation) {
+  EXPECT_EQ(16.0, append_interleaved(_context, MTL_ALLOCATION_WORST_FIT));
+}
+
+TEST_F(MetalTest, KeepsAppendsContiguousWithReservationWindows) {
+  EXPECT_EQ(1.0,
+            append_interleaved(_context, MTL_ALLOCATION_RESERVATION_WINDOWS));
+
+  // All windows are given back once the files are gone
+  for (int i = 0; i < 4; ++i) {
+    std::string filename = "/file" + std::to_string(i);
+    EXPECT_EQ(MTL_SUCCESS, mtl_unlink(_context, filename.c_str()));
+  }
+
+  mtl_fragmentation_report report;
+  EXPECT_EQ(MTL_SUCCESS, mtl_get_fragmentation_report(_context, &report));
+  EXPECT_EQ(0u, report.files);
+  EXPECT_EQ(1u, report.free_extents);
+  EXPECT_EQ(report.free_blocks, report.largest_free_extent);
+}
+
+TEST_F(MetalTest, ReportsFragmentation) {
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  // Creates a hole of one block between two extents of b
+  const uint64_t block_size = 4096;
+  ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, b, 0, 0, block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, a, 0, 0, block_size));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_fallocate(_context, b, 0, block_size, block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, a, 0));
+
+  mtl_fragmentation_report report;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_fragmentation_report(_context, &report));
+  EXPECT_EQ(1u, report.files);
+  EXPECT_EQ(2u, report.file_extents);
+  EXPECT_EQ(2u, report.max_file_extents);
+  EXPECT_EQ(1u, report.files_by_extents[1]);
+  EXPECT_EQ(2u, report.free_extents);
+  EXPECT_EQ(1u, report.free_extents_by_length[0]);
+  // The rest of the storage (32765 blocks)
+  EXPECT_EQ(1u, report.free_extents_by_length[14]);
+}
+
+static void expect_statfs_matches_extents(mtl_context *context) {
+  mtl_filesystem_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_statfs(context, &stats));
+  mtl_fragmentation_report report;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_fragmentation_report(context, &report));
+
+  EXPECT_EQ(32768u, stats.blocks);
+  EXPECT_EQ(report.free_blocks, stats.free_blocks);
+  EXPECT_EQ(stats.blocks - report.free_blocks, stats.used_blocks);
+  EXPECT_GE(report.largest_free_extent, stats.largest_free_extent);
+}
+
+TEST_F(MetalTest, KeepsSpaceCountersForStatfs) {
+  mtl_filesystem_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_statfs(_context, &stats));
+  EXPECT_EQ(4096u, stats.block_size);
+  EXPECT_EQ(32768u, stats.free_blocks);
+  EXPECT_EQ(32768u, stats.largest_free_extent);
+  EXPECT_EQ(1u, stats.inodes);  // the root directory
+
+  // Reservation windows, preallocation and trimming all move blocks around
+  const uint64_t block_size = 4096;
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, a));
+  std::vector<char> data(3 * block_size, 'x');
+  for (uint64_t offset = 0; offset < 8 * data.size(); offset += data.size()) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, a, data.data(), data.size(), offset));
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, b, data.data(), data.size(), offset));
+  }
+  expect_statfs_matches_extents(_context);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, b, block_size + 1));
+  expect_statfs_matches_extents(_context);
+  ASSERT_EQ(MTL_SUCCESS, mtl_statfs(_context, &stats));
+  EXPECT_EQ(24u + 2u, stats.used_blocks);
+  EXPECT_EQ(3u, stats.inodes);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/a"));
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/b"));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_set_allocation_policy(_context, MTL_ALLOCATION_WORST_FIT));
+  ASSERT_EQ(MTL_SUCCESS, mtl_statfs(_context, &stats));
+  EXPECT_EQ(32768u, stats.free_blocks);
+  EXPECT_EQ(32768u, stats.largest_free_extent);
+  EXPECT_EQ(1u, stats.inodes);
+}
+
+TEST_F(MetalTest, ChangesTheGenerationWithTheExtentsOfAFile) {
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  const uint64_t block_size = 4096;
+  std::vector<char> data(2 * block_size, 'x');
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, data.data(), data.size(), 0));
+
+  uint64_t before, after;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &before));
+
+  // Lookups leave it alone, and so do the blocks of other files
+  mtl_file_extent extents[4];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, a, 0, data.size(), extents,
+                                       4, &extents_length));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, b, data.data(), data.size(), 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, b, 0, 0, 4 * block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &after));
+  EXPECT_EQ(before, after);
+
+  // As well as writing to blocks that the file has already
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, data.data(), block_size, 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &after));
+  EXPECT_EQ(before, after);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, data.data(), data.size(),
+                                   data.size()));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &after));
+  EXPECT_LT(before, after);
+
+  before = after;
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, a, block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &after));
+  EXPECT_LT(before, after);
+
+  // Moving the blocks of the file changes it, too
+  for (uint64_t i = 1; i < 4; ++i) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_fallocate(_context, a, 0, i * block_size, block_size));
+    ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, b, 0, (4 + i) * block_size,
+                                         block_size));
+  }
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &before));
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment_file(_context, a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &after));
+  EXPECT_LT(before, after);
+
+  // It doesn't start over when remounting
+  before = after;
+  mtl_deinitialize(_context);
+  ASSERT_EQ(MTL_SUCCESS, mtl_initialize(&_context, "test_files/metadata_store",
+                                        &in_memory_storage));
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_generation(_context, a, &after));
+  EXPECT_EQ(before, after);
+}
+
+TEST_F(MetalTest, ClonesFilesWithoutCopyingBlocks) {
+  const uint64_t block_size = 4096;
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  std::vector<char> data(1536 * block_size);
+  for (uint64_t i = 0; i < data.size(); ++i) data[i] = (char)(i % 251);
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, data.data(), data.size(), 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, b, "old", 3, 0));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_clone(_context, a, b));
+  EXPECT_EQ(1536u, used_blocks(_context));
+
+  std::vector<char> output(data.size());
+  EXPECT_EQ(data.size(), mtl_read(_context, b, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+
+  // Only the (4 MiB) piece that is written to is copied
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, b, "new", 3, 1300 * block_size));
+  EXPECT_EQ(1536u + 512u, used_blocks(_context));
+
+  EXPECT_EQ(data.size(), mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+  EXPECT_EQ(data.size(), mtl_read(_context, b, output.data(), output.size(), 0));
+  std::copy_n("new", 3, data.begin() + 1300 * block_size);
+  EXPECT_EQ(data, output);
+
+  // Truncating within a shared piece copies the part that is kept
+  ASSERT_EQ(MTL_SUCCESS, mtl_truncate(_context, a, 256 * block_size + 100));
+  EXPECT_EQ(257u + 1024u + 512u, used_blocks(_context));
+  EXPECT_EQ(256 * block_size + 100,
+            mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_TRUE(std::equal(output.begin(), output.begin() + 256 * block_size,
+                         data.begin()));
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/b"));
+  EXPECT_EQ(257u, used_blocks(_context));
+  ASSERT_EQ(MTL_SUCCESS, mtl_unlink(_context, "/a"));
+  EXPECT_EQ(0u, used_blocks(_context));
+}
+
+TEST_F(MetalTest, CopiesSharedBlocksBeforeWritingThroughAnOpenFile) {
+  const uint64_t block_size = 4096;
+  uint64_t a, b, c;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/c", 0755, &c));
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, a));
+
+  // The preallocated blocks of the open file are not shared
+  std::vector<char> data(8 * block_size, 'a');
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, data.data(), data.size(), 0));
+  ASSERT_EQ(MTL_SUCCESS, mtl_clone(_context, a, b));
+  EXPECT_EQ(8u, used_blocks(_context));
+
+  // The snapshot of the open file knows about the shared blocks
+  mtl_file_extent extents[2];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, a, extents, &extents_length, NULL));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, "bb", 2, 4 * block_size));
+  ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, "cc", 2, 4 * block_size + 2));
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, a));
+  EXPECT_EQ(16u, used_blocks(_context));
+
+  std::vector<char> output(data.size());
+  EXPECT_EQ(data.size(), mtl_read(_context, b, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+  EXPECT_EQ(data.size(), mtl_read(_context, a, output.data(), output.size(), 0));
+  std::copy_n("bbcc", 4, data.begin() + 4 * block_size);
+  EXPECT_EQ(data, output);
+
+  // Blocks that are mapped to be written to in place are copied by fallocate
+  ASSERT_EQ(MTL_SUCCESS, mtl_clone(_context, a, c));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_fallocate(_context, c, MTL_FALLOCATE_KEEP_SIZE, 0, block_size));
+  EXPECT_EQ(24u, used_blocks(_context));
+
+  mtl_file_extent c_extents[2];
+  uint64_t c_extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, a, 0, block_size, extents, 2,
+                                       &extents_length));
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, c, 0, block_size, c_extents,
+                                       2, &c_extents_length));
+  ASSERT_EQ(1u, extents_length);
+  ASSERT_EQ(1u, c_extents_length);
+  EXPECT_NE(extents[0].offset, c_extents[0].offset);
+  EXPECT_EQ(data.size(), mtl_read(_context, c, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+}
+
+TEST_F(MetalTest, DefragmentsFilesThatAreNotOpen) {
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_set_allocation_policy(_context, MTL_ALLOCATION_WORST_FIT));
+
+  const uint64_t block_size = 4096;
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  // Interleaved appends leave both files with 8 extents
+  std::vector<char> data_a(16 * block_size), data_b(16 * block_size);
+  for (uint64_t i = 0; i < data_a.size(); ++i) {
+    data_a[i] = (char)(i % 251);
+    data_b[i] = (char)(i % 241);
+  }
+  for (uint64_t offset = 0; offset < data_a.size(); offset += 2 * block_size) {
+    ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, a, &data_a[offset],
+                                     2 * block_size, offset));
+    ASSERT_EQ(MTL_SUCCESS, mtl_write(_context, b, &data_b[offset],
+                                     2 * block_size, offset));
+  }
+
+  mtl_file_extent extents[MTL_MAX_EXTENTS];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, a, extents, &extents_length, NULL));
+  ASSERT_EQ(8u, extents_length);
+
+  // Open files are left alone
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, b));
+  uint64_t bytes_moved;
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment(_context, 4, 0, &bytes_moved));
+  EXPECT_EQ(16 * block_size, bytes_moved);
+  EXPECT_EQ(MTL_ERROR_BUSY, mtl_defragment_file(_context, b));
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, b));
+
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, a, extents, &extents_length, NULL));
+  EXPECT_EQ(1u, extents_length);
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, b, extents, &extents_length, NULL));
+  EXPECT_EQ(8u, extents_length);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment_file(_context, b));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, b, extents, &extents_length, NULL));
+  EXPECT_EQ(1u, extents_length);
+  EXPECT_EQ(32u, used_blocks(_context));
+
+  std::vector<char> output(data_a.size());
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_EQ(data_a, output);
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, b, output.data(), output.size(), 0));
+  EXPECT_EQ(data_b, output);
+
+  mtl_defragment_stats stats;
+  ASSERT_EQ(MTL_SUCCESS, mtl_get_defragment_stats(_context, &stats));
+  EXPECT_EQ(1u, stats.passes);
+  EXPECT_EQ(2u, stats.files_moved);
+  EXPECT_EQ(2u, stats.files_skipped);
+  EXPECT_EQ(32 * block_size, stats.bytes_moved);
+  EXPECT_EQ(14u, stats.extents_removed);
+
+  // Nothing is left to merge
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment(_context, 1, 0, &bytes_moved));
+  EXPECT_EQ(0u, bytes_moved);
+}
+
+TEST_F(MetalTest, KeepsTheExtentsOfMappedFiles) {
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_set_allocation_policy(_context, MTL_ALLOCATION_WORST_FIT));
+
+  const uint64_t block_size = 4096;
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  std::vector<char> data(16 * block_size);
+  for (uint64_t i = 0; i < data.size(); ++i) data[i] = (char)(i % 251);
+  for (uint64_t offset = 0; offset < data.size(); offset += 2 * block_size) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, a, &data[offset], 2 * block_size, offset));
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, b, &data[offset], 2 * block_size, offset));
+  }
+
+  // Like a file data sink, which holds the file open while the card writes
+  // to the extents it mapped
+  ASSERT_EQ(MTL_SUCCESS, mtl_open_file(_context, a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_fallocate(_context, a, MTL_FALLOCATE_KEEP_SIZE,
+                                       0, data.size()));
+  mtl_file_extent mapped[MTL_MAX_EXTENTS];
+  uint64_t mapped_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, a, 0, data.size(), mapped,
+                                       MTL_MAX_EXTENTS, &mapped_length));
+  ASSERT_EQ(8u, mapped_length);
+
+  uint64_t bytes_moved;
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment(_context, 4, 0, &bytes_moved));
+  EXPECT_EQ(data.size(), bytes_moved);
+  EXPECT_EQ(MTL_ERROR_BUSY, mtl_defragment_file(_context, a));
+
+  mtl_file_extent extents[MTL_MAX_EXTENTS];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_map_range(_context, a, 0, data.size(), extents,
+                                       MTL_MAX_EXTENTS, &extents_length));
+  ASSERT_EQ(mapped_length, extents_length);
+  for (uint64_t i = 0; i < extents_length; ++i) {
+    EXPECT_EQ(mapped[i].offset, extents[i].offset);
+    EXPECT_EQ(mapped[i].length, extents[i].length);
+  }
+
+  std::vector<char> output(data.size());
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+  ASSERT_EQ(MTL_SUCCESS, mtl_close_file(_context, a));
+
+  // Once the sink is gone, the file can be moved
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment_file(_context, a));
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, a, extents, &extents_length, NULL));
+  EXPECT_EQ(1u, extents_length);
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+}
+
+TEST_F(MetalTest, KeepsFilesInPlaceWhileTheyAreWrittenTo) {
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_set_allocation_policy(_context, MTL_ALLOCATION_WORST_FIT));
+
+  const uint64_t block_size = 4096;
+  uint64_t a, b;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/a", 0755, &a));
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/b", 0755, &b));
+
+  std::vector<char> data(16 * block_size);
+  for (uint64_t i = 0; i < data.size(); ++i) data[i] = (char)(i % 251);
+  for (uint64_t offset = 0; offset < data.size(); offset += 2 * block_size) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, a, &data[offset], 2 * block_size, offset));
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, b, &data[offset], 2 * block_size, offset));
+  }
+
+  // A write without a handle has looked up its blocks, but its data may not
+  // have reached them yet
+  for (uint64_t i = 0; i < block_size; ++i) data[i] = (char)(i % 241 + 1);
+  struct iovec iov = {data.data(), block_size};
+  mtl_io *io;
+  ASSERT_EQ(MTL_SUCCESS, mtl_write_async(_context, a, &iov, 1, 0, &io));
+  EXPECT_EQ(MTL_ERROR_BUSY, mtl_defragment_file(_context, a));
+
+  uint64_t written;
+  ASSERT_EQ(MTL_SUCCESS, mtl_wait(_context, io, &written));
+  EXPECT_EQ(block_size, written);
+
+  ASSERT_EQ(MTL_SUCCESS, mtl_defragment_file(_context, a));
+  mtl_file_extent extents[MTL_MAX_EXTENTS];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_load_extent_list(_context, a, extents, &extents_length, NULL));
+  EXPECT_EQ(1u, extents_length);
+
+  std::vector<char> output(data.size());
+  EXPECT_EQ(output.size(),
+            mtl_read(_context, a, output.data(), output.size(), 0));
+  EXPECT_EQ(data, output);
+}
+
+TEST_F(MetalTest, ReadsAndWritesAsynchronouslyAcrossExtents) {
+  const uint64_t block_size = 4096;
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo", 0755, &inode_id));
+
+  // Two extents with a hole in between, too large to be packed
+  std::vector<char> data(20 * block_size);
+  for (uint64_t i = 0; i < data.size(); ++i) data[i] = (char)(i % 251 + 1);
+  std::fill(data.begin() + 4 * block_size, data.begin() + 12 * block_size, 0);
+
+  mtl_io *writes[2];
+  struct iovec last = {data.data() + 12 * block_size, 8 * block_size};
+  ASSERT_EQ(MTL_SUCCESS, mtl_write_async(_context, inode_id, &last, 1,
+                                         12 * block_size, &writes[0]));
+  struct iovec first[] = {{data.data(), 100},
+                          {data.data() + 100, 3000},
+                          {data.data() + 3100, 4 * block_size - 3100}};
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write_async(_context, inode_id, first, 3, 0, &writes[1]));
+
+  uint64_t length;
+  EXPECT_EQ(MTL_SUCCESS, mtl_wait(_context, writes[0], &length));
+  EXPECT_EQ(8 * block_size, length);
+  EXPECT_EQ(MTL_SUCCESS, mtl_wait(_context, writes[1], &length));
+  EXPECT_EQ(4 * block_size, length);
+
+  mtl_file_extent extents[4];
+  uint64_t extents_length;
+  ASSERT_EQ(MTL_SUCCESS, mtl_load_extent_list(_context, inode_id, extents,
+                                              &extents_length, NULL));
+  EXPECT_EQ(2u, extents_length);
+
+  // Buffer boundaries don't line up with the extents
+  std::vector<char> output(data.size() + 10, 'x');
+  struct iovec buffers[] = {{output.data(), 5000},
+                            {output.data() + 5000, 50000},
+                            {output.data() + 55000, output.size() - 55000}};
+  mtl_io *read;
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_read_async(_context, inode_id, buffers, 3, 1, &read));
+  EXPECT_EQ(MTL_SUCCESS, mtl_wait(_context, read, &length));
+  EXPECT_EQ(data.size() - 1, length);
+  EXPECT_TRUE(std::equal(data.begin() + 1, data.end(), output.begin()));
+}
+
 }  // namespace
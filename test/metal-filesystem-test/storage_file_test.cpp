@@ -0,0 +1,143 @@
+extern "C" {
+#include <metal-filesystem/metal.h>
+}
+
+#include <string>
+#include <vector>
+
+#include "base_test.hpp"
+
+namespace {
+
+class FileStorageTest : public BaseTest {
+ protected:
+  void SetUp() override {
+    BaseTest::SetUp();
+
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_file_storage_create(&_storage, "test_files/storage",
+                                      16ul << 20, 4096, 4));
+    mount();
+  }
+
+  void TearDown() override {
+    mtl_deinitialize(_context);
+    mtl_file_storage_destroy(_storage);
+  }
+
+  void mount() {
+    ASSERT_EQ(MTL_SUCCESS, mtl_initialize(&_context, "test_files/metadata_store",
+                                          _storage));
+  }
+
+  void remount() {
+    mtl_deinitialize(_context);
+    mount();
+  }
+
+  std::vector<char> read_file(uint64_t inode_id, uint64_t length) {
+    std::vector<char> data(length);
+    EXPECT_EQ(length, mtl_read(_context, inode_id, data.data(), length, 0));
+    return data;
+  }
+
+  mtl_storage_backend *_storage;
+  mtl_context *_context;
+};
+
+std::vector<char> pattern(uint64_t length, char seed) {
+  std::vector<char> data(length);
+  for (uint64_t i = 0; i < length; ++i) data[i] = (char)(seed + i * 7);
+  return data;
+}
+
+TEST_F(FileStorageTest, WritesAndReadsAtUnalignedOffsets) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo", 0644, &inode_id));
+
+  // Spans several blocks, with unaligned edges
+  auto data = pattern(3 << 20, 1);
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, data.data() + 1, data.size() - 1, 1));
+  auto patch = pattern(10000, 5);
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, patch.data(), patch.size(), 4093));
+
+  data[0] = 0;
+  std::copy(patch.begin(), patch.end(), data.begin() + 4093);
+  EXPECT_EQ(data, read_file(inode_id, data.size()));
+
+  std::vector<char> piece(100);
+  EXPECT_EQ(piece.size(), mtl_read(_context, inode_id, piece.data(),
+                                   piece.size(), 8190));
+  EXPECT_TRUE(std::equal(piece.begin(), piece.end(), data.begin() + 8190));
+}
+
+TEST_F(FileStorageTest, KeepsSmallFilesSharingABlockIntact) {
+  std::vector<uint64_t> inode_ids;
+  for (int i = 0; i < 3; ++i) {
+    uint64_t inode_id;
+    ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, ("/" + std::to_string(i)).c_str(),
+                                      0644, &inode_id));
+    auto data = pattern(1100, i);
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write(_context, inode_id, data.data(), data.size(), 0));
+    inode_ids.push_back(inode_id);
+  }
+
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(pattern(1100, i), read_file(inode_ids[i], 1100));
+}
+
+TEST_F(FileStorageTest, KeepsRequestsOfSeveralFilesInFlight) {
+  // More requests than the queue depth, from unaligned buffers
+  const int files = 8;
+  std::vector<uint64_t> inode_ids(files);
+  std::vector<std::vector<char>> contents;
+  std::vector<mtl_io *> ios(files);
+  for (int i = 0; i < files; ++i) {
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_create(_context, ("/" + std::to_string(i)).c_str(), 0644,
+                         &inode_ids[i]));
+    contents.push_back(pattern(300000 + i, i));
+  }
+
+  for (int i = 0; i < files; ++i) {
+    struct iovec iov[] = {{contents[i].data(), 1000},
+                          {contents[i].data() + 1000,
+                           contents[i].size() - 1000}};
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_write_async(_context, inode_ids[i], iov, 2, 0, &ios[i]));
+  }
+  for (int i = 0; i < files; ++i)
+    EXPECT_EQ(MTL_SUCCESS, mtl_wait(_context, ios[i], nullptr));
+
+  std::vector<std::vector<char>> outputs;
+  for (int i = 0; i < files; ++i) {
+    outputs.emplace_back(contents[i].size());
+    struct iovec iov = {outputs[i].data(), outputs[i].size()};
+    ASSERT_EQ(MTL_SUCCESS,
+              mtl_read_async(_context, inode_ids[i], &iov, 1, 0, &ios[i]));
+  }
+  for (int i = 0; i < files; ++i) {
+    uint64_t length;
+    EXPECT_EQ(MTL_SUCCESS, mtl_wait(_context, ios[i], &length));
+    EXPECT_EQ(contents[i].size(), length);
+    EXPECT_EQ(contents[i], outputs[i]);
+  }
+}
+
+TEST_F(FileStorageTest, KeepsTheDataWhenRemounted) {
+  uint64_t inode_id;
+  ASSERT_EQ(MTL_SUCCESS, mtl_create(_context, "/foo", 0644, &inode_id));
+
+  auto data = pattern(100000, 3);
+  ASSERT_EQ(MTL_SUCCESS,
+            mtl_write(_context, inode_id, data.data(), data.size(), 0));
+
+  remount();
+
+  EXPECT_EQ(data, read_file(inode_id, data.size()));
+}
+
+}  // namespace
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+
+#include <metal-pipeline/snap_action.hpp>
+
+#include "snap_stub.hpp"
+
+namespace metal {
+
+TEST(JobBufferPoolTest, HandsOutZeroedPageAlignedBuffers) {
+  auto pool = std::make_shared<JobBufferPool>();
+
+  {
+    auto buffer = pool->acquire(100);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(buffer.data()) % 4096);
+    EXPECT_EQ(4096u, buffer.size());
+    memset(buffer.data(), 0xff, buffer.size());
+  }
+
+  auto buffer = pool->acquire(4096);
+  for (size_t i = 0; i < buffer.size(); ++i)
+    ASSERT_EQ(0, buffer.as<char>()[i]);
+}
+
+TEST(JobBufferPoolTest, RecyclesBuffersOfTheSameSizeClass) {
+  auto pool = std::make_shared<JobBufferPool>();
+
+  void *first;
+  {
+    auto buffer = pool->acquire(8200);
+    EXPECT_EQ(16384u, buffer.size());
+    first = buffer.data();
+  }
+  {
+    auto buffer = pool->acquire(16384);
+    EXPECT_EQ(first, buffer.data());
+  }
+
+  auto stats = pool->stats();
+  EXPECT_EQ(1u, stats.allocations);
+  EXPECT_EQ(1u, stats.reuses);
+  EXPECT_EQ(0u, stats.outstanding);
+  EXPECT_EQ(16384u, stats.cachedBytes);
+}
+
+TEST(JobBufferPoolTest, DoesNotAllocateOnceWarmedUp) {
+  SnapStub::reset();
+  SnapAction action;
+
+  // What a pipeline run takes: a configuration, two maps and perfmon counters
+  auto run = [&action]() {
+    auto config = action.allocateJobBuffer(4096);
+    auto sourceMap = action.allocateJobBuffer(8 * 1032);
+    auto sinkMap = action.allocateJobBuffer(8 * 1032);
+    auto counters = action.allocateJobBuffer(48);
+    action.executeJob(fpga::JobType::Map, sourceMap.data());
+  };
+
+  run();
+  auto warm = action.jobBufferStats();
+  for (int i = 0; i < 100; ++i) run();
+  auto stats = action.jobBufferStats();
+
+  EXPECT_EQ(warm.allocations, stats.allocations);
+  EXPECT_EQ(warm.reuses + 400, stats.reuses);
+  EXPECT_EQ(0u, stats.outstanding);
+}
+
+}  // namespace metal
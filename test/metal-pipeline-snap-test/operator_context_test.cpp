@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include <metal-pipeline/operator.hpp>
+#include <metal-pipeline/operator_context.hpp>
+#include <metal-pipeline/operator_specification.hpp>
+#include <metal-pipeline/snap_action.hpp>
+
+#include "snap_stub.hpp"
+
+namespace metal {
+
+const char *PreparedOperatorJson =
+    R"({"id":"lookup","description":"Needs a preparation run","prepare_required":true,"options":{"value":{"short":"v","type":"int","description":"A value","offset":256}},"internal_id":2})";
+
+class OperatorContextTest : public ::testing::Test {
+ protected:
+  void SetUp() override { SnapStub::reset(); }
+
+  static Operator makeOperator(uint32_t value) {
+    auto spec = std::make_shared<OperatorSpecification>("lookup",
+                                                        PreparedOperatorJson);
+    Operator op(spec);
+    op.setOption("value", value);
+    return op;
+  }
+};
+
+TEST_F(OperatorContextTest, SkipsConfigurationOfPreparedOperators) {
+  SnapAction action;
+  OperatorContext context(makeOperator(5));
+
+  context.configure(action);
+  EXPECT_TRUE(context.needs_preparation());
+  context.set_is_prepared();
+
+  context.configure(action);
+  EXPECT_FALSE(context.needs_preparation());
+  EXPECT_EQ(1u, SnapStub::configuredRanges.size());
+}
+
+TEST_F(OperatorContextTest, ArmsPreparationForEveryNewContext) {
+  SnapAction action;
+  OperatorContext first(makeOperator(5));
+  first.configure(action);
+  first.set_is_prepared();
+
+  // The registers hold the same value already, but the card has forgotten
+  // about preparation after the run of the first context
+  OperatorContext second(makeOperator(5));
+  second.configure(action);
+  EXPECT_TRUE(second.needs_preparation());
+
+  std::vector<bool> expected = {true, true};
+  EXPECT_EQ(expected, SnapStub::configuredPrepare);
+}
+
+}  // namespace metal
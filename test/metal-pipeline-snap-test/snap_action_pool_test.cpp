@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <metal-pipeline/snap_action_pool.hpp>
+
+#include "snap_stub.hpp"
+
+namespace metal {
+
+class SnapActionPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override { SnapStub::reset(); }
+};
+
+TEST_F(SnapActionPoolTest, KeepsActionsAttachedBetweenLeases) {
+  auto pool = std::make_shared<SnapActionPool>(Card{0, 1});
+
+  SnapAction *first;
+  {
+    auto lease = pool->borrow(1);
+    first = &*lease;
+  }
+  auto lease = pool->borrow(1);
+
+  EXPECT_EQ(first, &*lease);
+  EXPECT_EQ(1, SnapStub::attachedActions);
+}
+
+TEST_F(SnapActionPoolTest, LendsTheSameActionToNestedBorrows) {
+  auto pool = std::make_shared<SnapActionPool>(Card{0, 1});
+
+  auto outer = pool->borrow(1);
+  {
+    // Like storage I/O in the middle of a pipeline run
+    auto nested = pool->borrow(1);
+    EXPECT_EQ(&*outer, &*nested);
+  }
+
+  // The outer lease still holds the action
+  bool timedOut = false;
+  std::thread other([&] {
+    try {
+      pool->borrow(1);
+    } catch (std::runtime_error &) {
+      timedOut = true;
+    }
+  });
+  other.join();
+  EXPECT_TRUE(timedOut);
+}
+
+TEST_F(SnapActionPoolTest, HandsTheActionToTheNextThreadWhenReturned) {
+  auto pool = std::make_shared<SnapActionPool>(Card{0, 1});
+
+  auto lease = std::make_unique<SnapActionPool::Lease>(pool->borrow(1));
+  SnapAction *action = &**lease;
+
+  SnapAction *borrowed = nullptr;
+  std::thread other([&] { borrowed = &*pool->borrow(5); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  lease.reset();
+  other.join();
+
+  EXPECT_EQ(action, borrowed);
+}
+
+}  // namespace metal
@@ -0,0 +1,186 @@
+#include <gtest/gtest.h>
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#include <metal-pipeline/snap_action.hpp>
+
+#include "snap_stub.hpp"
+
+namespace metal {
+
+class SnapActionTest : public ::testing::Test {
+ protected:
+  void SetUp() override { SnapStub::reset(); }
+};
+
+TEST_F(SnapActionTest, ReturnsBeforeTheJobIsComplete) {
+  SnapStub::jobLatency = std::chrono::milliseconds(50);
+  SnapAction action;
+
+  auto start = std::chrono::steady_clock::now();
+  auto result = action.submitJob(fpga::JobType::RunOperators, nullptr, {}, {},
+                                 41);
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(25));
+
+  EXPECT_EQ(42u, result.get().directDataOut0);
+}
+
+TEST_F(SnapActionTest, RunsJobsOneAfterAnotherInOrder) {
+  SnapStub::jobLatency = std::chrono::milliseconds(2);
+  SnapAction action;
+
+  std::vector<std::future<SnapAction::JobResult>> results;
+  for (uint64_t i = 0; i < 10; ++i)
+    results.push_back(
+        action.submitJob(fpga::JobType::RunOperators, nullptr, {}, {}, i));
+
+  // A blocking job waits for the ones that were submitted before
+  uint64_t out;
+  action.executeJob(fpga::JobType::RunOperators, nullptr, {}, {}, 10, 0, &out);
+  EXPECT_EQ(11u, out);
+
+  for (uint64_t i = 0; i < 10; ++i) {
+    EXPECT_EQ(std::future_status::ready,
+              results[i].wait_for(std::chrono::seconds(0)));
+    EXPECT_EQ(i + 1, results[i].get().directDataOut0);
+  }
+
+  std::vector<uint64_t> expected = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  EXPECT_EQ(expected, SnapStub::executedDirectData);
+  EXPECT_EQ(1, SnapStub::maxRunningJobs);
+}
+
+TEST_F(SnapActionTest, HandsFailuresToTheFuture) {
+  SnapStub::failJobs = true;
+  SnapStub::failingJobType = fpga::JobType::Map;
+  SnapAction action;
+
+  auto failing = action.submitJob(fpga::JobType::Map);
+  auto following = action.submitJob(fpga::JobType::RunOperators, nullptr, {},
+                                    {}, 1);
+
+  EXPECT_THROW(failing.get(), std::runtime_error);
+  EXPECT_EQ(2u, following.get().directDataOut0);
+  EXPECT_FALSE(action.isHealthy());
+}
+
+TEST_F(SnapActionTest, CompletesSubmittedJobsBeforeDetaching) {
+  SnapStub::jobLatency = std::chrono::milliseconds(10);
+  std::future<SnapAction::JobResult> result;
+  {
+    SnapAction action;
+    result = action.submitJob(fpga::JobType::RunOperators, nullptr, {}, {}, 7);
+  }
+
+  EXPECT_EQ(0, SnapStub::attachedActions);
+  EXPECT_EQ(8u, result.get().directDataOut0);
+}
+
+TEST_F(SnapActionTest, SkipsMapJobsForExtentsTheSlotHolds) {
+  SnapAction action;
+  std::vector<SnapAction::Extent> extents = {{10, 4}, {20, 2}};
+
+  auto version = action.mapExtents(fpga::ExtmapSlot::NVMeRead, extents);
+  EXPECT_NE(0u, version);
+  EXPECT_EQ(version, action.mapExtents(fpga::ExtmapSlot::NVMeRead, extents));
+  EXPECT_EQ(1u, SnapStub::executedDirectData.size());
+
+  // Another slot and other extents have to be sent
+  EXPECT_NE(version, action.mapExtents(fpga::ExtmapSlot::NVMeWrite, extents));
+  extents.push_back({30, 1});
+  auto changed = action.mapExtents(fpga::ExtmapSlot::NVMeRead, extents);
+  EXPECT_NE(version, changed);
+  EXPECT_EQ(changed, action.extentMapVersion(fpga::ExtmapSlot::NVMeRead));
+  EXPECT_EQ(3u, SnapStub::executedDirectData.size());
+
+  EXPECT_EQ(3u, action.extentMapStats().mapJobs);
+  EXPECT_EQ(1u, action.extentMapStats().skippedMapJobs);
+}
+
+TEST_F(SnapActionTest, ForgetsTheSlotContentWhenMappingFails) {
+  SnapAction action;
+  std::vector<SnapAction::Extent> extents = {{10, 4}};
+  action.mapExtents(fpga::ExtmapSlot::CardDRAMRead, extents);
+
+  SnapStub::failJobs = true;
+  SnapStub::failingJobType = fpga::JobType::Map;
+  EXPECT_THROW(action.mapExtents(fpga::ExtmapSlot::CardDRAMRead, {{11, 4}}),
+               std::runtime_error);
+  EXPECT_EQ(0u, action.extentMapVersion(fpga::ExtmapSlot::CardDRAMRead));
+
+  // The old extents may or may not be mapped anymore
+  SnapStub::failJobs = false;
+  action.mapExtents(fpga::ExtmapSlot::CardDRAMRead, extents);
+  EXPECT_EQ(3u, SnapStub::executedDirectData.size());
+}
+
+TEST_F(SnapActionTest, WritesOnlyChangedOperatorRegisters) {
+  SnapAction action;
+  std::map<uint32_t, uint32_t> registers = {{0, 1}, {1, 2}, {2, 3}, {3, 4}};
+
+  EXPECT_TRUE(action.configureOperator(3, false, registers));
+  EXPECT_FALSE(action.configureOperator(3, false, registers));
+
+  registers[2] = 5;
+  EXPECT_TRUE(action.configureOperator(3, false, registers));
+
+  // Other operators have registers of their own
+  EXPECT_TRUE(action.configureOperator(4, false, registers));
+
+  using Ranges = std::vector<std::pair<uint32_t, uint32_t>>;
+  EXPECT_EQ((Ranges{{0, 4}, {2, 1}, {0, 4}}), SnapStub::configuredRanges);
+  EXPECT_EQ(7u, action.configurationStats().unchangedWords);
+}
+
+TEST_F(SnapActionTest, CoalescesChangedRegistersAcrossKnownOnes) {
+  SnapAction action;
+  std::map<uint32_t, uint32_t> registers = {{0, 1}, {1, 2}, {2, 3}, {8, 4}};
+  action.configureOperator(1, true, registers);
+
+  // Words 1 and 2 are sent again to save a job, 3 to 7 are unknown
+  registers[0] = 10;
+  registers[2] = 11;
+  registers[8] = 12;
+  action.configureOperator(1, true, registers);
+
+  using Ranges = std::vector<std::pair<uint32_t, uint32_t>>;
+  EXPECT_EQ((Ranges{{0, 3}, {8, 1}, {0, 3}, {8, 1}}),
+            SnapStub::configuredRanges);
+  EXPECT_EQ(4u, action.configurationStats().configureJobs);
+}
+
+TEST_F(SnapActionTest, SkipsStreamConfigurationsTheSwitchHolds) {
+  SnapAction action;
+  std::array<uint32_t, SnapAction::SwitchPorts> inputs;
+  inputs.fill(0x80000000);
+  inputs[0] = 0;
+
+  EXPECT_TRUE(action.configureStreams(inputs));
+  EXPECT_FALSE(action.configureStreams(inputs));
+
+  inputs[0] = 3;
+  inputs[3] = 0;
+  EXPECT_TRUE(action.configureStreams(inputs));
+  EXPECT_EQ(2u, SnapStub::executedDirectData.size());
+}
+
+TEST_F(SnapActionTest, ForgetsOperatorRegistersWhenConfigurationFails) {
+  SnapAction action;
+  std::map<uint32_t, uint32_t> registers = {{0, 1}};
+  action.configureOperator(2, false, registers);
+
+  SnapStub::failJobs = true;
+  SnapStub::failingJobType = fpga::JobType::ConfigureOperator;
+  EXPECT_THROW(action.configureOperator(2, false, {{0, 2}}),
+               std::runtime_error);
+
+  SnapStub::failJobs = false;
+  EXPECT_TRUE(action.configureOperator(2, false, registers));
+}
+
+}  // namespace metal
@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <metal-pipeline/data_sink_context.hpp>
+#include <metal-pipeline/data_source_context.hpp>
+#include <metal-pipeline/pipeline.hpp>
+#include <metal-pipeline/snap_pipeline_runner.hpp>
+
+#include "snap_stub.hpp"
+
+namespace metal {
+
+class SnapPipelineRunnerTest : public ::testing::Test {
+ protected:
+  void SetUp() override { SnapStub::reset(); }
+};
+
+// Reads a buffer in chunks, each of which takes setUpLatency to set up.
+// Records how many jobs were running on the card when it was done.
+class ChunkedDataSourceContext : public DataSourceContext {
+ public:
+  static constexpr uint64_t ChunkSize = 4096;
+
+  ChunkedDataSourceContext(uint64_t chunks,
+                           std::chrono::microseconds setUpLatency)
+      : _buffer(chunks * ChunkSize),
+        _chunks(chunks),
+        _chunk(0),
+        _setUpLatency(setUpLatency),
+        _prepared(false) {}
+
+  const DataSource dataSource() const override {
+    return DataSource(_buffer.data() + _chunk * ChunkSize, ChunkSize);
+  }
+  uint64_t reportTotalSize() const override { return _buffer.size(); }
+  bool endOfInput() const override { return _chunk + 1 == _chunks; }
+
+  void configure(SnapAction &action, bool initial) override {
+    (void)action;
+    (void)initial;
+    if (!_prepared) setUp();
+    _prepared = false;
+  }
+  void prepareNext(SnapAction &action) override {
+    (void)action;
+    if (failPreparation) throw std::runtime_error("Unable to prepare");
+    setUp();
+    _prepared = true;
+  }
+  void finalize(SnapAction &action) override {
+    (void)action;
+    ++_chunk;
+  }
+
+  bool failPreparation = false;
+  std::vector<int> runningJobsAfterSetUp;
+
+ protected:
+  void setUp() {
+    std::this_thread::sleep_for(_setUpLatency);
+    runningJobsAfterSetUp.push_back(SnapStub::runningJobs);
+  }
+
+  std::vector<char> _buffer;
+  uint64_t _chunks;
+  uint64_t _chunk;
+  std::chrono::microseconds _setUpLatency;
+  bool _prepared;
+};
+
+TEST_F(SnapPipelineRunnerTest, SetsUpTheNextChunkWhileTheCardRuns) {
+  SnapStub::jobLatency = std::chrono::milliseconds(100);
+  SnapPipelineRunner runner(Card{0, 10}, std::make_shared<Pipeline>());
+
+  ChunkedDataSourceContext source(3, std::chrono::milliseconds(20));
+  std::vector<char> output(ChunkedDataSourceContext::ChunkSize);
+  DefaultDataSinkContext sink(DataSink(output.data(), output.size()));
+
+  bool endOfInput = false;
+  while (!endOfInput) {
+    endOfInput = runner.run(source, sink).second;
+  }
+
+  // The first chunk is set up before its run, the others during the run of
+  // the chunk before them
+  std::vector<int> expected = {0, 1, 1};
+  EXPECT_EQ(expected, source.runningJobsAfterSetUp);
+  EXPECT_EQ(1, SnapStub::maxRunningJobs);
+}
+
+TEST_F(SnapPipelineRunnerTest, WaitsForTheRunWhenPreparationFails) {
+  SnapStub::jobLatency = std::chrono::milliseconds(50);
+  SnapPipelineRunner runner(Card{0, 10}, std::make_shared<Pipeline>());
+
+  ChunkedDataSourceContext source(2, std::chrono::microseconds(0));
+  source.failPreparation = true;
+  std::vector<char> output(ChunkedDataSourceContext::ChunkSize);
+  DefaultDataSinkContext sink(DataSink(output.data(), output.size()));
+
+  // The card may not use the buffers anymore once the error is out
+  EXPECT_THROW(runner.run(source, sink), std::runtime_error);
+  EXPECT_EQ(0, SnapStub::runningJobs);
+}
+
+}  // namespace metal
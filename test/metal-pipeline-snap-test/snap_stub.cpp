@@ -0,0 +1,144 @@
+#include "snap_stub.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <thread>
+
+#include <libsnap.h>
+#include <snap_hls_if.h>
+
+namespace metal {
+
+std::chrono::microseconds SnapStub::jobLatency{0};
+bool SnapStub::failJobs = false;
+fpga::JobType SnapStub::failingJobType = fpga::JobType::RunOperators;
+std::atomic<int> SnapStub::attachedActions{0};
+std::atomic<int> SnapStub::runningJobs{0};
+std::atomic<int> SnapStub::maxRunningJobs{0};
+std::mutex SnapStub::executedMutex;
+std::vector<uint64_t> SnapStub::executedDirectData;
+std::vector<std::pair<uint32_t, uint32_t>> SnapStub::configuredRanges;
+std::vector<bool> SnapStub::configuredPrepare;
+
+void SnapStub::reset() {
+  jobLatency = std::chrono::microseconds(0);
+  failJobs = false;
+  attachedActions = 0;
+  runningJobs = 0;
+  maxRunningJobs = 0;
+  std::lock_guard<std::mutex> lock(executedMutex);
+  executedDirectData.clear();
+  configuredRanges.clear();
+  configuredPrepare.clear();
+}
+
+}  // namespace metal
+
+using metal::SnapStub;
+
+struct snap_card {
+  int unused;
+};
+
+struct snap_action {
+  struct snap_card *card;
+};
+
+extern "C" {
+
+struct snap_card *snap_card_alloc_dev(const char *path, uint16_t vendor_id,
+                                      uint16_t device_id) {
+  (void)path;
+  (void)vendor_id;
+  (void)device_id;
+  return new snap_card{0};
+}
+
+void snap_card_free(struct snap_card *card) { delete card; }
+
+int snap_card_ioctl(struct snap_card *card, unsigned int cmd,
+                    unsigned long parm) {
+  (void)card;
+  (void)cmd;
+  *reinterpret_cast<unsigned long *>(parm) = 0;
+  return 0;
+}
+
+int snap_mmio_read32(struct snap_card *card, uint64_t offset,
+                     uint32_t *data) {
+  (void)card;
+  *data = offset == ACTION_TYPE_REG ? (uint32_t)metal::fpga::ActionType : 0;
+  return 0;
+}
+
+struct snap_action *snap_attach_action(struct snap_card *card,
+                                       snap_action_type_t action_type,
+                                       snap_action_flag_t action_flags,
+                                       int timeout_sec) {
+  (void)action_type;
+  (void)action_flags;
+  (void)timeout_sec;
+  ++SnapStub::attachedActions;
+  return new snap_action{card};
+}
+
+int snap_detach_action(struct snap_action *action) {
+  --SnapStub::attachedActions;
+  delete action;
+  return 0;
+}
+
+void snap_job_set(struct snap_job *djob, void *win_addr, unsigned int win_size,
+                  void *wout_addr, unsigned int wout_size) {
+  memset(djob, 0, sizeof(*djob));
+  djob->win_addr = (uint64_t)(uintptr_t)win_addr;
+  djob->win_size = win_size;
+  djob->wout_addr = (uint64_t)(uintptr_t)wout_addr;
+  djob->wout_size = wout_size;
+}
+
+// Takes jobLatency and answers with directData0 + 1 in the first output word
+int snap_action_sync_execute_job(struct snap_action *action,
+                                 struct snap_job *cjob,
+                                 unsigned int timeout_sec) {
+  (void)action;
+  (void)timeout_sec;
+
+  int running = ++SnapStub::runningJobs;
+  int max = SnapStub::maxRunningJobs;
+  while (running > max &&
+         !SnapStub::maxRunningJobs.compare_exchange_weak(max, running)) {
+  }
+
+  auto *job = reinterpret_cast<metal::fpga::Job *>(cjob->win_addr);
+  std::this_thread::sleep_for(SnapStub::jobLatency);
+  {
+    std::lock_guard<std::mutex> lock(SnapStub::executedMutex);
+    SnapStub::executedDirectData.push_back(job->direct_data[0]);
+    if (job->job_type == metal::fpga::JobType::ConfigureOperator) {
+      auto *config = reinterpret_cast<const uint32_t *>(job->job_address);
+      SnapStub::configuredRanges.emplace_back(be32toh(config[0]),
+                                              be32toh(config[1]));
+      SnapStub::configuredPrepare.push_back(be32toh(config[3]) != 0);
+    }
+  }
+
+  --SnapStub::runningJobs;
+  if (SnapStub::failJobs && job->job_type == SnapStub::failingJobType) {
+    return SNAP_ETIMEDOUT;
+  }
+
+  job->direct_data[2] = job->direct_data[0] + 1;
+  cjob->retc = SNAP_RETC_SUCCESS;
+  return 0;
+}
+
+void *snap_malloc(size_t size) {
+  void *memory = nullptr;
+  if (posix_memalign(&memory, 4096, size) != 0) return nullptr;
+  return memory;
+}
+
+}  // extern "C"
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <metal-pipeline/fpga_interface.hpp>
+
+namespace metal {
+
+// Controls and observes the libsnap stub that replaces the card in these tests
+struct SnapStub {
+  // How long every job takes on the "card"
+  static std::chrono::microseconds jobLatency;
+  // Jobs of this type fail with a timeout
+  static bool failJobs;
+  static fpga::JobType failingJobType;
+
+  static std::atomic<int> attachedActions;
+  static std::atomic<int> runningJobs;
+  static std::atomic<int> maxRunningJobs;
+
+  static std::mutex executedMutex;
+  static std::vector<uint64_t> executedDirectData;  // directData0 of each job
+  // Offset and length of each ConfigureOperator job, in words
+  static std::vector<std::pair<uint32_t, uint32_t>> configuredRanges;
+  static std::vector<bool> configuredPrepare;  // the prepare word of each
+
+  static void reset();
+};
+
+}  // namespace metal